@@ -0,0 +1,707 @@
+#include"../src/complex_batch.h"
+#include"../src/grid.h"
+#include"../src/integrate.h"
+#include"../src/intern.h"
+#include"../src/interval.h"
+#include"../src/jit.h"
+#include"../src/mixed_precision.h"
+#include"../src/newton.h"
+#include"../src/parallel_eval.h"
+#include"../src/polynomial.h"
+#include"../src/profile.h"
+#include"../src/program.h"
+#include"../src/serialize.h"
+#include"../src/taylor.h"
+#include"../src/vecmath.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// > make benchmark RELEASE=1
+// compares tree eval() against the tape interpreter (double, float and mixed precision) and the JIT,
+// libm against the vecmath.h kernels,
+// plus complex batches with std::complex against split real/imaginary arrays (libm and vecmath.h),
+// re-parsing to_string() output against loading the binary format,
+// parsing a large expression from a string, a stream and a mapped file,
+// evaluating a derivative through diff() against lazy_diff(), high-order derivatives
+// through repeated diff() against the Taylor-mode evaluator,
+// a model with fixed parameters before and after specialize(),
+// grid sampling on one thread against all of them,
+// the cost per sample of integrating through eval() against the Integrator,
+// Newton iterations through subs() and eval() against the batched NewtonSolver,
+// building expressions with the operators against an InternTable on 1 to 64 threads,
+// the gradient and Hessian of one function through a tape per output, one tape for all of them and a Program,
+// eval() of a tree with about a million nodes against ParallelEval on one thread and all of them,
+// bounding a function over boxes by sampling points in each against one interval evaluation,
+// second derivatives of a factored polynomial through diff(), diff_polynomials() and a tape against Polynomial,
+// parse(), diff() and to_string() with and without a Budget,
+// and a tape against the Profiler sampling one block in 8 and every block
+
+template<typename F>
+double time_ns(std::size_t points, F&& body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / points;
+}
+
+void report(const std::string& name, double ns, double baseline, const std::string& unit = "ns/point") {
+    std::cout << std::format("  {:<24}{:>10.1f} {} {:>8.1f}x\n", name, ns, unit, baseline / ns);
+}
+
+void bench_eval(const std::string& source) {
+    Expression<double> expr(source);
+    auto grad = expr.diff("x") + expr.diff("y");
+    std::cout << "f = " << source << " (d/dx + d/dy)\n";
+
+    const std::size_t n = 1 << 16;
+    std::vector<double> points(2 * n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        points[2 * i] = 0.5 + i * 1e-5;
+        points[2 * i + 1] = 1.5 - i * 1e-5;
+    }
+
+    const std::size_t tree_n = n / 16;
+    double sink = 0;
+    double tree = time_ns(tree_n, [&]() {
+        for (std::size_t i = 0; i < tree_n; i++) {
+            sink += grad.subs("x", points[2 * i]).subs("y", points[2 * i + 1]).eval();
+        }
+    });
+    report("tree subs + eval", tree, tree);
+
+    Tape<double> tape(grad, {"x", "y"});
+    std::vector<double> scratch(tape.size());
+    report("tape eval", time_ns(n, [&]() {
+        for (std::size_t i = 0; i < n; i++) {
+            sink += tape.eval(&points[2 * i], scratch.data());
+        }
+    }), tree);
+    report("tape eval_batch", time_ns(n, [&]() {
+        tape.eval_batch(points.data(), n, out.data());
+    }), tree);
+
+    Tape<double> vector_tape = tape;
+    vector_tape.vector_math = true;
+    report("tape vector_math", time_ns(n, [&]() {
+        vector_tape.eval_batch(points.data(), n, out.data());
+    }), tree);
+    Tape<float> float_tape(tape);
+    std::vector<float> float_points(points.begin(), points.end()), float_out(n);
+    report("float tape eval_batch", time_ns(n, [&]() {
+        float_tape.eval_batch(float_points.data(), n, float_out.data());
+    }), tree);
+    MixedTape mixed(grad, {"x", "y"});
+    std::size_t fallbacks = 0;
+    report("mixed eval_batch", time_ns(n, [&]() {
+        fallbacks = mixed.eval_batch(points.data(), n, out.data());
+    }), tree);
+    std::cout << "  (" << fallbacks << " of " << n << " points recomputed in double)\n";
+
+    JitFunction jit(grad, {"x", "y"});
+    std::string suffix = jit.is_native() ? "" : " (fallback)";
+    report("jit" + suffix, time_ns(n, [&]() {
+        for (std::size_t i = 0; i < n; i++) {
+            sink += jit(&points[2 * i]);
+        }
+    }), tree);
+    report("jit eval_batch" + suffix, time_ns(n, [&]() {
+        jit.eval_batch(points.data(), n, out.data());
+    }), tree);
+    JitFunction vector_jit(grad, {"x", "y"}, true);
+    report("jit vector_math" + suffix, time_ns(n, [&]() {
+        vector_jit.eval_batch(points.data(), n, out.data());
+    }), tree);
+
+    std::cout << "  (" << tape.size() << " tape slots, checksum " << sink + out[n - 1] << ")\n";
+}
+
+void bench_vecmath() {
+    const std::size_t n = 1 << 16;
+    std::vector<double> x(n), y(n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        x[i] = 0.1 + i * 1e-4;
+        y[i] = 2.5 - i * 1e-5;
+    }
+    std::cout << "libm against vecmath.h\n";
+    auto compare = [&](const std::string& name, auto libm, auto vector) {
+        double base = time_ns(n, [&]() {
+            for (std::size_t i = 0; i < n; i++) out[i] = libm(x[i], y[i]);
+        });
+        report(name, base, base, "ns/value");
+        report(name + " vecmath", time_ns(n, vector), base, "ns/value");
+    };
+    compare("sin", [](double a, double) { return std::sin(a); }, [&]() { vecmath::sin(x.data(), out.data(), n); });
+    compare("cos", [](double a, double) { return std::cos(a); }, [&]() { vecmath::cos(x.data(), out.data(), n); });
+    compare("exp", [](double a, double) { return std::exp(a); }, [&]() { vecmath::exp(x.data(), out.data(), n); });
+    compare("ln", [](double a, double) { return std::log(a); }, [&]() { vecmath::log(x.data(), out.data(), n); });
+    compare("pow", [](double a, double b) { return std::pow(a, b); }, [&]() { vecmath::pow(x.data(), y.data(), out.data(), n); });
+}
+
+void bench_complex(const std::string& source) {
+    Expression<complex> expr(source);
+    auto grad = expr.diff("z") + expr.diff("w");
+    std::cout << "f = " << source << " over complex (d/dz + d/dw)\n";
+
+    const std::size_t n = 1 << 14;
+    std::vector<complex> points(2 * n), out(n);
+    std::vector<double> re(2 * n), im(2 * n), out_re(n), out_im(n);
+    for (std::size_t i = 0; i < n; i++) {
+        points[2 * i] = complex(0.5 + i * 1e-5, 0.25);
+        points[2 * i + 1] = complex(1.5 - i * 1e-5, -0.5);
+        re[i] = points[2 * i].real();
+        im[i] = points[2 * i].imag();
+        re[n + i] = points[2 * i + 1].real();
+        im[n + i] = points[2 * i + 1].imag();
+    }
+
+    Tape<complex> tape(grad, {"z", "w"});
+    double base = time_ns(n, [&]() {
+        tape.eval_batch(points.data(), n, out.data());
+    });
+    report("tape eval_batch", base, base);
+    ComplexBatch strict(grad, {"z", "w"});
+    report("split eval_batch", time_ns(n, [&]() {
+        strict.eval_batch(re.data(), im.data(), n, out_re.data(), out_im.data());
+    }), base);
+    ComplexBatch fast(grad, {"z", "w"}, true);
+    report("split fast_math", time_ns(n, [&]() {
+        fast.eval_batch(re.data(), im.data(), n, out_re.data(), out_im.data());
+    }), base);
+    ComplexBatch vector(grad, {"z", "w"});
+    vector.vector_math = true;
+    report("split vector_math", time_ns(n, [&]() {
+        vector.eval_batch(re.data(), im.data(), n, out_re.data(), out_im.data());
+    }), base);
+    std::cout << "  (checksum " << out[n - 1] << " " << complex(out_re[n - 1], out_im[n - 1]) << ")\n";
+}
+
+void bench_load(const std::string& source, int order) {
+    Expression<double> expr(source);
+    for (int i = 0; i < order; i++) {
+        expr = expr.diff("x");
+    }
+    std::string text = expr.to_string();
+    std::stringstream stream;
+    write_binary(stream, expr);
+    std::string binary = stream.str();
+    std::cout << std::format("d^{}/dx^{} {}: {} bytes of text, {} bytes binary\n", order, order, source, text.size(), binary.size());
+
+    double parse = time_ns(1, [&]() {
+        Expression<double> parsed(text);
+    });
+    report("parse to_string()", parse, parse, "ns");
+    report("read_binary", time_ns(1, [&]() {
+        read_binary(std::as_bytes(std::span(binary.data(), binary.size())));
+    }), parse, "ns");
+}
+
+void bench_lazy_diff(const std::string& source, int order) {
+    Expression<double> expr(source);
+    for (int i = 0; i < order; i++) {
+        expr = expr.diff("x");
+    }
+    std::cout << std::format("d/dx of d^{}/dx^{} {} at one point\n", order, order, source);
+    double sum = 0;
+    double eager = time_ns(1, [&]() {
+        sum += expr.diff("x").subs("x", 0.5).eval();
+    });
+    report("diff().eval()", eager, eager, "ns");
+    report("lazy_diff().eval()", time_ns(1, [&]() {
+        sum += expr.lazy_diff("x").subs("x", 0.5).eval();
+    }), eager, "ns");
+    std::cout << "  (checksum " << sum << ")\n";
+}
+
+void bench_specialize(const std::string& source, const std::vector<std::pair<std::string, double>>& parameters) {
+    Expression<double> model(source);
+    std::vector<std::string> vars = {"x"};
+    for (auto& [name, value]: parameters) {
+        vars.push_back(name);
+    }
+    std::cout << "f = " << source << " with " << parameters.size() << " fixed parameters\n";
+
+    const std::size_t n = 1 << 16;
+    std::size_t stride = vars.size();
+    std::vector<double> points(stride * n), xs(n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        xs[i] = points[stride * i] = 0.5 + i * 1e-5;
+        for (std::size_t j = 0; j < parameters.size(); j++) {
+            points[stride * i + j + 1] = parameters[j].second;
+        }
+    }
+
+    Tape<double> full(model, vars);
+    double base = time_ns(n, [&]() {
+        full.eval_batch(points.data(), n, out.data());
+    });
+    report("tape eval_batch", base, base);
+    Specialized<double> specialized = model.specialize(parameters);
+    Tape<double> tape(specialized.expr, {"x"});
+    report("specialized eval_batch", time_ns(n, [&]() {
+        tape.eval_batch(xs.data(), n, out.data());
+    }), base);
+    double once = time_ns(1, [&]() {
+        model.specialize(parameters);
+    });
+    report("specialize() once", once, once, "ns");
+    std::cout << "  (" << specialized.removed << " nodes removed, " << full.size() << " -> " << tape.size() << " tape slots, checksum " << out[n - 1] << ")\n";
+}
+
+void bench_taylor(const std::string& source, int order) {
+    Expression<double> expr(source);
+    std::cout << std::format("derivatives of {} up to order {} at one point\n", source, order);
+    double sum = 0;
+    double repeated = time_ns(1, [&]() {
+        Expression<double> d = expr;
+        for (int k = 0; k <= order; k++) {
+            sum += d.subs("x", 0.5).eval();
+            d = d.diff("x");
+        }
+    });
+    report("repeated diff()", repeated, repeated, "ns");
+    report("taylor_derivatives", time_ns(1, [&]() {
+        for (double value: taylor_derivatives(expr, "x", 0.5, order)) {
+            sum += value;
+        }
+    }), repeated, "ns");
+    std::cout << "  (checksum " << sum << ")\n";
+}
+
+void bench_grid(const std::string& source, std::size_t steps) {
+    Expression<double> expr(source);
+    std::vector<GridAxis> axes = {{"x", -2, 2, steps}, {"y", -2, 2, steps}};
+    std::cout << std::format("{} over a {}x{} grid with derivatives\n", source, steps, steps);
+    GridSampler single(expr, axes, true, 1);
+    std::vector<double> out(single.points() * single.outputs());
+    double base = time_ns(single.points(), [&]() {
+        single.sample(out.data());
+    });
+    report("1 thread", base, base);
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    GridSampler parallel(expr, axes, true, threads);
+    report(std::format("{} threads", threads), time_ns(parallel.points(), [&]() {
+        parallel.sample(out.data());
+    }), base);
+    std::cout << "  (checksum " << out[out.size() / 2] << ")\n";
+}
+
+void bench_integrate(const std::string& source, std::size_t sets) {
+    Expression<double> expr(source);
+    std::cout << std::format("integral of {} over x in [0, 3] for {} values of s\n", source, sets);
+    std::vector<double> scales(sets);
+    for (std::size_t i = 0; i < sets; i++) {
+        scales[i] = 0.5 + i * 0.01;
+    }
+    std::vector<Integral> results(sets);
+    Integrator integrator(expr, {"x"}, {"s"});
+    double ns = time_ns(1, [&]() {
+        integrator.integrate_batch({{0, 3}}, scales.data(), sets, results.data());
+    });
+    std::size_t evaluations = 0;
+    for (auto& result: results) {
+        evaluations += result.evaluations;
+    }
+
+    const std::size_t tree_n = 1 << 12;
+    double sink = 0;
+    double tree = time_ns(tree_n, [&]() {
+        for (std::size_t i = 0; i < tree_n; i++) {
+            sink += expr.subs("s", 0.5).subs("x", i * 1e-3).eval();
+        }
+    });
+    report("tree subs + eval", tree, tree, "ns/sample");
+    report("Integrator, 1 thread", ns / evaluations, tree, "ns/sample");
+    integrator.threads = 0;
+    report(std::format("Integrator, {} threads", thread_count(0)), time_ns(evaluations, [&]() {
+        integrator.integrate_batch({{0, 3}}, scales.data(), sets, results.data());
+    }), tree, "ns/sample");
+    std::cout << std::format("  ({:.1f} us per integral, {} samples each, checksum {})\n",
+                             ns / sets / 1000, evaluations / sets, results[0].value + sink);
+}
+
+void bench_newton(const std::string& source, std::size_t sets) {
+    Expression<double> expr(source);
+    std::cout << std::format("roots of {} in x for {} values of a\n", source, sets);
+    std::vector<double> values(sets), starts(sets, 1);
+    for (std::size_t i = 0; i < sets; i++) {
+        values[i] = 0.01 + i * 0.01;
+    }
+
+    Expression<double> derivative = expr.diff("x");
+    double sink = 0;
+    const std::size_t tree_n = std::min<std::size_t>(sets, 256);
+    double tree = time_ns(tree_n, [&]() {
+        for (std::size_t i = 0; i < tree_n; i++) {
+            auto f = expr.subs("a", values[i]);
+            auto df = derivative.subs("a", values[i]);
+            double x = starts[i];
+            for (int k = 0; k < 50; k++) {
+                double step = f.subs("x", x).eval() / df.subs("x", x).eval();
+                x -= step;
+                if (std::abs(step) <= 1e-12 * std::max(1.0, std::abs(x))) break;
+            }
+            sink += x;
+        }
+    });
+    report("tree subs + eval per problem", tree, tree, "ns/problem");
+
+    NewtonSolver solver(expr, "x", {"a"});
+    std::vector<Root> roots(sets);
+    report("NewtonSolver, 1 thread", time_ns(sets, [&]() {
+        solver.solve(starts.data(), values.data(), sets, roots.data());
+    }), tree, "ns/problem");
+    solver.threads = 0;
+    report(std::format("NewtonSolver, {} threads", thread_count(0)), time_ns(sets, [&]() {
+        solver.solve(starts.data(), values.data(), sets, roots.data());
+    }), tree, "ns/problem");
+    int iterations = 0;
+    for (auto& root: roots) {
+        iterations += root.iterations;
+    }
+    std::cout << std::format("  ({:.1f} iterations per problem, checksum {})\n", double(iterations) / sets, roots[0].x + sink);
+}
+
+void bench_parse(std::size_t groups) {
+    // grouped so the tree stays shallow enough for the recursive destructors
+    std::string source;
+    for (std::size_t g = 0; g < groups; g++) {
+        source += "(";
+        for (std::size_t i = 0; i < 100; i++) {
+            source += std::format("{}.5e-3 * sin(x{} + {}) + ", g * 100 + i, i % 50, i % 9);
+        }
+        source += "z) + ";
+    }
+    source += "y";
+    std::string path = (std::filesystem::temp_directory_path() / "symexpr_bench_parse.txt").string();
+    std::ofstream(path) << source;
+    std::cout << std::format("parsing {:.1f} MB of generated text\n", source.size() / 1e6);
+
+    double string = time_ns(source.size(), [&]() {
+        Expression<double> parsed(source);
+    });
+    report("from a string", string, string, "ns/byte");
+    report("from a stream", time_ns(source.size(), [&]() {
+        std::istringstream stream(source);
+        parse<double>(stream);
+    }), string, "ns/byte");
+    report("from a mapped file", time_ns(source.size(), [&]() {
+        parse_file<double>(path);
+    }), string, "ns/byte");
+    std::filesystem::remove(path);
+}
+
+void bench_intern(std::size_t jobs) {
+    // every job builds one of 16 expressions of 200 nodes, so most of the work is repeated
+    const int steps = 100;
+    std::cout << std::format("building {} expressions of {} nodes, 16 of them distinct\n", jobs, 2 * steps + 1);
+    std::vector<Expression<double>> results(jobs, Expression<double>(0.0));
+    double sink = 0;
+
+    double plain = time_ns(jobs * 2 * steps, [&]() {
+        for (std::size_t i = 0; i < jobs; i++) {
+            Expression<double> e = Expression<double>::var("x");
+            for (int k = 0; k < steps; k++) {
+                e = sin(e) * Expression<double>(double(i % 16 + k));
+            }
+            results[i] = e;
+        }
+    });
+    report("operators, 1 thread", plain, plain, "ns/node");
+    std::size_t nodes = 0;
+    for (auto& e: results) {
+        nodes += node_count(e);
+    }
+
+    for (unsigned threads: {1, 2, 4, 8, 16, 32, 64}) {
+        InternTable<double> table;
+        double ns = time_ns(jobs * 2 * steps, [&]() {
+            parallel_for(jobs, threads, [&](std::size_t i) {
+                Expression<double> e = table.var("x");
+                for (int k = 0; k < steps; k++) {
+                    e = table.mul(table.sin(e), table.num(double(i % 16 + k)));
+                }
+                results[i] = e;
+            });
+        });
+        report(std::format("InternTable, {} threads", threads), ns, plain, "ns/node");
+        sink += table.size();
+    }
+    std::cout << std::format("  ({} nodes built by the operators, {} in the table)\n", nodes, sink / 7);
+}
+
+void bench_program(std::size_t dims) {
+    std::vector<std::string> vars;
+    std::string source = "0";
+    for (std::size_t i = 0; i < dims; i++) {
+        vars.push_back(std::format("x{}", i));
+    }
+    for (std::size_t i = 0; i < dims; i++) {
+        auto& a = vars[i];
+        auto& b = vars[(i + 1) % dims];
+        source += std::format(" + sin({} * {}) * exp(-{} * {}) / (1 + {} ^ 2)", a, b, a, a, b);
+    }
+    Expression<double> f(source);
+    std::vector<Expression<double>> outputs;
+    for (auto& v: vars) {
+        outputs.push_back(f.diff(v));
+        for (auto& w: vars) {
+            outputs.push_back(f.diff(v).diff(w));
+        }
+    }
+    std::cout << std::format("gradient and Hessian of a function of {} variables ({} outputs)\n", dims, outputs.size());
+
+    const std::size_t n = 1 << 12;
+    std::vector<double> points(n * dims), out(n * outputs.size()), column(n);
+    for (std::size_t i = 0; i < points.size(); i++) {
+        points[i] = 0.1 + (i % 97) * 0.01;
+    }
+
+    std::vector<Tape<double>> tapes;
+    std::size_t separate_size = 0;
+    for (auto& output: outputs) {
+        tapes.emplace_back(output, vars);
+        separate_size += tapes.back().size();
+    }
+    double separate = time_ns(n, [&]() {
+        for (auto& tape: tapes) {
+            tape.eval_batch(points.data(), n, column.data());
+        }
+    });
+    report("a tape per output", separate, separate);
+    Tape<double> tape(outputs, vars);
+    report("one tape eval_batch_all", time_ns(n, [&]() {
+        tape.eval_batch_all(points.data(), n, out.data());
+    }), separate);
+    Program<double> program(outputs, vars);
+    report("Program eval_batch", time_ns(n, [&]() {
+        program.eval_batch(points.data(), n, out.data());
+    }), separate);
+
+    std::vector<double> scratch(tape.size()), program_scratch(program.registers);
+    double tape_single = time_ns(n, [&]() {
+        for (std::size_t p = 0; p < n; p++) {
+            tape.eval(&points[p * dims], scratch.data(), &out[p * outputs.size()]);
+        }
+    });
+    report("one tape eval", tape_single, separate);
+    report("Program eval", time_ns(n, [&]() {
+        for (std::size_t p = 0; p < n; p++) {
+            program.eval(&points[p * dims], program_scratch.data(), &out[p * outputs.size()]);
+        }
+    }), separate);
+    std::cout << std::format("  ({} instructions in separate tapes, {} merged, {} registers, checksum {})\n",
+                             separate_size, program.size(), program.registers, out[out.size() - 1] + column[n - 1]);
+}
+
+void bench_parallel_eval(std::size_t leaves) {
+    auto x = Expression<double>::var("x"), y = Expression<double>::var("y");
+    std::vector<Expression<double>> terms;
+    for (std::size_t i = 0; i < leaves; i++) {
+        terms.push_back(sin(x * (i * 1e-3 + 2.5)) / (y + i * 0.3 + 1.5) + x * y * (i + 0.5));
+    }
+    while (terms.size() > 1) {
+        std::vector<Expression<double>> next;
+        for (std::size_t i = 0; i + 1 < terms.size(); i += 2) {
+            next.push_back(i % 4 ? sin(terms[i]) * terms[i + 1] : terms[i] + terms[i + 1]);
+        }
+        terms = next;
+    }
+    Expression<double> expr = terms[0];
+    Expression<double> bound = expr.subs("x", 0.37).subs("y", 1.21);
+    std::cout << std::format("one point of a tree with {} nodes\n", node_count(expr));
+
+    const std::size_t repeats = 20;
+    double expected = 0;
+    double tree = time_ns(repeats, [&]() {
+        for (std::size_t i = 0; i < repeats; i++) expected = bound.eval();
+    });
+    report("tree eval", tree / 1e3, tree / 1e3, "us/point");
+    std::vector<double> values = {0.37, 1.21};
+    bool identical = true;
+    for (unsigned threads: {1u, 0u}) {
+        ParallelEval<double> parallel(expr, {"x", "y"}, threads);
+        double result = 0;
+        double ns = time_ns(repeats, [&]() {
+            for (std::size_t i = 0; i < repeats; i++) result = parallel.eval(values.data());
+        });
+        identical &= std::bit_cast<std::uint64_t>(result) == std::bit_cast<std::uint64_t>(expected);
+        report(std::format("ParallelEval, {} threads", thread_count(threads)), ns / 1e3, tree / 1e3, "us/point");
+    }
+    std::cout << std::format("  (bit-identical: {}, result {})\n", identical ? "yes" : "no", expected);
+}
+
+void bench_interval(const std::string& source, std::size_t boxes) {
+    Expression<double> expr(source);
+    std::cout << std::format("bounds of {} over {} boxes\n", source, boxes);
+    std::vector<double> lo(2 * boxes), hi(2 * boxes);
+    for (std::size_t i = 0; i < boxes; i++) {
+        lo[2 * i] = -2 + 4.0 * (i % 64) / 64;
+        lo[2 * i + 1] = -2 + 4.0 * (i / 64 % 64) / 64;
+        hi[2 * i] = lo[2 * i] + 4.0 / 64;
+        hi[2 * i + 1] = lo[2 * i + 1] + 4.0 / 64;
+    }
+
+    // a 16x16 grid of samples per box, which is still only an estimate
+    const std::size_t side = 16;
+    Tape<double> tape(expr, {"x", "y"});
+    std::vector<double> points(2 * side * side), values(side * side);
+    std::size_t sampled_positive = 0;
+    double sampled = time_ns(boxes, [&]() {
+        for (std::size_t b = 0; b < boxes; b++) {
+            for (std::size_t k = 0; k < side * side; k++) {
+                points[2 * k] = lo[2 * b] + (hi[2 * b] - lo[2 * b]) * (k % side) / (side - 1);
+                points[2 * k + 1] = lo[2 * b + 1] + (hi[2 * b + 1] - lo[2 * b + 1]) * (k / side) / (side - 1);
+            }
+            tape.eval_batch(points.data(), side * side, values.data());
+            sampled_positive += *std::min_element(values.begin(), values.end()) > 0;
+        }
+    });
+    report("16x16 samples per box", sampled, sampled, "ns/box");
+
+    BoxEvaluator<double> evaluator(expr, {"x", "y"});
+    std::vector<Interval<double>> bounds(boxes);
+    report("BoxEvaluator", time_ns(boxes, [&]() {
+        evaluator.eval_batch(lo.data(), hi.data(), boxes, bounds.data());
+    }), sampled, "ns/box");
+    std::size_t proven_positive = std::count_if(bounds.begin(), bounds.end(), [](auto& bound) { return bound.lo > 0; });
+    std::cout << std::format("  ({} boxes look positive from samples, {} are proven positive)\n", sampled_positive, proven_positive);
+}
+
+void bench_polynomial(const std::string& source) {
+    Expression<double> expr(source);
+    std::cout << std::format("d^2/dxdy of {}\n", source);
+    std::vector<std::string> vars = {"x", "y"};
+
+    Expression<double> tree_diff(0.0), auto_diff(0.0), expanded_diff(0.0);
+    double build = time_ns(1, [&]() { tree_diff = expr.diff_by_rules("x").diff_by_rules("y"); });
+    // diff() leaves products of factors with more than one term as they are
+    double auto_build = time_ns(1, [&]() { auto_diff = expr.diff("x").diff("y"); });
+    double expanded_build = time_ns(1, [&]() { expanded_diff = diff_polynomials(diff_polynomials(expr, "x"), "y"); });
+    std::optional<Polynomial<double>> poly;
+    Polynomial<double> poly_diff;
+    double poly_build = time_ns(1, [&]() {
+        poly = to_polynomial(expr, vars);
+        poly_diff = poly->diff("x").diff("y");
+    });
+    report("diff_by_rules()", build, build, "ns");
+    report("diff()", auto_build, build, "ns");
+    report("diff_polynomials()", expanded_build, build, "ns");
+    report("Polynomial::diff", poly_build, build, "ns");
+
+    const std::size_t n = 1 << 14;
+    std::vector<double> points(2 * n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        points[2 * i] = 0.5 + i * 1e-5;
+        points[2 * i + 1] = -0.3 + i * 1e-5;
+    }
+    Tape<double> tape(tree_diff, vars);
+    double tape_ns = time_ns(n, [&]() { tape.eval_batch(points.data(), n, out.data()); });
+    report("tape of diff_by_rules()", tape_ns, tape_ns);
+    Tape<double> auto_tape(auto_diff, vars);
+    report("tape of diff()", time_ns(n, [&]() { auto_tape.eval_batch(points.data(), n, out.data()); }), tape_ns);
+    Tape<double> expanded_tape(expanded_diff, vars);
+    report("tape of diff_polynomials()", time_ns(n, [&]() { expanded_tape.eval_batch(points.data(), n, out.data()); }), tape_ns);
+    report("Polynomial eval_batch", time_ns(n, [&]() { poly_diff.eval_batch(points.data(), n, out.data()); }), tape_ns);
+    Tape<double> horner(poly_diff.to_expression(), vars);
+    report("tape of to_expression()", time_ns(n, [&]() { horner.eval_batch(points.data(), n, out.data()); }), tape_ns);
+    std::cout << std::format("  ({} tape slots from diff_by_rules(), {} from diff(), {} from diff_polynomials(), {} terms, {} tape slots in Horner form, checksum {})\n",
+                             tape.size(), auto_tape.size(), expanded_tape.size(), poly_diff.terms(), horner.size(), out[n - 1]);
+
+    // repeated derivatives, which the rules grow and diff_polynomials() keeps in Horner form
+    const int order = 4;
+    Expression<double> tree_high = expr, auto_high = expr;
+    double high_build = time_ns(1, [&]() {
+        for (int i = 0; i < order; i++) tree_high = tree_high.diff_by_rules("x");
+    });
+    report(std::format("d^{}/dx^{} diff_by_rules()", order, order), high_build, high_build, "ns");
+    report(std::format("d^{}/dx^{} diff_polynomials()", order, order), time_ns(1, [&]() {
+        for (int i = 0; i < order; i++) auto_high = diff_polynomials(auto_high, "x");
+    }), high_build, "ns");
+    Tape<double> tree_high_tape(tree_high, vars), auto_high_tape(auto_high, vars);
+    double high_ns = time_ns(n, [&]() { tree_high_tape.eval_batch(points.data(), n, out.data()); });
+    report("tape of diff_by_rules()", high_ns, high_ns);
+    report("tape of diff_polynomials()", time_ns(n, [&]() { auto_high_tape.eval_batch(points.data(), n, out.data()); }), high_ns);
+    std::cout << std::format("  ({} tape slots from diff_by_rules(), {} from diff_polynomials())\n", tree_high_tape.size(), auto_high_tape.size());
+}
+
+void bench_budget(const std::string& source, int order) {
+    std::cout << std::format("parse, d^{}/dx^{} and to_string of {}\n", order, order, source);
+    std::size_t length = 0;
+    auto work = [&]() {
+        Expression<double> expr = parse<double>(source);
+        for (int i = 0; i < order; i++) {
+            expr = expr.diff("x");
+        }
+        length += expr.to_string().size();
+    };
+    const int runs = 20;
+    double plain = time_ns(runs, [&]() {
+        for (int i = 0; i < runs; i++) work();
+    });
+    report("no budget", plain, plain, "ns");
+    Budget budget = Budget::within(std::chrono::hours(1));
+    budget.max_nodes = budget.max_length = budget.max_depth = 1ull << 40;
+    double budgeted = time_ns(runs, [&]() {
+        BudgetScope scope(budget);
+        for (int i = 0; i < runs; i++) work();
+    });
+    report("with a Budget", budgeted, plain, "ns");
+    std::cout << std::format("  ({} nodes per run, depth {}, {} characters; checksum {})\n",
+                             budget.nodes / runs, budget.deepest, budget.length, length);
+}
+
+void bench_profile(const std::string& source) {
+    Expression<double> expr(source);
+    auto grad = expr.diff("x") + expr.diff("y");
+    std::cout << "profiling f = " << source << " (d/dx + d/dy)\n";
+    std::vector<std::string> vars = {"x", "y"};
+
+    const std::size_t n = 1 << 16;
+    std::vector<double> points(2 * n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        points[2 * i] = 0.5 + i * 1e-5;
+        points[2 * i + 1] = 1.5 - i * 1e-5;
+    }
+    Tape<double> tape(grad, vars);
+    double base = time_ns(n, [&]() { tape.eval_batch(points.data(), n, out.data()); });
+    report("tape eval_batch", base, base);
+    Profiler<double> profiler(grad, vars);
+    report("Profiler, 1 block in 8", time_ns(n, [&]() { profiler.eval_batch(points.data(), n, out.data()); }), base);
+    profiler.sample_every = 1;
+    report("Profiler, every block", time_ns(n, [&]() { profiler.eval_batch(points.data(), n, out.data()); }), base);
+    auto heaviest = profiler.heaviest(2);
+    std::cout << std::format("  ({} tape slots, {} nodes; heaviest below the root: {:.0f}% in {})\n", tape.size(), profiler.size(),
+                             100 * heaviest[1].total / heaviest[0].total, heaviest[1].expr.to_string());
+}
+
+int main() {
+    bench_eval("x * y + x / y - x * x * y");
+    bench_eval("x * sin(y) + exp(-x * x) / (1 + y ^ 2)");
+    bench_eval("(x + y) ^ 3 * ln(x) - cos(x * y) * sin(x - y)");
+    bench_vecmath();
+    bench_complex("z * w / (z + w) - z * z * w");
+    bench_complex("z * sin(w) + exp(-z * z) / (1 + w ^ 2)");
+    bench_load("x * sin(x) / (1 + exp(-x))", 5);
+    bench_parse(3000);
+    bench_lazy_diff("x * sin(x) / (1 + exp(-x))", 4);
+    bench_taylor("x * sin(x) / (1 + exp(-x))", 6);
+    bench_specialize("a * sin(b * x + c) * exp(-d * x) + ln(a * a + b) * cos(c * d) * x ^ 2 + sin(a * b) / (1 + c ^ 2)",
+                     {{"a", 1.5}, {"b", 0.7}, {"c", -0.3}, {"d", 2}});
+    bench_grid("x * sin(y) + exp(-x * x) / (1 + y ^ 2)", 1000);
+    bench_integrate("exp(-s * x) * sin(10 * x) / (1 + x * x)", 1000);
+    bench_newton("x * exp(x) + sin(x) - a", 10000);
+    bench_intern(4096);
+    bench_program(20);
+    bench_parallel_eval(1 << 16);
+    bench_interval("x * sin(y) + exp(-x * x) / (1 + y ^ 2) + 0.5", 4096);
+    bench_polynomial("(1 + x + y) ^ 4 * (x - 2 * y + 3) ^ 3 * (x * y - 1) * (2 * x + y) * (x - y)");
+    bench_budget("x * sin(x) / (1 + exp(-x))", 4);
+    bench_profile("x * sin(y) + exp(-x * x) / (1 + y ^ 2)");
+    return 0;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// Limits on the work a single operation (parse, diff, subs, to_string, a
+// simplifier) may do, so that one bad input can't take gigabytes or minutes.
+//
+// A budget applies to everything the thread does while a BudgetScope for it is
+// alive; the overloads that take a Budget& open one around the operation. The
+// checks are made where the work happens: every node constructed counts towards
+// max_nodes, every level of recursion in diff(), subs(), to_string() and the
+// simplifiers towards max_depth, and every string to_string() builds is held
+// to max_length. The clock is only read every CLOCK_INTERVAL of those steps.
+// Going over a limit throws BudgetExceeded; what was used stays in the budget,
+// so one budget can also be shared by several operations in a row.
+struct Budget {
+    using clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t UNLIMITED = std::numeric_limits<std::size_t>::max();
+    static constexpr std::uint32_t CLOCK_INTERVAL = 256;
+
+    std::size_t max_nodes = UNLIMITED;
+    // of any one string built by to_string()
+    std::size_t max_length = UNLIMITED;
+    // of recursion, or of the tree being parsed
+    std::size_t max_depth = UNLIMITED;
+    std::optional<clock::time_point> deadline;
+
+    // used so far
+    std::size_t nodes = 0;
+    std::size_t length = 0;
+    std::size_t depth = 0;
+    std::size_t deepest = 0;
+    // set by the first scope
+    std::optional<clock::time_point> started;
+    // checks made; the clock is read on every CLOCK_INTERVAL-th
+    std::uint32_t steps = 0;
+
+    // a budget that runs out `timeout` from now
+    static Budget within(clock::duration timeout) {
+        Budget budget;
+        budget.started = clock::now();
+        budget.deadline = *budget.started + timeout;
+        return budget;
+    }
+
+    void add_node();
+    void add_length(std::size_t size);
+    // one level deeper, undone by leave()
+    void enter();
+    void leave() {
+        depth--;
+    }
+    // a depth reached by other means than enter(), such as the height of a parsed tree
+    void reach(std::size_t height);
+    // reads the clock if it's time to
+    void tick();
+};
+
+// thrown when a Budget runs out, with what was used of which limit
+class BudgetExceeded : public std::runtime_error {
+public:
+    enum Resource {
+        NODES,
+        LENGTH,
+        DEPTH,
+        TIME,
+    };
+
+    Resource resource;
+    // nodes, characters, levels, or microseconds since the budget started
+    std::size_t used;
+    std::size_t limit;
+
+    BudgetExceeded(Resource _resource, std::size_t _used, std::size_t _limit)
+        : std::runtime_error(message(_resource, _used, _limit)), resource(_resource), used(_used), limit(_limit) {}
+
+private:
+    static std::string message(Resource resource, std::size_t used, std::size_t limit) {
+        switch (resource) {
+            case NODES: return std::format("Budget exceeded: created {} nodes, the limit is {}", used, limit);
+            case LENGTH: return std::format("Budget exceeded: built a string of {} characters, the limit is {}", used, limit);
+            case DEPTH: return std::format("Budget exceeded: reached depth {}, the limit is {}", used, limit);
+            case TIME: return std::format("Budget exceeded: ran for {} us, the limit is {} us", used, limit);
+        }
+        return "Budget exceeded";
+    }
+};
+
+namespace budget_detail {
+
+// the budget of the innermost BudgetScope on this thread
+inline constinit thread_local Budget* current = nullptr;
+
+inline std::size_t microseconds(Budget::clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+inline void add_node() {
+    if (Budget* budget = current) budget->add_node();
+}
+
+inline void add_length(std::size_t size) {
+    if (Budget* budget = current) budget->add_length(size);
+}
+
+} // namespace budget_detail
+
+inline void Budget::tick() {
+    if (++steps % CLOCK_INTERVAL == 0 && deadline) {
+        auto now = clock::now();
+        if (now > *deadline) {
+            auto start = std::min(started.value_or(now), *deadline);
+            throw BudgetExceeded(BudgetExceeded::TIME, budget_detail::microseconds(now - start),
+                                 budget_detail::microseconds(*deadline - start));
+        }
+    }
+}
+
+inline void Budget::add_node() {
+    if (++nodes > max_nodes) {
+        throw BudgetExceeded(BudgetExceeded::NODES, nodes, max_nodes);
+    }
+    tick();
+}
+
+inline void Budget::add_length(std::size_t size) {
+    if (size > length) {
+        length = size;
+        if (length > max_length) {
+            throw BudgetExceeded(BudgetExceeded::LENGTH, length, max_length);
+        }
+    }
+    tick();
+}
+
+inline void Budget::enter() {
+    reach(depth + 1);
+    tick();
+    depth++;
+}
+
+inline void Budget::reach(std::size_t height) {
+    if (height > deepest) {
+        deepest = height;
+        if (deepest > max_depth) {
+            throw BudgetExceeded(BudgetExceeded::DEPTH, deepest, max_depth);
+        }
+    }
+}
+
+// makes `budget` the one that applies on this thread until the scope ends
+class BudgetScope {
+    Budget* previous;
+
+public:
+    explicit BudgetScope(Budget& budget) : previous(budget_detail::current) {
+        if (!budget.started) {
+            budget.started = Budget::clock::now();
+        }
+        budget_detail::current = &budget;
+    }
+    BudgetScope(const BudgetScope&) = delete;
+    BudgetScope& operator=(const BudgetScope&) = delete;
+    ~BudgetScope() {
+        budget_detail::current = previous;
+    }
+};
+
+// one level of recursion, charged to the current budget (if any) while it lives
+class BudgetDepth {
+    Budget* budget;
+
+public:
+    BudgetDepth() : budget(budget_detail::current) {
+        if (budget) budget->enter();
+    }
+    BudgetDepth(const BudgetDepth&) = delete;
+    BudgetDepth& operator=(const BudgetDepth&) = delete;
+    ~BudgetDepth() {
+        if (budget) budget->leave();
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "tape.h"
+#include <cmath>
+#include <format>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+struct CodegenOptions {
+    // name of the scalar function, the batched one gets a `_batch` suffix
+    std::string name = "expr";
+    // also emit `NAME_batch` evaluating rows of points in a loop
+    bool batch = true;
+};
+
+namespace codegen_detail {
+
+// C literal that keeps full precision and is never an integer
+inline std::string literal(double value) {
+    if (std::isnan(value)) {
+        return "NAN";
+    }
+    if (std::isinf(value)) {
+        return value > 0 ? "HUGE_VAL" : "(-HUGE_VAL)";
+    }
+    std::string str = std::format("{:.17g}", value);
+    if (str.find_first_of(".e") == std::string::npos) {
+        str += ".0";
+    }
+    return std::signbit(value) ? "(" + str + ")" : str;
+}
+
+inline std::string literal(complex value) {
+    return std::format("std::complex<double>({}, {})", literal(value.real()), literal(value.imag()));
+}
+
+} // namespace codegen_detail
+
+// Emits standalone source for evaluating `outputs` at a point:
+//
+//     void NAME(const T* in, T* out);
+//     void NAME_batch(const T* in, T* out, size_t n);
+//
+// `in[i]` is `vars[i]` and `out[k]` is `outputs[k]`; the batched variant takes
+// `n` points row by row (`in[p * vars.size() + i]`, `out[p * outputs.size() + k]`).
+// T is `double` (plain C, needs only math.h) or `std::complex<double>` (C++).
+// Every distinct subexpression becomes one temporary, so shared work is done once.
+template<typename Number>
+std::string emit_c(const std::vector<Expression<Number>>& outputs, const std::vector<std::string>& vars, const CodegenOptions& options = {}) {
+    static_assert(std::is_same_v<Number, double> || std::is_same_v<Number, complex>, "emit_c supports double and complex");
+    constexpr bool is_complex = std::is_same_v<Number, complex>;
+    const std::string type = is_complex ? "std::complex<double>" : "double";
+    const std::string size_type = is_complex ? "std::size_t" : "size_t";
+    const std::string math = is_complex ? "std::" : "";
+
+    Tape<Number> tape(outputs, vars);
+    auto ref = [&](std::uint32_t slot) {
+        auto ins = tape.code[slot];
+        switch (ins.kind) {
+            case EXPR_NUM: return codegen_detail::literal(tape.constants[ins.lhs]);
+            case EXPR_VAR: return std::format("in[{}]", ins.lhs);
+            default: return std::format("t{}", slot);
+        }
+    };
+
+    std::string src = "/* generated by symexpr */\n";
+    src += is_complex ? "#include <cmath>\n#include <complex>\n#include <cstddef>\n" : "#include <math.h>\n#include <stddef.h>\n";
+    src += "\n/* in: ";
+    for (std::size_t i = 0; i < vars.size(); i++) {
+        src += std::format("{}in[{}] = {}", i ? ", " : "", i, vars[i]);
+    }
+    src += std::format("; out: {} value{} */\n", outputs.size(), outputs.size() == 1 ? "" : "s");
+
+    src += std::format("void {}(const {}* in, {}* out) {{\n", options.name, type, type);
+    for (std::uint32_t i = 0; i < tape.size(); i++) {
+        auto ins = tape.code[i];
+        std::string value;
+        switch (ins.kind) {
+            case EXPR_NUM:
+            case EXPR_VAR:
+                continue;
+            case EXPR_SUM: value = std::format("{} + {}", ref(ins.lhs), ref(ins.rhs)); break;
+            case EXPR_NEG: value = std::format("-{}", ref(ins.lhs)); break;
+            case EXPR_MUL: value = std::format("{} * {}", ref(ins.lhs), ref(ins.rhs)); break;
+            case EXPR_DIV: value = std::format("{} / {}", ref(ins.lhs), ref(ins.rhs)); break;
+            case EXPR_POW: value = std::format("{}pow({}, {})", math, ref(ins.lhs), ref(ins.rhs)); break;
+            case EXPR_SIN: value = std::format("{}sin({})", math, ref(ins.lhs)); break;
+            case EXPR_COS: value = std::format("{}cos({})", math, ref(ins.lhs)); break;
+            case EXPR_LN: value = std::format("{}log({})", math, ref(ins.lhs)); break;
+            case EXPR_EXP: value = std::format("{}exp({})", math, ref(ins.lhs)); break;
+        }
+        src += std::format("    const {} t{} = {};\n", type, i, value);
+    }
+    for (std::size_t k = 0; k < outputs.size(); k++) {
+        src += std::format("    out[{}] = {};\n", k, ref(tape.outputs[k]));
+    }
+    src += "}\n";
+
+    if (options.batch) {
+        src += std::format("\nvoid {}_batch(const {}* in, {}* out, {} n) {{\n", options.name, type, type, size_type);
+        src += std::format("    for ({} p = 0; p < n; p++) {{\n", size_type);
+        src += std::format("        {}(in + p * {}, out + p * {});\n", options.name, vars.size(), outputs.size());
+        src += "    }\n}\n";
+    }
+    return src;
+}
+
+template<typename Number>
+std::string emit_c(const Expression<Number>& expr, const std::vector<std::string>& vars, const CodegenOptions& options = {}) {
+    return emit_c(std::vector<Expression<Number>>{expr}, vars, options);
+}
+
+// like emit_c, with `out[0]` the value and `out[1 + i]` the derivative by `vars[i]`
+template<typename Number>
+std::string emit_c_gradient(const Expression<Number>& expr, const std::vector<std::string>& vars, const CodegenOptions& options = {}) {
+    std::vector<Expression<Number>> outputs{expr};
+    for (auto& var: vars) {
+        outputs.push_back(expr.diff(var));
+    }
+    return emit_c(outputs, vars, options);
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "tape.h"
+#include "vecmath.h"
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <string>
+#include <vector>
+
+// Batch evaluation of a complex tape with real and imaginary parts in separate
+// arrays, so the arithmetic runs as plain double loops that vectorize, instead
+// of going element by element through std::complex.
+//
+// Multiplication and division use the textbook formulas. In the default strict
+// mode, lanes where those can go wrong (a nan result, or for division an
+// overflowing or underflowing denominator) are redone with std::complex, which
+// recovers infinities the way C's Annex G specifies. The same goes for every
+// non-finite result of the library functions. With `fast_math` these fix-ups
+// are skipped, so infinities and nans may come out differently.
+//
+// Each operation's result matches std::complex to within a few ulps of
+// max(|result|, 1): ln uses log(hypot(re, im)), which is less accurate than
+// clog() for |z| near 1, and pow is exp(y * ln(x)) like glibc's cpow().
+//
+// With `vector_math`, exp, ln, sin, cos and pow run on the vecmath.h kernels
+// over whole blocks instead of calling libm lane by lane. Their real parts are
+// within 2 ulp, and ln's real part stays accurate for |z| near 1 as well.
+class ComplexBatch {
+    Tape<complex> tape;
+    std::vector<double> constant_re;
+    std::vector<double> constant_im;
+
+public:
+    static constexpr std::size_t BATCH = Tape<complex>::BATCH;
+
+    bool fast_math;
+    // let eval_batch use the vecmath.h kernels for exp, ln, sin, cos and pow
+    bool vector_math = false;
+
+    ComplexBatch(const Expression<complex>& expr, std::vector<std::string> vars, bool _fast_math = false)
+        : ComplexBatch(Tape<complex>(expr, std::move(vars)), _fast_math) {}
+
+    ComplexBatch(Tape<complex> _tape, bool _fast_math = false) : tape(std::move(_tape)), fast_math(_fast_math) {
+        for (complex value: tape.constants) {
+            constant_re.push_back(value.real());
+            constant_im.push_back(value.imag());
+        }
+    }
+
+    // evaluate `n` points stored by variable: `vars[i]` of point `p` is
+    // `re[i * n + p] + im[i * n + p] * i`. The first output goes to `out_re`/`out_im`.
+    void eval_batch(const double* re, const double* im, std::size_t n, double* out_re, double* out_im) const {
+        std::vector<double> scratch_re(tape.size() * BATCH), scratch_im(tape.size() * BATCH);
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            run_block(re + begin, im + begin, n, count, scratch_re.data(), scratch_im.data());
+            std::uint32_t slot = tape.outputs[0];
+            std::copy_n(&scratch_re[slot * BATCH], count, out_re + begin);
+            std::copy_n(&scratch_im[slot * BATCH], count, out_im + begin);
+        }
+    }
+
+    // same layout as Tape::eval_batch, split on the way in and joined on the way out
+    void eval_batch(const complex* points, std::size_t n, complex* out) const {
+        std::size_t nvars = tape.vars.size();
+        std::vector<double> re(nvars * n), im(nvars * n), out_re(n), out_im(n);
+        for (std::size_t p = 0; p < n; p++) {
+            for (std::size_t i = 0; i < nvars; i++) {
+                re[i * n + p] = points[p * nvars + i].real();
+                im[i * n + p] = points[p * nvars + i].imag();
+            }
+        }
+        eval_batch(re.data(), im.data(), n, out_re.data(), out_im.data());
+        for (std::size_t p = 0; p < n; p++) {
+            out[p] = complex(out_re[p], out_im[p]);
+        }
+    }
+
+private:
+    void run_block(const double* re, const double* im, std::size_t stride, std::size_t count, double* sre, double* sim) const {
+        for (std::size_t i = 0; i < tape.code.size(); i++) {
+            const auto& ins = tape.code[i];
+            double* dre = &sre[i * BATCH];
+            double* dim = &sim[i * BATCH];
+            // lhs and rhs of leaves aren't slots
+            std::size_t operands = operand_count(ins.kind);
+            const double* are = operands > 0 ? &sre[ins.lhs * BATCH] : nullptr;
+            const double* aim = operands > 0 ? &sim[ins.lhs * BATCH] : nullptr;
+            const double* bre = operands > 1 ? &sre[ins.rhs * BATCH] : nullptr;
+            const double* bim = operands > 1 ? &sim[ins.rhs * BATCH] : nullptr;
+            switch (ins.kind) {
+                case EXPR_NUM:
+                    std::fill(dre, dre + count, constant_re[ins.lhs]);
+                    std::fill(dim, dim + count, constant_im[ins.lhs]);
+                    break;
+                case EXPR_VAR:
+                    std::copy_n(re + ins.lhs * stride, count, dre);
+                    std::copy_n(im + ins.lhs * stride, count, dim);
+                    break;
+                case EXPR_SUM:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dre[j] = are[j] + bre[j];
+                        dim[j] = aim[j] + bim[j];
+                    }
+                    break;
+                case EXPR_NEG:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dre[j] = -are[j];
+                        dim[j] = -aim[j];
+                    }
+                    break;
+                case EXPR_MUL:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dre[j] = are[j] * bre[j] - aim[j] * bim[j];
+                        dim[j] = are[j] * bim[j] + aim[j] * bre[j];
+                    }
+                    if (!fast_math) {
+                        for (std::size_t j = 0; j < count; j++) {
+                            if (std::isnan(dre[j]) && std::isnan(dim[j])) {
+                                store(dre, dim, j, complex(are[j], aim[j]) * complex(bre[j], bim[j]));
+                            }
+                        }
+                    }
+                    break;
+                case EXPR_DIV:
+                    for (std::size_t j = 0; j < count; j++) {
+                        double d = bre[j] * bre[j] + bim[j] * bim[j];
+                        dre[j] = (are[j] * bre[j] + aim[j] * bim[j]) / d;
+                        dim[j] = (aim[j] * bre[j] - are[j] * bim[j]) / d;
+                    }
+                    if (!fast_math) {
+                        for (std::size_t j = 0; j < count; j++) {
+                            double d = bre[j] * bre[j] + bim[j] * bim[j];
+                            if (!(d >= DBL_MIN && d <= DBL_MAX) || !finite(dre, dim, j)) {
+                                store(dre, dim, j, complex(are[j], aim[j]) / complex(bre[j], bim[j]));
+                            }
+                        }
+                    }
+                    break;
+                case EXPR_POW:
+                    if (vector_math) {
+                        eval_vector_math(ins.kind, are, aim, bre, bim, dre, dim, count);
+                    } else {
+                        for (std::size_t j = 0; j < count; j++) {
+                            // exp(b * ln(a))
+                            double lre = std::log(std::hypot(are[j], aim[j]));
+                            double lim = std::atan2(aim[j], are[j]);
+                            double tre = bre[j] * lre - bim[j] * lim;
+                            double tim = bre[j] * lim + bim[j] * lre;
+                            double r = std::exp(tre);
+                            dre[j] = r * std::cos(tim);
+                            dim[j] = r * std::sin(tim);
+                        }
+                    }
+                    fix_up(dre, dim, count, are, aim, bre, bim, [](complex a, complex b) { return std::pow(a, b); });
+                    break;
+                case EXPR_SIN:
+                    if (vector_math) {
+                        eval_vector_math(ins.kind, are, aim, bre, bim, dre, dim, count);
+                    } else {
+                        for (std::size_t j = 0; j < count; j++) {
+                            dre[j] = std::sin(are[j]) * std::cosh(aim[j]);
+                            dim[j] = std::cos(are[j]) * std::sinh(aim[j]);
+                        }
+                    }
+                    fix_up(dre, dim, count, are, aim, are, aim, [](complex a, complex) { return std::sin(a); });
+                    break;
+                case EXPR_COS:
+                    if (vector_math) {
+                        eval_vector_math(ins.kind, are, aim, bre, bim, dre, dim, count);
+                    } else {
+                        for (std::size_t j = 0; j < count; j++) {
+                            dre[j] = std::cos(are[j]) * std::cosh(aim[j]);
+                            dim[j] = -std::sin(are[j]) * std::sinh(aim[j]);
+                        }
+                    }
+                    fix_up(dre, dim, count, are, aim, are, aim, [](complex a, complex) { return std::cos(a); });
+                    break;
+                case EXPR_LN:
+                    if (vector_math) {
+                        eval_vector_math(ins.kind, are, aim, bre, bim, dre, dim, count);
+                    } else {
+                        for (std::size_t j = 0; j < count; j++) {
+                            dre[j] = std::log(std::hypot(are[j], aim[j]));
+                            dim[j] = std::atan2(aim[j], are[j]);
+                        }
+                    }
+                    fix_up(dre, dim, count, are, aim, are, aim, [](complex a, complex) { return std::log(a); });
+                    break;
+                case EXPR_EXP:
+                    if (vector_math) {
+                        eval_vector_math(ins.kind, are, aim, bre, bim, dre, dim, count);
+                    } else {
+                        for (std::size_t j = 0; j < count; j++) {
+                            double r = std::exp(are[j]);
+                            dre[j] = r * std::cos(aim[j]);
+                            dim[j] = r * std::sin(aim[j]);
+                        }
+                    }
+                    fix_up(dre, dim, count, are, aim, are, aim, [](complex a, complex) { return std::exp(a); });
+                    break;
+            }
+        }
+    }
+
+    // the transcendental operations on the vecmath.h kernels; `dre` and `dim` must not overlap the operands
+    static void eval_vector_math(ExprKind kind, const double* are, const double* aim, const double* bre, const double* bim,
+                                 double* dre, double* dim, std::size_t count) {
+        std::array<double, BATCH> s, c, sh, ch;
+        switch (kind) {
+            case EXPR_POW:
+                // exp(b * ln(a))
+                vecmath::log_hypot(are, aim, s.data(), count);
+                vecmath::atan2(aim, are, c.data(), count);
+                for (std::size_t j = 0; j < count; j++) {
+                    sh[j] = bre[j] * s[j] - bim[j] * c[j];
+                    ch[j] = bre[j] * c[j] + bim[j] * s[j];
+                }
+                vecmath::exp(sh.data(), s.data(), count);
+                vecmath::sincos(ch.data(), dim, c.data(), count);
+                for (std::size_t j = 0; j < count; j++) {
+                    dre[j] = s[j] * c[j];
+                    dim[j] = s[j] * dim[j];
+                }
+                break;
+            case EXPR_SIN:
+                vecmath::sincos(are, s.data(), c.data(), count);
+                vecmath::sinhcosh(aim, sh.data(), ch.data(), count);
+                for (std::size_t j = 0; j < count; j++) {
+                    dre[j] = s[j] * ch[j];
+                    dim[j] = c[j] * sh[j];
+                }
+                break;
+            case EXPR_COS:
+                vecmath::sincos(are, s.data(), c.data(), count);
+                vecmath::sinhcosh(aim, sh.data(), ch.data(), count);
+                for (std::size_t j = 0; j < count; j++) {
+                    dre[j] = c[j] * ch[j];
+                    dim[j] = -s[j] * sh[j];
+                }
+                break;
+            case EXPR_LN:
+                vecmath::log_hypot(are, aim, dre, count);
+                vecmath::atan2(aim, are, dim, count);
+                break;
+            case EXPR_EXP:
+                vecmath::exp(are, sh.data(), count);
+                vecmath::sincos(aim, s.data(), c.data(), count);
+                for (std::size_t j = 0; j < count; j++) {
+                    dre[j] = sh[j] * c[j];
+                    dim[j] = sh[j] * s[j];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    static bool finite(const double* re, const double* im, std::size_t j) {
+        return std::isfinite(re[j]) && std::isfinite(im[j]);
+    }
+
+    static void store(double* re, double* im, std::size_t j, complex value) {
+        re[j] = value.real();
+        im[j] = value.imag();
+    }
+
+    // redo non-finite lanes with std::complex
+    template<typename F>
+    void fix_up(double* dre, double* dim, std::size_t count,
+                const double* are, const double* aim, const double* bre, const double* bim, F f) const {
+        if (fast_math) {
+            return;
+        }
+        for (std::size_t j = 0; j < count; j++) {
+            if (!finite(dre, dim, j)) {
+                store(dre, dim, j, f(complex(are[j], aim[j]), complex(bre[j], bim[j])));
+            }
+        }
+    }
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "hash.h"
+#include "mapped_file.h"
+#include "serialize.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Opt-in persistent cache of derivatives: a directory with one file per
+// (structural hash of the expression, variable, order, simplification level),
+// holding the derivative in the binary format of serialize.h.
+//
+//     DiffCache cache("/var/cache/symexpr");
+//     auto d2 = cache.diff(expr, "x", 2);   // computed once, then read back
+//
+// Several processes may share a directory. Entries are written to a temporary
+// file and renamed into place, so readers only ever see complete files, and a
+// reader's mapping stays valid if the entry is replaced or evicted meanwhile.
+// Eviction removes the least recently used entries (a hit refreshes the file's
+// modification time) and is serialized between processes with flock().
+class DiffCache {
+    std::filesystem::path dir;
+    std::uintmax_t max_bytes;
+    // the size of the entries as of the last scan, plus what this object stored since
+    std::optional<std::uintmax_t> known_bytes;
+    std::size_t stores_since_scan = 0;
+
+public:
+    // the only level today: what Expression::diff() gives, i.e. the folding done by
+    // Expression's operators and its compact polynomial subtrees (see polynomial.h)
+    static constexpr int DEFAULT_LEVEL = 0;
+    // part of every entry's header; bumped whenever diff() can give another result,
+    // so entries written by older versions are recomputed
+    static constexpr std::uint16_t VERSION = 2;
+    // how often store() scans the directory again, to see what other processes stored
+    static constexpr std::size_t RESCAN_STORES = 256;
+
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+
+    DiffCache(std::filesystem::path _dir, std::uintmax_t _max_bytes = std::uintmax_t(1) << 30)
+        : dir(std::move(_dir)), max_bytes(_max_bytes)
+    {
+        std::filesystem::create_directories(dir);
+    }
+
+    // the `order`-th derivative by `name`, reading or filling the cache for
+    // every order up to it
+    template<typename Number = DefaultNumber>
+    Expression<Number> diff(const Expression<Number>& expr, const std::string& name, int order = 1, int level = DEFAULT_LEVEL) {
+        StructuralHash hash = structural_hash(expr);
+        int known = order;
+        std::optional<Expression<Number>> result;
+        for (; known > 0; known--) {
+            if ((result = lookup<Number>(hash, name, known, level))) {
+                break;
+            }
+        }
+        if (!result) {
+            result = expr;
+        }
+        for (int k = known + 1; k <= order; k++) {
+            result = result->diff(name);
+            store(hash, name, k, level, *result);
+        }
+        return *result;
+    }
+
+    template<typename Number = DefaultNumber>
+    std::optional<Expression<Number>> lookup(const StructuralHash& hash, const std::string& name, int order, int level = DEFAULT_LEVEL) {
+        auto path = entry_path<Number>(hash, name, order, level);
+        try {
+            MappedFile file(path.string());
+            std::string_view data(file.data(), file.size());
+            std::string header = entry_header<Number>(hash, name, order, level);
+            if (!data.starts_with(header)) {
+                misses++;
+                return {};
+            }
+            auto bytes = file.bytes().subspan(header.size());
+            Expression<Number> result = read_binary<Number>(bytes);
+            std::error_code ec;
+            std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+            hits++;
+            return result;
+        } catch (const std::runtime_error&) {
+            // no such entry
+        } catch (const std::invalid_argument&) {
+            // damaged entry, drop it
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+        misses++;
+        return {};
+    }
+
+    // returns false if the entry couldn't be written; the cache is only an optimization
+    template<typename Number = DefaultNumber>
+    bool store(const StructuralHash& hash, const std::string& name, int order, int level, const Expression<Number>& derivative) {
+        static std::atomic<unsigned> counter = 0;
+        auto path = entry_path<Number>(hash, name, order, level);
+        auto tmp = dir / std::format(".tmp-{}-{}", getpid(), counter++);
+        std::error_code ec;
+        std::uintmax_t written = 0;
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out << entry_header<Number>(hash, name, order, level);
+            write_binary(out, derivative);
+            out.flush();
+            if (!out) {
+                std::filesystem::remove(tmp, ec);
+                return false;
+            }
+            written = out.tellp();
+        }
+        // an entry being replaced doesn't count anymore
+        std::uintmax_t replaced = std::filesystem::file_size(path, ec);
+        if (ec) {
+            replaced = 0;
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+        if (!known_bytes || ++stores_since_scan >= RESCAN_STORES) {
+            known_bytes = size_bytes();
+            stores_since_scan = 0;
+        } else {
+            *known_bytes += written - std::min(replaced, *known_bytes + written);
+        }
+        if (*known_bytes > max_bytes) {
+            evict(max_bytes - max_bytes / 4);
+        }
+        return true;
+    }
+
+    // total size of all entries, by scanning the directory
+    std::uintmax_t size_bytes() const {
+        std::uintmax_t total = 0;
+        std::error_code ec;
+        for (auto& entry: std::filesystem::directory_iterator(dir, ec)) {
+            if (is_entry(entry.path())) {
+                total += entry.file_size(ec);
+            }
+        }
+        return total;
+    }
+
+    // remove least recently used entries until at most `target` bytes remain
+    void evict(std::uintmax_t target) {
+        int lock = open((dir / ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock < 0) {
+            return;
+        }
+        flock(lock, LOCK_EX);
+
+        struct Entry {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            std::uintmax_t size;
+        };
+        std::vector<Entry> entries;
+        std::uintmax_t total = 0;
+        std::error_code ec;
+        auto stale = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+        for (auto& entry: std::filesystem::directory_iterator(dir, ec)) {
+            auto used = entry.last_write_time(ec);
+            if (entry.path().filename().string().starts_with(".tmp-")) {
+                // left behind by a writer that died
+                if (!ec && used < stale) {
+                    std::filesystem::remove(entry.path(), ec);
+                }
+                continue;
+            }
+            if (is_entry(entry.path())) {
+                entries.push_back({entry.path(), used, entry.file_size(ec)});
+                total += entries.back().size;
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.used < b.used;
+        });
+        for (auto& entry: entries) {
+            if (total <= target) {
+                break;
+            }
+            if (std::filesystem::remove(entry.path, ec)) {
+                total -= entry.size;
+            }
+        }
+        known_bytes = total;
+        stores_since_scan = 0;
+
+        flock(lock, LOCK_UN);
+        close(lock);
+    }
+
+private:
+    static bool is_entry(const std::filesystem::path& path) {
+        return path.extension() == ".symd";
+    }
+
+    template<typename Number>
+    static StructuralHash entry_key(const StructuralHash& hash, const std::string& name, int order, int level) {
+        return hash.combine(name).combine(order).combine(level).combine(serial_number_type<Number>());
+    }
+
+    template<typename Number>
+    std::filesystem::path entry_path(const StructuralHash& hash, const std::string& name, int order, int level) const {
+        return dir / (entry_key<Number>(hash, name, order, level).hex() + ".symd");
+    }
+
+    // the full key is repeated inside the file, so a file name collision is detected
+    template<typename Number>
+    static std::string entry_header(const StructuralHash& hash, const std::string& name, int order, int level) {
+        return std::format("SYMD {} {} {} {} {} {}\n", VERSION, hash.hex(), int(serial_number_type<Number>()), order, level, name);
+    }
+};
@@ -1,9 +1,20 @@
 #include"../src/symexpr.h"
+#include"../src/codegen.h"
+#include"../src/domain.h"
+#include"../src/grid.h"
+#include"../src/profile.h"
+#include"../src/taylor.h"
 #include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <format>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 // > differentiator --eval “x * y“ x=10 y=12
@@ -12,10 +23,143 @@
 // > differentiator --diff “x * sin(x)“ --by x
 // x * cos(x) + sin(x)
 
+// > differentiator --taylor “exp(2 * x)“ x=0 --order 3
+// 1
+// 2
+// 4
+// 8
+
+// > differentiator --grid “x * y“ x=0:1:3 y=1:2:2
+// 0 1 0
+// 0 2 0
+// 0.5 1 0.5
+// ...
+// (with --output FILE, the binary format described in grid.h instead)
+
+// > differentiator --emit-c “x * sin(y)“ x y --gradient --name model
+// (C source of `void model(const double* in, double* out)` and `model_batch`)
+
+// > differentiator --profile “x * sin(y) + exp(-x * x)“ x=0.5 y=2 --top 2 --folded model.folded
+// {x * {sin(y) : 35.2%} : 50.8%} + {exp({{-x : 11.1%} * x : 22.6%}) : 42.8%}
+// 100.0%   6.5%  x * sin(y) + exp(-x * x)
+//  50.8%   5.5%  x * sin(y)
+// (the time in each subtree, then in the node itself; the flame graph stacks go to the file)
+
+// > differentiator --diff @model.txt --by x
+// (EXPR can be read from a file with `@PATH` or `--file PATH`, or from stdin with `@-`)
+
 void print_usage() {
     std::cout << "Usage:\n";
     std::cout << "  differentiator --eval EXPR [VAR=VALUE...]\n";
     std::cout << "  differentiator --diff EXPR --by VAR\n";
+    std::cout << "  differentiator --taylor EXPR VAR=POINT [--order N] [VAR=VALUE...]\n";
+    std::cout << "  differentiator --grid EXPR VAR=MIN:MAX:STEPS... [VAR=VALUE...] [--derivatives] [--threads N] [--output FILE]\n";
+    std::cout << "  differentiator --emit-c EXPR [VAR...] [--gradient] [--complex] [--name NAME]\n";
+    std::cout << "  differentiator --profile EXPR [VAR=VALUE...] [--points N] [--top N] [--folded FILE]\n";
+    std::cout << "EXPR can also be @PATH or --file PATH, and @- reads it from stdin\n";
+}
+
+// the expression argument: the text itself, or a file that's mapped (or stdin
+// that's read in chunks) and parsed without copying it into a string
+struct ExpressionArg {
+    std::string text;
+    bool is_file = false;
+
+    template<typename Number>
+    Expression<Number> parse() const {
+        if (!is_file) {
+            return Expression<Number>(text);
+        }
+        if (text == "-") {
+            return ::parse<Number>(std::cin);
+        }
+        return parse_file<Number>(text);
+    }
+};
+
+// `VAR=VALUE`, with VALUE evaluated as a complex expression
+bool parse_binding(const std::string& arg, Bindings& bindings) {
+    size_t eq_pos = arg.find('=');
+    if (eq_pos == std::string::npos) {
+        return false;
+    }
+    std::string var = arg.substr(0, eq_pos);
+    complex val = Expression<complex>(arg.substr(eq_pos + 1)).eval();
+    if (val.imag() == 0) {
+        // `-1` evaluates to (-1, -0), which would put ln() on the other branch cut
+        val = val.real();
+    }
+    bindings.emplace_back(var, val);
+    return true;
+}
+
+// the value of a count option such as `--order N`: decimal digits only, at most `max`
+std::size_t parse_count(const std::string& option, const std::string& value, std::size_t max) {
+    std::size_t result = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (value.empty() || error != std::errc() || end != value.data() + value.size() || result > max) {
+        throw std::invalid_argument(std::format("Invalid {} `{}`, expected a whole number up to {}", option, value, max));
+    }
+    return result;
+}
+
+// Taylor coefficients take O(order^2) per node, so anything above this is a typo
+constexpr std::size_t MAX_TAYLOR_ORDER = 10000;
+
+// the derivatives of orders 0..order by the first binding, at its value, one per line
+template<typename Number>
+void print_taylor(const Expression<Number>& expr, const Bindings& values_map, std::size_t order) {
+    std::vector<std::pair<std::string, Number>> bindings;
+    for (auto& [var, val]: values_map) {
+        if constexpr (std::is_same_v<Number, complex>) {
+            bindings.emplace_back(var, val);
+        } else {
+            bindings.emplace_back(var, val.real());
+        }
+    }
+    auto [var, at] = bindings.front();
+    bindings.erase(bindings.begin());
+    for (Number value: taylor_derivatives(expr, var, at, order, bindings)) {
+        std::cout << format_number(value, false) << std::endl;
+    }
+}
+
+// evaluates `expr` at the point `points` times and prints where the time went
+void print_profile(const Expression<double>& expr, const Bindings& values_map, std::size_t points, std::size_t top, const std::string& folded) {
+    std::vector<std::string> vars;
+    std::vector<double> point;
+    for (auto& [var, val]: values_map) {
+        if (val.imag() != 0) {
+            throw std::invalid_argument(std::format("Can't profile with a complex `{}`", var));
+        }
+        vars.push_back(var);
+        point.push_back(val.real());
+    }
+    Profiler<double> profiler(expr, vars);
+    std::vector<double> batch(points * vars.size()), out(points);
+    for (std::size_t p = 0; p < points; p++) {
+        std::copy(point.begin(), point.end(), batch.begin() + p * vars.size());
+    }
+    profiler.eval_batch(batch.data(), points, out.data());
+
+    std::cout << profiler.annotate() << std::endl;
+    double total = profiler.profile().back().total;
+    for (auto& node: profiler.heaviest(top)) {
+        std::cout << std::format("{:>5.1f}% {:>5.1f}%  {}", 100 * node.total / total, 100 * node.self / total, profiler.to_string(node.slot)) << std::endl;
+    }
+    if (!folded.empty()) {
+        std::ofstream file(folded);
+        if (!file) {
+            throw std::invalid_argument(std::format("Can't write `{}`", folded));
+        }
+        file << profiler.folded();
+    }
+}
+
+template<typename Number>
+void emit_source(const ExpressionArg& expr_arg, const std::vector<std::string>& vars, bool gradient, const CodegenOptions& options) {
+    Expression<Number> expr = expr_arg.parse<Number>();
+    std::cout << (gradient ? emit_c_gradient(expr, vars, options) : emit_c(expr, vars, options));
 }
 
 int main(int argc, char* argv[]) {
@@ -25,51 +169,179 @@ int main(int argc, char* argv[]) {
     }
 
     std::string op = argv[1];
-    std::string expr_str = argv[2];
+    ExpressionArg expr_arg{argv[2]};
+    // the first argument after EXPR
+    int rest = 3;
+    if (expr_arg.text == "--file" && argc > 3) {
+        expr_arg = {argv[3], true};
+        rest = 4;
+    } else if (expr_arg.text.starts_with('@')) {
+        expr_arg = {expr_arg.text.substr(1), true};
+    }
+    if (expr_arg.is_file && expr_arg.text != "-" && !std::ifstream(expr_arg.text)) {
+        std::cerr << std::format("Can't open `{}`", expr_arg.text) << std::endl;
+        return 1;
+    }
 
     if (op == "--eval") {
-        std::vector<std::pair<std::string, complex>> values_map;
-        for (int i = 3; i < argc; i++) {
-            std::string arg = argv[i];
-            size_t eq_pos = arg.find('=');
-            if (eq_pos == std::string::npos) {
+        Bindings values_map;
+        for (int i = rest; i < argc; i++) {
+            if (!parse_binding(argv[i], values_map)) {
                 print_usage();
                 return 1;
             }
-            std::string var = arg.substr(0, eq_pos);
-            complex val = Expression<complex>(arg.substr(eq_pos + 1)).eval();
-            values_map.emplace_back(var, val);
         }
-        if (std::all_of(values_map.begin(), values_map.end(), [](std::pair<std::string, complex> v) {
-            return v.second.imag() == 0;
-        })) {
-            try {
-                Expression<double> expr(expr_str);
-                for (auto [var, val]: values_map) {
-                    expr = expr.subs(var, val.real());
-                }
-                std::cout << expr.eval() << std::endl;
-            } catch (const std::invalid_argument& e) {
-                Expression<complex> expr(expr_str);
-                for (auto [var, val]: values_map) {
-                    expr = expr.subs(var, val);
-                }
-                std::cout << format_complex(expr.eval(), false) << std::endl;
+        // parsed once; the real tree is converted from it when complex arithmetic isn't needed
+        Expression<complex> parsed = expr_arg.parse<complex>();
+        if (infer_domain(parsed, values_map) == DOMAIN_REAL) {
+            Expression<double> expr = to_real(parsed);
+            for (auto [var, val]: values_map) {
+                expr = expr.subs(var, val.real());
+            }
+            auto value = expr.try_eval();
+            if (!value) {
+                std::cerr << value.error().message() << std::endl;
+                return 1;
             }
+            std::cout << *value << std::endl;
         } else {
-            Expression<complex> expr(expr_str);
-            for (auto [var, val]: values_map) {
-                expr = expr.subs(var, val);
+            // folded rather than evaluated, so real constants such as -1 in ln(-1) get a +0
+            // imaginary part like the bindings do
+            Expression<complex> expr = parsed.specialize(values_map).expr;
+            auto value = expr.try_eval();
+            if (!value) {
+                std::cerr << value.error().message() << std::endl;
+                return 1;
             }
-            std::cout << format_complex(expr.eval(), false) << std::endl;
+            std::cout << format_complex(*value, false) << std::endl;
         }
-        
     }
-    else if (op == "--diff" && argc == 5 && std::string(argv[3]) == "--by") {
-        Expression<complex> expr(expr_str);
-        std::string var = argv[4];
+    else if (op == "--diff" && argc == rest + 2 && std::string(argv[rest]) == "--by") {
+        Expression<complex> expr = expr_arg.parse<complex>();
+        std::string var = argv[rest + 1];
         std::cout << expr.diff(var).to_string() << std::endl;
     }
+    else if (op == "--taylor") {
+        Bindings values_map;
+        std::size_t order = 10;
+        try {
+            for (int i = rest; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "--order" && i + 1 < argc) {
+                    order = parse_count("order", argv[++i], MAX_TAYLOR_ORDER);
+                } else if (arg.starts_with("--") || !parse_binding(arg, values_map)) {
+                    print_usage();
+                    return 1;
+                }
+            }
+            if (values_map.empty()) {
+                print_usage();
+                return 1;
+            }
+            Expression<complex> parsed = expr_arg.parse<complex>();
+            if (infer_domain(parsed, values_map) == DOMAIN_REAL) {
+                print_taylor(to_real(parsed), values_map, order);
+            } else {
+                print_taylor(parsed, values_map, order);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else if (op == "--grid") {
+        std::vector<GridAxis> axes;
+        std::vector<std::pair<std::string, double>> bindings;
+        bool derivatives = false;
+        unsigned threads = 0;
+        std::string output;
+        try {
+            for (int i = rest; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "--derivatives") {
+                    derivatives = true;
+                } else if (arg == "--threads" && i + 1 < argc) {
+                    threads = parse_count("thread count", argv[++i], std::numeric_limits<unsigned>::max());
+                } else if (arg == "--output" && i + 1 < argc) {
+                    output = argv[++i];
+                } else if (arg.find(':') != std::string::npos) {
+                    axes.push_back(parse_grid_axis(arg));
+                } else if (size_t eq_pos = arg.find('='); eq_pos != std::string::npos && !arg.starts_with("--")) {
+                    bindings.emplace_back(arg.substr(0, eq_pos), Expression<double>(arg.substr(eq_pos + 1)).eval());
+                } else {
+                    print_usage();
+                    return 1;
+                }
+            }
+            // the fixed values are folded in once instead of evaluated at every point
+            Expression<double> expr = expr_arg.parse<double>().specialize(bindings).expr;
+            GridSampler sampler(expr, axes, derivatives, threads);
+            if (output.empty()) {
+                sampler.write_text(std::cout);
+            } else {
+                sampler.write_file(output);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else if (op == "--profile") {
+        Bindings values_map;
+        std::size_t points = 1 << 16;
+        std::size_t top = 5;
+        std::string folded;
+        try {
+            for (int i = rest; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "--points" && i + 1 < argc) {
+                    points = parse_count("point count", argv[++i], std::numeric_limits<std::size_t>::max());
+                } else if (arg == "--top" && i + 1 < argc) {
+                    top = parse_count("count", argv[++i], std::numeric_limits<std::size_t>::max());
+                } else if (arg == "--folded" && i + 1 < argc) {
+                    folded = argv[++i];
+                } else if (arg.starts_with("--") || !parse_binding(arg, values_map)) {
+                    print_usage();
+                    return 1;
+                }
+            }
+            print_profile(expr_arg.parse<double>(), values_map, std::max<std::size_t>(points, 1), top, folded);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else if (op == "--emit-c") {
+        std::vector<std::string> vars;
+        CodegenOptions options;
+        bool gradient = false;
+        bool use_complex = false;
+        for (int i = rest; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--gradient") {
+                gradient = true;
+            } else if (arg == "--complex") {
+                use_complex = true;
+            } else if (arg == "--name" && i + 1 < argc) {
+                options.name = argv[++i];
+            } else if (arg.starts_with("--")) {
+                print_usage();
+                return 1;
+            } else {
+                vars.push_back(arg);
+            }
+        }
+        try {
+            if (use_complex) {
+                emit_source<complex>(expr_arg, vars, gradient, options);
+            } else {
+                emit_source<double>(expr_arg, vars, gradient, options);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
     else {
         print_usage();
         return 1;
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "symexpr.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Decides up front whether an expression needs complex arithmetic, so it can be
+// parsed once (as Expression<complex>, which keeps imaginary literals and `i`)
+// and only the representation that's actually needed gets built.
+//
+// Complex is required by an imaginary constant, a variable bound to a complex
+// value, or `ln`/a non-integer power of something that may be negative. Signs
+// are tracked as a set of {negative, zero, positive}; a variable without a
+// binding may have any sign.
+
+enum Domain {
+    DOMAIN_REAL,
+    DOMAIN_COMPLEX,
+};
+
+using Bindings = std::vector<std::pair<std::string, complex>>;
+
+class DomainAnalysis {
+    enum : std::uint8_t {
+        NEG = 1,
+        ZERO = 2,
+        POS = 4,
+        ANY = NEG | ZERO | POS,
+    };
+
+    const Bindings& bindings;
+    std::unordered_map<const Expr<complex>*, std::uint8_t> memo;
+    // folds exponents to constants where the bindings allow
+    Specializer<complex> folder;
+    bool needs_complex = false;
+
+public:
+    DomainAnalysis(const Bindings& _bindings) : bindings(_bindings), folder(_bindings) {}
+
+    Domain operator()(const Expression<complex>& expr) {
+        sign(expr);
+        return needs_complex ? DOMAIN_COMPLEX : DOMAIN_REAL;
+    }
+
+private:
+    static std::uint8_t sign_of(double value) {
+        if (std::isnan(value)) return ANY;
+        return value < 0 ? NEG : value > 0 ? POS : ZERO;
+    }
+
+    std::uint8_t sign_of(complex value) {
+        if (value.imag() != 0) {
+            needs_complex = true;
+            return ANY;
+        }
+        return sign_of(value.real());
+    }
+
+    // signs of `a op b` over every pair of possible operand signs
+    template<typename Op>
+    static std::uint8_t combine(std::uint8_t a, std::uint8_t b, Op op) {
+        std::uint8_t result = 0;
+        for (std::uint8_t x: {NEG, ZERO, POS}) {
+            for (std::uint8_t y: {NEG, ZERO, POS}) {
+                if ((a & x) && (b & y)) {
+                    result |= op(x, y);
+                }
+            }
+        }
+        return result;
+    }
+
+    static std::uint8_t add(std::uint8_t x, std::uint8_t y) {
+        if (x == ZERO) return y;
+        if (y == ZERO || x == y) return x;
+        return ANY;
+    }
+
+    static std::uint8_t mul(std::uint8_t x, std::uint8_t y) {
+        if (x == ZERO || y == ZERO) return ZERO;
+        return x == y ? POS : NEG;
+    }
+
+    // like mul, but dividing by zero gives an infinity or nan
+    static std::uint8_t div(std::uint8_t x, std::uint8_t y) {
+        return y == ZERO ? ANY : mul(x, y);
+    }
+
+    static std::uint8_t negate(std::uint8_t s) {
+        return (s & ZERO) | (s & NEG ? POS : 0) | (s & POS ? NEG : 0);
+    }
+
+    std::uint8_t sign(const Expression<complex>& expr) {
+        const Expr<complex>* node = expr.inner.get();
+        auto it = memo.find(node);
+        if (it != memo.end()) {
+            return it->second;
+        }
+        std::uint8_t result = sign_node(node);
+        memo.emplace(node, result);
+        return result;
+    }
+
+    std::uint8_t sign_node(const Expr<complex>* node) {
+        switch (node->kind()) {
+            case EXPR_NUM:
+                return sign_of(static_cast<const NumExpr<complex>*>(node)->value);
+            case EXPR_VAR: {
+                auto& name = static_cast<const VarExpr<complex>*>(node)->name;
+                for (auto& [var, value]: bindings) {
+                    if (var == name) {
+                        return sign_of(value);
+                    }
+                }
+                return ANY;
+            }
+            case EXPR_SUM: {
+                auto v = static_cast<const SumExpr<complex>*>(node);
+                std::uint8_t l = sign(v->lhs);
+                return combine(l, sign(v->rhs), add);
+            }
+            case EXPR_NEG:
+                return negate(sign(static_cast<const NegExpr<complex>*>(node)->expr));
+            case EXPR_MUL: {
+                auto v = static_cast<const MulExpr<complex>*>(node);
+                std::uint8_t l = sign(v->lhs);
+                return combine(l, sign(v->rhs), mul);
+            }
+            case EXPR_DIV: {
+                auto v = static_cast<const DivExpr<complex>*>(node);
+                std::uint8_t l = sign(v->lhs);
+                return combine(l, sign(v->rhs), div);
+            }
+            case EXPR_POW:
+                return sign_pow(static_cast<const PowExpr<complex>*>(node));
+            case EXPR_LN:
+                if (sign(static_cast<const FunExpr<complex>*>(node)->expr) & NEG) {
+                    needs_complex = true;
+                }
+                return ANY;
+            case EXPR_EXP:
+                sign(static_cast<const FunExpr<complex>*>(node)->expr);
+                return POS;
+            case EXPR_SIN:
+            case EXPR_COS:
+                sign(static_cast<const FunExpr<complex>*>(node)->expr);
+                return ANY;
+        }
+        throw std::logic_error("Unknown expression kind");
+    }
+
+    // the value of `expr` with the bindings substituted, if that makes it constant
+    std::optional<complex> constant(const Expression<complex>& expr) {
+        Expression<complex> folded = folder(expr);
+        if (folded.inner->kind() == EXPR_NUM) {
+            return static_cast<const NumExpr<complex>*>(folded.inner.get())->value;
+        }
+        return {};
+    }
+
+    std::uint8_t sign_pow(const PowExpr<complex>* node) {
+        std::uint8_t base = sign(node->base);
+        std::uint8_t exponent = sign(node->exponent);
+        // a negative base is fine for an integer exponent, bound or computed from constants
+        if (auto value = constant(node->exponent)) {
+            double n = value->real();
+            if (value->imag() == 0 && std::isfinite(n) && n == std::trunc(n)) {
+                if (std::fmod(n, 2) != 0) {
+                    return base;
+                }
+                return (base & ZERO) | POS;
+            }
+        }
+        if (base & NEG) {
+            needs_complex = true;
+        }
+        // 0 ^ negative is an infinity
+        return (base & ZERO) && (exponent & POS) ? ZERO | POS : POS;
+    }
+};
+
+// DOMAIN_COMPLEX if evaluating `expr` with `bindings` substituted may leave the reals
+inline Domain infer_domain(const Expression<complex>& expr, const Bindings& bindings = {}) {
+    return DomainAnalysis(bindings)(expr);
+}
+
+// The same tree over doubles, rebuilt node by node (shared nodes stay shared)
+// instead of parsed again. Throws if a constant has an imaginary part.
+class RealConverter {
+    std::unordered_map<const Expr<complex>*, Expression<double>> memo;
+
+public:
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack
+    Expression<double> operator()(const Expression<complex>& expr) {
+        std::vector<const Expr<complex>*> stack = {expr.inner.get()};
+        while (!stack.empty()) {
+            const Expr<complex>* node = stack.back();
+            if (memo.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!memo.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]->inner.get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            memo.emplace(node, convert(node, children));
+        }
+        return memo.at(expr.inner.get());
+    }
+
+private:
+    // nodes are rebuilt as they are; the folding already happened while parsing
+    template<typename Node, typename... Args>
+    static Expression<double> make(Args&&... args) {
+        return Expression<double>(make_ref<Node>(std::forward<Args>(args)...));
+    }
+
+    // once the operands are converted
+    Expression<double> convert(const Expr<complex>* node, const std::array<const Expression<complex>*, 2>& children) {
+        auto operand = [&](std::size_t i) -> const Expression<double>& {
+            return memo.at(children[i]->inner.get());
+        };
+        switch (node->kind()) {
+            case EXPR_NUM: {
+                complex value = static_cast<const NumExpr<complex>*>(node)->value;
+                if (value.imag() != 0) {
+                    throw std::invalid_argument(std::format("Can't convert `{}` to a real number", format_complex(value, false)));
+                }
+                return Expression<double>(value.real());
+            }
+            case EXPR_VAR:
+                return Expression<double>::var(static_cast<const VarExpr<complex>*>(node)->name);
+            case EXPR_SUM: return make<SumExpr<double>>(operand(0), operand(1));
+            case EXPR_NEG: return make<NegExpr<double>>(operand(0));
+            case EXPR_MUL: return make<MulExpr<double>>(operand(0), operand(1));
+            case EXPR_DIV: return make<DivExpr<double>>(operand(0), operand(1));
+            case EXPR_POW: return make<PowExpr<double>>(operand(0), operand(1));
+            case EXPR_SIN: return make<SinExpr<double>>(operand(0));
+            case EXPR_COS: return make<CosExpr<double>>(operand(0));
+            case EXPR_LN: return make<LnExpr<double>>(operand(0));
+            case EXPR_EXP: return make<ExpExpr<double>>(operand(0));
+        }
+        throw std::logic_error("Unknown expression kind");
+    }
+};
+
+inline Expression<double> to_real(const Expression<complex>& expr) {
+    return RealConverter()(expr);
+}
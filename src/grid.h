@@ -0,0 +1,316 @@
+#pragma once
+
+#include "parallel.h"
+#include "tape.h"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Tabulates an expression (and optionally its derivatives by every axis) over
+// the Cartesian product of evenly spaced axes, in parallel tiles.
+//
+// Binary grid format, all numbers little-endian:
+//
+//     header:  "SYMG"  u16 version  u16 number of axes  u32 outputs per point
+//              per axis: f64 min  f64 max  u64 steps  u32 name length, then the name bytes
+//              zero padding to a multiple of 8 bytes
+//     data:    f64 values, point by point with the last axis changing fastest;
+//              each point holds the value and then the derivatives in axis order
+//
+// The data is a plain array, so it can be mapped and indexed directly.
+
+constexpr char GRID_MAGIC[4] = {'S', 'Y', 'M', 'G'};
+constexpr std::uint16_t GRID_VERSION = 1;
+
+struct GridAxis {
+    std::string name;
+    double min;
+    double max;
+    std::size_t steps;
+
+    // the value of step `i`; the first and last steps are exactly `min` and `max`,
+    // and a single step is `min`
+    double at(std::size_t i) const {
+        if (i == 0) {
+            return min;
+        }
+        if (i + 1 == steps) {
+            return max;
+        }
+        return min + (max - min) * (double(i) / double(steps - 1));
+    }
+
+    bool operator==(const GridAxis&) const = default;
+};
+
+inline double parse_grid_number(const std::string& str, const std::string& spec) {
+    try {
+        return parse_number<double>(str);
+    } catch (const std::exception&) {
+        throw std::invalid_argument(std::format("Invalid grid axis `{}`, expected NAME=MIN:MAX:STEPS", spec));
+    }
+}
+
+// parses `NAME=MIN:MAX:STEPS`
+inline GridAxis parse_grid_axis(const std::string& spec) {
+    std::size_t eq = spec.find('=');
+    std::size_t colon1 = spec.find(':', eq);
+    std::size_t colon2 = colon1 == std::string::npos ? colon1 : spec.find(':', colon1 + 1);
+    if (eq == 0 || eq == std::string::npos || colon2 == std::string::npos) {
+        throw std::invalid_argument(std::format("Invalid grid axis `{}`, expected NAME=MIN:MAX:STEPS", spec));
+    }
+    GridAxis axis{
+        spec.substr(0, eq),
+        parse_grid_number(spec.substr(eq + 1, colon1 - eq - 1), spec),
+        parse_grid_number(spec.substr(colon1 + 1, colon2 - colon1 - 1), spec),
+        0,
+    };
+    std::string steps = spec.substr(colon2 + 1);
+    auto [end, error] = std::from_chars(steps.data(), steps.data() + steps.size(), axis.steps);
+    if (error != std::errc() || end != steps.data() + steps.size() || axis.steps == 0) {
+        throw std::invalid_argument(std::format("Invalid grid axis `{}`, expected NAME=MIN:MAX:STEPS", spec));
+    }
+    return axis;
+}
+
+struct GridHeader {
+    std::vector<GridAxis> axes;
+    std::uint32_t outputs;
+    // where the data starts, a multiple of 8
+    std::size_t data_offset;
+};
+
+inline std::string write_grid_header(const std::vector<GridAxis>& axes, std::uint32_t outputs) {
+    std::string buffer(GRID_MAGIC, 4);
+    auto put = [&](std::uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) buffer.push_back(char(value >> (8 * i)));
+    };
+    put(GRID_VERSION, 2);
+    put(axes.size(), 2);
+    put(outputs, 4);
+    for (auto& axis: axes) {
+        put(std::bit_cast<std::uint64_t>(axis.min), 8);
+        put(std::bit_cast<std::uint64_t>(axis.max), 8);
+        put(axis.steps, 8);
+        put(axis.name.size(), 4);
+        buffer += axis.name;
+    }
+    buffer.resize((buffer.size() + 7) / 8 * 8, '\0');
+    return buffer;
+}
+
+inline GridHeader read_grid_header(std::span<const std::byte> bytes) {
+    std::size_t pos = 0;
+    auto get = [&](int size) {
+        if (pos + size > bytes.size()) {
+            throw std::invalid_argument("Truncated grid header");
+        }
+        std::uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= std::uint64_t(bytes[pos + i]) << (8 * i);
+        }
+        pos += size;
+        return value;
+    };
+    if (bytes.size() < 4 || std::memcmp(bytes.data(), GRID_MAGIC, 4) != 0) {
+        throw std::invalid_argument("Not a grid file");
+    }
+    pos = 4;
+    if (get(2) != GRID_VERSION) {
+        throw std::invalid_argument("Unsupported grid version");
+    }
+    GridHeader header;
+    std::size_t naxes = get(2);
+    header.outputs = get(4);
+    for (std::size_t i = 0; i < naxes; i++) {
+        GridAxis axis;
+        axis.min = std::bit_cast<double>(get(8));
+        axis.max = std::bit_cast<double>(get(8));
+        axis.steps = get(8);
+        std::size_t length = get(4);
+        if (pos + length > bytes.size()) {
+            throw std::invalid_argument("Truncated grid header");
+        }
+        axis.name.assign(reinterpret_cast<const char*>(bytes.data() + pos), length);
+        pos += length;
+        header.axes.push_back(std::move(axis));
+    }
+    header.data_offset = (pos + 7) / 8 * 8;
+    return header;
+}
+
+class GridSampler {
+    std::vector<GridAxis> axes;
+    Tape<double> tape;
+
+public:
+    // points evaluated by one thread at a time
+    static constexpr std::size_t TILE = 4096;
+
+    // worker threads; 0 means one per hardware thread
+    unsigned threads;
+
+    // `vector_math` evaluates sin, cos, exp, ln and pow with the vecmath.h kernels, see Tape::vector_math
+    GridSampler(const Expression<double>& expr, std::vector<GridAxis> _axes, bool derivatives = false, unsigned _threads = 0,
+                bool vector_math = false)
+        : axes(std::move(_axes)), tape(outputs_of(expr, axes, derivatives), names(axes)), threads(_threads) {
+        tape.vector_math = vector_math;
+    }
+
+    const std::vector<GridAxis>& grid_axes() const {
+        return axes;
+    }
+
+    std::size_t points() const {
+        std::size_t result = 1;
+        for (auto& axis: axes) {
+            result *= axis.steps;
+        }
+        return result;
+    }
+
+    std::size_t outputs() const {
+        return tape.outputs.size();
+    }
+
+    // evaluates points [begin, end) into `out`, outputs() numbers per point
+    void sample(std::size_t begin, std::size_t end, double* out) const {
+        std::size_t tiles = (end - begin + TILE - 1) / TILE;
+        parallel_for(tiles, threads, [&](std::size_t tile) {
+            std::vector<double> coordinates(TILE * axes.size());
+            std::size_t first = begin + tile * TILE;
+            std::size_t count = std::min(TILE, end - first);
+            fill_coordinates(first, count, coordinates.data());
+            tape.eval_batch_all(coordinates.data(), count, out + (first - begin) * outputs());
+        });
+    }
+
+    void sample(double* out) const {
+        sample(0, points(), out);
+    }
+
+    // one line per point: the axis values, then the outputs, in shortest round-trip form
+    void write_text(std::ostream& out) const {
+        std::size_t total = points();
+        std::size_t chunk = TILE * thread_count(threads);
+        std::vector<double> values(std::min(chunk, total) * outputs());
+        std::vector<double> coordinates(axes.size());
+        std::string line;
+        for (std::size_t begin = 0; begin < total; begin += chunk) {
+            std::size_t end = std::min(total, begin + chunk);
+            sample(begin, end, values.data());
+            for (std::size_t p = begin; p < end; p++) {
+                fill_coordinates(p, 1, coordinates.data());
+                line.clear();
+                for (double x: coordinates) {
+                    append_number(line, x);
+                }
+                for (std::size_t k = 0; k < outputs(); k++) {
+                    append_number(line, values[(p - begin) * outputs() + k]);
+                }
+                line.back() = '\n';
+                out << line;
+            }
+        }
+    }
+
+    // header and data, computed and written a chunk at a time
+    void write_binary(std::ostream& out) const {
+        std::string header = write_grid_header(axes, outputs());
+        out.write(header.data(), header.size());
+        std::size_t total = points();
+        std::size_t chunk = TILE * thread_count(threads);
+        std::vector<double> values(std::min(chunk, total) * outputs());
+        for (std::size_t begin = 0; begin < total; begin += chunk) {
+            std::size_t end = std::min(total, begin + chunk);
+            std::size_t count = (end - begin) * outputs();
+            sample(begin, end, values.data());
+            to_little_endian(values.data(), count);
+            out.write(reinterpret_cast<const char*>(values.data()), count * sizeof(double));
+        }
+    }
+
+    // creates `path` at its final size, maps it and lets the threads write into it directly
+    void write_file(const std::string& path) const {
+        std::string header = write_grid_header(axes, outputs());
+        std::size_t count = points() * outputs();
+        std::size_t size = header.size() + count * sizeof(double);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Can't open `{}`", path));
+        }
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            throw std::runtime_error(std::format("Can't resize `{}`", path));
+        }
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error(std::format("Can't map `{}`", path));
+        }
+        char* bytes = static_cast<char*>(data);
+        std::memcpy(bytes, header.data(), header.size());
+        double* values = reinterpret_cast<double*>(bytes + header.size());
+        sample(values);
+        to_little_endian(values, count);
+        munmap(data, size);
+    }
+
+private:
+    static std::vector<Expression<double>> outputs_of(const Expression<double>& expr, const std::vector<GridAxis>& axes, bool derivatives) {
+        std::vector<Expression<double>> result = {expr};
+        if (derivatives) {
+            for (auto& axis: axes) {
+                result.push_back(expr.diff(axis.name));
+            }
+        }
+        return result;
+    }
+
+    static std::vector<std::string> names(const std::vector<GridAxis>& axes) {
+        std::vector<std::string> result;
+        for (auto& axis: axes) {
+            result.push_back(axis.name);
+        }
+        return result;
+    }
+
+    // coordinates of points [first, first + count), row by row as Tape::eval_batch takes them
+    void fill_coordinates(std::size_t first, std::size_t count, double* out) const {
+        std::size_t naxes = axes.size();
+        for (std::size_t p = 0; p < count; p++) {
+            std::size_t index = first + p;
+            for (std::size_t i = naxes; i-- > 0;) {
+                out[p * naxes + i] = axes[i].at(index % axes[i].steps);
+                index /= axes[i].steps;
+            }
+        }
+    }
+
+    static void append_number(std::string& line, double value) {
+        char buffer[32];
+        auto end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+        line.append(buffer, end);
+        line.push_back(' ');
+    }
+
+    static void to_little_endian(double* values, std::size_t count) {
+        if constexpr (std::endian::native == std::endian::big) {
+            for (std::size_t i = 0; i < count; i++) {
+                values[i] = std::bit_cast<double>(std::byteswap(std::bit_cast<std::uint64_t>(values[i])));
+            }
+        }
+    }
+};
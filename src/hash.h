@@ -0,0 +1,119 @@
+#pragma once
+
+#include "symexpr.h"
+#include <bit>
+#include <cstdint>
+#include <format>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// 128-bit hash of an expression's structure. Equal trees hash equal no matter how
+// their nodes are shared, and the value only depends on the tree (not on
+// addresses or the platform's std::hash), so it can be stored on disk.
+struct StructuralHash {
+    std::uint64_t lo = 0;
+    std::uint64_t hi = 0;
+
+    bool operator==(const StructuralHash&) const = default;
+
+    std::string hex() const {
+        return std::format("{:016x}{:016x}", hi, lo);
+    }
+
+    // finalizer from MurmurHash3
+    static constexpr std::uint64_t mix(std::uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // fold `value` into both halves, with different constants so they stay independent
+    constexpr StructuralHash combine(std::uint64_t value) const {
+        return {
+            mix(lo ^ (value + 0x9e3779b97f4a7c15ull + (lo << 6) + (lo >> 2))),
+            mix(hi ^ (value + 0xc2b2ae3d27d4eb4full + (hi << 6) + (hi >> 2))),
+        };
+    }
+
+    constexpr StructuralHash combine(const StructuralHash& other) const {
+        return combine(other.lo).combine(other.hi);
+    }
+
+    StructuralHash combine(std::string_view str) const {
+        StructuralHash h = combine(str.size());
+        for (unsigned char c: str) {
+            h = h.combine(c);
+        }
+        return h;
+    }
+};
+
+template<>
+struct std::hash<StructuralHash> {
+    std::size_t operator()(const StructuralHash& h) const {
+        return h.lo;
+    }
+};
+
+template<typename Number = DefaultNumber>
+class StructuralHasher {
+    std::unordered_map<const Expr<Number>*, StructuralHash> memo;
+
+public:
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack
+    StructuralHash operator()(const Expression<Number>& expr) {
+        std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+        while (!stack.empty()) {
+            const Expr<Number>* node = stack.back();
+            if (memo.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!memo.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]->inner.get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            StructuralHash h = StructuralHash{}.combine(node->kind());
+            switch (node->kind()) {
+                case EXPR_NUM: {
+                    auto value = static_cast<const NumExpr<Number>*>(node)->value;
+                    if constexpr (std::is_same_v<Number, complex>) {
+                        h = h.combine(std::bit_cast<std::uint64_t>(value.real())).combine(std::bit_cast<std::uint64_t>(value.imag()));
+                    } else {
+                        h = h.combine(std::bit_cast<std::uint64_t>(double(value)));
+                    }
+                    break;
+                }
+                case EXPR_VAR:
+                    h = h.combine(std::string_view(static_cast<const VarExpr<Number>*>(node)->name));
+                    break;
+                default:
+                    for (std::size_t i = 0; i < operand_count(node->kind()); i++) {
+                        h = h.combine(memo.at(children[i]->inner.get()));
+                    }
+                    break;
+            }
+            memo.emplace(node, h);
+        }
+        return memo.at(expr.inner.get());
+    }
+};
+
+template<typename Number = DefaultNumber>
+StructuralHash structural_hash(const Expression<Number>& expr) {
+    return StructuralHasher<Number>()(expr);
+}
@@ -0,0 +1,304 @@
+#pragma once
+
+#include "parallel.h"
+#include "tape.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Adaptive Gauss-Kronrod integration over an interval or a box.
+//
+// Every box is integrated with the 15-point Kronrod rule in each dimension
+// (15^d points). The 7-point Gauss rule uses a subset of those points, so
+// replacing it along dimension j gives a second estimate for free. The sum over
+// j of |Kronrod - Gauss along j| is the box's error estimate, and the largest
+// term picks the dimension to bisect.
+//
+// Refinement goes in rounds: every box whose error is above its share (by
+// volume) of the target max(abs_tol, rel_tol * |value|) is bisected, and all
+// new boxes are evaluated together, in parallel chunks, through Tape::eval_batch.
+// The estimate is pessimistic for smooth integrands, so the actual error is
+// usually far below the reported one.
+
+struct IntegrationRange {
+    std::string var;
+    double a;
+    double b;
+};
+
+struct Integral {
+    double value;
+    double error;
+    // points evaluated
+    std::size_t evaluations;
+    // false if max_boxes was reached (or boxes became too small to split) first
+    bool converged;
+};
+
+class Integrator {
+    // nodes of the 15-point Kronrod rule on [-1, 1], ascending, with the Kronrod
+    // weights and the 7-point Gauss weights (0 at Kronrod-only nodes)
+    static constexpr std::size_t RULE = 15;
+    static constexpr std::array<double, 8> XK = {
+        0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+        0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+        0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+        0.207784955007898467600689403773245, 0.000000000000000000000000000000000,
+    };
+    static constexpr std::array<double, 8> WK = {
+        0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+        0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+        0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+        0.204432940075298892414161999234649, 0.209482141084727828012999174891714,
+    };
+    static constexpr std::array<double, 8> WG = {
+        0, 0.129484966168869693270611432679082, 0, 0.279705391489276667901467771423780,
+        0, 0.381830050505118944950369775488975, 0, 0.417959183673469387755102040816327,
+    };
+
+    struct Box {
+        std::vector<double> lower;
+        std::vector<double> upper;
+        double value = 0;
+        double error = 0;
+        std::size_t split = 0;
+    };
+
+    Tape<double> tape;
+    std::size_t dims;
+
+public:
+    // each thread evaluates boxes in chunks of about this many points
+    static constexpr std::size_t CHUNK_POINTS = 4096;
+
+    double abs_tol = 1e-10;
+    double rel_tol = 1e-10;
+    std::size_t max_boxes = 1 << 16;
+    // worker threads for one integral; 0 means one per hardware thread
+    unsigned threads = 1;
+
+    // integrates over `vars`; `parameters` are the other variables, given with every call.
+    // `vector_math` evaluates sin, cos, exp, ln and pow with the vecmath.h kernels, see Tape::vector_math
+    Integrator(const Expression<double>& expr, const std::vector<std::string>& vars, const std::vector<std::string>& parameters = {},
+               bool vector_math = false)
+        : tape(expr, concat(vars, parameters)), dims(vars.size()) {
+        if (dims == 0) {
+            throw std::invalid_argument("Nothing to integrate over");
+        }
+        tape.vector_math = vector_math;
+    }
+
+    // the integral over the box with `vars[i]` from `limits[i].first` to `limits[i].second`
+    Integral operator()(const std::vector<std::pair<double, double>>& limits, const std::vector<double>& parameters = {}) const {
+        if (limits.size() != dims || parameters.size() != tape.vars.size() - dims) {
+            throw std::invalid_argument("Wrong number of limits or parameters");
+        }
+        Box whole;
+        for (auto [a, b]: limits) {
+            whole.lower.push_back(a);
+            whole.upper.push_back(b);
+        }
+        std::vector<Box> boxes = {whole};
+        Integral result{0, 0, 0, false};
+        evaluate(boxes, parameters, result);
+        double volume = box_volume(whole);
+        while (true) {
+            double value = 0, error = 0;
+            for (auto& box: boxes) {
+                value += box.value;
+                error += box.error;
+            }
+            result.value = value;
+            result.error = error;
+            double target = std::max(abs_tol, rel_tol * std::abs(value));
+            if (!(error > target)) {
+                result.converged = !std::isnan(error);
+                return result;
+            }
+            std::vector<Box> children;
+            std::size_t kept = 0;
+            for (auto& box: boxes) {
+                if (box.error > target * (box_volume(box) / volume) && !too_small(box)) {
+                    auto [left, right] = bisect(box);
+                    children.push_back(std::move(left));
+                    children.push_back(std::move(right));
+                } else {
+                    boxes[kept++] = std::move(box);
+                }
+            }
+            boxes.resize(kept);
+            if (children.empty() || boxes.size() + children.size() > max_boxes) {
+                return result;
+            }
+            evaluate(children, parameters, result);
+            for (auto& child: children) {
+                boxes.push_back(std::move(child));
+            }
+        }
+    }
+
+    Integral operator()(double a, double b, const std::vector<double>& parameters = {}) const {
+        return (*this)({{a, b}}, parameters);
+    }
+
+    // one integral per parameter set (`parameters[s * count + i]`, count being the number of
+    // parameters); the sets are spread over the threads instead of each integral
+    void integrate_batch(const std::vector<std::pair<double, double>>& limits, const double* parameters, std::size_t sets, Integral* out) const {
+        std::size_t count = tape.vars.size() - dims;
+        Integrator single = *this;
+        single.threads = 1;
+        parallel_for(sets, threads, [&](std::size_t s) {
+            out[s] = single(limits, std::vector<double>(parameters + s * count, parameters + (s + 1) * count));
+        });
+    }
+
+private:
+    static std::vector<std::string> concat(std::vector<std::string> vars, const std::vector<std::string>& parameters) {
+        vars.insert(vars.end(), parameters.begin(), parameters.end());
+        return vars;
+    }
+
+    // node `i` of the 15, and the index of its weights in WK and WG
+    static double node(std::size_t i) {
+        return i < 7 ? -XK[i] : i == 7 ? 0 : XK[14 - i];
+    }
+
+    static std::size_t weight_index(std::size_t i) {
+        return i <= 7 ? i : 14 - i;
+    }
+
+    static double box_volume(const Box& box) {
+        double volume = 1;
+        for (std::size_t k = 0; k < box.lower.size(); k++) {
+            volume *= std::abs(box.upper[k] - box.lower[k]);
+        }
+        return volume;
+    }
+
+    bool too_small(const Box& box) const {
+        double middle = (box.lower[box.split] + box.upper[box.split]) / 2;
+        return middle == box.lower[box.split] || middle == box.upper[box.split];
+    }
+
+    static std::pair<Box, Box> bisect(const Box& box) {
+        Box left = box, right = box;
+        double middle = (box.lower[box.split] + box.upper[box.split]) / 2;
+        left.upper[box.split] = middle;
+        right.lower[box.split] = middle;
+        return {std::move(left), std::move(right)};
+    }
+
+    std::size_t points_per_box() const {
+        std::size_t points = 1;
+        for (std::size_t k = 0; k < dims; k++) {
+            points *= RULE;
+        }
+        return points;
+    }
+
+    void evaluate(std::vector<Box>& boxes, const std::vector<double>& parameters, Integral& result) const {
+        std::size_t per_box = points_per_box();
+        std::size_t chunk = std::max<std::size_t>(1, CHUNK_POINTS / per_box);
+        std::size_t chunks = (boxes.size() + chunk - 1) / chunk;
+        parallel_for(chunks, threads, [&](std::size_t c) {
+            std::size_t first = c * chunk;
+            std::size_t last = std::min(boxes.size(), first + chunk);
+            evaluate_chunk(&boxes[first], last - first, parameters);
+        });
+        result.evaluations += boxes.size() * per_box;
+    }
+
+    void evaluate_chunk(Box* boxes, std::size_t count, const std::vector<double>& parameters) const {
+        std::size_t per_box = points_per_box();
+        std::size_t nvars = tape.vars.size();
+        std::vector<double> points(count * per_box * nvars), values(count * per_box);
+        std::vector<std::size_t> digits(dims);
+        for (std::size_t b = 0; b < count; b++) {
+            const Box& box = boxes[b];
+            for (std::size_t p = 0; p < per_box; p++) {
+                double* row = &points[(b * per_box + p) * nvars];
+                std::size_t index = p;
+                for (std::size_t k = 0; k < dims; k++) {
+                    double center = (box.lower[k] + box.upper[k]) / 2;
+                    double half = (box.upper[k] - box.lower[k]) / 2;
+                    row[k] = center + half * node(index % RULE);
+                    index /= RULE;
+                }
+                std::copy(parameters.begin(), parameters.end(), row + dims);
+            }
+        }
+        tape.eval_batch(points.data(), count * per_box, values.data());
+
+        std::vector<double> gauss(dims);
+        for (std::size_t b = 0; b < count; b++) {
+            Box& box = boxes[b];
+            double kronrod = 0;
+            std::fill(gauss.begin(), gauss.end(), 0);
+            for (std::size_t p = 0; p < per_box; p++) {
+                double f = values[b * per_box + p];
+                std::size_t index = p;
+                double weight = 1;
+                for (std::size_t k = 0; k < dims; k++) {
+                    digits[k] = weight_index(index % RULE);
+                    weight *= WK[digits[k]];
+                    index /= RULE;
+                }
+                kronrod += weight * f;
+                // the same product with the Gauss weight in dimension k
+                for (std::size_t k = 0; k < dims; k++) {
+                    if (WG[digits[k]] != 0) {
+                        gauss[k] += weight / WK[digits[k]] * WG[digits[k]] * f;
+                    }
+                }
+            }
+            double scale = 1;
+            for (std::size_t k = 0; k < dims; k++) {
+                scale *= (box.upper[k] - box.lower[k]) / 2;
+            }
+            box.value = kronrod * scale;
+            box.error = 0;
+            box.split = 0;
+            double worst = -1;
+            for (std::size_t k = 0; k < dims; k++) {
+                double difference = std::abs((kronrod - gauss[k]) * scale);
+                box.error += difference;
+                if (difference > worst) {
+                    worst = difference;
+                    box.split = k;
+                }
+            }
+            if (std::isnan(box.value)) {
+                box.error = box.value;
+            }
+        }
+    }
+};
+
+// the integral of `expr` over `var` from `a` to `b`, within max(tol, tol * |value|)
+// if it converges; `bindings` give the other variables
+inline Integral integrate(const Expression<double>& expr, const std::string& var, double a, double b, double tol = 1e-10,
+                          const std::vector<std::pair<std::string, double>>& bindings = {}) {
+    Integrator integrator(expr.specialize(bindings).expr, {var});
+    integrator.abs_tol = integrator.rel_tol = tol;
+    return integrator(a, b);
+}
+
+// the same over a box, on one thread per hardware thread
+inline Integral integrate(const Expression<double>& expr, const std::vector<IntegrationRange>& ranges, double tol = 1e-10,
+                          const std::vector<std::pair<std::string, double>>& bindings = {}) {
+    std::vector<std::string> vars;
+    std::vector<std::pair<double, double>> limits;
+    for (auto& range: ranges) {
+        vars.push_back(range.var);
+        limits.emplace_back(range.a, range.b);
+    }
+    Integrator integrator(expr.specialize(bindings).expr, vars);
+    integrator.abs_tol = integrator.rel_tol = tol;
+    integrator.threads = 0;
+    return integrator(limits);
+}
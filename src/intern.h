@@ -0,0 +1,264 @@
+#pragma once
+
+#include "hash.h"
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Hash-consing of expression nodes that several threads can build into at once.
+//
+// Every node returned by the table is canonical: its children are canonical,
+// and no other canonical node has the same kind, value and children. So two
+// structurally equal expressions built through one table (on any threads) are
+// the same node, and the lookup for a new node only compares child pointers.
+//
+// The table is split into SHARDS independently locked shards by the node's hash,
+// so threads rarely wait for each other. Canonical nodes are marked with
+// share_across_threads(), and the table keeps a reference to each of them;
+// collect() drops the nodes that nothing else refers to anymore.
+template<typename Number = DefaultNumber>
+class InternTable {
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_multimap<std::uint64_t, Ref<Expr<Number>>> nodes;
+    };
+
+public:
+    static constexpr std::size_t SHARDS = 64;
+
+    InternTable() = default;
+    InternTable(const InternTable&) = delete;
+    InternTable& operator=(const InternTable&) = delete;
+
+    // The builders take canonical expressions (from this table) and fold like
+    // Expression's operators do. The new node is only allocated if there's none yet.
+    Expression<Number> num(Number value) {
+        return find_or_add({EXPR_NUM, &value}, [&]() { return Expression<Number>(value); });
+    }
+    Expression<Number> var(const std::string& name) {
+        return find_or_add({EXPR_VAR, nullptr, &name}, [&]() { return Expression<Number>::var(name); });
+    }
+    Expression<Number> add(const Expression<Number>& lhs, const Expression<Number>& rhs) {
+        if (is(lhs, Number(0))) return rhs;
+        if (is(rhs, Number(0))) return lhs;
+        return binary<SumExpr<Number>>(EXPR_SUM, lhs, rhs);
+    }
+    Expression<Number> neg(const Expression<Number>& expr) {
+        if (is(expr, Number(0))) return expr;
+        return unary<NegExpr<Number>>(EXPR_NEG, expr);
+    }
+    Expression<Number> sub(const Expression<Number>& lhs, const Expression<Number>& rhs) {
+        return add(lhs, neg(rhs));
+    }
+    Expression<Number> mul(const Expression<Number>& lhs, const Expression<Number>& rhs) {
+        if (is(lhs, Number(0))) return lhs;
+        if (is(lhs, Number(1))) return rhs;
+        if (is(rhs, Number(0))) return rhs;
+        if (is(rhs, Number(1))) return lhs;
+        return binary<MulExpr<Number>>(EXPR_MUL, lhs, rhs);
+    }
+    Expression<Number> div(const Expression<Number>& lhs, const Expression<Number>& rhs) {
+        return binary<DivExpr<Number>>(EXPR_DIV, lhs, rhs);
+    }
+    Expression<Number> pow(const Expression<Number>& base, const Expression<Number>& exponent) {
+        if (is(exponent, Number(1))) return base;
+        return binary<PowExpr<Number>>(EXPR_POW, base, exponent);
+    }
+    Expression<Number> sin(const Expression<Number>& expr) { return unary<SinExpr<Number>>(EXPR_SIN, expr); }
+    Expression<Number> cos(const Expression<Number>& expr) { return unary<CosExpr<Number>>(EXPR_COS, expr); }
+    Expression<Number> ln(const Expression<Number>& expr) { return unary<LnExpr<Number>>(EXPR_LN, expr); }
+    Expression<Number> exp(const Expression<Number>& expr) { return unary<ExpExpr<Number>>(EXPR_EXP, expr); }
+
+    // the canonical version of any expression, structure unchanged (nothing is folded);
+    // shared subtrees are interned once
+    Expression<Number> intern(const Expression<Number>& expr) {
+        std::unordered_map<const Expr<Number>*, Expression<Number>> done;
+        std::vector<const Expression<Number>*> stack = {&expr};
+        while (!stack.empty()) {
+            const Expression<Number>& top = *stack.back();
+            const Expr<Number>* node = top.inner.get();
+            if (done.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (auto child: children) {
+                if (child && !done.contains(child->inner.get())) {
+                    stack.push_back(child);
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            done.emplace(node, canonical(rebuild(top, children, done)));
+        }
+        return done.at(expr.inner.get());
+    }
+
+    // the number of canonical nodes
+    std::size_t size() {
+        std::size_t result = 0;
+        for (auto& shard: shards) {
+            std::lock_guard lock(shard.mutex);
+            result += shard.nodes.size();
+        }
+        return result;
+    }
+
+    // drops the nodes only the table refers to (which may free their children in
+    // turn) and returns how many; safe to run while other threads build
+    std::size_t collect() {
+        std::size_t removed = 0;
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto& shard: shards) {
+                std::lock_guard lock(shard.mutex);
+                std::size_t erased = std::erase_if(shard.nodes, [](const auto& entry) {
+                    return entry.second->ref_count() == 1;
+                });
+                removed += erased;
+                changed |= erased > 0;
+            }
+        }
+        return removed;
+    }
+
+private:
+    std::array<Shard, SHARDS> shards;
+
+    // `expr` with its operands replaced by their canonical versions, without folding
+    static Expression<Number> rebuild(const Expression<Number>& expr, const std::array<const Expression<Number>*, 2>& children,
+                                      const std::unordered_map<const Expr<Number>*, Expression<Number>>& done) {
+        auto mapped = [&](std::size_t i) -> const Expression<Number>& {
+            return done.at(children[i]->inner.get());
+        };
+        bool same = true;
+        for (std::size_t i = 0; i < 2; i++) {
+            same &= !children[i] || mapped(i).inner == children[i]->inner;
+        }
+        if (same) {
+            return expr;
+        }
+        switch (expr.inner->kind()) {
+            case EXPR_SUM: return Expression<Number>(make_ref<SumExpr<Number>>(mapped(0), mapped(1)));
+            case EXPR_MUL: return Expression<Number>(make_ref<MulExpr<Number>>(mapped(0), mapped(1)));
+            case EXPR_DIV: return Expression<Number>(make_ref<DivExpr<Number>>(mapped(0), mapped(1)));
+            case EXPR_POW: return Expression<Number>(make_ref<PowExpr<Number>>(mapped(0), mapped(1)));
+            case EXPR_NEG: return Expression<Number>(make_ref<NegExpr<Number>>(mapped(0)));
+            case EXPR_SIN: return Expression<Number>(make_ref<SinExpr<Number>>(mapped(0)));
+            case EXPR_COS: return Expression<Number>(make_ref<CosExpr<Number>>(mapped(0)));
+            case EXPR_LN: return Expression<Number>(make_ref<LnExpr<Number>>(mapped(0)));
+            case EXPR_EXP: return Expression<Number>(make_ref<ExpExpr<Number>>(mapped(0)));
+            case EXPR_NUM:
+            case EXPR_VAR:
+                break;
+        }
+        return expr;
+    }
+
+    // a node that may or may not exist yet
+    struct Key {
+        ExprKind kind;
+        const Number* value = nullptr;
+        const std::string* name = nullptr;
+        const Expr<Number>* lhs = nullptr;
+        const Expr<Number>* rhs = nullptr;
+    };
+
+    static bool is(const Expression<Number>& expr, Number value) {
+        return expr.inner->kind() == EXPR_NUM && static_cast<const NumExpr<Number>*>(expr.inner.get())->value == value;
+    }
+
+    static Key key_of(const Expr<Number>* node) {
+        switch (node->kind()) {
+            case EXPR_NUM: return {EXPR_NUM, &static_cast<const NumExpr<Number>*>(node)->value};
+            case EXPR_VAR: return {EXPR_VAR, nullptr, &static_cast<const VarExpr<Number>*>(node)->name};
+            default: break;
+        }
+        auto children = operands(node);
+        return {node->kind(), nullptr, nullptr, children[0]->inner.get(), children[1] ? children[1]->inner.get() : nullptr};
+    }
+
+    // numbers are told apart by their bits, so 0 and -0 are different nodes
+    static StructuralHash number_bits(Number value) {
+        if constexpr (std::is_same_v<Number, complex>) {
+            return {std::bit_cast<std::uint64_t>(value.real()), std::bit_cast<std::uint64_t>(value.imag())};
+        } else {
+            return {std::bit_cast<std::uint64_t>(double(value)), 0};
+        }
+    }
+
+    // depends on the operands' addresses, which is enough since they're canonical
+    static std::uint64_t key_hash(const Key& key) {
+        StructuralHash h = StructuralHash{}.combine(key.kind);
+        if (key.value) {
+            return h.combine(number_bits(*key.value)).lo;
+        }
+        if (key.name) {
+            return h.combine(std::hash<std::string>()(*key.name)).lo;
+        }
+        return h.combine(std::uint64_t(reinterpret_cast<std::uintptr_t>(key.lhs)))
+                .combine(std::uint64_t(reinterpret_cast<std::uintptr_t>(key.rhs))).lo;
+    }
+
+    static bool matches(const Expr<Number>* node, const Key& key) {
+        if (node->kind() != key.kind) {
+            return false;
+        }
+        Key other = key_of(node);
+        if (key.value) {
+            return number_bits(*other.value) == number_bits(*key.value);
+        }
+        if (key.name) {
+            return *other.name == *key.name;
+        }
+        return other.lhs == key.lhs && other.rhs == key.rhs;
+    }
+
+    // the canonical node for `key`, which `make()` creates if there's none yet
+    template<typename Make>
+    Expression<Number> find_or_add(const Key& key, Make make) {
+        std::uint64_t hash = key_hash(key);
+        Shard& shard = shards[(hash >> 58) % SHARDS];
+        std::lock_guard lock(shard.mutex);
+        auto [begin, end] = shard.nodes.equal_range(hash);
+        for (auto it = begin; it != end; ++it) {
+            if (matches(it->second.get(), key)) {
+                return Expression<Number>(it->second);
+            }
+        }
+        Expression<Number> result = make();
+        result.inner->share_across_threads();
+        shard.nodes.emplace(hash, result.inner);
+        return result;
+    }
+
+    template<typename Node>
+    Expression<Number> binary(ExprKind kind, const Expression<Number>& lhs, const Expression<Number>& rhs) {
+        return find_or_add({kind, nullptr, nullptr, lhs.inner.get(), rhs.inner.get()}, [&]() {
+            return Expression<Number>(make_ref<Node>(lhs, rhs));
+        });
+    }
+
+    template<typename Node>
+    Expression<Number> unary(ExprKind kind, const Expression<Number>& operand) {
+        return find_or_add({kind, nullptr, nullptr, operand.inner.get()}, [&]() {
+            return Expression<Number>(make_ref<Node>(operand));
+        });
+    }
+
+    // the canonical node equal to `expr`, whose operands must be canonical already
+    Expression<Number> canonical(const Expression<Number>& expr) {
+        return find_or_add(key_of(expr.inner.get()), [&]() { return expr; });
+    }
+};
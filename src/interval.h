@@ -0,0 +1,405 @@
+#pragma once
+
+#include "parallel.h"
+#include "tape.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numbers>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace interval_detail {
+
+template<typename Real>
+Real down(Real x) {
+    return std::nextafter(x, -std::numeric_limits<Real>::infinity());
+}
+
+template<typename Real>
+Real up(Real x) {
+    return std::nextafter(x, std::numeric_limits<Real>::infinity());
+}
+
+// libm's sin, cos, exp, log and pow are within one ulp, not correctly rounded
+template<typename Real>
+Real down2(Real x) {
+    return down(down(x));
+}
+
+template<typename Real>
+Real up2(Real x) {
+    return up(up(x));
+}
+
+// 0 * inf is 0 for bounds: the infinite endpoint stands for finite values
+template<typename Real>
+Real product(Real x, Real y) {
+    return x == 0 || y == 0 ? Real(0) : x * y;
+}
+
+// the significant digits of a decimal number and the power of ten of the last one,
+// so "0.0250" and "2.5e-2" are both {"25", -3}; nullopt for anything else, such as `pi`
+inline std::optional<std::pair<std::string, long>> decimal_digits(std::string_view text) {
+    std::string digits;
+    long exponent = 0;
+    bool any = false, point = false;
+    std::size_t i = 0;
+    for (; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '.' && !point) {
+            point = true;
+        } else if (c >= '0' && c <= '9') {
+            any = true;
+            exponent -= point;
+            if (c != '0' || !digits.empty()) {
+                digits += c;
+            }
+        } else {
+            break;
+        }
+    }
+    if (!any) {
+        return std::nullopt;
+    }
+    if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+        i++;
+        bool negative = i < text.size() && text[i] == '-';
+        if (i < text.size() && (text[i] == '-' || text[i] == '+')) {
+            i++;
+        }
+        long power = 0;
+        auto [end, error] = std::from_chars(text.data() + i, text.data() + text.size(), power);
+        if (error != std::errc() || end == text.data() + i) {
+            return std::nullopt;
+        }
+        exponent += negative ? -power : power;
+        i = end - text.data();
+    }
+    if (i != text.size()) {
+        return std::nullopt;
+    }
+    while (!digits.empty() && digits.back() == '0') {
+        digits.pop_back();
+        exponent++;
+    }
+    if (digits.empty()) {
+        exponent = 0;
+    }
+    return std::pair(std::move(digits), exponent);
+}
+
+// whether the decimal `text` is exactly `value`, which it was parsed to: every binary
+// fraction has a finite decimal expansion, so print all of it and compare the digits
+template<typename Real>
+bool exact_literal(Real value, std::string_view text) {
+    auto literal = decimal_digits(text);
+    if (!literal) {
+        return false;
+    }
+    // the most significant digits a Real can have: m / 2^k with m < 2^digits is m 5^k / 10^k
+    constexpr int precision = int(std::numeric_limits<Real>::digits * 0.30103
+        + (std::numeric_limits<Real>::digits - std::numeric_limits<Real>::min_exponent) * 0.69898) + 2;
+    std::string buffer(precision + 16, '\0');
+    auto [end, error] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value, std::chars_format::scientific, precision);
+    return error == std::errc() && decimal_digits(std::string_view(buffer.data(), end - buffer.data())) == literal;
+}
+
+}
+
+// A closed interval [lo, hi] of reals, as a Number type: Expression<Interval<double>>
+// evaluates to bounds that contain every value the expression takes for its
+// variables in the given intervals.
+//
+// Results are rounded outwards by stepping one ulp away from the nearest result
+// (two for the libm functions), so they're guaranteed but may be wider than
+// needed. An empty interval (the result of ln or a fractional power of
+// negatives only, or of dividing by [0, 0]) has NaN bounds and stays empty.
+// Parts of an argument outside a function's real domain are ignored, so ln([-1, 4])
+// is [-inf, ln 4].
+template<typename Real = double>
+struct Interval {
+    Real lo;
+    Real hi;
+
+    Interval() : lo(0), hi(0) {}
+
+    Interval(Real value) : lo(value), hi(value) {}
+
+    Interval(Real _lo, Real _hi) : lo(_lo), hi(_hi) {}
+
+    static Interval entire() {
+        return {-std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity()};
+    }
+
+    static Interval empty() {
+        return {std::numeric_limits<Real>::quiet_NaN(), std::numeric_limits<Real>::quiet_NaN()};
+    }
+
+    bool is_empty() const {
+        return std::isnan(lo) || std::isnan(hi);
+    }
+
+    bool contains(Real x) const {
+        return lo <= x && x <= hi;
+    }
+
+    bool contains(const Interval& other) const {
+        return other.is_empty() || (lo <= other.lo && other.hi <= hi);
+    }
+
+    Real width() const {
+        return hi - lo;
+    }
+
+    Real mid() const {
+        return lo / 2 + hi / 2;
+    }
+
+    friend bool operator==(const Interval& a, const Interval& b) {
+        return (a.lo == b.lo && a.hi == b.hi) || (a.is_empty() && b.is_empty());
+    }
+
+    friend Interval operator+(const Interval& a, const Interval& b) {
+        using namespace interval_detail;
+        if (a.is_empty() || b.is_empty()) return empty();
+        return {down(a.lo + b.lo), up(a.hi + b.hi)};
+    }
+
+    friend Interval operator-(const Interval& a) {
+        return {-a.hi, -a.lo};
+    }
+
+    friend Interval operator-(const Interval& a, const Interval& b) {
+        return a + -b;
+    }
+
+    friend Interval operator*(const Interval& a, const Interval& b) {
+        using namespace interval_detail;
+        if (a.is_empty() || b.is_empty()) return empty();
+        Real p[4] = {product(a.lo, b.lo), product(a.lo, b.hi), product(a.hi, b.lo), product(a.hi, b.hi)};
+        return {down(*std::min_element(p, p + 4)), up(*std::max_element(p, p + 4))};
+    }
+
+    // dividing by an interval that contains 0 gives everything (or nothing, for [0, 0])
+    friend Interval operator/(const Interval& a, const Interval& b) {
+        using namespace interval_detail;
+        if (a.is_empty() || b.is_empty() || (b.lo == 0 && b.hi == 0)) return empty();
+        if (b.contains(0)) return entire();
+        Real q[4] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+        if (std::any_of(q, q + 4, [](Real x) { return std::isnan(x); })) return entire();
+        return {down(*std::min_element(q, q + 4)), up(*std::max_element(q, q + 4))};
+    }
+
+    Interval& operator+=(const Interval& other) { return *this = *this + other; }
+    Interval& operator-=(const Interval& other) { return *this = *this - other; }
+    Interval& operator*=(const Interval& other) { return *this = *this * other; }
+    Interval& operator/=(const Interval& other) { return *this = *this / other; }
+
+    friend Interval exp(const Interval& a) {
+        using namespace interval_detail;
+        if (a.is_empty()) return empty();
+        return {std::max(Real(0), down2(std::exp(a.lo))), up2(std::exp(a.hi))};
+    }
+
+    friend Interval log(const Interval& a) {
+        using namespace interval_detail;
+        if (a.is_empty() || a.hi < 0) return empty();
+        Real lo = a.lo <= 0 ? -std::numeric_limits<Real>::infinity() : down2(std::log(a.lo));
+        return {lo, a.hi == 0 ? lo : up2(std::log(a.hi))};
+    }
+
+    friend Interval sin(const Interval& a) {
+        return periodic(a, true);
+    }
+
+    friend Interval cos(const Interval& a) {
+        return periodic(a, false);
+    }
+
+    // an integer exponent allows negative bases; otherwise only the base's
+    // nonnegative part counts
+    friend Interval pow(const Interval& base, const Interval& exponent) {
+        using namespace interval_detail;
+        if (base.is_empty() || exponent.is_empty()) return empty();
+        Real n = exponent.lo;
+        if (n == exponent.hi && n == std::trunc(n) && std::abs(n) < Real(1 << 30)) {
+            if (n == 0) return Interval(1);
+            if (n < 0) return Interval(1) / pow(base, Interval(-n));
+            bool even = std::fmod(n, Real(2)) == 0;
+            if (!even || base.lo >= 0) return {down2(std::pow(base.lo, n)), up2(std::pow(base.hi, n))};
+            if (base.hi <= 0) return {down2(std::pow(base.hi, n)), up2(std::pow(base.lo, n))};
+            return {0, up2(std::pow(std::max(-base.lo, base.hi), n))};
+        }
+        if (base.hi < 0) return empty();
+        // x ^ y is monotonic in each argument for x >= 0, so the corners bound it
+        Real x0 = std::max(base.lo, Real(0));
+        Real p[4] = {std::pow(x0, exponent.lo), std::pow(x0, exponent.hi), std::pow(base.hi, exponent.lo), std::pow(base.hi, exponent.hi)};
+        if (std::any_of(p, p + 4, [](Real x) { return std::isnan(x); })) return {0, std::numeric_limits<Real>::infinity()};
+        return {std::max(Real(0), down2(*std::min_element(p, p + 4))), up2(*std::max_element(p, p + 4))};
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const Interval& a) {
+        if (a.lo == a.hi) {
+            return out << a.lo;
+        }
+        return out << "[" << a.lo << ", " << a.hi << "]";
+    }
+
+private:
+    // sin or cos: the values at the ends, and ±1 if an extremum (a multiple of pi / 2) may lie between them
+    static Interval periodic(const Interval& a, bool is_sin) {
+        using namespace interval_detail;
+        if (a.is_empty()) return empty();
+        Interval whole(-1, 1);
+        // beyond 2^50 neighbouring numbers are far apart, and pi / 2 is only known to 2^-53
+        Real limit = Real(1ull << 50);
+        if (!(a.lo > -limit && a.hi < limit) || a.width() >= 2 * std::numbers::pi_v<Real>) {
+            return whole;
+        }
+        Real ql = a.lo / (std::numbers::pi_v<Real> / 2), qh = a.hi / (std::numbers::pi_v<Real> / 2);
+        // covers the error of the quotients in units of pi / 2, so no extremum is missed
+        Real margin = 4 * std::numeric_limits<Real>::epsilon() * (1 + std::max(std::abs(ql), std::abs(qh)));
+        auto first = std::int64_t(std::floor(ql - margin)) + 1;
+        auto last = std::int64_t(std::floor(qh + margin));
+        Real at_lo = is_sin ? std::sin(a.lo) : std::cos(a.lo);
+        Real at_hi = is_sin ? std::sin(a.hi) : std::cos(a.hi);
+        Interval result(down2(std::min(at_lo, at_hi)), up2(std::max(at_lo, at_hi)));
+        // sin has its maximum at q = 1 (mod 4) quarter turns, cos at q = 0
+        int shift = is_sin ? 3 : 0;
+        for (std::int64_t q = first; q <= last && q < first + 4; q++) {
+            int phase = int(((q + shift) % 4 + 4) % 4);
+            if (phase == 0) result.hi = 1;
+            if (phase == 2) result.lo = -1;
+        }
+        return {std::max(result.lo, Real(-1)), std::min(result.hi, Real(1))};
+    }
+};
+
+template<typename Real>
+struct real_type<Interval<Real>> {
+    using type = Real;
+};
+
+// literals that are exactly a Real, such as 2, 2.0, 1e1 or 0.5, are point intervals;
+// the others (0.1, pi) are widened by an ulp each way
+template<typename Real>
+struct literal_value<Interval<Real>> {
+    static Interval<Real> make(Real value, std::string_view text) {
+        // integers below 2 ^ digits don't need the digits compared
+        bool integer = !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return c >= '0' && c <= '9'; })
+            && value < Real(1ull << std::numeric_limits<Real>::digits);
+        if (integer || interval_detail::exact_literal(value, text)) {
+            return Interval<Real>(value);
+        }
+        return {interval_detail::down(value), interval_detail::up(value)};
+    }
+};
+
+// `expr` over intervals, with every number as a point interval (so e.g. the 0.1 in
+// it stands for the double nearest to 0.1, not for 0.1 itself)
+template<typename Real>
+Expression<Interval<Real>> to_interval(const Expression<Real>& expr) {
+    using Result = Expression<Interval<Real>>;
+    std::unordered_map<const Expr<Real>*, Result> memo;
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack
+    std::vector<const Expr<Real>*> stack = {expr.inner.get()};
+    while (!stack.empty()) {
+        const Expr<Real>* node = stack.back();
+        if (memo.contains(node)) {
+            stack.pop_back();
+            continue;
+        }
+        auto children = operands(node);
+        bool ready = true;
+        for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+            if (!memo.contains(children[i]->inner.get())) {
+                stack.push_back(children[i]->inner.get());
+                ready = false;
+            }
+        }
+        if (!ready) {
+            continue;
+        }
+        stack.pop_back();
+        auto operand = [&](std::size_t i) -> const Result& {
+            return memo.at(children[i]->inner.get());
+        };
+        Result result(Interval<Real>(0));
+        switch (node->kind()) {
+            case EXPR_NUM: result = Interval<Real>(static_cast<const NumExpr<Real>*>(node)->value); break;
+            case EXPR_VAR: result = Result::var(static_cast<const VarExpr<Real>*>(node)->name); break;
+            case EXPR_SUM: result = Result(make_ref<SumExpr<Interval<Real>>>(operand(0), operand(1))); break;
+            case EXPR_NEG: result = Result(make_ref<NegExpr<Interval<Real>>>(operand(0))); break;
+            case EXPR_MUL: result = Result(make_ref<MulExpr<Interval<Real>>>(operand(0), operand(1))); break;
+            case EXPR_DIV: result = Result(make_ref<DivExpr<Interval<Real>>>(operand(0), operand(1))); break;
+            case EXPR_POW: result = Result(make_ref<PowExpr<Interval<Real>>>(operand(0), operand(1))); break;
+            case EXPR_SIN: result = sin(operand(0)); break;
+            case EXPR_COS: result = cos(operand(0)); break;
+            case EXPR_LN: result = ln(operand(0)); break;
+            case EXPR_EXP: result = exp(operand(0)); break;
+        }
+        memo.emplace(node, std::move(result));
+    }
+    return memo.at(expr.inner.get());
+}
+
+// Bounds of an expression over many boxes at once. A box gives every variable
+// an interval; boxes are evaluated through one Tape<Interval<Real>>, in chunks
+// spread over `threads`.
+template<typename Real = double>
+class BoxEvaluator {
+    Tape<Interval<Real>> tape;
+
+public:
+    // boxes evaluated together by one thread
+    static constexpr std::size_t CHUNK = 1024;
+
+    // 0 means one per hardware thread
+    unsigned threads = 1;
+
+    BoxEvaluator(const Expression<Interval<Real>>& expr, std::vector<std::string> vars) : tape(expr, std::move(vars)) {}
+
+    BoxEvaluator(const Expression<Real>& expr, std::vector<std::string> vars) : BoxEvaluator(to_interval(expr), std::move(vars)) {}
+
+    const std::vector<std::string>& vars() const {
+        return tape.vars;
+    }
+
+    // `boxes[p * vars().size() + i]` is the interval of `vars()[i]` in box `p`
+    void eval_batch(const Interval<Real>* boxes, std::size_t n, Interval<Real>* out) const {
+        std::size_t chunks = (n + CHUNK - 1) / CHUNK;
+        parallel_for(chunks, threads, [&](std::size_t c) {
+            std::size_t first = c * CHUNK;
+            tape.eval_batch(boxes + first * tape.vars.size(), std::min(CHUNK, n - first), out + first);
+        });
+    }
+
+    // boxes given by their lower and upper corners, laid out like points for Tape::eval_batch
+    void eval_batch(const Real* lo, const Real* hi, std::size_t n, Interval<Real>* out) const {
+        std::size_t nvars = tape.vars.size();
+        std::size_t chunks = (n + CHUNK - 1) / CHUNK;
+        parallel_for(chunks, threads, [&](std::size_t c) {
+            std::size_t first = c * CHUNK;
+            std::size_t count = std::min(CHUNK, n - first);
+            std::vector<Interval<Real>> boxes(count * nvars);
+            for (std::size_t i = 0; i < boxes.size(); i++) {
+                boxes[i] = Interval<Real>(lo[first * nvars + i], hi[first * nvars + i]);
+            }
+            tape.eval_batch(boxes.data(), count, out + first);
+        });
+    }
+
+    Interval<Real> eval(const Interval<Real>* box) const {
+        return tape.eval(box);
+    }
+};
@@ -0,0 +1,484 @@
+#pragma once
+
+#include "tape.h"
+#include "vecmath.h"
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Native code is only generated on x86-64 unix; everywhere else (or with
+// SYMEXPR_NO_JIT defined) JitFunction evaluates through its Tape instead.
+#if defined(__x86_64__) && defined(__unix__) && !defined(SYMEXPR_NO_JIT)
+#define SYMEXPR_JIT_NATIVE 1
+#include <sys/mman.h>
+#else
+#define SYMEXPR_JIT_NATIVE 0
+#endif
+
+namespace jit_detail {
+
+// libm entry points called from generated code
+inline double call_sin(double x) { return std::sin(x); }
+inline double call_cos(double x) { return std::cos(x); }
+inline double call_log(double x) { return std::log(x); }
+inline double call_exp(double x) { return std::exp(x); }
+inline double call_pow(double x, double y) { return std::pow(x, y); }
+
+// the vecmath.h kernels instead, for one point and for the two lanes of a packed slot
+inline double call_vector_sin(double x) { return vecmath::sin(x); }
+inline double call_vector_cos(double x) { return vecmath::cos(x); }
+inline double call_vector_log(double x) { return vecmath::log(x); }
+inline double call_vector_exp(double x) { return vecmath::exp(x); }
+inline double call_vector_pow(double x, double y) { return vecmath::pow(x, y); }
+inline void call_packed_sin(const double* x, double* out) { vecmath::sin(x, out, 2); }
+inline void call_packed_cos(const double* x, double* out) { vecmath::cos(x, out, 2); }
+inline void call_packed_log(const double* x, double* out) { vecmath::log(x, out, 2); }
+inline void call_packed_exp(const double* x, double* out) { vecmath::exp(x, out, 2); }
+inline void call_packed_pow(const double* x, const double* y, double* out) { vecmath::pow(x, y, out, 2); }
+
+enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// SSE2 opcodes (second byte after 0F); the prefix picks the scalar (F2) or packed (66) form
+enum SseOp : std::uint8_t {
+    SSE_LOAD = 0x10,
+    SSE_STORE = 0x11,
+    SSE_UNPCKL = 0x14,
+    SSE_LOADH = 0x16,
+    SSE_XOR = 0x57,
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_DIV = 0x5E,
+};
+
+constexpr std::uint8_t SCALAR = 0xF2;
+constexpr std::uint8_t PACKED = 0x66;
+
+// Just enough of an x86-64 encoder for the code JitFunction emits.
+// Only xmm0 and xmm1 are used, so SSE instructions never need REX.R.
+struct Assembler {
+    std::vector<std::uint8_t> code;
+
+    void byte(std::uint8_t b) {
+        code.push_back(b);
+    }
+
+    void imm32(std::int32_t value) {
+        for (int i = 0; i < 4; i++) byte(std::uint32_t(value) >> (8 * i));
+    }
+
+    void imm64(std::uint64_t value) {
+        for (int i = 0; i < 8; i++) byte(value >> (8 * i));
+    }
+
+    void push(Reg r) {
+        if (r >= R8) byte(0x41);
+        byte(0x50 + (r & 7));
+    }
+
+    void pop(Reg r) {
+        if (r >= R8) byte(0x41);
+        byte(0x58 + (r & 7));
+    }
+
+    void mov(Reg dst, Reg src) {
+        byte(0x48 | (src >= R8) << 2 | (dst >= R8));
+        byte(0x89);
+        byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    void mov(Reg dst, std::uint64_t value) {
+        byte(0x48 | (dst >= R8));
+        byte(0xB8 + (dst & 7));
+        imm64(value);
+    }
+
+    void add(Reg dst, std::int32_t value) {
+        byte(0x48 | (dst >= R8));
+        byte(0x81);
+        byte(0xC0 | (dst & 7));
+        imm32(value);
+    }
+
+    void sub(Reg dst, std::int32_t value) {
+        byte(0x48 | (dst >= R8));
+        byte(0x81);
+        byte(0xE8 | (dst & 7));
+        imm32(value);
+    }
+
+    void dec(Reg r) {
+        byte(0x48 | (r >= R8));
+        byte(0xFF);
+        byte(0xC8 | (r & 7));
+    }
+
+    // jump back to `target` if the last result was nonzero
+    void jnz(std::size_t target) {
+        byte(0x0F);
+        byte(0x85);
+        imm32(std::int32_t(target) - std::int32_t(code.size() + 4));
+    }
+
+    // lea dst, [base + disp]
+    void lea(Reg dst, Reg base, std::int32_t disp) {
+        byte(0x48 | (dst >= R8) << 2 | (base >= R8));
+        byte(0x8D);
+        byte(0x80 | (dst & 7) << 3 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        imm32(disp);
+    }
+
+    void call(Reg r) {
+        if (r >= R8) byte(0x41);
+        byte(0xFF);
+        byte(0xD0 | (r & 7));
+    }
+
+    void ret() {
+        byte(0xC3);
+    }
+
+    // `op xmm, [base + disp]`
+    void sse(std::uint8_t prefix, std::uint8_t op, int xmm, Reg base, std::int32_t disp) {
+        byte(prefix);
+        if (base >= R8) byte(0x41);
+        byte(0x0F);
+        byte(op);
+        byte(0x80 | xmm << 3 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        imm32(disp);
+    }
+
+    // `op dst, src`
+    void sse(std::uint8_t prefix, std::uint8_t op, int dst, int src) {
+        byte(prefix);
+        byte(0x0F);
+        byte(op);
+        byte(0xC0 | dst << 3 | src);
+    }
+
+    // movq xmm, rax
+    void movq_rax(int xmm) {
+        byte(0x66);
+        byte(0x48);
+        byte(0x0F);
+        byte(0x6E);
+        byte(0xC0 | xmm << 3);
+    }
+};
+
+} // namespace jit_detail
+
+// Compiles an expression to x86-64 machine code (SSE2) in an executable buffer.
+// Arithmetic nodes are inlined, sin/cos/ln/exp/pow call into libm, or with
+// `vector_math` into the vecmath.h kernels (both lanes of a packed slot at once).
+// Two entry points are generated: a scalar one for a single point and a packed
+// one that evaluates two points per iteration for eval_batch.
+class JitFunction {
+    Tape<double> _tape;
+    void* memory = nullptr;
+    std::size_t memory_size = 0;
+    double (*scalar)(const double* values, double* scratch) = nullptr;
+    void (*packed)(const double* points, double* out, std::size_t pairs, double* scratch) = nullptr;
+
+public:
+    JitFunction(const Expression<double>& expr, std::vector<std::string> vars, bool vector_math = false)
+        : _tape(expr, std::move(vars)) {
+        _tape.vector_math = vector_math;
+        compile();
+    }
+
+    JitFunction(const JitFunction&) = delete;
+    JitFunction& operator=(const JitFunction&) = delete;
+
+    JitFunction(JitFunction&& other) noexcept
+        : _tape(std::move(other._tape)),
+        memory(std::exchange(other.memory, nullptr)),
+        memory_size(std::exchange(other.memory_size, 0)),
+        scalar(std::exchange(other.scalar, nullptr)),
+        packed(std::exchange(other.packed, nullptr))
+    {}
+
+    ~JitFunction() {
+        release();
+    }
+
+    // false if the portable Tape fallback is in use
+    bool is_native() const {
+        return scalar != nullptr;
+    }
+
+    const Tape<double>& tape() const {
+        return _tape;
+    }
+
+    // evaluate with `values[i]` bound to `tape().vars[i]`
+    double operator()(const double* values) const {
+        double* s = scratch();
+        return scalar ? scalar(values, s) : _tape.eval(values, s);
+    }
+
+    // same layout as Tape::eval_batch
+    void eval_batch(const double* points, std::size_t n, double* out) const {
+        if (!packed) {
+            _tape.eval_batch(points, n, out);
+            return;
+        }
+        double* s = scratch();
+        if (n >= 2) {
+            packed(points, out, n / 2, s);
+        }
+        if (n % 2) {
+            out[n - 1] = scalar(points + (n - 1) * _tape.vars.size(), s);
+        }
+    }
+
+private:
+    // packed code keeps two doubles per slot, scalar code reuses the same buffer
+    double* scratch() const {
+        thread_local std::vector<double> buffer;
+        if (buffer.size() < 2 * _tape.size()) {
+            buffer.resize(2 * _tape.size());
+        }
+        return buffer.data();
+    }
+
+    void release() {
+#if SYMEXPR_JIT_NATIVE
+        if (memory) {
+            munmap(memory, memory_size);
+        }
+#endif
+        memory = nullptr;
+        scalar = nullptr;
+        packed = nullptr;
+    }
+
+    void compile() {
+#if SYMEXPR_JIT_NATIVE
+        // slot offsets are encoded as 32-bit displacements
+        if (_tape.size() >= (1u << 26) || _tape.vars.size() >= (1u << 26)) {
+            return;
+        }
+        jit_detail::Assembler scalar_code = emit_scalar();
+        jit_detail::Assembler packed_code = emit_packed();
+
+        std::size_t page = 4096;
+        std::size_t size = (scalar_code.code.size() + packed_code.code.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return;
+        }
+        auto bytes = static_cast<std::uint8_t*>(mem);
+        std::memcpy(bytes, scalar_code.code.data(), scalar_code.code.size());
+        std::memcpy(bytes + scalar_code.code.size(), packed_code.code.data(), packed_code.code.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, size);
+            return;
+        }
+        memory = mem;
+        memory_size = size;
+        scalar = reinterpret_cast<decltype(scalar)>(bytes);
+        packed = reinterpret_cast<decltype(packed)>(bytes + scalar_code.code.size());
+#endif
+    }
+
+    std::uint64_t libm_function(ExprKind kind) const {
+        using namespace jit_detail;
+        bool vector = _tape.vector_math;
+        switch (kind) {
+            case EXPR_SIN: return std::bit_cast<std::uint64_t>(vector ? &call_vector_sin : &call_sin);
+            case EXPR_COS: return std::bit_cast<std::uint64_t>(vector ? &call_vector_cos : &call_cos);
+            case EXPR_LN: return std::bit_cast<std::uint64_t>(vector ? &call_vector_log : &call_log);
+            case EXPR_EXP: return std::bit_cast<std::uint64_t>(vector ? &call_vector_exp : &call_exp);
+            case EXPR_POW: return std::bit_cast<std::uint64_t>(vector ? &call_vector_pow : &call_pow);
+            default: return 0;
+        }
+    }
+
+    // void fn(const double* x, [const double* y,] double* out) over two lanes
+    static std::uint64_t packed_function(ExprKind kind) {
+        using namespace jit_detail;
+        switch (kind) {
+            case EXPR_SIN: return std::bit_cast<std::uint64_t>(&call_packed_sin);
+            case EXPR_COS: return std::bit_cast<std::uint64_t>(&call_packed_cos);
+            case EXPR_LN: return std::bit_cast<std::uint64_t>(&call_packed_log);
+            case EXPR_EXP: return std::bit_cast<std::uint64_t>(&call_packed_exp);
+            case EXPR_POW: return std::bit_cast<std::uint64_t>(&call_packed_pow);
+            default: return 0;
+        }
+    }
+
+    static std::uint8_t sse_op(ExprKind kind) {
+        using namespace jit_detail;
+        switch (kind) {
+            case EXPR_SUM: return SSE_ADD;
+            case EXPR_MUL: return SSE_MUL;
+            case EXPR_DIV: return SSE_DIV;
+            default: return 0;
+        }
+    }
+
+    // double fn(const double* values /* rdi */, double* scratch /* rsi */)
+    // rbp holds `values`, rbx holds the scratch slots, 8 bytes each
+    jit_detail::Assembler emit_scalar() const {
+        using namespace jit_detail;
+        Assembler a;
+        a.push(RBX);
+        a.push(RBP);
+        a.sub(RSP, 8);
+        a.mov(RBP, RDI);
+        a.mov(RBX, RSI);
+        for (std::size_t i = 0; i < _tape.size(); i++) {
+            auto ins = _tape.code[i];
+            std::int32_t dst = 8 * i, lhs = 8 * ins.lhs, rhs = 8 * ins.rhs;
+            switch (ins.kind) {
+                case EXPR_NUM:
+                    a.mov(RAX, std::bit_cast<std::uint64_t>(_tape.constants[ins.lhs]));
+                    a.movq_rax(0);
+                    break;
+                case EXPR_VAR:
+                    a.sse(SCALAR, SSE_LOAD, 0, RBP, lhs);
+                    break;
+                case EXPR_SUM:
+                case EXPR_MUL:
+                case EXPR_DIV:
+                    a.sse(SCALAR, SSE_LOAD, 0, RBX, lhs);
+                    a.sse(SCALAR, SSE_LOAD, 1, RBX, rhs);
+                    a.sse(SCALAR, sse_op(ins.kind), 0, 1);
+                    break;
+                case EXPR_NEG:
+                    a.sse(SCALAR, SSE_LOAD, 0, RBX, lhs);
+                    a.mov(RAX, 0x8000000000000000ull);
+                    a.movq_rax(1);
+                    a.sse(PACKED, SSE_XOR, 0, 1);
+                    break;
+                case EXPR_POW:
+                    a.sse(SCALAR, SSE_LOAD, 1, RBX, rhs);
+                    [[fallthrough]];
+                case EXPR_SIN:
+                case EXPR_COS:
+                case EXPR_LN:
+                case EXPR_EXP:
+                    a.sse(SCALAR, SSE_LOAD, 0, RBX, lhs);
+                    a.mov(RAX, libm_function(ins.kind));
+                    a.call(RAX);
+                    break;
+            }
+            a.sse(SCALAR, SSE_STORE, 0, RBX, dst);
+        }
+        a.sse(SCALAR, SSE_LOAD, 0, RBX, 8 * _tape.outputs[0]);
+        a.add(RSP, 8);
+        a.pop(RBP);
+        a.pop(RBX);
+        a.ret();
+        return a;
+    }
+
+    // void fn(const double* points /* rdi */, double* out /* rsi */, size_t pairs /* rdx */, double* scratch /* rcx */)
+    // rbp walks the points, r14 walks the output, r15 counts the remaining pairs,
+    // rbx holds the scratch slots, 16 bytes (two lanes) each
+    jit_detail::Assembler emit_packed() const {
+        using namespace jit_detail;
+        Assembler a;
+        std::int32_t nvars = _tape.vars.size();
+        a.push(RBX);
+        a.push(RBP);
+        a.push(R14);
+        a.push(R15);
+        a.sub(RSP, 8);
+        a.mov(RBP, RDI);
+        a.mov(R14, RSI);
+        a.mov(R15, RDX);
+        a.mov(RBX, RCX);
+
+        // constants don't depend on the point, fill their slots once
+        for (std::size_t i = 0; i < _tape.size(); i++) {
+            auto ins = _tape.code[i];
+            if (ins.kind == EXPR_NUM) {
+                a.mov(RAX, std::bit_cast<std::uint64_t>(_tape.constants[ins.lhs]));
+                a.movq_rax(0);
+                a.sse(PACKED, SSE_UNPCKL, 0, 0);
+                a.sse(PACKED, SSE_STORE, 0, RBX, 16 * i);
+            }
+        }
+
+        std::size_t loop = a.code.size();
+        for (std::size_t i = 0; i < _tape.size(); i++) {
+            auto ins = _tape.code[i];
+            std::int32_t dst = 16 * i, lhs = 16 * ins.lhs, rhs = 16 * ins.rhs;
+            switch (ins.kind) {
+                case EXPR_NUM:
+                    continue;
+                case EXPR_VAR:
+                    a.sse(SCALAR, SSE_LOAD, 0, RBP, 8 * ins.lhs);
+                    a.sse(PACKED, SSE_LOADH, 0, RBP, 8 * (nvars + ins.lhs));
+                    break;
+                case EXPR_SUM:
+                case EXPR_MUL:
+                case EXPR_DIV:
+                    a.sse(PACKED, SSE_LOAD, 0, RBX, lhs);
+                    a.sse(PACKED, SSE_LOAD, 1, RBX, rhs);
+                    a.sse(PACKED, sse_op(ins.kind), 0, 1);
+                    break;
+                case EXPR_NEG:
+                    a.sse(PACKED, SSE_LOAD, 0, RBX, lhs);
+                    a.mov(RAX, 0x8000000000000000ull);
+                    a.movq_rax(1);
+                    a.sse(PACKED, SSE_UNPCKL, 1, 1);
+                    a.sse(PACKED, SSE_XOR, 0, 1);
+                    break;
+                case EXPR_POW:
+                case EXPR_SIN:
+                case EXPR_COS:
+                case EXPR_LN:
+                case EXPR_EXP:
+                    if (_tape.vector_math) {
+                        // the slots' addresses as arguments; `dst` never overlaps the operands
+                        a.lea(RDI, RBX, lhs);
+                        if (ins.kind == EXPR_POW) {
+                            a.lea(RSI, RBX, rhs);
+                            a.lea(RDX, RBX, dst);
+                        } else {
+                            a.lea(RSI, RBX, dst);
+                        }
+                        a.mov(RAX, packed_function(ins.kind));
+                        a.call(RAX);
+                        continue;
+                    }
+                    // libm is scalar, call it once per lane
+                    for (int lane = 0; lane < 2; lane++) {
+                        a.sse(SCALAR, SSE_LOAD, 0, RBX, lhs + 8 * lane);
+                        if (ins.kind == EXPR_POW) {
+                            a.sse(SCALAR, SSE_LOAD, 1, RBX, rhs + 8 * lane);
+                        }
+                        a.mov(RAX, libm_function(ins.kind));
+                        a.call(RAX);
+                        a.sse(SCALAR, SSE_STORE, 0, RBX, dst + 8 * lane);
+                    }
+                    continue;
+            }
+            a.sse(PACKED, SSE_STORE, 0, RBX, dst);
+        }
+        a.sse(PACKED, SSE_LOAD, 0, RBX, 16 * _tape.outputs[0]);
+        a.sse(PACKED, SSE_STORE, 0, R14, 0);
+        a.add(RBP, 16 * nvars);
+        a.add(R14, 16);
+        a.dec(R15);
+        a.jnz(loop);
+
+        a.add(RSP, 8);
+        a.pop(R15);
+        a.pop(R14);
+        a.pop(RBP);
+        a.pop(RBX);
+        a.ret();
+        return a;
+    }
+};
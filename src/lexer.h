@@ -1,6 +1,11 @@
 #pragma once
 
+#include <bit>
+#include <cctype>
 #include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <istream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -12,36 +17,112 @@ enum TokenKind {
     TOK_EOF,
 };
 
+namespace lexer_detail {
+
+constexpr std::uint64_t ONES = 0x0101010101010101;
+constexpr std::uint64_t HIGH = ONES * 0x80;
+
+// the high bit of every byte of `word` that's strictly between `lo` and `hi` (hi <= 128)
+inline std::uint64_t bytes_between(std::uint64_t word, unsigned lo, unsigned hi) {
+    std::uint64_t low7 = word & (ONES * 0x7f);
+    return (ONES * (127 + hi) - low7) & ~word & (low7 + ONES * (127 - lo)) & HIGH;
+}
+
+inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// the number of leading bytes of `word` (in memory order) whose flags are set
+inline int leading_flagged(std::uint64_t flags) {
+    std::uint64_t rest = ~flags & HIGH;
+    if constexpr (std::endian::native == std::endian::little) {
+        return rest == 0 ? 8 : std::countr_zero(rest) / 8;
+    } else {
+        return rest == 0 ? 8 : std::countl_zero(rest) / 8;
+    }
+}
+
+// the first byte in [pos, end) that isn't whitespace, eight bytes at a time
+inline const char* skip_spaces(const char* pos, const char* end) {
+    while (end - pos >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, pos, 8);
+        int n = leading_flagged(bytes_between(word, ' ' - 1, ' ' + 1) | bytes_between(word, '\t' - 1, '\r' + 1));
+        pos += n;
+        if (n < 8) {
+            return pos;
+        }
+    }
+    while (pos < end && is_space(*pos)) pos++;
+    return pos;
+}
+
+// the first byte in [pos, end) that isn't a decimal digit, eight bytes at a time
+inline const char* skip_digits(const char* pos, const char* end) {
+    while (end - pos >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, pos, 8);
+        int n = leading_flagged(bytes_between(word, '0' - 1, '9' + 1));
+        pos += n;
+        if (n < 8) {
+            return pos;
+        }
+    }
+    while (pos < end && is_digit(*pos)) pos++;
+    return pos;
+}
+
+}
+
 class Token {
     TokenKind _kind;
     std::string_view _str;
 
+    friend class Lexer;
+
 public:
-    Token(const char* source) {
-        while (source != nullptr && *source != 0 && std::isspace(*source)) {
-            source++;
-        }
-        if (source == nullptr || *source == 0) {
+    // the first token in [source, end); a NUL byte also ends the input
+    Token(const char* source, const char* end) {
+        using namespace lexer_detail;
+        source = source == nullptr ? end : skip_spaces(source, end);
+        if (source == end || *source == 0) {
             _kind = TOK_EOF;
             _str = std::string_view();
-        } else if (std::isdigit(*source)) {
-            char *end;
-            std::strtod(source, &end);
+        } else if (is_digit(*source)) {
+            // the extent std::strtod accepts for a decimal literal
+            if (*source == '0' && source + 1 < end && (source[1] == 'x' || source[1] == 'X')) {
+                throw std::invalid_argument("Hexadecimal literals are not supported");
+            }
+            auto number_end = skip_digits(source, end);
+            if (number_end < end && *number_end == '.') {
+                number_end = skip_digits(number_end + 1, end);
+            }
+            if (number_end < end && (*number_end == 'e' || *number_end == 'E')) {
+                auto exponent = number_end + 1;
+                if (exponent < end && (*exponent == '+' || *exponent == '-')) exponent++;
+                if (exponent < end && is_digit(*exponent)) {
+                    number_end = skip_digits(exponent, end);
+                }
+            }
             _kind = TOK_NUMBER;
-            _str = std::string_view(source, end);
+            _str = std::string_view(source, number_end);
         } else if (std::isalpha(*source)) {
-            auto end = source;
-            while (*end != 0 && std::isalnum(*end)) {
-                end++;
+            auto name_end = source;
+            while (name_end < end && std::isalnum(*name_end)) {
+                name_end++;
             }
             _kind = TOK_NAME;
-            _str = std::string_view(source, end);
+            _str = std::string_view(source, name_end);
         } else {
             _kind = TOK_OP;
             _str = std::string_view(source, source + 1);
         }
     }
-    
+
     TokenKind kind() const { return _kind; }
     const char* data() const { return _str.data(); }
     std::size_t size() const { return _str.size(); }
@@ -49,9 +130,11 @@ public:
     std::string_view str() const { return _str; }
     bool is(TokenKind k) const { return kind() == k; }
 
-    double value() const {
+    // parsed straight into `Real` (float or double), so it's rounded only once
+    template<typename Real = double>
+    Real value() const {
         if (!is(TOK_NUMBER)) throw std::runtime_error("Not a number token");
-        double result;
+        Real result;
         std::from_chars(data(), data() + size(), result);
         return result;
     }
@@ -59,23 +142,86 @@ public:
     bool operator==(const std::string_view& other) const { return _str == other; }
 };
 
+// Tokens of a string in memory (which the lexer doesn't copy, so it has to
+// outlive it), or of a stream read in chunks. The tokens point into the input
+// or the chunk buffer and stay valid until they're consumed.
 class Lexer {
-    std::string source;
+    const char* end;
+    std::istream* stream = nullptr;
+    std::string buffer;
     Token current;
     Token next;
+
 public:
-    Lexer(std::string source_)
-        : source(std::move(source_)),
-        current(source.c_str()),
-        next(current.data() + current.size())
+    // bytes read from a stream at a time
+    static constexpr std::size_t CHUNK = 1 << 16;
+
+    Lexer(std::string_view source)
+        : end(source.data() + source.size()),
+        current(source.data(), end),
+        next(after(current), end)
     {}
 
+    Lexer(std::istream& _stream)
+        : end(nullptr), stream(&_stream), current(nullptr, nullptr), next(nullptr, nullptr)
+    {
+        end = buffer.data();
+        current = lex(buffer.data());
+        next = lex(after(current));
+    }
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
     const Token& peek() const { return current; }
     const Token& peek2() const { return next; }
 
     void consume() {
         current = next;
-        next = Token(current.data() + current.size());
+        next = stream ? lex(after(current)) : Token(after(current), end);
+    }
+
+private:
+    const char* after(const Token& token) const {
+        return token.is(TOK_EOF) ? end : token.data() + token.size();
     }
-};
 
+    // the token at `pos`, reading more of the stream while it might continue past
+    // the buffer (a number needs up to two bytes of lookahead after its end)
+    Token lex(const char* pos) {
+        while (true) {
+            Token token(pos, end);
+            if (!stream || (!token.is(TOK_EOF) && token.data() + token.size() + 2 < end)) {
+                return token;
+            }
+            std::size_t offset = pos - buffer.data();
+            if (!refill(offset)) {
+                return token;
+            }
+            pos = buffer.data() + offset;
+        }
+    }
+
+    // drops the bytes before the current token and appends a chunk of the stream;
+    // `offset` (into the buffer) is moved along with the tokens
+    bool refill(std::size_t& offset) {
+        if (!*stream) {
+            return false;
+        }
+        std::size_t keep = current.is(TOK_EOF) || current.data() == nullptr ? offset : current.data() - buffer.data();
+        std::size_t current_offset = current.data() ? current.data() - buffer.data() : 0;
+        std::size_t next_offset = next.data() ? next.data() - buffer.data() : 0;
+        std::size_t used = end - buffer.data();
+        buffer.erase(0, keep);
+        used -= keep;
+        buffer.resize(used + CHUNK);
+        stream->read(buffer.data() + used, CHUNK);
+        std::size_t read = stream->gcount();
+        buffer.resize(used + read);
+        end = buffer.data() + buffer.size();
+        offset -= keep;
+        if (current.data()) current._str = std::string_view(buffer.data() + current_offset - keep, current.size());
+        if (next.data()) next._str = std::string_view(buffer.data() + next_offset - keep, next.size());
+        return read > 0;
+    }
+};
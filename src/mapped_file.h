@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+    void* _data = nullptr;
+    std::size_t _size = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Can't open `{}`", path));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error(std::format("Can't stat `{}`", path));
+        }
+        _size = st.st_size;
+        if (_size > 0) {
+            _data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (_data == MAP_FAILED) {
+            _data = nullptr;
+            throw std::runtime_error(std::format("Can't map `{}`", path));
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : _data(std::exchange(other._data, nullptr)), _size(std::exchange(other._size, 0)) {}
+
+    ~MappedFile() {
+        if (_data) {
+            munmap(_data, _size);
+        }
+    }
+
+    const char* data() const {
+        return static_cast<const char*>(_data);
+    }
+
+    std::size_t size() const {
+        return _size;
+    }
+
+    std::span<const std::byte> bytes() const {
+        return {static_cast<const std::byte*>(_data), _size};
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "tape.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Evaluates a real expression in float, which doubles the SIMD width of the
+// batch loops, and recomputes a point in double only when float may not be
+// accurate enough for it.
+//
+// Alongside every float value the float pass carries a running bound on its
+// absolute error: input and constant rounding, plus the rounding of every
+// operation, propagated to first order through each operation's condition.
+// A point is accepted when the bound of its output is within `tolerance`
+// relative to the value; otherwise (also for inf and nan) it's evaluated
+// again by the double tape. Library functions are assumed to be accurate to
+// 1 ulp, as glibc's float functions are.
+class MixedTape {
+    Tape<double> exact;
+    Tape<float> fast;
+    // |c - float(c)| for every constant
+    std::vector<float> constant_error;
+
+public:
+    static constexpr std::size_t BATCH = Tape<float>::BATCH;
+    // unit roundoff of float
+    static constexpr float U = std::numeric_limits<float>::epsilon() / 2;
+    // absolute error of an underflowing product
+    static constexpr float ETA = std::numeric_limits<float>::denorm_min();
+
+    // largest accepted error bound relative to the value
+    double tolerance;
+
+    MixedTape(const Expression<double>& expr, std::vector<std::string> vars, double _tolerance = 1e-4)
+        : exact(expr, std::move(vars)), fast(exact), tolerance(_tolerance)
+    {
+        for (double value: exact.constants) {
+            constant_error.push_back(std::abs(value - double(float(value))));
+        }
+    }
+
+    const Tape<double>& tape() const {
+        return exact;
+    }
+
+    double eval(const double* values) const {
+        double result;
+        eval_batch(values, 1, &result);
+        return result;
+    }
+
+    // same layout as Tape::eval_batch; returns the number of points recomputed in double
+    std::size_t eval_batch(const double* points, std::size_t n, double* out) const {
+        std::size_t nvars = exact.vars.size();
+        std::vector<float> value(fast.size() * BATCH), error(fast.size() * BATCH);
+        std::vector<double> scratch(exact.size());
+        std::size_t fallbacks = 0;
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            const double* block = points + begin * nvars;
+            run_block(block, count, value.data(), error.data());
+
+            std::uint32_t slot = fast.outputs[0];
+            const float* v = &value[slot * BATCH];
+            const float* e = &error[slot * BATCH];
+            for (std::size_t j = 0; j < count; j++) {
+                // written so that nan fails the check
+                if (std::isfinite(v[j]) && e[j] <= tolerance * std::abs(v[j])) {
+                    out[begin + j] = v[j];
+                } else {
+                    out[begin + j] = exact.eval(block + j * nvars, scratch.data());
+                    fallbacks++;
+                }
+            }
+        }
+        return fallbacks;
+    }
+
+private:
+    static constexpr float INF = std::numeric_limits<float>::infinity();
+
+    // error of ln(a) given the error of a: |ln(a + d) - ln(a)| <= ln(1 + ea / (|a| - ea)) <= ea / (|a| - ea)
+    static float log_error(float a, float ea) {
+        // a margin <= 0 divides by zero, giving inf (or nan), which fails the final check
+        float bound = ea / std::max(std::abs(a) - ea, 0.0f);
+        return ea == 0 ? 0 : bound;
+    }
+
+    // bound on expm1(t) for t >= 0, cheaper than calling it
+    static float expm1_bound(float t) {
+        return t / std::max(1 - t, 0.0f);
+    }
+
+    void run_block(const double* block, std::size_t count, float* value, float* error) const {
+        std::size_t nvars = exact.vars.size();
+        for (std::size_t i = 0; i < fast.code.size(); i++) {
+            const auto& ins = fast.code[i];
+            float* dst = &value[i * BATCH];
+            float* err = &error[i * BATCH];
+            // lhs and rhs of leaves aren't slots
+            std::size_t operands = operand_count(ins.kind);
+            const float* a = operands > 0 ? &value[ins.lhs * BATCH] : nullptr;
+            const float* ea = operands > 0 ? &error[ins.lhs * BATCH] : nullptr;
+            const float* b = operands > 1 ? &value[ins.rhs * BATCH] : nullptr;
+            const float* eb = operands > 1 ? &error[ins.rhs * BATCH] : nullptr;
+            switch (ins.kind) {
+                case EXPR_NUM:
+                    std::fill(dst, dst + count, fast.constants[ins.lhs]);
+                    std::fill(err, err + count, constant_error[ins.lhs]);
+                    break;
+                case EXPR_VAR:
+                    for (std::size_t j = 0; j < count; j++) {
+                        double x = block[j * nvars + ins.lhs];
+                        dst[j] = float(x);
+                        err[j] = std::abs(x - double(dst[j]));
+                    }
+                    break;
+                case EXPR_SUM:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = a[j] + b[j];
+                        err[j] = ea[j] + eb[j] + U * std::abs(dst[j]);
+                    }
+                    break;
+                case EXPR_NEG:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = -a[j];
+                        err[j] = ea[j];
+                    }
+                    break;
+                case EXPR_MUL:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = a[j] * b[j];
+                        err[j] = std::abs(a[j]) * eb[j] + std::abs(b[j]) * ea[j] + ea[j] * eb[j] + U * std::abs(dst[j]) + ETA;
+                    }
+                    break;
+                case EXPR_DIV:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = a[j] / b[j];
+                        float margin = std::max(std::abs(b[j]) - eb[j], 0.0f);
+                        err[j] = (ea[j] + std::abs(dst[j]) * eb[j]) / margin + U * std::abs(dst[j]) + ETA;
+                    }
+                    break;
+                case EXPR_POW:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = std::pow(a[j], b[j]);
+                        // relative error of |a|^b, through b * ln|a|; only an integer
+                        // exponent known exactly is fine with a negative base
+                        float t = std::abs(b[j]) * log_error(a[j], ea[j]);
+                        if (eb[j] != 0 || b[j] != std::trunc(b[j])) {
+                            t = a[j] > 0 ? t + (std::abs(std::log(a[j])) + log_error(a[j], ea[j])) * eb[j] : INF;
+                        }
+                        err[j] = std::abs(dst[j]) * (expm1_bound(t) + 2 * U) + ETA;
+                    }
+                    break;
+                case EXPR_SIN:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = std::sin(a[j]);
+                        err[j] = ea[j] + 2 * U * std::abs(dst[j]) + ETA;
+                    }
+                    break;
+                case EXPR_COS:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = std::cos(a[j]);
+                        err[j] = ea[j] + 2 * U * std::abs(dst[j]) + ETA;
+                    }
+                    break;
+                case EXPR_LN:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = std::log(a[j]);
+                        err[j] = log_error(a[j], ea[j]) + 2 * U * std::abs(dst[j]);
+                    }
+                    break;
+                case EXPR_EXP:
+                    for (std::size_t j = 0; j < count; j++) {
+                        dst[j] = std::exp(a[j]);
+                        err[j] = std::abs(dst[j]) * (expm1_bound(ea[j]) + 2 * U) + ETA;
+                    }
+                    break;
+            }
+        }
+    }
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "parallel.h"
+#include "tape.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Solves f(x) = 0 for many independent problems (one per parameter set) in
+// lockstep. f and f' are compiled into one tape once; every iteration is a
+// single eval_batch_all over the lanes that are still active, and lanes drop
+// out of the batch as soon as they finish.
+//
+// With a bracket [lo, hi] over which f changes sign, a Newton step that would
+// leave the bracket (or can't be taken) is replaced by bisection, and the
+// bracket shrinks around the sign change on every iteration, so the lane
+// converges whenever f is continuous.
+
+enum RootStatus {
+    ROOT_CONVERGED,
+    ROOT_MAX_ITERATIONS,
+    // f was inf or nan at an iterate, which leaves a bracket no side to keep;
+    // or f' was, without a bracket to fall back on
+    ROOT_NOT_FINITE,
+    // f' was zero at an iterate (without a bracket to fall back on)
+    ROOT_ZERO_DERIVATIVE,
+    // f has the same sign at both ends of the bracket
+    ROOT_NO_SIGN_CHANGE,
+};
+
+struct Root {
+    // the last evaluated iterate, or the step from it when that step was small
+    // enough to converge
+    double x;
+    // f at the last evaluated iterate
+    double f;
+    // evaluations of f and f' for this lane, including the two at the ends of a bracket
+    int iterations;
+    RootStatus status;
+};
+
+class NewtonSolver {
+    struct Lane {
+        double x;
+        double lo;
+        double hi;
+        bool bracketed;
+        // f(lo) < 0
+        bool negative_lo;
+        Root root;
+    };
+
+    Tape<double> tape;
+
+public:
+    // lanes solved in lockstep by one thread
+    static constexpr std::size_t CHUNK = 1024;
+
+    // a lane converges when a step is at most xtol * max(1, |x|), or |f| <= ftol
+    double xtol = 1e-12;
+    double ftol = 0;
+    int max_iterations = 50;
+    // 0 means one per hardware thread
+    unsigned threads = 1;
+
+    // solves `f` = 0 for `var`; `parameters` are the other variables, given per problem
+    NewtonSolver(const Expression<double>& f, const std::string& var, const std::vector<std::string>& parameters = {})
+        : tape(std::vector<Expression<double>>{f, f.diff(var)}, concat(var, parameters)) {}
+
+    // Newton from `x0[i]` with parameter set `parameters[i * count .. (i + 1) * count)`
+    void solve(const double* x0, const double* parameters, std::size_t n, Root* out) const {
+        std::vector<Lane> lanes(n);
+        for (std::size_t i = 0; i < n; i++) {
+            lanes[i] = {x0[i], 0, 0, false, false, {x0[i], NAN, 0, ROOT_MAX_ITERATIONS}};
+        }
+        run(lanes, parameters, out);
+    }
+
+    // safeguarded Newton inside [lo[i], hi[i]], starting from the midpoint
+    void solve_bracketed(const double* lo, const double* hi, const double* parameters, std::size_t n, Root* out) const {
+        std::vector<Lane> lanes(n);
+        for (std::size_t i = 0; i < n; i++) {
+            lanes[i] = {(lo[i] + hi[i]) / 2, std::min(lo[i], hi[i]), std::max(lo[i], hi[i]), true, false, {NAN, NAN, 0, ROOT_MAX_ITERATIONS}};
+        }
+        run(lanes, parameters, out);
+    }
+
+    Root solve(double x0, const std::vector<double>& parameters = {}) const {
+        check(parameters);
+        Root root;
+        solve(&x0, parameters.data(), 1, &root);
+        return root;
+    }
+
+    Root solve_bracketed(double lo, double hi, const std::vector<double>& parameters = {}) const {
+        check(parameters);
+        Root root;
+        solve_bracketed(&lo, &hi, parameters.data(), 1, &root);
+        return root;
+    }
+
+private:
+    static std::vector<std::string> concat(const std::string& var, const std::vector<std::string>& parameters) {
+        std::vector<std::string> vars = {var};
+        vars.insert(vars.end(), parameters.begin(), parameters.end());
+        return vars;
+    }
+
+    void check(const std::vector<double>& parameters) const {
+        if (parameters.size() != tape.vars.size() - 1) {
+            throw std::invalid_argument("Wrong number of parameters");
+        }
+    }
+
+    void run(std::vector<Lane>& lanes, const double* parameters, Root* out) const {
+        std::size_t chunks = (lanes.size() + CHUNK - 1) / CHUNK;
+        parallel_for(chunks, threads, [&](std::size_t c) {
+            std::size_t first = c * CHUNK;
+            std::size_t count = std::min(CHUNK, lanes.size() - first);
+            run_chunk(&lanes[first], count, parameters, first);
+            for (std::size_t i = first; i < first + count; i++) {
+                out[i] = lanes[i].root;
+            }
+        });
+    }
+
+    // evaluates f and f' at `xs[j]` for lane `active[j]` into `values[2 * j]`, `values[2 * j + 1]`
+    void evaluate(const std::vector<std::size_t>& active, const std::vector<double>& xs, const double* parameters,
+                  std::size_t offset, std::vector<double>& points, std::vector<double>& values) const {
+        std::size_t nvars = tape.vars.size();
+        std::size_t count = nvars - 1;
+        points.resize(xs.size() * nvars);
+        values.resize(xs.size() * 2);
+        for (std::size_t j = 0; j < xs.size(); j++) {
+            points[j * nvars] = xs[j];
+            const double* set = parameters + (offset + active[j % active.size()]) * count;
+            std::copy(set, set + count, &points[j * nvars + 1]);
+        }
+        tape.eval_batch_all(points.data(), xs.size(), values.data());
+    }
+
+    void run_chunk(Lane* lanes, std::size_t count, const double* parameters, std::size_t offset) const {
+        std::vector<std::size_t> active;
+        std::vector<double> xs, points, values;
+        for (std::size_t i = 0; i < count; i++) {
+            active.push_back(i);
+        }
+
+        // the signs at the ends of the brackets, lower ends first
+        if (count > 0 && lanes[0].bracketed) {
+            for (std::size_t i: active) xs.push_back(lanes[i].lo);
+            for (std::size_t i: active) xs.push_back(lanes[i].hi);
+            evaluate(active, xs, parameters, offset, points, values);
+            std::size_t kept = 0;
+            for (std::size_t j = 0; j < count; j++) {
+                Lane& lane = lanes[active[j]];
+                double flo = values[2 * j], fhi = values[2 * (j + count)];
+                if (flo == 0 || fhi == 0) {
+                    lane.root = {flo == 0 ? lane.lo : lane.hi, 0, 2, ROOT_CONVERGED};
+                } else if (!(std::signbit(flo) != std::signbit(fhi))) {
+                    lane.root = {lane.x, NAN, 2, ROOT_NO_SIGN_CHANGE};
+                } else {
+                    lane.root.iterations = 2;
+                    lane.negative_lo = flo < 0;
+                    active[kept++] = active[j];
+                }
+            }
+            active.resize(kept);
+        }
+
+        for (int iteration = 1; iteration <= max_iterations && !active.empty(); iteration++) {
+            xs.clear();
+            for (std::size_t i: active) xs.push_back(lanes[i].x);
+            evaluate(active, xs, parameters, offset, points, values);
+            std::size_t kept = 0;
+            for (std::size_t j = 0; j < active.size(); j++) {
+                Lane& lane = lanes[active[j]];
+                if (!step(lane, values[2 * j], values[2 * j + 1])) {
+                    active[kept++] = active[j];
+                }
+            }
+            active.resize(kept);
+        }
+        // root.x stays on the last evaluated iterate, to go with root.f
+        for (std::size_t i: active) {
+            lanes[i].root.status = ROOT_MAX_ITERATIONS;
+        }
+    }
+
+    // moves the lane to its next iterate; returns whether it's finished
+    bool step(Lane& lane, double f, double df) const {
+        lane.root = {lane.x, f, lane.root.iterations + 1, ROOT_CONVERGED};
+        if (std::abs(f) <= ftol) {
+            return true;
+        }
+        double next = lane.x - f / df;
+        if (lane.bracketed) {
+            // without a sign there's no telling which half holds the root, and the
+            // bisection fallback would be this same point again
+            if (!std::isfinite(f)) {
+                lane.root.status = ROOT_NOT_FINITE;
+                return true;
+            }
+            ((f < 0) == lane.negative_lo ? lane.lo : lane.hi) = lane.x;
+            if (!(next > lane.lo && next < lane.hi)) {
+                next = (lane.lo + lane.hi) / 2;
+            }
+            if (lane.hi - lane.lo <= xtol * std::max(1.0, std::abs(next))) {
+                lane.root.x = next;
+                return true;
+            }
+        } else if (!std::isfinite(f) || !std::isfinite(df)) {
+            lane.root.status = ROOT_NOT_FINITE;
+            return true;
+        } else if (df == 0) {
+            lane.root.status = ROOT_ZERO_DERIVATIVE;
+            return true;
+        }
+        double change = std::abs(next - lane.x);
+        lane.x = next;
+        if (change <= xtol * std::max(1.0, std::abs(next))) {
+            lane.root.x = next;
+            return true;
+        }
+        return false;
+    }
+};
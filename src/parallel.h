@@ -0,0 +1,35 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// 0 threads means one per hardware thread
+inline unsigned thread_count(unsigned threads) {
+    return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls `task(i)` for every i in [0, count) on up to `threads` threads, which
+// take the next index from a shared counter, so uneven tasks balance out.
+// Runs on the calling thread alone when one thread is enough.
+template<typename F>
+void parallel_for(std::size_t count, unsigned threads, F&& task) {
+    std::size_t workers = std::min<std::size_t>(thread_count(threads), count);
+    std::atomic<std::size_t> next = 0;
+    auto work = [&]() {
+        for (std::size_t i; (i = next++) < count;) {
+            task(i);
+        }
+    };
+    if (workers <= 1) {
+        work();
+        return;
+    }
+    std::vector<std::jthread> pool;
+    for (std::size_t i = 1; i < workers; i++) {
+        pool.emplace_back(work);
+    }
+    work();
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "parallel.h"
+#include "tape.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Evaluation of one large expression at a point on several threads, with the
+// same result, bit for bit, as eval() after substituting the values.
+//
+// The cost of every subtree is estimated once, when the evaluator is built.
+// Subtrees that cost no more than the grain are cut off and packed, in
+// evaluation order, into tasks of about one grain each, which are compiled to
+// tapes; what's left above them (the spine) is a list of operations on the
+// tasks' results. eval() runs the tasks with parallel_for, then the spine on
+// the calling thread. Every node still applies the same operation to the same
+// operand values, so neither the threads nor the order they finish in can
+// change the result.
+template<typename Number = DefaultNumber>
+class ParallelEval {
+    struct Task {
+        Tape<Number> tape;
+        // the outputs of the tape are results [first, first + tape.outputs.size())
+        std::size_t first;
+    };
+
+    // a spine operation; an operand `r` is spine step `r` if it's >= 0, and result `~r` otherwise
+    struct Step {
+        ExprKind kind;
+        std::int64_t lhs;
+        std::int64_t rhs;
+    };
+
+    std::vector<Task> tasks;
+    std::vector<Step> spine;
+    std::int64_t root = ~0;
+    std::size_t results = 0;
+
+public:
+    // the smallest automatic grain, so that a task outweighs starting it
+    static constexpr double MIN_GRAIN = 1 << 14;
+
+    std::vector<std::string> vars;
+    // 0 means one per hardware thread
+    unsigned threads;
+
+    // `grain` is the estimated cost of a task (about one per addition); 0 picks
+    // one that gives every thread several tasks
+    ParallelEval(const Expression<Number>& expr, std::vector<std::string> _vars = {}, unsigned _threads = 0, double grain = 0)
+        : vars(std::move(_vars)), threads(_threads)
+    {
+        auto costs = subtree_costs(expr);
+        if (grain <= 0) {
+            grain = std::max(MIN_GRAIN, costs.at(expr.inner.get()) / (thread_count(threads) * 8));
+        }
+
+        // the spine in post-order, and the subtrees cut off from it in evaluation order
+        std::vector<const Expression<Number>*> cut;
+        std::unordered_map<const Expr<Number>*, std::int64_t> refs;
+        auto ref = [&](const Expression<Number>& child) {
+            auto it = refs.find(child.inner.get());
+            if (it != refs.end()) {
+                return it->second;
+            }
+            cut.push_back(&child);
+            return refs[child.inner.get()] = ~std::int64_t(cut.size() - 1);
+        };
+        // a spine child is a step already; anything cheaper is cut off
+        auto operand_ref = [&](const Expression<Number>& child) {
+            return costs.at(child.inner.get()) > grain ? refs.at(child.inner.get()) : ref(child);
+        };
+        if (costs.at(expr.inner.get()) <= grain) {
+            root = ref(expr);
+        }
+        std::vector<const Expression<Number>*> stack;
+        if (cut.empty()) {
+            stack.push_back(&expr);
+        }
+        while (!stack.empty()) {
+            const Expr<Number>* node = stack.back()->inner.get();
+            if (refs.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = 2; i-- > 0;) {
+                if (children[i] && costs.at(children[i]->inner.get()) > grain && !refs.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]);
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            Step step{node->kind(), 0, 0};
+            step.lhs = operand_ref(*children[0]);
+            if (children[1]) {
+                step.rhs = operand_ref(*children[1]);
+            }
+            spine.push_back(step);
+            refs[node] = root = spine.size() - 1;
+        }
+
+        // consecutive cut subtrees are packed into tasks of about one grain
+        results = cut.size();
+        for (std::size_t begin = 0; begin < cut.size();) {
+            std::vector<Expression<Number>> exprs;
+            double cost = 0;
+            std::size_t end = begin;
+            while (end < cut.size() && (cost < grain || exprs.empty())) {
+                cost += costs.at(cut[end]->inner.get());
+                exprs.push_back(*cut[end++]);
+            }
+            tasks.push_back({Tape<Number>(exprs, vars), begin});
+            begin = end;
+        }
+    }
+
+    std::size_t task_count() const {
+        return tasks.size();
+    }
+
+    std::size_t spine_size() const {
+        return spine.size();
+    }
+
+    // evaluate with `values[i]` bound to `vars[i]`
+    Number eval(const Number* values) const {
+        using std::sin, std::cos, std::log, std::exp, std::pow;
+        std::vector<Number> result(results);
+        parallel_for(tasks.size(), threads, [&](std::size_t t) {
+            const Task& task = tasks[t];
+            std::vector<Number> scratch(task.tape.size());
+            task.tape.eval(values, scratch.data(), &result[task.first]);
+        });
+        std::vector<Number> steps(spine.size());
+        auto operand = [&](std::int64_t r) { return r >= 0 ? steps[r] : result[~r]; };
+        for (std::size_t i = 0; i < spine.size(); i++) {
+            const Step& step = spine[i];
+            switch (step.kind) {
+                case EXPR_SUM: steps[i] = operand(step.lhs) + operand(step.rhs); break;
+                case EXPR_NEG: steps[i] = -operand(step.lhs); break;
+                case EXPR_MUL: steps[i] = operand(step.lhs) * operand(step.rhs); break;
+                case EXPR_DIV: steps[i] = operand(step.lhs) / operand(step.rhs); break;
+                case EXPR_POW: steps[i] = pow(operand(step.lhs), operand(step.rhs)); break;
+                case EXPR_SIN: steps[i] = sin(operand(step.lhs)); break;
+                case EXPR_COS: steps[i] = cos(operand(step.lhs)); break;
+                case EXPR_LN: steps[i] = log(operand(step.lhs)); break;
+                case EXPR_EXP: steps[i] = exp(operand(step.lhs)); break;
+                // leaves are never on the spine
+                case EXPR_NUM:
+                case EXPR_VAR:
+                    break;
+            }
+        }
+        return operand(root);
+    }
+
+    Number eval() const {
+        return eval(nullptr);
+    }
+
+private:
+    // roughly proportional to the time eval() spends on the node itself
+    static double weight(ExprKind kind) {
+        switch (kind) {
+            case EXPR_DIV: return 4;
+            case EXPR_POW:
+            case EXPR_SIN:
+            case EXPR_COS:
+            case EXPR_LN:
+            case EXPR_EXP:
+                return 20;
+            default: return 1;
+        }
+    }
+
+    // the cost of evaluating each subtree as a tree, shared parts once per use
+    static std::unordered_map<const Expr<Number>*, double> subtree_costs(const Expression<Number>& expr) {
+        std::unordered_map<const Expr<Number>*, double> costs;
+        std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+        while (!stack.empty()) {
+            const Expr<Number>* node = stack.back();
+            if (costs.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (auto child: children) {
+                if (child && !costs.contains(child->inner.get())) {
+                    stack.push_back(child->inner.get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            double cost = weight(node->kind());
+            for (auto child: children) {
+                if (child) cost += costs.at(child->inner.get());
+            }
+            costs.emplace(node, cost);
+        }
+        return costs;
+    }
+};
@@ -1,144 +1,254 @@
 #pragma once
 
 #include "lexer.h"
+#include "mapped_file.h"
 #include "symexpr.h"
+#include <algorithm>
+#include <istream>
 #include <stdexcept>
+#include <string_view>
 #include <type_traits>
+#include <vector>
 
+// Operator precedence parsing with explicit stacks, so nesting depth is only
+// limited by memory: operands are built bottom-up as their operators are
+// reduced, and nothing but the two stacks outlives a token.
 template<typename Number = DefaultNumber>
 class Parser {
+    enum Op {
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_POW,
+        OP_NEG,
+        // an open parenthesis, alone or as a function call
+        OP_PAREN,
+        OP_SIN,
+        OP_COS,
+        OP_LN,
+        OP_EXP,
+    };
+
     Lexer lexer;
+    std::vector<Expression<Number>> operands;
+    // the current Budget, if any, and the height of each operand's tree, held to its max_depth
+    Budget* budget = nullptr;
+    std::vector<std::size_t> heights;
+    std::vector<Op> ops;
+    std::size_t open = 0;
 
 public:
-    Parser(std::string source) : lexer(std::move(source)) {}
+    // the source isn't copied and has to outlive the parser
+    Parser(std::string_view source) : lexer(source) {}
+
+    // reads the stream in chunks
+    Parser(std::istream& stream) : lexer(stream) {}
 
     Expression<Number> parse() {
-        auto expr = parse_sum();
-        if (!lexer.peek().is(TOK_EOF)) {
-            throw std::invalid_argument("Expected end of input");
+        budget = budget_detail::current;
+        while (true) {
+            parse_operand();
+            if (!parse_operator()) {
+                break;
+            }
         }
-        return expr;
+        while (!ops.empty()) {
+            reduce();
+        }
+        return std::move(operands.back());
+    }
+
+    Expression<Number> parse(Budget& budget) {
+        BudgetScope scope(budget);
+        return parse();
     }
 
 private:
-    Expression<Number> parse_sum() {
-        auto left = parse_product();
-        while (true) {
-            if (lexer.peek().str() == "+") {
-                lexer.consume();
-                left = left + parse_product();
-            } else if (lexer.peek().str() == "-") {
-                lexer.consume();
-                left = left - parse_product();
-            } else {
-                break;
-            }
+    static int precedence(Op op) {
+        switch (op) {
+            case OP_ADD: case OP_SUB: return 1;
+            case OP_MUL: case OP_DIV: return 2;
+            case OP_POW: return 3;
+            // -x ^ 2 is (-x) ^ 2
+            case OP_NEG: return 4;
+            default: return 0;
         }
-        return left;
     }
 
-    Expression<Number> parse_product() {
-        auto left = parse_power();
+    void push_operand(Expression<Number> operand) {
+        operands.push_back(std::move(operand));
+        if (budget) heights.push_back(1);
+    }
+
+    // prefix minuses and open parentheses, then a number, constant or variable
+    void parse_operand() {
         while (true) {
-            if (lexer.peek().str() == "*") {
+            const Token& tok = lexer.peek();
+
+            if (tok.str() == "-") {
                 lexer.consume();
-                left = left * parse_power();
-            } else if (lexer.peek().str() == "/") {
+                ops.push_back(OP_NEG);
+                continue;
+            }
+
+            if (tok.str() == "(") {
                 lexer.consume();
-                left = left / parse_power();
-            } else {
-                break;
+                ops.push_back(OP_PAREN);
+                open++;
+                continue;
             }
-        }
-        return left;
-    }
 
-    Expression<Number> parse_power() {
-        auto left = parse_unary();
-        if (lexer.peek().str() == "^") {
-            lexer.consume();
-            return pow(left, parse_power());
-        }
-        return left;
-    }
+            if (tok.is(TOK_NUMBER)) {
+                auto value = tok.value<real_t<Number>>();
+                Number literal = literal_value<Number>::make(value, tok.str());
+                lexer.consume();
+                if constexpr (std::is_same_v<Number, complex>) {
+                    if (lexer.peek().is(TOK_NAME) && lexer.peek() == "i") {
+                        lexer.consume();
+                        push_operand(Expression<complex>(complex(0, 1) * value));
+                        return;
+                    }
+                }
+                push_operand(Expression<Number>(literal));
+                return;
+            }
 
-    Expression<Number> parse_unary() {
-        if (lexer.peek().str() == "-") {
-            lexer.consume();
-            return -parse_unary();
-        }
-        return parse_atom();
-    }
+            if (tok.is(TOK_NAME)) {
+                std::string name(tok.str());
+                lexer.consume();
 
-    Expression<Number> parse_atom() {
-        Token tok = lexer.peek();
-        
-        if (tok.is(TOK_NUMBER)) {
-            lexer.consume();
-            if constexpr (std::is_same_v<Number, complex>) {
-                if (lexer.peek().is(TOK_NAME) && lexer.peek() == "i") {
+                if (lexer.peek().str() == "(") {
                     lexer.consume();
-                    return Expression<complex>(complex(0, 1) * tok.value());
+                    if (name == "sin") ops.push_back(OP_SIN);
+                    else if (name == "cos") ops.push_back(OP_COS);
+                    else if (name == "ln") ops.push_back(OP_LN);
+                    else if (name == "exp") ops.push_back(OP_EXP);
+                    else throw std::invalid_argument("Unknown function: " + name);
+                    open++;
+                    continue;
                 }
+
+                // Check for function names used without parentheses
+                if (name == "sin" || name == "cos" || name == "ln" || name == "exp") {
+                    throw std::invalid_argument("Function '" + name + "' must have an argument");
+                }
+
+                if (name == "pi") {
+                    push_operand(Expression<Number>(literal_value<Number>::make(M_PI, name)));
+                    return;
+                }
+                if (name == "e") {
+                    push_operand(Expression<Number>(literal_value<Number>::make(M_E, name)));
+                    return;
+                }
+                if constexpr (std::is_same_v<Number, complex>) {
+                    if (name == "i") {
+                        push_operand(Expression<complex>(complex(0, 1)));
+                        return;
+                    }
+                }
+
+                push_operand(Expression<Number>::var(name));
+                return;
             }
-            return Expression<Number>(tok.value());
+
+            throw std::invalid_argument("Unexpected token: " + std::string(tok.str()));
         }
-        
-        if (tok.is(TOK_NAME)) {
-            lexer.consume();
-            std::string name(tok.str());
-            
-            if (lexer.peek().str() == "(") {
+    }
+
+    // closing parentheses, then a binary operator (which is pushed) or the end;
+    // returns whether an operand follows
+    bool parse_operator() {
+        while (true) {
+            const Token& tok = lexer.peek();
+            Op op;
+            if (tok.str() == "+") op = OP_ADD;
+            else if (tok.str() == "-") op = OP_SUB;
+            else if (tok.str() == "*") op = OP_MUL;
+            else if (tok.str() == "/") op = OP_DIV;
+            else if (tok.str() == "^") op = OP_POW;
+            else if (tok.str() == ")" && open > 0) {
                 lexer.consume();
-                auto arg = parse_sum();
-                if (lexer.peek().str() != ")") {
-                    throw std::invalid_argument("Expected ')'");
+                while (ops.back() < OP_PAREN) {
+                    reduce();
                 }
-                lexer.consume();
-
-                if (name == "sin") return sin(arg);
-                if (name == "cos") return cos(arg);
-                if (name == "ln") return ln(arg);
-                if (name == "exp") return exp(arg);
-                
-                throw std::invalid_argument("Unknown function: " + name);
-            }
-    
-            // Check for function names used without parentheses
-            if (name == "sin" || name == "cos" || name == "ln" || name == "exp") {
-                throw std::invalid_argument("Function '" + name + "' must have an argument");
-            }
-    
-            if (name == "pi") {
-                return Expression<Number>(M_PI);
+                open--;
+                if (ops.back() == OP_PAREN) {
+                    ops.pop_back();
+                } else {
+                    reduce();
+                }
+                continue;
+            } else if (open > 0) {
+                throw std::invalid_argument("Expected ')'");
+            } else if (!tok.is(TOK_EOF)) {
+                throw std::invalid_argument("Expected end of input");
+            } else {
+                return false;
             }
-            if (name == "e") {
-                return Expression<Number>(M_E);
+
+            lexer.consume();
+            // ^ is right-associative, the rest are left-associative
+            while (!ops.empty() && (precedence(ops.back()) > precedence(op) || (op != OP_POW && precedence(ops.back()) == precedence(op)))) {
+                reduce();
             }
-            if constexpr (std::is_same_v<Number, complex>) {
-                if (name == "i") {
-                    return Expression<complex>(complex(0, 1));
-                }
+            ops.push_back(op);
+            return true;
+        }
+    }
+
+    // applies the operator on top of the stack to its operands
+    void reduce() {
+        Op op = ops.back();
+        ops.pop_back();
+        Expression<Number> arg = std::move(operands.back());
+        operands.pop_back();
+        if (budget) {
+            std::size_t height = heights.back() + 1;
+            heights.pop_back();
+            if (op < OP_SIN && op != OP_NEG) {
+                height = std::max(height, heights.back() + 1);
+                heights.pop_back();
             }
-            
-            return Expression<Number>::var(name);
+            heights.push_back(height);
+            budget->reach(height);
         }
-        
-        if (tok.str() == "(") {
-            lexer.consume();
-            auto expr = parse_sum();
-            if (lexer.peek().str() != ")") {
-                throw std::invalid_argument("Expected ')'");
+        if (op >= OP_SIN || op == OP_NEG) {
+            switch (op) {
+                case OP_NEG: arg = -arg; break;
+                case OP_SIN: arg = sin(arg); break;
+                case OP_COS: arg = cos(arg); break;
+                case OP_LN: arg = ln(arg); break;
+                default: arg = exp(arg); break;
             }
-            lexer.consume();
-            return expr;
+            operands.push_back(std::move(arg));
+            return;
+        }
+        Expression<Number>& left = operands.back();
+        switch (op) {
+            case OP_ADD: left = left + arg; break;
+            case OP_SUB: left = left - arg; break;
+            case OP_MUL: left = left * arg; break;
+            case OP_DIV: left = left / arg; break;
+            default: left = pow(left, arg); break;
         }
-        
-        throw std::invalid_argument("Unexpected token: " + std::string(tok.str()));
     }
 };
 
 template<typename Number = DefaultNumber>
-Expression<Number> parse(const std::string& source) {
+Expression<Number> parse(std::string_view source) {
     return Parser<Number>(source).parse();
-}
\ No newline at end of file
+}
+
+template<typename Number = DefaultNumber>
+Expression<Number> parse(std::istream& stream) {
+    return Parser<Number>(stream).parse();
+}
+
+// parses the file straight from a memory mapping
+template<typename Number = DefaultNumber>
+Expression<Number> parse_file(const std::string& path) {
+    MappedFile file(path);
+    return Parser<Number>(std::string_view(file.data(), file.size())).parse();
+}
@@ -0,0 +1,885 @@
+#pragma once
+
+#include "symexpr.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <compare>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Sparse multivariate polynomial: a coefficient per monomial, with each
+// monomial's exponents packed into a row of `exponents`. Terms are kept sorted
+// by their rows (lexicographically, over `vars` in order), with like terms
+// combined and zero terms dropped, so equal polynomials have equal
+// representations.
+//
+// Multiplication forms every pairwise product and merges them in one sort, and
+// evaluation is Horner's scheme nested over the variables, so a polynomial costs
+// about one multiplication and addition per term, plus squarings for the gaps
+// between exponents.
+template<typename Number = DefaultNumber>
+class Polynomial {
+public:
+    // number of points evaluated together by eval_batch
+    static constexpr std::size_t BATCH = 64;
+    // the largest total degree a product or power may have, far below where the
+    // 32-bit exponents would wrap around
+    static constexpr std::uint32_t MAX_DEGREE = 1 << 16;
+
+    std::vector<std::string> vars;
+    // the exponents of term `t` are exponents[t * vars.size() .. (t + 1) * vars.size())
+    std::vector<std::uint32_t> exponents;
+    std::vector<Number> coefficients;
+
+    explicit Polynomial(std::vector<std::string> _vars = {}) : vars(std::move(_vars)) {}
+
+    static Polynomial constant(std::vector<std::string> vars, Number value) {
+        Polynomial result(std::move(vars));
+        if (!(value == Number(0))) {
+            result.exponents.resize(result.vars.size());
+            result.coefficients.push_back(value);
+        }
+        return result;
+    }
+
+    // vars[i]
+    static Polynomial variable(std::vector<std::string> vars, std::size_t i) {
+        Polynomial result(std::move(vars));
+        result.exponents.resize(result.vars.size());
+        result.exponents[i] = 1;
+        result.coefficients.push_back(Number(1));
+        return result;
+    }
+
+    std::size_t terms() const {
+        return coefficients.size();
+    }
+
+    // about the nodes of the polynomial written as a sum of monomials: for every term,
+    // its coefficient unless that's 1, every variable in it (with its exponent and a `^`
+    // if that's above 1) and the products between them, plus the sums between the terms
+    std::size_t size() const {
+        std::size_t result = terms() == 0 ? 1 : terms() - 1;
+        for (std::size_t t = 0; t < terms(); t++) {
+            std::size_t factors = 0;
+            if (!(coefficients[t] == Number(1))) {
+                result++;
+                factors++;
+            }
+            for (std::size_t v = 0; v < vars.size(); v++) {
+                if (std::uint32_t e = row(t)[v]) {
+                    result += e > 1 ? 3 : 1;
+                    factors++;
+                }
+            }
+            result += factors == 0 ? 1 : factors - 1;
+        }
+        return result;
+    }
+
+    // the sum of `parts`, each negated if its flag is set, over `vars`, which must
+    // include all of their variables: their terms are gathered and sorted at once
+    static Polynomial sum(std::vector<std::string> vars, const std::vector<std::pair<bool, const Polynomial*>>& parts) {
+        Polynomial result(std::move(vars));
+        std::size_t nvars = result.vars.size();
+        // built the first time a part has other variables
+        std::unordered_map<std::string_view, std::size_t> index;
+        for (auto [negated, part]: parts) {
+            if (part->vars == result.vars) {
+                result.exponents.insert(result.exponents.end(), part->exponents.begin(), part->exponents.end());
+            } else {
+                if (index.empty()) {
+                    for (std::size_t v = 0; v < nvars; v++) {
+                        index.emplace(result.vars[v], v);
+                    }
+                }
+                // where each of the part's variables goes
+                std::vector<std::size_t> columns;
+                for (auto& var: part->vars) {
+                    auto it = index.find(var);
+                    if (it == index.end()) {
+                        throw std::invalid_argument("Polynomials over different variables");
+                    }
+                    columns.push_back(it->second);
+                }
+                for (std::size_t t = 0; t < part->terms(); t++) {
+                    result.exponents.resize(result.exponents.size() + nvars);
+                    std::uint32_t* row = result.exponents.data() + result.exponents.size() - nvars;
+                    for (std::size_t v = 0; v < columns.size(); v++) {
+                        row[columns[v]] = part->row(t)[v];
+                    }
+                }
+            }
+            for (const Number& c: part->coefficients) {
+                result.coefficients.push_back(negated ? -c : c);
+            }
+        }
+        result.normalize();
+        return result;
+    }
+
+    // the same polynomial over `vars`, which must include all of its own
+    Polynomial over(std::vector<std::string> vars) const {
+        return sum(std::move(vars), {{false, this}});
+    }
+
+    // the largest total degree of a term (0 for the zero polynomial)
+    std::uint32_t degree() const {
+        std::uint32_t result = 0;
+        for (std::size_t t = 0; t < terms(); t++) {
+            const std::uint32_t* row = &exponents[t * vars.size()];
+            result = std::max(result, std::accumulate(row, row + vars.size(), std::uint32_t(0)));
+        }
+        return result;
+    }
+
+    friend bool operator==(const Polynomial& a, const Polynomial& b) {
+        return a.vars == b.vars && a.exponents == b.exponents && a.coefficients == b.coefficients;
+    }
+
+    // by merging the sorted terms
+    friend Polynomial operator+(const Polynomial& a, const Polynomial& b) {
+        check(a, b);
+        Polynomial result(a.vars);
+        std::size_t i = 0, j = 0;
+        while (i < a.terms() || j < b.terms()) {
+            auto order = i == a.terms() ? std::strong_ordering::greater
+                       : j == b.terms() ? std::strong_ordering::less
+                       : std::lexicographical_compare_three_way(a.row(i), a.row(i) + a.vars.size(), b.row(j), b.row(j) + b.vars.size());
+            if (order < 0) {
+                result.append(a.row(i), a.coefficients[i]);
+                i++;
+            } else if (order > 0) {
+                result.append(b.row(j), b.coefficients[j]);
+                j++;
+            } else {
+                result.append(a.row(i), a.coefficients[i] + b.coefficients[j]);
+                i++;
+                j++;
+            }
+        }
+        return result;
+    }
+
+    friend Polynomial operator-(Polynomial a) {
+        for (auto& c: a.coefficients) {
+            c = -c;
+        }
+        return a;
+    }
+
+    friend Polynomial operator-(const Polynomial& a, const Polynomial& b) {
+        return a + -b;
+    }
+
+    friend Polynomial operator*(const Polynomial& a, const Polynomial& b) {
+        check(a, b);
+        check_degree(std::uint64_t(a.degree()) + b.degree());
+        std::size_t nvars = a.vars.size();
+        Polynomial result(a.vars);
+        result.exponents.resize(a.terms() * b.terms() * nvars);
+        result.coefficients.resize(a.terms() * b.terms());
+        std::size_t k = 0;
+        for (std::size_t i = 0; i < a.terms(); i++) {
+            for (std::size_t j = 0; j < b.terms(); j++, k++) {
+                for (std::size_t v = 0; v < nvars; v++) {
+                    result.exponents[k * nvars + v] = a.exponents[i * nvars + v] + b.exponents[j * nvars + v];
+                }
+                result.coefficients[k] = a.coefficients[i] * b.coefficients[j];
+            }
+        }
+        // multiplying by a monomial keeps the terms in order
+        if (a.terms() == 1 || b.terms() == 1) {
+            result.drop_zeros();
+        } else {
+            result.normalize();
+        }
+        return result;
+    }
+
+    // every coefficient divided by `value`
+    friend Polynomial operator/(Polynomial a, Number value) {
+        for (auto& c: a.coefficients) {
+            c = c / value;
+        }
+        a.drop_zeros();
+        return a;
+    }
+
+    // by repeated squaring
+    Polynomial pow(std::uint32_t n) const {
+        check_degree(std::uint64_t(degree()) * n);
+        Polynomial result = constant(vars, Number(1));
+        Polynomial square = *this;
+        for (; n > 0; n >>= 1) {
+            if (n & 1) result = result * square;
+            if (n > 1) square = square * square;
+        }
+        return result;
+    }
+
+    Polynomial diff(const std::string& name) const {
+        auto it = std::find(vars.begin(), vars.end(), name);
+        Polynomial result(vars);
+        if (it == vars.end()) {
+            return result;
+        }
+        std::size_t v = it - vars.begin(), nvars = vars.size();
+        // lowering one exponent in every row keeps them in order
+        for (std::size_t t = 0; t < terms(); t++) {
+            std::uint32_t e = exponents[t * nvars + v];
+            if (e == 0) {
+                continue;
+            }
+            result.exponents.insert(result.exponents.end(), &exponents[t * nvars], &exponents[(t + 1) * nvars]);
+            result.exponents[result.exponents.size() - nvars + v] = e - 1;
+            result.coefficients.push_back(coefficients[t] * Number(e));
+        }
+        return result;
+    }
+
+    // evaluate with `values[i]` bound to `vars[i]`
+    Number eval(const Number* values) const {
+        if (terms() == 0) {
+            return Number(0);
+        }
+        return horner<Number>(0, terms(), 0, [&](std::size_t t) { return coefficients[t]; },
+                              [&](std::size_t v) { return values[v]; });
+    }
+
+    // `points[p * vars.size() + i]` is vars[i] of point `p`. Each step of Horner's
+    // scheme runs over a block of BATCH points at once, in the same order as eval().
+    void eval_batch(const Number* points, std::size_t n, Number* out) const {
+        std::size_t nvars = vars.size();
+        std::vector<Number> xs(nvars * BATCH), scratch(2 * nvars * BATCH);
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            if (terms() == 0) {
+                std::fill(out + begin, out + begin + count, Number(0));
+                continue;
+            }
+            for (std::size_t v = 0; v < nvars; v++) {
+                for (std::size_t j = 0; j < count; j++) {
+                    xs[v * BATCH + j] = points[(begin + j) * nvars + v];
+                }
+            }
+            horner_block(0, terms(), 0, xs.data(), count, out + begin, scratch.data());
+        }
+    }
+
+    // in Horner form, e.g. (2 * x + y) * x + 1
+    Expression<Number> to_expression() const {
+        if (terms() == 0) {
+            return Expression<Number>(Number(0));
+        }
+        return horner<Expression<Number>>(0, terms(), 0, [&](std::size_t t) { return Expression<Number>(coefficients[t]); },
+                                          [&](std::size_t v) { return Expression<Number>::var(vars[v]); });
+    }
+
+private:
+    static void check(const Polynomial& a, const Polynomial& b) {
+        if (a.vars != b.vars) {
+            throw std::invalid_argument("Polynomials over different variables");
+        }
+    }
+
+    static void check_degree(std::uint64_t degree) {
+        if (degree > MAX_DEGREE) {
+            throw std::invalid_argument(std::format("A polynomial of degree {} is over the limit of {}", degree, MAX_DEGREE));
+        }
+    }
+
+    const std::uint32_t* row(std::size_t t) const {
+        return exponents.data() + t * vars.size();
+    }
+
+    // a term after the last one, unless its coefficient is zero
+    void append(const std::uint32_t* exponent_row, Number coefficient) {
+        if (!(coefficient == Number(0))) {
+            exponents.insert(exponents.end(), exponent_row, exponent_row + vars.size());
+            coefficients.push_back(coefficient);
+        }
+    }
+
+    // for terms that are already sorted and distinct
+    void drop_zeros() {
+        std::size_t nvars = vars.size(), kept = 0;
+        for (std::size_t t = 0; t < terms(); t++) {
+            if (!(coefficients[t] == Number(0))) {
+                std::copy_n(row(t), nvars, exponents.data() + kept * nvars);
+                coefficients[kept++] = coefficients[t];
+            }
+        }
+        exponents.resize(kept * nvars);
+        coefficients.resize(kept);
+    }
+
+    // sorts the terms by their exponents, combines like terms and drops zeros
+    void normalize() {
+        std::size_t nvars = vars.size();
+        std::vector<std::size_t> order(terms());
+        std::iota(order.begin(), order.end(), 0);
+        auto row = [&](std::size_t t) { return &exponents[t * nvars]; };
+        std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return std::lexicographical_compare(row(a), row(a) + nvars, row(b), row(b) + nvars);
+        });
+        std::vector<std::uint32_t> sorted_exponents;
+        std::vector<Number> sorted_coefficients;
+        for (std::size_t i = 0; i < order.size();) {
+            std::size_t t = order[i];
+            Number sum = coefficients[t];
+            for (i++; i < order.size() && std::equal(row(t), row(t) + nvars, row(order[i])); i++) {
+                sum = sum + coefficients[order[i]];
+            }
+            if (!(sum == Number(0))) {
+                sorted_exponents.insert(sorted_exponents.end(), row(t), row(t) + nvars);
+                sorted_coefficients.push_back(sum);
+            }
+        }
+        exponents = std::move(sorted_exponents);
+        coefficients = std::move(sorted_coefficients);
+    }
+
+    // acc * x ^ n, with x ^ n by squaring for numbers: from the highest bit of n
+    // down, square and multiply by x for every set bit (horner_block does the same)
+    template<typename T>
+    static T times_power(T acc, const T& x, std::uint32_t n) {
+        if constexpr (std::is_same_v<T, Expression<Number>>) {
+            // (pow is the member here)
+            return std::move(acc) * (n == 1 ? x : x ^ Expression<Number>(Number(n)));
+        } else {
+            if (n == 0) {
+                return acc;
+            }
+            T power = x;
+            for (int bit = std::bit_width(n) - 2; bit >= 0; bit--) {
+                power = power * power;
+                if (n >> bit & 1) power = power * x;
+            }
+            return acc * power;
+        }
+    }
+
+    // Horner's scheme in vars[v] over terms [begin, end), which agree on the
+    // exponents of the variables before it (so they're sorted by the exponent of vars[v])
+    template<typename T, typename Coefficient, typename Var>
+    T horner(std::size_t begin, std::size_t end, std::size_t v, const Coefficient& coefficient, const Var& var) const {
+        std::size_t nvars = vars.size();
+        if (v == nvars) {
+            return coefficient(begin);
+        }
+        std::optional<T> acc;
+        std::uint32_t previous = 0;
+        for (std::size_t group_end = end; group_end > begin;) {
+            std::uint32_t e = exponents[(group_end - 1) * nvars + v];
+            std::size_t group_begin = group_end - 1;
+            while (group_begin > begin && exponents[(group_begin - 1) * nvars + v] == e) {
+                group_begin--;
+            }
+            T inner = horner<T>(group_begin, group_end, v + 1, coefficient, var);
+            acc = acc ? times_power(std::move(*acc), var(v), previous - e) + inner : inner;
+            previous = e;
+            group_end = group_begin;
+        }
+        return previous == 0 ? *acc : times_power(std::move(*acc), var(v), previous);
+    }
+
+    // horner() for `count` points into `acc`; vars[v] of point `j` is xs[v * BATCH + j],
+    // and `scratch` holds 2 * BATCH numbers per variable from vars[v] on
+    void horner_block(std::size_t begin, std::size_t end, std::size_t v, const Number* xs, std::size_t count,
+                      Number* acc, Number* scratch) const {
+        std::size_t nvars = vars.size();
+        if (v == nvars) {
+            std::fill(acc, acc + count, coefficients[begin]);
+            return;
+        }
+        const Number* x = xs + v * BATCH;
+        Number* inner = scratch;
+        Number* power = scratch + BATCH;
+        // times_power() lane by lane
+        auto times_x = [&](std::uint32_t n) {
+            if (n == 0) {
+                return;
+            }
+            std::copy_n(x, count, power);
+            for (int bit = std::bit_width(n) - 2; bit >= 0; bit--) {
+                for (std::size_t j = 0; j < count; j++) power[j] = power[j] * power[j];
+                if (n >> bit & 1) {
+                    for (std::size_t j = 0; j < count; j++) power[j] = power[j] * x[j];
+                }
+            }
+            for (std::size_t j = 0; j < count; j++) acc[j] = acc[j] * power[j];
+        };
+        bool first = true;
+        std::uint32_t previous = 0;
+        for (std::size_t group_end = end; group_end > begin;) {
+            std::uint32_t e = exponents[(group_end - 1) * nvars + v];
+            std::size_t group_begin = group_end - 1;
+            while (group_begin > begin && exponents[(group_begin - 1) * nvars + v] == e) {
+                group_begin--;
+            }
+            if (first) {
+                horner_block(group_begin, group_end, v + 1, xs, count, acc, scratch + 2 * BATCH);
+                first = false;
+            } else {
+                horner_block(group_begin, group_end, v + 1, xs, count, inner, scratch + 2 * BATCH);
+                times_x(previous - e);
+                for (std::size_t j = 0; j < count; j++) acc[j] = acc[j] + inner[j];
+            }
+            previous = e;
+            group_end = group_begin;
+        }
+        times_x(previous);
+    }
+};
+
+// Converts expressions made of numbers, variables, +, -, *, division by a number
+// and powers with a constant nonnegative integer exponent into Polynomials over
+// `vars`, up to Polynomial::MAX_DEGREE. Results for shared subtrees are computed
+// once, and the terms of a sum (with the sums and negations in it flattened) are
+// added at once.
+//
+// A compact() converter, which Expression::diff() uses, instead gives every
+// polynomial the variables of its own subtree only, never multiplies out two
+// factors of more than one term (which would also lose the accuracy of a factored
+// form near its roots), and only converts a subtree whose polynomial's size() is
+// no larger than the subtree as a tree.
+template<typename Number = DefaultNumber>
+class PolynomialConverter {
+    struct Converted {
+        std::optional<Polynomial<Number>> polynomial;
+        // of the subtree as a tree, up to SIZE_MAX; only set along with `polynomial`
+        std::size_t nodes = 0;
+    };
+
+    std::size_t max_terms;
+    bool compact_form = false;
+    std::unordered_map<const Expr<Number>*, Converted> memo;
+
+public:
+    std::vector<std::string> vars;
+
+    // the largest exponent expanded by converting a power
+    static constexpr std::uint32_t MAX_EXPONENT = 1 << 10;
+
+    // expansions with more than `max_terms` terms count as not polynomial
+    PolynomialConverter(std::vector<std::string> _vars, std::size_t _max_terms = 1 << 12)
+        : max_terms(_max_terms), vars(std::move(_vars)) {}
+
+    static PolynomialConverter compact(std::size_t max_terms = 1 << 12) {
+        PolynomialConverter result({}, max_terms);
+        result.compact_form = true;
+        return result;
+    }
+
+    // the memoized result, valid as long as the converter
+    const std::optional<Polynomial<Number>>& operator()(const Expression<Number>& expr) {
+        return converted(expr).polynomial;
+    }
+
+private:
+    const Converted& converted(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        auto it = memo.find(node);
+        if (it != memo.end()) {
+            return it->second;
+        }
+        BudgetDepth depth;
+        Converted result = convert(expr);
+        auto& p = result.polynomial;
+        if (p && (p->terms() > max_terms || (compact_form && p->size() > result.nodes))) {
+            p.reset();
+        }
+        return memo.emplace(node, std::move(result)).first->second;
+    }
+
+    static std::size_t add(std::size_t a, std::size_t b) {
+        return a > SIZE_MAX - b ? SIZE_MAX : a + b;
+    }
+
+    // `op` on `a` and `b` over the same variables: the union of theirs, for a compact converter
+    template<typename Op>
+    static Polynomial<Number> combine(const Polynomial<Number>& a, const Polynomial<Number>& b, Op op) {
+        if (a.vars == b.vars) {
+            return op(a, b);
+        }
+        std::vector<std::string> both;
+        std::set_union(a.vars.begin(), a.vars.end(), b.vars.begin(), b.vars.end(), std::back_inserter(both));
+        return op(a.over(both), b.over(both));
+    }
+
+    Converted convert(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        switch (node->kind()) {
+            case EXPR_NUM:
+                return {Polynomial<Number>::constant(vars, static_cast<const NumExpr<Number>*>(node)->value), 1};
+            case EXPR_VAR: {
+                auto& name = static_cast<const VarExpr<Number>*>(node)->name;
+                if (compact_form) {
+                    return {Polynomial<Number>::variable({name}, 0), 1};
+                }
+                auto it = std::find(vars.begin(), vars.end(), name);
+                if (it == vars.end()) return {};
+                return {Polynomial<Number>::variable(vars, it - vars.begin()), 1};
+            }
+            case EXPR_SUM:
+            case EXPR_NEG:
+                return sum(expr);
+            case EXPR_MUL: {
+                auto v = static_cast<const MulExpr<Number>*>(node);
+                const auto& l = converted(v->lhs);
+                if (!l.polynomial) return {};
+                const auto& r = converted(v->rhs);
+                if (!r.polynomial || l.polynomial->terms() * r.polynomial->terms() > max_terms * 16) return {};
+                if (compact_form && l.polynomial->terms() > 1 && r.polynomial->terms() > 1) return {};
+                if (std::uint64_t(l.polynomial->degree()) + r.polynomial->degree() > Polynomial<Number>::MAX_DEGREE) return {};
+                return {combine(*l.polynomial, *r.polynomial, [](const auto& a, const auto& b) { return a * b; }),
+                        add(add(l.nodes, r.nodes), 1)};
+            }
+            case EXPR_DIV: {
+                auto v = static_cast<const DivExpr<Number>*>(node);
+                if (v->rhs.inner->kind() != EXPR_NUM) return {};
+                Number divisor = static_cast<const NumExpr<Number>*>(v->rhs.inner.get())->value;
+                if (divisor == Number(0)) return {};
+                const auto& l = converted(v->lhs);
+                if (!l.polynomial) return {};
+                return {*l.polynomial / divisor, add(l.nodes, 2)};
+            }
+            case EXPR_POW: {
+                auto v = static_cast<const PowExpr<Number>*>(node);
+                auto n = exponent(v->exponent);
+                if (!n) return {};
+                const auto& base = converted(v->base);
+                const auto& b = base.polynomial;
+                if (!b || !power_fits(b->terms(), *n)) return {};
+                if (compact_form && b->terms() > 1 && *n > 1) return {};
+                if (std::uint64_t(b->degree()) * *n > Polynomial<Number>::MAX_DEGREE) return {};
+                return {b->pow(*n), add(base.nodes, 2)};
+            }
+            case EXPR_SIN:
+            case EXPR_COS:
+            case EXPR_LN:
+            case EXPR_EXP:
+                return {};
+        }
+        return {};
+    }
+
+    // a sum or negation, with the sums and negations in it flattened
+    Converted sum(const Expression<Number>& expr) {
+        std::vector<std::pair<bool, const Polynomial<Number>*>> parts;
+        std::size_t nodes = 0;
+        std::vector<std::pair<bool, const Expression<Number>*>> stack = {{false, &expr}};
+        while (!stack.empty()) {
+            auto [negated, term] = stack.back();
+            stack.pop_back();
+            const Expr<Number>* node = term->inner.get();
+            if (node->kind() == EXPR_SUM) {
+                stack.push_back({negated, &static_cast<const SumExpr<Number>*>(node)->rhs});
+                stack.push_back({negated, &static_cast<const SumExpr<Number>*>(node)->lhs});
+                nodes = add(nodes, 1);
+            } else if (node->kind() == EXPR_NEG) {
+                stack.push_back({!negated, &static_cast<const NegExpr<Number>*>(node)->expr});
+                nodes = add(nodes, 1);
+            } else {
+                const Converted& part = converted(*term);
+                if (!part.polynomial) return {};
+                parts.push_back({negated, &*part.polynomial});
+                nodes = add(nodes, part.nodes);
+            }
+        }
+        std::vector<std::string> sum_vars = vars;
+        if (compact_form) {
+            for (auto [negated, part]: parts) {
+                sum_vars.insert(sum_vars.end(), part->vars.begin(), part->vars.end());
+            }
+            std::sort(sum_vars.begin(), sum_vars.end());
+            sum_vars.erase(std::unique(sum_vars.begin(), sum_vars.end()), sum_vars.end());
+        }
+        return {Polynomial<Number>::sum(std::move(sum_vars), parts), nodes};
+    }
+
+    // whether a polynomial of `terms` terms to the `n`th power surely has at most
+    // max_terms terms: it has at most C(n + terms - 1, terms - 1), one per way to pick n of them
+    bool power_fits(std::size_t terms, std::uint32_t n) const {
+        double count = 1;
+        for (std::size_t i = 1; i < terms; i++) {
+            count = count * (n + i) / i;
+            if (count > max_terms) return false;
+        }
+        return true;
+    }
+
+    static std::optional<std::uint32_t> exponent(const Expression<Number>& expr) {
+        if (expr.inner->kind() != EXPR_NUM) {
+            return {};
+        }
+        Number value = static_cast<const NumExpr<Number>*>(expr.inner.get())->value;
+        real_t<Number> re;
+        if constexpr (std::is_same_v<Number, complex>) {
+            if (value.imag() != 0) return {};
+            re = value.real();
+        } else {
+            re = value;
+        }
+        if (!(re >= 0 && re <= MAX_EXPONENT && re == std::trunc(re))) {
+            return {};
+        }
+        return std::uint32_t(re);
+    }
+};
+
+template<typename Number = DefaultNumber>
+std::optional<Polynomial<Number>> to_polynomial(const Expression<Number>& expr, std::vector<std::string> vars = {}) {
+    if (vars.empty()) {
+        vars = variables(expr);
+    }
+    return PolynomialConverter<Number>(std::move(vars))(expr);
+}
+
+// Rewrites the largest polynomial subtrees (see PolynomialConverter) into their
+// expanded, Horner form (see Polynomial::to_expression), so like terms are
+// combined; the rest of the tree is rebuilt with Expression's operators.
+template<typename Number = DefaultNumber>
+class PolynomialSimplifier {
+    PolynomialConverter<Number> converter;
+    std::unordered_map<const Expr<Number>*, Expression<Number>> memo;
+
+public:
+    PolynomialSimplifier(const Expression<Number>& root) : converter(variables(root)) {}
+
+    Expression<Number> operator()(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        auto it = memo.find(node);
+        if (it != memo.end()) {
+            return it->second;
+        }
+        BudgetDepth depth;
+        Expression<Number> result = simplify(expr);
+        memo.emplace(node, result);
+        return result;
+    }
+
+private:
+    Expression<Number> simplify(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        if (node->kind() == EXPR_NUM || node->kind() == EXPR_VAR) {
+            return expr;
+        }
+        if (const auto& p = converter(expr)) {
+            return p->to_expression();
+        }
+        switch (node->kind()) {
+            case EXPR_SUM: return simplify_sum(expr);
+            case EXPR_MUL: {
+                auto v = static_cast<const MulExpr<Number>*>(node);
+                return (*this)(v->lhs) * (*this)(v->rhs);
+            }
+            case EXPR_DIV: {
+                auto v = static_cast<const DivExpr<Number>*>(node);
+                return (*this)(v->lhs) / (*this)(v->rhs);
+            }
+            case EXPR_POW: {
+                auto v = static_cast<const PowExpr<Number>*>(node);
+                return pow((*this)(v->base), (*this)(v->exponent));
+            }
+            case EXPR_NEG: return simplify_sum(expr);
+            case EXPR_SIN: return sin((*this)(static_cast<const FunExpr<Number>*>(node)->expr));
+            case EXPR_COS: return cos((*this)(static_cast<const FunExpr<Number>*>(node)->expr));
+            case EXPR_LN: return ln((*this)(static_cast<const FunExpr<Number>*>(node)->expr));
+            case EXPR_EXP: return exp((*this)(static_cast<const FunExpr<Number>*>(node)->expr));
+            case EXPR_NUM:
+            case EXPR_VAR:
+                break;
+        }
+        return expr;
+    }
+
+    // the polynomial terms of a sum (with the sums and negations around them flattened)
+    // are combined into one, which goes first
+    Expression<Number> simplify_sum(const Expression<Number>& expr) {
+        Polynomial<Number> combined = Polynomial<Number>::constant(converter.vars, Number(0));
+        std::vector<std::pair<bool, Expression<Number>>> others;
+        std::vector<std::pair<bool, const Expression<Number>*>> stack = {{false, &expr}};
+        while (!stack.empty()) {
+            auto [negated, term] = stack.back();
+            stack.pop_back();
+            const Expr<Number>* node = term->inner.get();
+            if (node->kind() == EXPR_SUM) {
+                stack.push_back({negated, &static_cast<const SumExpr<Number>*>(node)->rhs});
+                stack.push_back({negated, &static_cast<const SumExpr<Number>*>(node)->lhs});
+            } else if (node->kind() == EXPR_NEG) {
+                stack.push_back({!negated, &static_cast<const NegExpr<Number>*>(node)->expr});
+            } else if (const auto& p = converter(*term)) {
+                combined = negated ? combined - *p : combined + *p;
+            } else {
+                others.push_back({negated, (*this)(*term)});
+            }
+        }
+        Expression<Number> result = combined.to_expression();
+        for (auto& [negated, term]: others) {
+            result = negated ? result - term : result + term;
+        }
+        return result;
+    }
+};
+
+template<typename Number = DefaultNumber>
+Expression<Number> simplify_polynomials(const Expression<Number>& expr) {
+    return PolynomialSimplifier<Number>(expr)(expr);
+}
+
+template<typename Number = DefaultNumber>
+Expression<Number> simplify_polynomials(const Expression<Number>& expr, Budget& budget) {
+    BudgetScope scope(budget);
+    return simplify_polynomials(expr);
+}
+
+// diff() that switches to Polynomial::diff for the largest polynomial subtrees
+// of at least `min_nodes` nodes (as trees), so e.g. the derivative of
+// (x + y) ^ 6 * sin(x) has the expanded derivative of the power rather than
+// nested product and chain rules. Other nodes follow the rules of diff_by_rules().
+//
+// Expression::diff() runs automatic(): subtrees of at least AUTO_NODES nodes,
+// converted by a compact PolynomialConverter, so only polynomials that are no
+// larger than their trees (such as sums of many like terms, or powers of x written
+// as products) are used. Their derivatives are polynomials in Horner form too, so
+// repeated derivatives and their tapes don't grow the way the product and chain
+// rules make them, and everything else is left as it was written.
+template<typename Number = DefaultNumber>
+class PolynomialDifferentiator {
+    std::string name;
+    std::size_t min_nodes;
+    PolynomialConverter<Number> converter;
+    std::unordered_map<const Expr<Number>*, Expression<Number>> memo;
+
+    PolynomialDifferentiator(std::string _name, std::size_t _min_nodes, PolynomialConverter<Number> _converter)
+        : name(std::move(_name)), min_nodes(_min_nodes), converter(std::move(_converter)) {}
+
+public:
+    // the smallest expressions and subtrees Expression::diff() converts
+    static constexpr std::size_t AUTO_NODES = 24;
+
+    PolynomialDifferentiator(const Expression<Number>& root, std::string _name, std::size_t _min_nodes = 0)
+        : PolynomialDifferentiator(std::move(_name), _min_nodes, PolynomialConverter<Number>(variables(root))) {}
+
+    // what Expression::diff() runs
+    static PolynomialDifferentiator automatic(std::string name) {
+        return PolynomialDifferentiator(std::move(name), AUTO_NODES, PolynomialConverter<Number>::compact());
+    }
+
+    // whether `node` has at least `n` nodes as a tree, counting no further
+    static bool has_nodes(const Expr<Number>* node, std::size_t n) {
+        count_down(node, n);
+        return n == 0;
+    }
+
+    Expression<Number> operator()(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        auto it = memo.find(node);
+        if (it != memo.end()) {
+            return it->second;
+        }
+        BudgetDepth depth;
+        Expression<Number> result = diff(expr);
+        memo.emplace(node, result);
+        return result;
+    }
+
+private:
+    Expression<Number> diff(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        if (node->kind() == EXPR_NUM || node->kind() == EXPR_VAR || !has_nodes(node, min_nodes)) {
+            return expr.diff_by_rules(name);
+        }
+        if (const auto& p = converter(expr)) {
+            return p->diff(name).to_expression();
+        }
+        auto& d = *this;
+        switch (node->kind()) {
+            case EXPR_SUM: {
+                auto v = static_cast<const SumExpr<Number>*>(node);
+                return d(v->lhs) + d(v->rhs);
+            }
+            case EXPR_NEG: return -d(static_cast<const NegExpr<Number>*>(node)->expr);
+            case EXPR_MUL: {
+                auto v = static_cast<const MulExpr<Number>*>(node);
+                return v->lhs * d(v->rhs) + v->rhs * d(v->lhs);
+            }
+            case EXPR_DIV: {
+                auto v = static_cast<const DivExpr<Number>*>(node);
+                return (v->rhs * d(v->lhs) - v->lhs * d(v->rhs)) / (v->rhs * v->rhs);
+            }
+            case EXPR_POW: {
+                auto v = static_cast<const PowExpr<Number>*>(node);
+                return expr * (v->exponent * d(v->base) / v->base + d(v->exponent) * ln(v->base));
+            }
+            case EXPR_SIN: {
+                auto& x = static_cast<const FunExpr<Number>*>(node)->expr;
+                return cos(x) * d(x);
+            }
+            case EXPR_COS: {
+                auto& x = static_cast<const FunExpr<Number>*>(node)->expr;
+                return -sin(x) * d(x);
+            }
+            case EXPR_LN: {
+                auto& x = static_cast<const FunExpr<Number>*>(node)->expr;
+                return d(x) / x;
+            }
+            case EXPR_EXP: {
+                auto& x = static_cast<const FunExpr<Number>*>(node)->expr;
+                return expr * d(x);
+            }
+            case EXPR_NUM:
+            case EXPR_VAR:
+                break;
+        }
+        return expr.diff_by_rules(name);
+    }
+
+    static void count_down(const Expr<Number>* node, std::size_t& n) {
+        if (n == 0) {
+            return;
+        }
+        n--;
+        auto children = operands(node);
+        for (std::size_t i = 0; i < operand_count(node->kind()); i++) {
+            count_down(children[i]->inner.get(), n);
+        }
+    }
+};
+
+template<typename Number>
+Expression<Number> Expression<Number>::diff(const std::string& name) const {
+    constexpr std::size_t min_nodes = PolynomialDifferentiator<Number>::AUTO_NODES;
+    // only plain (real or complex) numbers: expanding bounds (see interval.h) would change what they enclose
+    constexpr bool plain = std::is_same_v<Number, real_t<Number>> || std::is_same_v<Number, std::complex<real_t<Number>>>;
+    if constexpr (plain) {
+        if (PolynomialDifferentiator<Number>::has_nodes(inner.get(), min_nodes)) {
+            return PolynomialDifferentiator<Number>::automatic(name)(*this);
+        }
+    }
+    return diff_by_rules(name);
+}
+
+template<typename Number = DefaultNumber>
+Expression<Number> diff_polynomials(const Expression<Number>& expr, const std::string& name) {
+    return PolynomialDifferentiator<Number>(expr, name)(expr);
+}
+
+template<typename Number = DefaultNumber>
+Expression<Number> diff_polynomials(const Expression<Number>& expr, const std::string& name, Budget& budget) {
+    BudgetScope scope(budget);
+    return diff_polynomials(expr, name);
+}
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "tape.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Ticks are TSC cycles on x86, and steady_clock nanoseconds everywhere else.
+#if defined(__x86_64__) || defined(__i386__)
+#define SYMEXPR_PROFILE_TSC 1
+#include <x86intrin.h>
+#else
+#define SYMEXPR_PROFILE_TSC 0
+#endif
+
+namespace profile_detail {
+
+inline std::uint64_t ticks() {
+#if SYMEXPR_PROFILE_TSC
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+} // namespace profile_detail
+
+// Evaluation that measures where the time goes, node by node.
+//
+// The expression is flattened like a Tape, but with one instruction per distinct
+// node (nothing is merged by value), so every cost belongs to a node of `expr`.
+// eval_batch() runs the instructions over blocks of BATCH points, and one block
+// in `sample_every` reads the tick counter around each instruction; the others
+// run at full speed, and the costs are scaled up from the sampled points.
+//
+// A subtree's cost is its nodes' own costs. A node shared by several parents is
+// computed once per point, so it's charged to one of them (the first to be
+// computed), as a tree: that's what the totals, annotate() and folded() use.
+template<typename Number = DefaultNumber>
+class Profiler {
+    using Instr = typename Tape<Number>::Instr;
+
+public:
+    static constexpr std::size_t BATCH = Tape<Number>::BATCH;
+    // no parent: the root
+    static constexpr std::uint32_t NONE = UINT32_MAX;
+
+    struct NodeProfile {
+        Expression<Number> expr;
+        // its index in profile(), as to_string() takes it
+        std::uint32_t slot;
+        // the node this one is charged to, or NONE
+        std::uint32_t parent;
+        // how many times the node was computed
+        std::size_t calls;
+        // how many times eval() on the tree would compute it per point, once for every path to it
+        double tree_calls;
+        // estimated ticks in the node itself, and in its subtree
+        double self;
+        double total;
+    };
+
+    std::vector<std::string> vars;
+    // a block in `sample_every` is timed; 1 times all of them
+    std::size_t sample_every = 8;
+    // let eval_batch use the vecmath.h kernels, as Tape::vector_math does
+    bool vector_math = false;
+
+    Profiler(const Expression<Number>& expr, std::vector<std::string> _vars) : vars(std::move(_vars)) {
+        emit(expr);
+        std::vector<double> paths(code.size(), 0);
+        paths.back() = 1;
+        // parents come after their operands
+        for (std::size_t i = code.size(); i-- > 0;) {
+            for (std::size_t j = 0; j < operand_count(code[i].kind); j++) {
+                paths[code[i].operand(j)] += paths[i];
+            }
+        }
+        tree_calls = std::move(paths);
+        sampled_ticks.assign(code.size(), 0);
+    }
+
+    std::size_t size() const {
+        return code.size();
+    }
+
+    // evaluate `n` points stored row by row (`points[p * vars.size() + i]` is `vars[i]` of point `p`)
+    // into `out`, with the same results as Tape::eval_batch
+    void eval_batch(const Number* points, std::size_t n, Number* out) {
+        std::vector<Number> scratch(code.size() * BATCH);
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            if (blocks++ % std::max<std::size_t>(sample_every, 1) == 0) {
+                run_block<true>(points + begin * vars.size(), count, scratch.data());
+                sampled_points += count;
+            } else {
+                run_block<false>(points + begin * vars.size(), count, scratch.data());
+            }
+            std::copy_n(&scratch[(code.size() - 1) * BATCH], count, out + begin);
+            evaluated += count;
+        }
+    }
+
+    // forget what was measured so far
+    void reset() {
+        std::fill(sampled_ticks.begin(), sampled_ticks.end(), 0);
+        blocks = sampled_points = evaluated = 0;
+    }
+
+    // every node, operands before the nodes using them (so the root is last)
+    std::vector<NodeProfile> profile() const {
+        std::vector<NodeProfile> result;
+        double scale = sampled_points ? double(evaluated) / sampled_points : 0;
+        for (std::size_t i = 0; i < code.size(); i++) {
+            double self = sampled_ticks[i] * scale;
+            result.push_back({nodes[i], std::uint32_t(i), parents[i], evaluated, tree_calls[i], self, self});
+        }
+        for (std::size_t i = 0; i + 1 < result.size(); i++) {
+            result[parents[i]].total += result[i].total;
+        }
+        return result;
+    }
+
+    // the `n` subtrees with the largest totals, largest first
+    std::vector<NodeProfile> heaviest(std::size_t n) const {
+        std::vector<NodeProfile> result = profile();
+        n = std::min(n, result.size());
+        std::partial_sort(result.begin(), result.begin() + n, result.end(), [](const auto& a, const auto& b) {
+            return a.total > b.total;
+        });
+        result.erase(result.begin() + n, result.end());
+        return result;
+    }
+
+    // to_string() of the expression, with every subtree but the whole that takes at least
+    // `min_share` of the time wrapped as `{subtree : 12.5%}`
+    std::string annotate(double min_share = 0.05) const {
+        std::vector<NodeProfile> profiled = profile();
+        double total = profiled.back().total;
+        std::vector<double> share(profiled.size());
+        for (std::size_t i = 0; i < profiled.size(); i++) {
+            share[i] = total > 0 ? profiled[i].total / total : 0;
+        }
+        return annotated(code.size() - 1, share, min_share);
+    }
+
+    // to_string() of the node in `slot`, which unlike it doesn't recurse on deep trees
+    std::string to_string(std::size_t slot) const {
+        return annotated(slot, {}, 0);
+    }
+
+    // the costs as a flame graph's folded stacks: a line per node, with the nodes
+    // from the root down to it separated by `;`, a space and its own ticks
+    std::string folded() const {
+        std::vector<NodeProfile> profiled = profile();
+        std::vector<std::string> stacks(profiled.size());
+        std::string result;
+        for (std::size_t i = profiled.size(); i-- > 0;) {
+            std::string frame = label(i);
+            stacks[i] = parents[i] == NONE ? frame : stacks[parents[i]] + ";" + frame;
+            result += std::format("{} {}\n", stacks[i], std::llround(profiled[i].self));
+        }
+        return result;
+    }
+
+private:
+    std::vector<Number> constants;
+    std::vector<Instr> code;
+    std::vector<Expression<Number>> nodes;
+    std::vector<std::uint32_t> parents;
+    std::vector<double> tree_calls;
+    std::vector<std::uint64_t> sampled_ticks;
+    std::size_t blocks = 0;
+    std::size_t sampled_points = 0;
+    std::size_t evaluated = 0;
+
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack
+    void emit(const Expression<Number>& expr) {
+        std::unordered_map<const Expr<Number>*, std::uint32_t> visited;
+        std::vector<const Expression<Number>*> stack = {&expr};
+        while (!stack.empty()) {
+            const Expression<Number>* top = stack.back();
+            const Expr<Number>* node = top->inner.get();
+            if (visited.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!visited.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]);
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            Instr ins{node->kind(), 0, 0};
+            switch (node->kind()) {
+                case EXPR_NUM:
+                    ins.lhs = constants.size();
+                    constants.push_back(static_cast<const NumExpr<Number>*>(node)->value);
+                    break;
+                case EXPR_VAR: {
+                    auto& name = static_cast<const VarExpr<Number>*>(node)->name;
+                    auto var = std::find(vars.begin(), vars.end(), name);
+                    if (var == vars.end()) {
+                        throw std::invalid_argument(std::format("Can't evaluate an unknown `{}`", name));
+                    }
+                    ins.lhs = var - vars.begin();
+                    break;
+                }
+                default:
+                    ins.lhs = visited.at(children[0]->inner.get());
+                    if (children[1]) {
+                        ins.rhs = visited.at(children[1]->inner.get());
+                    }
+                    break;
+            }
+            std::uint32_t slot = code.size();
+            code.push_back(ins);
+            nodes.push_back(*top);
+            parents.push_back(NONE);
+            for (std::size_t j = 0; j < operand_count(ins.kind); j++) {
+                if (parents[ins.operand(j)] == NONE) {
+                    parents[ins.operand(j)] = slot;
+                }
+            }
+            visited.emplace(node, slot);
+        }
+    }
+
+    // evaluate `count` <= BATCH points into `scratch`, slot `i` of point `j` at `scratch[i * BATCH + j]`
+    template<bool timed>
+    void run_block(const Number* block, std::size_t count, Number* scratch) {
+        std::uint64_t start = timed ? profile_detail::ticks() : 0;
+        for (std::size_t i = 0; i < code.size(); i++) {
+            Tape<Number>::run_instr(code[i], constants.data(), block, vars.size(), scratch, &scratch[i * BATCH], count, vector_math);
+            if constexpr (timed) {
+                // one read per instruction: its end is the next one's start
+                std::uint64_t end = profile_detail::ticks();
+                sampled_ticks[i] += end - start;
+                start = end;
+            }
+        }
+    }
+
+    // to_string() of node `i`, with the same parentheses, and the operands whose `share`
+    // is at least `min_share` annotated (none if `share` is empty). It's written out in
+    // order from an explicit stack of slots and text, so it takes time linear in its
+    // length however deep the tree is, and stops once it's longer than `max_length`.
+    std::string annotated(std::size_t i, const std::vector<double>& share, double min_share,
+                          std::size_t max_length = std::string::npos) const {
+        struct Piece {
+            // NONE for `text`
+            std::uint32_t slot;
+            std::string text;
+        };
+        std::string result;
+        std::vector<Piece> stack = {{std::uint32_t(i), {}}};
+        while (!stack.empty() && result.size() <= max_length) {
+            Piece piece = std::move(stack.back());
+            stack.pop_back();
+            if (piece.slot == NONE) {
+                result += piece.text;
+                continue;
+            }
+            const Expr<Number>* node = nodes[piece.slot].inner.get();
+            std::string prefix, infix, suffix;
+            switch (node->kind()) {
+                case EXPR_NUM:
+                case EXPR_VAR:
+                    result += node->to_string();
+                    continue;
+                case EXPR_SUM: infix = " + "; break;
+                case EXPR_MUL: infix = " * "; break;
+                case EXPR_DIV: infix = " / "; break;
+                case EXPR_POW: infix = " ^ "; break;
+                case EXPR_NEG: prefix = "-"; break;
+                case EXPR_SIN: prefix = "sin("; suffix = ")"; break;
+                case EXPR_COS: prefix = "cos("; suffix = ")"; break;
+                case EXPR_LN: prefix = "ln("; suffix = ")"; break;
+                case EXPR_EXP: prefix = "exp("; suffix = ")"; break;
+            }
+            // pushed in reverse, so they come off the stack in order
+            auto children = operands(node);
+            stack.push_back({NONE, std::move(suffix)});
+            for (std::size_t k = operand_count(node->kind()); k-- > 0;) {
+                std::uint32_t slot = code[piece.slot].operand(k);
+                std::string open, close;
+                // a function's argument is in its own parentheses already
+                if (node->kind() < EXPR_SIN && children[k]->precedence() < node->precedence()) {
+                    open = "(";
+                    close = ")";
+                }
+                bool leaf = code[slot].kind == EXPR_NUM || code[slot].kind == EXPR_VAR;
+                if (!share.empty() && share[slot] >= min_share && !leaf) {
+                    open = "{" + open;
+                    close += std::format(" : {:.1f}%}}", 100 * share[slot]);
+                }
+                stack.push_back({NONE, std::move(close)});
+                stack.push_back({slot, {}});
+                stack.push_back({NONE, std::move(open)});
+                if (k > 0) {
+                    stack.push_back({NONE, infix});
+                }
+            }
+            stack.push_back({NONE, std::move(prefix)});
+        }
+        return result;
+    }
+
+    // a frame name: the subtree itself if it's short, otherwise its operator and slot
+    std::string label(std::size_t i) const {
+        // stops as soon as it's too long, however large the subtree is
+        std::string text = annotated(i, {}, 0, 40);
+        if (text.size() <= 40) {
+            return text;
+        }
+        switch (code[i].kind) {
+            case EXPR_SUM: return std::format("+ #{}", i);
+            case EXPR_MUL: return std::format("* #{}", i);
+            case EXPR_DIV: return std::format("/ #{}", i);
+            case EXPR_POW: return std::format("^ #{}", i);
+            case EXPR_NEG: return std::format("- #{}", i);
+            case EXPR_SIN: return std::format("sin #{}", i);
+            case EXPR_COS: return std::format("cos #{}", i);
+            case EXPR_LN: return std::format("ln #{}", i);
+            case EXPR_EXP: return std::format("exp #{}", i);
+            default: return std::format("#{}", i);
+        }
+    }
+};
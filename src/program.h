@@ -0,0 +1,163 @@
+#pragma once
+
+#include "tape.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Evaluation schedule for many outputs over the same variables, such as the
+// components of a gradient. The expressions are merged into one Tape, so every
+// distinct subexpression is computed once for all of them, and then each value
+// is given a register that's reused as soon as its last reader has run. Outputs
+// are written to the caller's array right after they're computed, so the
+// scratch space is the largest set of values alive at once rather than one
+// slot per subexpression, which keeps it in cache for hundreds of outputs.
+template<typename Number = DefaultNumber>
+class Program {
+public:
+    struct Instr {
+        ExprKind kind;
+        std::uint32_t dst;
+        // operand registers; for EXPR_NUM `lhs` indexes `constants`, for EXPR_VAR it indexes `vars`
+        std::uint32_t lhs;
+        std::uint32_t rhs;
+        // outputs written after this instruction: stores[first_store .. next instruction's first_store)
+        std::uint32_t first_store;
+    };
+
+    struct Store {
+        std::uint32_t reg;
+        std::uint32_t output;
+    };
+
+    // number of points evaluated together by eval_batch
+    static constexpr std::size_t BATCH = Tape<Number>::BATCH;
+
+    std::vector<std::string> vars;
+    std::vector<Number> constants;
+    std::vector<Instr> code;
+    std::vector<Store> stores;
+    std::size_t registers = 0;
+    std::size_t outputs = 0;
+    // let eval_batch use the vecmath.h kernels, as Tape::vector_math does
+    bool vector_math = false;
+
+    Program(const std::vector<Expression<Number>>& exprs, std::vector<std::string> _vars)
+        : Program(Tape<Number>(exprs, std::move(_vars))) {}
+
+    explicit Program(const Tape<Number>& tape)
+        : vars(tape.vars), constants(tape.constants), outputs(tape.outputs.size()), vector_math(tape.vector_math) {
+        std::size_t n = tape.code.size();
+        // the last instruction reading each slot (itself if none does)
+        std::vector<std::uint32_t> last_use(n);
+        for (std::uint32_t i = 0; i < n; i++) {
+            last_use[i] = i;
+            for (std::size_t j = 0; j < operand_count(tape.code[i].kind); j++) {
+                last_use[tape.code[i].operand(j)] = i;
+            }
+        }
+        std::vector<std::vector<std::uint32_t>> outputs_of(n);
+        for (std::uint32_t k = 0; k < outputs; k++) {
+            outputs_of[tape.outputs[k]].push_back(k);
+        }
+
+        std::vector<std::uint32_t> reg(n);
+        // freed registers, the most recently freed (so still in cache) on top
+        std::vector<std::uint32_t> free;
+        for (std::uint32_t i = 0; i < n; i++) {
+            const auto& ins = tape.code[i];
+            // taken before the operands are released, so the kernels never alias
+            if (free.empty()) {
+                reg[i] = registers++;
+            } else {
+                reg[i] = free.back();
+                free.pop_back();
+            }
+            Instr out{ins.kind, reg[i], ins.lhs, ins.rhs, std::uint32_t(stores.size())};
+            std::size_t arity = operand_count(ins.kind);
+            if (arity > 0) out.lhs = reg[ins.lhs];
+            if (arity > 1) out.rhs = reg[ins.rhs];
+            code.push_back(out);
+            for (std::uint32_t k: outputs_of[i]) {
+                stores.push_back({reg[i], k});
+            }
+            for (std::size_t j = 0; j < arity; j++) {
+                bool repeated = j == 1 && ins.lhs == ins.rhs;
+                if (last_use[ins.operand(j)] == i && !repeated) {
+                    free.push_back(reg[ins.operand(j)]);
+                }
+            }
+            if (last_use[i] == i) {
+                free.push_back(reg[i]);
+            }
+        }
+    }
+
+    std::size_t size() const {
+        return code.size();
+    }
+
+    // evaluate with `values[i]` bound to `vars[i]`, writing output `k` to `out[k]`.
+    // `scratch` must hold `registers` numbers.
+    void eval(const Number* values, Number* scratch, Number* out) const {
+        using std::sin, std::cos, std::log, std::exp, std::pow;
+        for (std::size_t i = 0; i < code.size(); i++) {
+            const Instr& ins = code[i];
+            Number& dst = scratch[ins.dst];
+            switch (ins.kind) {
+                case EXPR_NUM: dst = constants[ins.lhs]; break;
+                case EXPR_VAR: dst = values[ins.lhs]; break;
+                case EXPR_SUM: dst = scratch[ins.lhs] + scratch[ins.rhs]; break;
+                case EXPR_NEG: dst = -scratch[ins.lhs]; break;
+                case EXPR_MUL: dst = scratch[ins.lhs] * scratch[ins.rhs]; break;
+                case EXPR_DIV: dst = scratch[ins.lhs] / scratch[ins.rhs]; break;
+                case EXPR_POW: dst = pow(scratch[ins.lhs], scratch[ins.rhs]); break;
+                case EXPR_SIN: dst = sin(scratch[ins.lhs]); break;
+                case EXPR_COS: dst = cos(scratch[ins.lhs]); break;
+                case EXPR_LN: dst = log(scratch[ins.lhs]); break;
+                case EXPR_EXP: dst = exp(scratch[ins.lhs]); break;
+            }
+            for (std::size_t s = ins.first_store; s < stores_end(i); s++) {
+                out[stores[s].output] = scratch[stores[s].reg];
+            }
+        }
+    }
+
+    void eval(const Number* values, Number* out) const {
+        std::vector<Number> scratch(registers);
+        eval(values, scratch.data(), out);
+    }
+
+    // evaluate `n` points stored row by row (`points[p * vars.size() + i]` is `vars[i]` of point `p`);
+    // `out[p * outputs + k]` is output `k` of point `p`, as with Tape::eval_batch_all
+    void eval_batch(const Number* points, std::size_t n, Number* out) const {
+        std::vector<Number> scratch(registers * BATCH);
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            run_block(points + begin * vars.size(), count, scratch.data(), out + begin * outputs);
+        }
+    }
+
+private:
+    std::size_t stores_end(std::size_t i) const {
+        return i + 1 < code.size() ? code[i + 1].first_store : stores.size();
+    }
+
+    // evaluate `count` <= BATCH points, register `r` of point `j` at `scratch[r * BATCH + j]`
+    void run_block(const Number* block, std::size_t count, Number* scratch, Number* out) const {
+        for (std::size_t i = 0; i < code.size(); i++) {
+            const Instr& ins = code[i];
+            Number* dst = &scratch[ins.dst * BATCH];
+            // the operands are registers, which index `scratch` just like Tape's slots
+            Tape<Number>::run_instr({ins.kind, ins.lhs, ins.rhs}, constants.data(), block, vars.size(), scratch, dst, count,
+                                    vector_math);
+            for (std::size_t s = ins.first_store; s < stores_end(i); s++) {
+                for (std::size_t j = 0; j < count; j++) {
+                    out[j * outputs + stores[s].output] = dst[j];
+                }
+            }
+        }
+    }
+};
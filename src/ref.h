@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Intrusive reference counting for immutable objects such as expression nodes.
+//
+// The count lives in the object and is a plain integer, so copying a Ref is one
+// increment with no atomic instruction. An object that may be referenced from
+// several threads at once has to be marked with share_across_threads() before
+// it's handed over; from then on its count is updated atomically.
+class RefCounted {
+    template<typename T>
+    friend class Ref;
+
+    mutable std::uint32_t refs = 0;
+    mutable bool shared = false;
+
+    void retain() const {
+        if (shared) {
+            std::atomic_ref<std::uint32_t>(refs).fetch_add(1, std::memory_order_relaxed);
+        } else {
+            refs++;
+        }
+    }
+
+    // whether that was the last reference
+    bool release() const {
+        if (shared) {
+            return std::atomic_ref<std::uint32_t>(refs).fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+        return --refs == 0;
+    }
+
+public:
+    // makes the count atomic; the object must not be in use by other threads yet
+    void share_across_threads() const {
+        shared = true;
+    }
+
+    bool shared_across_threads() const {
+        return shared;
+    }
+
+    std::uint32_t ref_count() const {
+        return shared ? std::atomic_ref<std::uint32_t>(refs).load(std::memory_order_acquire) : refs;
+    }
+
+protected:
+    RefCounted() = default;
+    // a copy is a new object, with no references yet
+    RefCounted(const RefCounted&) {}
+    RefCounted& operator=(const RefCounted&) {
+        return *this;
+    }
+    ~RefCounted() = default;
+};
+
+// Owning pointer to a RefCounted `T`, which is deleted through `T*` (so `T`
+// needs a virtual destructor if it's a base).
+template<typename T>
+class Ref {
+    template<typename U>
+    friend class Ref;
+
+    T* ptr = nullptr;
+
+public:
+    Ref() = default;
+
+    Ref(std::nullptr_t) {}
+
+    // takes a reference to `p`, which must be heap-allocated and owned by Refs only
+    explicit Ref(T* p) : ptr(p) {
+        if (ptr) ptr->retain();
+    }
+
+    Ref(const Ref& other) : ptr(other.ptr) {
+        if (ptr) ptr->retain();
+    }
+
+    Ref(Ref&& other) noexcept : ptr(std::exchange(other.ptr, nullptr)) {}
+
+    template<typename U> requires std::convertible_to<U*, T*>
+    Ref(const Ref<U>& other) : ptr(other.ptr) {
+        if (ptr) ptr->retain();
+    }
+
+    template<typename U> requires std::convertible_to<U*, T*>
+    Ref(Ref<U>&& other) noexcept : ptr(std::exchange(other.ptr, nullptr)) {}
+
+    Ref& operator=(Ref other) noexcept {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+
+    ~Ref() {
+        if (ptr && ptr->release()) {
+            destroy(ptr);
+        }
+    }
+
+    T* get() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    T* operator->() const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+    friend bool operator==(const Ref& lhs, const Ref& rhs) {
+        return lhs.ptr == rhs.ptr;
+    }
+
+private:
+    // Deleting an object releases the Refs it holds. Objects freed by that are
+    // queued and deleted by the outermost call, so a deep chain doesn't recurse.
+    static void destroy(T* p) {
+        thread_local std::vector<T*> pending;
+        thread_local bool destroying = false;
+        if (destroying) {
+            pending.push_back(p);
+            return;
+        }
+        destroying = true;
+        delete p;
+        while (!pending.empty()) {
+            T* next = pending.back();
+            pending.pop_back();
+            delete next;
+        }
+        destroying = false;
+    }
+};
+
+template<typename T, typename... Args>
+Ref<T> make_ref(Args&&... args) {
+    return Ref<T>(new T(std::forward<Args>(args)...));
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "symexpr.h"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Binary expression format, all integers little-endian:
+//
+//     header:  "SYMX"  u16 version  u8 number type (1 = double, 2 = complex)  u8 0
+//     records: u8 tag, then
+//              EXPR_NUM          the value's IEEE bits (u64, or two u64 for complex)
+//              EXPR_VAR          u32 name index
+//              unary kinds       u32 operand node index
+//              binary kinds      u32 lhs node index, u32 rhs node index
+//              SERIAL_NAME       u32 length, then the name bytes; defines the next name index
+//              SERIAL_ROOT       u32 node index of a finished expression
+//
+// Nodes are numbered in the order they appear and only refer back to earlier
+// ones, so a shared subtree is stored once and every name is stored once.
+// A stream may hold several expressions (e.g. a function and its derivatives)
+// that share nodes; each one ends with a SERIAL_ROOT record.
+
+constexpr char SERIAL_MAGIC[4] = {'S', 'Y', 'M', 'X'};
+constexpr std::uint16_t SERIAL_VERSION = 1;
+
+enum SerialTag : std::uint8_t {
+    SERIAL_NAME = 0x40,
+    SERIAL_ROOT = 0x41,
+};
+
+template<typename Number>
+constexpr std::uint8_t serial_number_type() {
+    static_assert(std::is_same_v<Number, double> || std::is_same_v<Number, complex>, "Unsupported number type");
+    return std::is_same_v<Number, double> ? 1 : 2;
+}
+
+// Appends expressions to a stream. Nodes already written by an earlier write()
+// are referenced instead of written again.
+template<typename Number = DefaultNumber>
+class BinaryWriter {
+    std::ostream& out;
+    std::string buffer;
+    std::unordered_map<const Expr<Number>*, std::uint32_t> written;
+    std::unordered_map<std::string, std::uint32_t> names;
+    std::uint32_t count = 0;
+    // keeps written nodes alive so their addresses can't be reused by new nodes
+    std::vector<Expression<Number>> roots;
+
+public:
+    BinaryWriter(std::ostream& _out) : out(_out) {
+        buffer.append(SERIAL_MAGIC, 4);
+        put16(SERIAL_VERSION);
+        buffer.push_back(serial_number_type<Number>());
+        buffer.push_back(0);
+        flush();
+    }
+
+    void write(const Expression<Number>& expr) {
+        std::uint32_t root = emit(expr);
+        buffer.push_back(SERIAL_ROOT);
+        put32(root);
+        flush();
+        roots.push_back(expr);
+    }
+
+private:
+    void flush() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void put16(std::uint16_t value) {
+        for (int i = 0; i < 2; i++) buffer.push_back(char(value >> (8 * i)));
+    }
+
+    void put32(std::uint32_t value) {
+        for (int i = 0; i < 4; i++) buffer.push_back(char(value >> (8 * i)));
+    }
+
+    void put64(std::uint64_t value) {
+        for (int i = 0; i < 8; i++) buffer.push_back(char(value >> (8 * i)));
+    }
+
+    void put_number(const Number& value) {
+        if constexpr (std::is_same_v<Number, complex>) {
+            put64(std::bit_cast<std::uint64_t>(value.real()));
+            put64(std::bit_cast<std::uint64_t>(value.imag()));
+        } else {
+            put64(std::bit_cast<std::uint64_t>(value));
+        }
+    }
+
+    std::uint32_t name(const std::string& str) {
+        auto [it, inserted] = names.emplace(str, names.size());
+        if (inserted) {
+            buffer.push_back(SERIAL_NAME);
+            put32(str.size());
+            buffer += str;
+        }
+        return it->second;
+    }
+
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack; operands are written left to right
+    std::uint32_t emit(const Expression<Number>& expr) {
+        std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+        while (!stack.empty()) {
+            const Expr<Number>* node = stack.back();
+            if (written.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!written.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]->inner.get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            switch (node->kind()) {
+                case EXPR_NUM:
+                    buffer.push_back(EXPR_NUM);
+                    put_number(static_cast<const NumExpr<Number>*>(node)->value);
+                    break;
+                case EXPR_VAR: {
+                    std::uint32_t index = name(static_cast<const VarExpr<Number>*>(node)->name);
+                    buffer.push_back(EXPR_VAR);
+                    put32(index);
+                    break;
+                }
+                default:
+                    buffer.push_back(node->kind());
+                    for (std::size_t i = 0; i < operand_count(node->kind()); i++) {
+                        put32(written.at(children[i]->inner.get()));
+                    }
+                    break;
+            }
+            if (buffer.size() >= 1 << 16) {
+                flush();
+            }
+            written.emplace(node, count++);
+        }
+        return written.at(expr.inner.get());
+    }
+};
+
+// Reads expressions back from bytes in memory, e.g. a MappedFile.
+// Names are referenced in place; the only copies made are the nodes themselves.
+template<typename Number = DefaultNumber>
+class BinaryReader {
+    const unsigned char* pos;
+    const unsigned char* end;
+    std::vector<Expression<Number>> nodes;
+    std::vector<std::string_view> names;
+    // one shared VarExpr per name
+    std::vector<std::optional<Expression<Number>>> vars;
+
+public:
+    BinaryReader(std::span<const std::byte> data)
+        : pos(reinterpret_cast<const unsigned char*>(data.data())), end(pos + data.size())
+    {
+        need(8);
+        if (std::memcmp(pos, SERIAL_MAGIC, 4) != 0) {
+            throw std::invalid_argument("Invalid expression data: bad magic");
+        }
+        pos += 4;
+        if (get16() != SERIAL_VERSION) {
+            throw std::invalid_argument("Invalid expression data: unsupported version");
+        }
+        if (*pos++ != serial_number_type<Number>()) {
+            throw std::invalid_argument("Invalid expression data: stored for a different number type");
+        }
+        pos++;
+    }
+
+    // the next expression in the stream, nullopt at the end
+    std::optional<Expression<Number>> next() {
+        while (pos != end) {
+            std::uint8_t tag = *pos++;
+            switch (tag) {
+                case EXPR_NUM:
+                    nodes.emplace_back(get_number());
+                    break;
+                case EXPR_VAR: {
+                    std::uint32_t index = get32();
+                    if (index >= names.size()) {
+                        throw std::invalid_argument("Invalid expression data: bad name index");
+                    }
+                    if (!vars[index]) {
+                        vars[index] = Expression<Number>::var(std::string(names[index]));
+                    }
+                    nodes.push_back(*vars[index]);
+                    break;
+                }
+                case EXPR_SUM: binary<SumExpr<Number>>(); break;
+                case EXPR_MUL: binary<MulExpr<Number>>(); break;
+                case EXPR_DIV: binary<DivExpr<Number>>(); break;
+                case EXPR_POW: binary<PowExpr<Number>>(); break;
+                case EXPR_NEG: unary<NegExpr<Number>>(); break;
+                case EXPR_SIN: unary<SinExpr<Number>>(); break;
+                case EXPR_COS: unary<CosExpr<Number>>(); break;
+                case EXPR_LN: unary<LnExpr<Number>>(); break;
+                case EXPR_EXP: unary<ExpExpr<Number>>(); break;
+                case SERIAL_NAME: {
+                    std::uint32_t size = get32();
+                    need(size);
+                    names.emplace_back(reinterpret_cast<const char*>(pos), size);
+                    vars.emplace_back();
+                    pos += size;
+                    break;
+                }
+                case SERIAL_ROOT:
+                    return node(get32());
+                default:
+                    throw std::invalid_argument("Invalid expression data: bad record");
+            }
+        }
+        return {};
+    }
+
+    std::vector<Expression<Number>> read_all() {
+        std::vector<Expression<Number>> result;
+        while (auto expr = next()) {
+            result.push_back(*expr);
+        }
+        return result;
+    }
+
+private:
+    void need(std::size_t size) const {
+        if (std::size_t(end - pos) < size) {
+            throw std::invalid_argument("Invalid expression data: truncated");
+        }
+    }
+
+    std::uint16_t get16() {
+        need(2);
+        std::uint16_t value = pos[0] | pos[1] << 8;
+        pos += 2;
+        return value;
+    }
+
+    std::uint32_t get32() {
+        need(4);
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= std::uint32_t(pos[i]) << (8 * i);
+        pos += 4;
+        return value;
+    }
+
+    std::uint64_t get64() {
+        need(8);
+        std::uint64_t value = 0;
+        for (int i = 0; i < 8; i++) value |= std::uint64_t(pos[i]) << (8 * i);
+        pos += 8;
+        return value;
+    }
+
+    Number get_number() {
+        if constexpr (std::is_same_v<Number, complex>) {
+            double re = std::bit_cast<double>(get64());
+            return complex(re, std::bit_cast<double>(get64()));
+        } else {
+            return std::bit_cast<double>(get64());
+        }
+    }
+
+    const Expression<Number>& node(std::uint32_t index) const {
+        if (index >= nodes.size()) {
+            throw std::invalid_argument("Invalid expression data: bad node index");
+        }
+        return nodes[index];
+    }
+
+    // nodes are rebuilt as stored, without the folding done by Expression's operators
+    template<typename Node>
+    void unary() {
+        auto& operand = node(get32());
+        nodes.emplace_back(make_ref<Node>(operand));
+    }
+
+    template<typename Node>
+    void binary() {
+        auto& lhs = node(get32());
+        auto& rhs = node(get32());
+        nodes.emplace_back(make_ref<Node>(lhs, rhs));
+    }
+};
+
+template<typename Number = DefaultNumber>
+void write_binary(std::ostream& out, const Expression<Number>& expr) {
+    BinaryWriter<Number>(out).write(expr);
+}
+
+// the first expression stored in `data`
+template<typename Number = DefaultNumber>
+Expression<Number> read_binary(std::span<const std::byte> data) {
+    auto expr = BinaryReader<Number>(data).next();
+    if (!expr) {
+        throw std::invalid_argument("Invalid expression data: no expression");
+    }
+    return *expr;
+}
+
+template<typename Number = DefaultNumber>
+Expression<Number> load_binary(const std::string& path) {
+    MappedFile file(path);
+    return read_binary<Number>(file.bytes());
+}
@@ -0,0 +1,641 @@
+#pragma once
+
+#include "symexpr.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+// Compile-time counterpart of Parser:
+//
+//     constexpr auto f = "x * sin(x)"_sym;
+//     double y = f.eval(static_expr::bind<"x">(2.0));
+//     auto df = f.diff<"x">();   // x * cos(x) + sin(x), also a type
+//
+// The string is parsed during compilation into an expression template whose
+// nodes are empty types, so evaluation inlines to plain arithmetic.
+// Parsing follows Parser<double> exactly (including the simplifications done by
+// Expression's operators), and diff<>() follows the runtime diff() rules;
+// to_expression() rebuilds the runtime tree for comparison or further symbolic work.
+// Malformed input is a compile error. Number literals are exact when they have at
+// most 15 significant digits and a decimal exponent within ±22, otherwise they may
+// differ from std::from_chars in the last bit.
+namespace static_expr {
+
+template<std::size_t N>
+struct fixed_string {
+    char data[N]{};
+
+    constexpr fixed_string() = default;
+
+    constexpr fixed_string(const char (&str)[N]) {
+        std::copy_n(str, N, data);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(data, std::find(data, data + N, '\0'));
+    }
+};
+
+// longest variable name accepted in a static expression
+constexpr std::size_t MAX_NAME = 32;
+using name_t = fixed_string<MAX_NAME>;
+
+template<std::size_t N, std::size_t M>
+constexpr bool same_name(const fixed_string<N>& a, const fixed_string<M>& b) {
+    return a.view() == b.view();
+}
+
+// Parsing
+
+struct Node {
+    ExprKind kind = EXPR_NUM;
+    int lhs = -1;
+    int rhs = -1;
+    double value = 0;
+    name_t name;
+};
+
+template<std::size_t Capacity>
+struct Ast {
+    Node nodes[Capacity]{};
+    int size = 0;
+    int root = -1;
+};
+
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+constexpr bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// the same tokens Lexer produces
+struct StaticToken {
+    TokenKind kind = TOK_EOF;
+    std::string_view str;
+
+    constexpr bool operator==(std::string_view other) const {
+        return str == other;
+    }
+};
+
+template<std::size_t Capacity>
+class StaticParser {
+    std::string_view source;
+    std::size_t pos = 0;
+    StaticToken current;
+    Ast<Capacity> ast;
+
+public:
+    constexpr StaticParser(std::string_view _source) : source(_source) {
+        current = lex();
+    }
+
+    constexpr Ast<Capacity> parse() {
+        ast.root = parse_sum();
+        if (current.kind != TOK_EOF) {
+            throw std::invalid_argument("Expected end of input");
+        }
+        return ast;
+    }
+
+private:
+    constexpr StaticToken lex() {
+        while (pos < source.size() && is_space(source[pos])) {
+            pos++;
+        }
+        if (pos == source.size() || source[pos] == 0) {
+            return {TOK_EOF, {}};
+        }
+        std::size_t begin = pos;
+        if (is_digit(source[pos])) {
+            // the extent std::strtod accepts for a decimal literal
+            if (source[pos] == '0' && pos + 1 < source.size() && (source[pos + 1] == 'x' || source[pos + 1] == 'X')) {
+                throw std::invalid_argument("Hexadecimal literals are not supported");
+            }
+            while (pos < source.size() && is_digit(source[pos])) pos++;
+            if (pos < source.size() && source[pos] == '.') {
+                pos++;
+                while (pos < source.size() && is_digit(source[pos])) pos++;
+            }
+            if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+                std::size_t exp = pos + 1;
+                if (exp < source.size() && (source[exp] == '+' || source[exp] == '-')) exp++;
+                if (exp < source.size() && is_digit(source[exp])) {
+                    pos = exp;
+                    while (pos < source.size() && is_digit(source[pos])) pos++;
+                }
+            }
+            return {TOK_NUMBER, source.substr(begin, pos - begin)};
+        }
+        if (is_alpha(source[pos])) {
+            while (pos < source.size() && (is_alpha(source[pos]) || is_digit(source[pos]))) pos++;
+            return {TOK_NAME, source.substr(begin, pos - begin)};
+        }
+        pos++;
+        return {TOK_OP, source.substr(begin, 1)};
+    }
+
+    constexpr void consume() {
+        current = lex();
+    }
+
+    static constexpr double number(std::string_view str) {
+        std::uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        std::size_t i = 0;
+        bool fraction = false;
+        for (; i < str.size() && str[i] != 'e' && str[i] != 'E'; i++) {
+            if (str[i] == '.') {
+                fraction = true;
+                continue;
+            }
+            if (mantissa == 0 && str[i] == '0') {
+                exponent -= fraction;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (str[i] - '0');
+                digits++;
+                exponent -= fraction;
+            } else {
+                exponent += !fraction;
+            }
+        }
+        if (i < str.size()) {
+            bool negative = str[++i] == '-';
+            if (str[i] == '+' || str[i] == '-') i++;
+            int e = 0;
+            for (; i < str.size(); i++) e = std::min(e * 10 + (str[i] - '0'), 100000);
+            exponent += negative ? -e : e;
+        }
+        // powers of ten up to 1e22 are exact, so one rounding step for mantissas below 2^53
+        constexpr double exact[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        double result = mantissa;
+        for (; exponent > 22; exponent -= 22) result *= exact[22];
+        for (; exponent < -22; exponent += 22) result /= exact[22];
+        return exponent < 0 ? result / exact[-exponent] : result * exact[exponent];
+    }
+
+    constexpr int push(Node node) {
+        ast.nodes[ast.size] = node;
+        return ast.size++;
+    }
+
+    constexpr bool is_value(int node, double value) const {
+        return ast.nodes[node].kind == EXPR_NUM && ast.nodes[node].value == value;
+    }
+
+    // the folding done by Expression's operators
+
+    constexpr int sum(int lhs, int rhs) {
+        if (is_value(lhs, 0)) return rhs;
+        if (is_value(rhs, 0)) return lhs;
+        return push({EXPR_SUM, lhs, rhs});
+    }
+
+    constexpr int neg(int expr) {
+        if (is_value(expr, 0)) return expr;
+        return push({EXPR_NEG, expr});
+    }
+
+    constexpr int mul(int lhs, int rhs) {
+        if (is_value(lhs, 0)) return lhs;
+        if (is_value(lhs, 1)) return rhs;
+        if (is_value(rhs, 0)) return rhs;
+        if (is_value(rhs, 1)) return lhs;
+        return push({EXPR_MUL, lhs, rhs});
+    }
+
+    constexpr int pow(int base, int exponent) {
+        if (is_value(exponent, 1)) return base;
+        return push({EXPR_POW, base, exponent});
+    }
+
+    constexpr int parse_sum() {
+        int left = parse_product();
+        while (true) {
+            if (current == "+") {
+                consume();
+                left = sum(left, parse_product());
+            } else if (current == "-") {
+                consume();
+                left = sum(left, neg(parse_product()));
+            } else {
+                break;
+            }
+        }
+        return left;
+    }
+
+    constexpr int parse_product() {
+        int left = parse_power();
+        while (true) {
+            if (current == "*") {
+                consume();
+                left = mul(left, parse_power());
+            } else if (current == "/") {
+                consume();
+                int right = parse_power();
+                left = push({EXPR_DIV, left, right});
+            } else {
+                break;
+            }
+        }
+        return left;
+    }
+
+    constexpr int parse_power() {
+        int left = parse_unary();
+        if (current == "^") {
+            consume();
+            return pow(left, parse_power());
+        }
+        return left;
+    }
+
+    constexpr int parse_unary() {
+        if (current == "-") {
+            consume();
+            return neg(parse_unary());
+        }
+        return parse_atom();
+    }
+
+    constexpr int parse_atom() {
+        StaticToken tok = current;
+
+        if (tok.kind == TOK_NUMBER) {
+            consume();
+            return push({EXPR_NUM, -1, -1, number(tok.str)});
+        }
+
+        if (tok.kind == TOK_NAME) {
+            consume();
+            std::string_view name = tok.str;
+
+            if (current == "(") {
+                consume();
+                int arg = parse_sum();
+                if (current != ")") {
+                    throw std::invalid_argument("Expected ')'");
+                }
+                consume();
+
+                if (name == "sin") return push({EXPR_SIN, arg});
+                if (name == "cos") return push({EXPR_COS, arg});
+                if (name == "ln") return push({EXPR_LN, arg});
+                if (name == "exp") return push({EXPR_EXP, arg});
+
+                throw std::invalid_argument("Unknown function");
+            }
+
+            if (name == "sin" || name == "cos" || name == "ln" || name == "exp") {
+                throw std::invalid_argument("Function must have an argument");
+            }
+
+            if (name == "pi") {
+                return push({EXPR_NUM, -1, -1, M_PI});
+            }
+            if (name == "e") {
+                return push({EXPR_NUM, -1, -1, M_E});
+            }
+
+            if (name.size() >= MAX_NAME) {
+                throw std::invalid_argument("Variable name is too long");
+            }
+            Node var{EXPR_VAR};
+            std::copy(name.begin(), name.end(), var.name.data);
+            return push(var);
+        }
+
+        if (tok == "(") {
+            consume();
+            int expr = parse_sum();
+            if (current != ")") {
+                throw std::invalid_argument("Expected ')'");
+            }
+            consume();
+            return expr;
+        }
+
+        throw std::invalid_argument("Unexpected token");
+    }
+};
+
+template<fixed_string Source>
+struct parsed {
+    // every token adds at most two nodes (`a - b` is `a + -b`)
+    static constexpr auto ast = StaticParser<2 * sizeof(Source.data) + 1>(Source.view()).parse();
+};
+
+// Bindings
+
+template<fixed_string Name, typename T>
+struct Binding {
+    static constexpr auto name = Name;
+    T value;
+};
+
+template<fixed_string Name, typename T>
+constexpr Binding<Name, T> bind(T value) {
+    return {value};
+}
+
+template<fixed_string Name>
+constexpr void lookup() {
+    static_assert(Name.data[0] == 0, "Can't evaluate an unknown variable");
+}
+
+template<fixed_string Name, typename B, typename... Rest>
+constexpr auto lookup(const B& first, const Rest&... rest) {
+    if constexpr (same_name(B::name, Name)) {
+        return first.value;
+    } else {
+        return lookup<Name>(rest...);
+    }
+}
+
+// Expression templates
+
+template<typename Self>
+struct Base {
+    // evaluate with `bind<"name">(value)` arguments; unbound variables don't compile
+    template<typename Number = DefaultNumber, typename... Bs>
+    constexpr Number eval(const Bs&... bindings) const {
+        return Self::template compute<Number>(bindings...);
+    }
+
+    template<fixed_string Name>
+    constexpr auto diff() const;
+
+    template<typename Number = DefaultNumber>
+    Expression<Number> to_expression() const {
+        return Self::template build<Number>();
+    }
+
+    std::string to_string() const {
+        return to_expression().to_string();
+    }
+};
+
+template<double Value>
+struct Num : Base<Num<Value>> {
+    static constexpr ExprKind kind = EXPR_NUM;
+    static constexpr double value = Value;
+
+    template<typename Number, typename... Bs>
+    static constexpr Number compute(const Bs&...) {
+        return Number(Value);
+    }
+
+    template<typename Number>
+    static Expression<Number> build() {
+        return Expression<Number>(Number(Value));
+    }
+};
+
+template<fixed_string Name>
+struct Var : Base<Var<Name>> {
+    static constexpr ExprKind kind = EXPR_VAR;
+    static constexpr auto name = Name;
+
+    template<typename Number, typename... Bs>
+    static constexpr Number compute(const Bs&... bindings) {
+        return Number(lookup<Name>(bindings...));
+    }
+
+    template<typename Number>
+    static Expression<Number> build() {
+        return Expression<Number>::var(std::string(Name.view()));
+    }
+};
+
+template<typename E>
+struct Neg : Base<Neg<E>> {
+    static constexpr ExprKind kind = EXPR_NEG;
+
+    template<typename Number, typename... Bs>
+    static constexpr Number compute(const Bs&... bindings) {
+        return -E::template compute<Number>(bindings...);
+    }
+
+    template<typename Number>
+    static Expression<Number> build() {
+        return Expression<Number>(make_ref<NegExpr<Number>>(E::template build<Number>()));
+    }
+};
+
+#define STATIC_EXPR_BINARY(NAME, KIND, NODE, COMPUTE)                                               \
+    template<typename L, typename R>                                                                \
+    struct NAME : Base<NAME<L, R>> {                                                                \
+        static constexpr ExprKind kind = KIND;                                                      \
+                                                                                                    \
+        template<typename Number, typename... Bs>                                                   \
+        static constexpr Number compute(const Bs&... bindings) {                                    \
+            using std::pow;                                                                         \
+            Number lhs = L::template compute<Number>(bindings...);                                  \
+            Number rhs = R::template compute<Number>(bindings...);                                  \
+            return COMPUTE;                                                                         \
+        }                                                                                           \
+                                                                                                    \
+        template<typename Number>                                                                   \
+        static Expression<Number> build() {                                                         \
+            return Expression<Number>(make_ref<NODE<Number>>(                               \
+                L::template build<Number>(), R::template build<Number>()));                         \
+        }                                                                                           \
+    };
+
+STATIC_EXPR_BINARY(Sum, EXPR_SUM, SumExpr, lhs + rhs)
+STATIC_EXPR_BINARY(Mul, EXPR_MUL, MulExpr, lhs * rhs)
+STATIC_EXPR_BINARY(Div, EXPR_DIV, DivExpr, lhs / rhs)
+STATIC_EXPR_BINARY(Pow, EXPR_POW, PowExpr, pow(lhs, rhs))
+
+#undef STATIC_EXPR_BINARY
+
+#define STATIC_EXPR_FUNCTION(NAME, KIND, NODE, FUNCTION)                                            \
+    template<typename E>                                                                            \
+    struct NAME : Base<NAME<E>> {                                                                   \
+        static constexpr ExprKind kind = KIND;                                                      \
+                                                                                                    \
+        template<typename Number, typename... Bs>                                                   \
+        static constexpr Number compute(const Bs&... bindings) {                                    \
+            using std::FUNCTION;                                                                    \
+            return FUNCTION(E::template compute<Number>(bindings...));                              \
+        }                                                                                           \
+                                                                                                    \
+        template<typename Number>                                                                   \
+        static Expression<Number> build() {                                                         \
+            return Expression<Number>(make_ref<NODE<Number>>(E::template build<Number>())); \
+        }                                                                                           \
+    };
+
+STATIC_EXPR_FUNCTION(Sin, EXPR_SIN, SinExpr, sin)
+STATIC_EXPR_FUNCTION(Cos, EXPR_COS, CosExpr, cos)
+STATIC_EXPR_FUNCTION(Ln, EXPR_LN, LnExpr, log)
+STATIC_EXPR_FUNCTION(Exp, EXPR_EXP, ExpExpr, exp)
+
+#undef STATIC_EXPR_FUNCTION
+
+// AST to types
+
+template<const auto& Tree, int I>
+constexpr auto lower() {
+    constexpr const Node& node = Tree.nodes[I];
+    if constexpr (node.kind == EXPR_NUM) {
+        return Num<node.value>{};
+    } else if constexpr (node.kind == EXPR_VAR) {
+        return Var<node.name>{};
+    } else if constexpr (node.kind == EXPR_NEG) {
+        return Neg<decltype(lower<Tree, node.lhs>())>{};
+    } else if constexpr (node.kind == EXPR_SUM) {
+        return Sum<decltype(lower<Tree, node.lhs>()), decltype(lower<Tree, node.rhs>())>{};
+    } else if constexpr (node.kind == EXPR_MUL) {
+        return Mul<decltype(lower<Tree, node.lhs>()), decltype(lower<Tree, node.rhs>())>{};
+    } else if constexpr (node.kind == EXPR_DIV) {
+        return Div<decltype(lower<Tree, node.lhs>()), decltype(lower<Tree, node.rhs>())>{};
+    } else if constexpr (node.kind == EXPR_POW) {
+        return Pow<decltype(lower<Tree, node.lhs>()), decltype(lower<Tree, node.rhs>())>{};
+    } else if constexpr (node.kind == EXPR_SIN) {
+        return Sin<decltype(lower<Tree, node.lhs>())>{};
+    } else if constexpr (node.kind == EXPR_COS) {
+        return Cos<decltype(lower<Tree, node.lhs>())>{};
+    } else if constexpr (node.kind == EXPR_LN) {
+        return Ln<decltype(lower<Tree, node.lhs>())>{};
+    } else {
+        return Exp<decltype(lower<Tree, node.lhs>())>{};
+    }
+}
+
+template<fixed_string Source>
+using expr_t = decltype(lower<parsed<Source>::ast, parsed<Source>::ast.root>());
+
+// Differentiation, with the same folding as Expression's operators
+
+template<typename E>
+constexpr bool is_value(double value) {
+    if constexpr (E::kind == EXPR_NUM) {
+        return E::value == value;
+    } else {
+        return false;
+    }
+}
+
+template<typename L, typename R>
+constexpr auto operator+(L, R) requires std::is_base_of_v<Base<L>, L> && std::is_base_of_v<Base<R>, R> {
+    if constexpr (is_value<L>(0)) return R{};
+    else if constexpr (is_value<R>(0)) return L{};
+    else return Sum<L, R>{};
+}
+
+template<typename E>
+constexpr auto operator-(E) requires std::is_base_of_v<Base<E>, E> {
+    if constexpr (is_value<E>(0)) return E{};
+    else return Neg<E>{};
+}
+
+template<typename L, typename R>
+constexpr auto operator-(L lhs, R rhs) requires std::is_base_of_v<Base<L>, L> && std::is_base_of_v<Base<R>, R> {
+    return lhs + (-rhs);
+}
+
+template<typename L, typename R>
+constexpr auto operator*(L, R) requires std::is_base_of_v<Base<L>, L> && std::is_base_of_v<Base<R>, R> {
+    if constexpr (is_value<L>(0)) return L{};
+    else if constexpr (is_value<L>(1)) return R{};
+    else if constexpr (is_value<R>(0)) return R{};
+    else if constexpr (is_value<R>(1)) return L{};
+    else return Mul<L, R>{};
+}
+
+template<typename L, typename R>
+constexpr auto operator/(L, R) requires std::is_base_of_v<Base<L>, L> && std::is_base_of_v<Base<R>, R> {
+    return Div<L, R>{};
+}
+
+template<typename B, typename E>
+constexpr auto pow(B, E) requires std::is_base_of_v<Base<B>, B> && std::is_base_of_v<Base<E>, E> {
+    if constexpr (is_value<E>(1)) return B{};
+    else return Pow<B, E>{};
+}
+
+template<fixed_string X, double V>
+constexpr auto derivative(Num<V>) {
+    return Num<0.0>{};
+}
+
+template<fixed_string X, fixed_string Name>
+constexpr auto derivative(Var<Name>) {
+    if constexpr (same_name(Name, X)) return Num<1.0>{};
+    else return Num<0.0>{};
+}
+
+template<fixed_string X, typename L, typename R>
+constexpr auto derivative(Sum<L, R>) {
+    return derivative<X>(L{}) + derivative<X>(R{});
+}
+
+template<fixed_string X, typename E>
+constexpr auto derivative(Neg<E>) {
+    return -derivative<X>(E{});
+}
+
+template<fixed_string X, typename L, typename R>
+constexpr auto derivative(Mul<L, R>) {
+    return L{} * derivative<X>(R{}) + R{} * derivative<X>(L{});
+}
+
+template<fixed_string X, typename L, typename R>
+constexpr auto derivative(Div<L, R>) {
+    return (R{} * derivative<X>(L{}) - L{} * derivative<X>(R{})) / (R{} * R{});
+}
+
+template<fixed_string X, typename B, typename E>
+constexpr auto derivative(Pow<B, E>) {
+    return pow(B{}, E{}) * (E{} * derivative<X>(B{}) / B{} + derivative<X>(E{}) * Ln<B>{});
+}
+
+template<fixed_string X, typename E>
+constexpr auto derivative(Sin<E>) {
+    return Cos<E>{} * derivative<X>(E{});
+}
+
+template<fixed_string X, typename E>
+constexpr auto derivative(Cos<E>) {
+    return -Sin<E>{} * derivative<X>(E{});
+}
+
+template<fixed_string X, typename E>
+constexpr auto derivative(Ln<E>) {
+    return derivative<X>(E{}) / E{};
+}
+
+template<fixed_string X, typename E>
+constexpr auto derivative(Exp<E>) {
+    return Exp<E>{} * derivative<X>(E{});
+}
+
+template<typename Self>
+template<fixed_string Name>
+constexpr auto Base<Self>::diff() const {
+    return derivative<Name>(Self{});
+}
+
+} // namespace static_expr
+
+template<static_expr::fixed_string Source>
+constexpr static_expr::expr_t<Source> operator""_sym() {
+    return {};
+}
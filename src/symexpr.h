@@ -3,18 +3,61 @@
 #include <string>
 #include <complex>
 #include <algorithm>
+#include <array>
+#include <expected>
+#include "budget.h"
+#include "ref.h"
 #include <memory>
 #include <format>
 #include <optional>
 #include <stdexcept>
 #include <sstream>
+#include <type_traits>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 using DefaultNumber = double;
 using complex = std::complex<double>;
 
+// the real type underlying a Number: float, double, or double for complex
+template<typename Number>
+struct real_type {
+    using type = Number;
+};
+
+template<typename Real>
+struct real_type<std::complex<Real>> {
+    using type = Real;
+};
+
+template<typename Number>
+using real_t = typename real_type<Number>::type;
+
+// the Number for the literal or constant `text`, which was rounded to `value`; types
+// that bound values (see interval.h) widen it to include the exact value
+template<typename Number>
+struct literal_value {
+    static Number make(real_t<Number> value, std::string_view text) {
+        return Number(value);
+    }
+};
+
 template<typename Number = DefaultNumber>
 Number parse_number(const std::string& str);
 
+template<>
+inline float parse_number<float>(const std::string& str) {
+    std::size_t processed;
+    float result = std::stof(str, &processed);
+    if (processed != str.size()) {
+        throw std::invalid_argument(std::format("Invalid number `{}`", str));
+    }
+    return result;
+}
+
 template<>
 inline double parse_number<double>(const std::string& str) {
     std::size_t processed;
@@ -56,27 +99,111 @@ inline std::string format_complex(complex value, bool wrap_parens = true) {
     return ss.str();
 }
 
+template<typename Number>
+std::string format_number(Number value, bool wrap_parens = true) {
+    if constexpr (std::is_same_v<Number, complex>) {
+        return format_complex(value, wrap_parens);
+    } else {
+        std::stringstream ss;
+        ss << value;
+        return ss.str();
+    }
+}
+
 template<typename Number>
 struct Expression;
 
-// Expr shall be stored in a shared_ptr and not be modified
+enum ExprKind {
+    EXPR_NUM,
+    EXPR_VAR,
+    EXPR_SUM,
+    EXPR_NEG,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_POW,
+    EXPR_SIN,
+    EXPR_COS,
+    EXPR_LN,
+    EXPR_EXP,
+};
+
+// how many operands a node of the kind has (lhs, then rhs)
+constexpr std::size_t operand_count(ExprKind kind) {
+    switch (kind) {
+        case EXPR_NUM:
+        case EXPR_VAR:
+            return 0;
+        case EXPR_NEG:
+        case EXPR_SIN:
+        case EXPR_COS:
+        case EXPR_LN:
+        case EXPR_EXP:
+            return 1;
+        case EXPR_SUM:
+        case EXPR_MUL:
+        case EXPR_DIV:
+        case EXPR_POW:
+            return 2;
+    }
+    return 0;
+}
+
+// why try_eval() couldn't produce a value
+struct EvalError {
+    // the first variable without a value. Points into the expression, which must outlive the error.
+    std::string_view name;
+
+    std::string message() const {
+        return std::format("Can't evaluate an unknown `{}`", name);
+    }
+};
+
+// a value together with its derivative by one variable
+template<typename Number>
+struct Dual {
+    Number value;
+    Number diff;
+};
+
+// Expr shall be stored in a Ref and not be modified
 template<typename Number = DefaultNumber>
-struct Expr {
+struct Expr : RefCounted {
     // substitute and return the new value. return nullopt if unchanged.
     virtual std::optional<Expression<Number>> subs(const std::string& name, const Expression<Number>& value) const = 0;
 
     // evaluate into a Number.
     virtual Number eval() const = 0;
 
+    // like eval(), but reports an unbound variable as an error value instead of throwing
+    virtual std::expected<Number, EvalError> try_eval() const = 0;
+
     virtual Expression<Number> diff(const std::string& name) const = 0;
 
+    // the value and the derivative by `name` (which has the value `at`, if any) in one walk,
+    // using the rules of diff() without building the derivative
+    virtual std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const = 0;
+
     virtual std::string to_string() const = 0;
 
     virtual int precedence() const = 0;
 
+    // node type tag, used by passes that walk the tree from outside (see tape.h).
+    virtual ExprKind kind() const = 0;
+
     virtual bool operator==(const Expression<Number>&) const = 0;
 
     virtual ~Expr() = default;
+
+protected:
+    // every node counts towards the current Budget, if there is one
+    Expr() {
+        budget_detail::add_node();
+    }
+
+    // another reference to this node, for results that contain it unchanged
+    Expression<Number> self() const {
+        return Expression<Number>(Ref<Expr<Number>>(const_cast<Expr<Number>*>(this)));
+    }
 };
 
 template<typename Number = DefaultNumber>
@@ -91,15 +218,24 @@ struct NumExpr : Expr<Number> {
     Number eval() const override {
         return value;
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        return value;
+    }
     Expression<Number> diff(const std::string& name) const override {
         return Expression<Number>(Number(0));
     }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        return Dual<Number>{value, Number(0)};
+    }
     std::string to_string() const override {
-        return format_complex(value);
+        return format_number(value);
     }
     int precedence() const override {
         return 4;
     }
+    ExprKind kind() const override {
+        return EXPR_NUM;
+    }
     bool operator==(const Expression<Number>& other) const override {
         NumExpr<Number>* v;
         return (v = dynamic_cast<NumExpr<Number>*>(other.inner.get())) && v->value == value;
@@ -122,15 +258,27 @@ struct VarExpr : Expr<Number> {
     Number eval() const override {
         throw std::invalid_argument(std::format("Can't evaluate an unknown `{}`", name));
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        return std::unexpected(EvalError{name});
+    }
     Expression<Number> diff(const std::string& name) const override {
         return Expression<Number>(name == this->name ? Number(1) : Number(0));
     }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        if (name == this->name && at) {
+            return Dual<Number>{*at, Number(1)};
+        }
+        return std::unexpected(EvalError{this->name});
+    }
     std::string to_string() const override{
         return name;
     }
     int precedence() const override {
         return 4;
     }
+    ExprKind kind() const override {
+        return EXPR_VAR;
+    }
     bool operator==(const Expression<Number>& other) const override {
         VarExpr<Number>* v;
         return (v = dynamic_cast<VarExpr<Number>*>(other.inner.get())) && v->name == name;
@@ -156,8 +304,22 @@ struct SumExpr : Expr<Number> {
     Number eval() const override {
         return lhs.eval() + rhs.eval();
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        auto l = lhs.try_eval();
+        if (!l) return l;
+        auto r = rhs.try_eval();
+        if (!r) return r;
+        return *l + *r;
+    }
     Expression<Number> diff(const std::string& name) const override {
-        return lhs.diff(name) + rhs.diff(name);
+        return lhs.diff_by_rules(name) + rhs.diff_by_rules(name);
+    }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto l = lhs.inner->eval_diff(name, at);
+        if (!l) return l;
+        auto r = rhs.inner->eval_diff(name, at);
+        if (!r) return r;
+        return Dual<Number>{l->value + r->value, l->diff + r->diff};
     }
     std::string to_string() const override {
         return std::format("{} + {}", 
@@ -168,6 +330,9 @@ struct SumExpr : Expr<Number> {
     int precedence() const override {
         return 0;
     }
+    ExprKind kind() const override {
+        return EXPR_SUM;
+    }
     bool operator==(const Expression<Number>& other) const override {
         SumExpr<Number>* v;
         return (v = dynamic_cast<SumExpr<Number>*>(other.inner.get())) && v->lhs == lhs && v->rhs == rhs;
@@ -181,13 +346,23 @@ struct NegExpr : Expr<Number> {
     NegExpr(Expression<Number> _expr) : expr(std::move(_expr)) {}
 
     std::optional<Expression<Number>> subs(const std::string& name, const Expression<Number>& value) const override {
-        return expr.subs_maybe(name, value).transform([](auto v){ return -v; });
+        return expr.subs_maybe(name, value).transform([](auto v){ return -std::move(v); });
     };
     Number eval() const override {
         return -expr.eval();
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        auto x = expr.try_eval();
+        if (!x) return x;
+        return -*x;
+    }
     Expression<Number> diff(const std::string& name) const override {
-        return -expr.diff(name);
+        return -expr.diff_by_rules(name);
+    }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto x = expr.inner->eval_diff(name, at);
+        if (!x) return x;
+        return Dual<Number>{-x->value, -x->diff};
     }
     std::string to_string() const override {
         return "-" + (expr.precedence() < this->precedence() ? "(" + expr.to_string() + ")" : expr.to_string());
@@ -195,6 +370,9 @@ struct NegExpr : Expr<Number> {
     int precedence() const override {
         return 4;
     }
+    ExprKind kind() const override {
+        return EXPR_NEG;
+    }
     bool operator==(const Expression<Number>& other) const override {
         NegExpr<Number>* v;
         return (v = dynamic_cast<NegExpr<Number>*>(other.inner.get())) && v->expr == expr;
@@ -220,8 +398,22 @@ struct MulExpr : Expr<Number> {
     Number eval() const override {
         return lhs.eval() * rhs.eval();
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        auto l = lhs.try_eval();
+        if (!l) return l;
+        auto r = rhs.try_eval();
+        if (!r) return r;
+        return *l * *r;
+    }
     Expression<Number> diff(const std::string& name) const override {
-        return lhs * rhs.diff(name) + rhs * lhs.diff(name);
+        return lhs * rhs.diff_by_rules(name) + rhs * lhs.diff_by_rules(name);
+    }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto l = lhs.inner->eval_diff(name, at);
+        if (!l) return l;
+        auto r = rhs.inner->eval_diff(name, at);
+        if (!r) return r;
+        return Dual<Number>{l->value * r->value, l->value * r->diff + r->value * l->diff};
     }
     std::string to_string() const override {
         return std::format("{} * {}", 
@@ -232,6 +424,9 @@ struct MulExpr : Expr<Number> {
     int precedence() const override {
         return 1;
     }
+    ExprKind kind() const override {
+        return EXPR_MUL;
+    }
     bool operator==(const Expression<Number>& other) const override {
         MulExpr<Number>* v;
         return (v = dynamic_cast<MulExpr<Number>*>(other.inner.get())) && v->lhs == lhs && v->rhs == rhs;
@@ -257,8 +452,22 @@ struct DivExpr : Expr<Number> {
     Number eval() const override {
         return lhs.eval() / rhs.eval();
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        auto l = lhs.try_eval();
+        if (!l) return l;
+        auto r = rhs.try_eval();
+        if (!r) return r;
+        return *l / *r;
+    }
     Expression<Number> diff(const std::string& name) const override {
-        return (rhs * lhs.diff(name) - lhs * rhs.diff(name)) / (rhs * rhs);
+        return (rhs * lhs.diff_by_rules(name) - lhs * rhs.diff_by_rules(name)) / (rhs * rhs);
+    }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto l = lhs.inner->eval_diff(name, at);
+        if (!l) return l;
+        auto r = rhs.inner->eval_diff(name, at);
+        if (!r) return r;
+        return Dual<Number>{l->value / r->value, (r->value * l->diff - l->value * r->diff) / (r->value * r->value)};
     }
     std::string to_string() const override {
         return std::format("{} / {}", 
@@ -269,6 +478,9 @@ struct DivExpr : Expr<Number> {
     int precedence() const override {
         return 2;
     }
+    ExprKind kind() const override {
+        return EXPR_DIV;
+    }
     bool operator==(const Expression<Number>& other) const override {
         DivExpr<Number>* v;
         return (v = dynamic_cast<DivExpr<Number>*>(other.inner.get())) && v->lhs == lhs && v->rhs == rhs;
@@ -295,9 +507,31 @@ struct PowExpr : Expr<Number> {
         using std::pow;
         return pow(base.eval(), exponent.eval());
     };
+    std::expected<Number, EvalError> try_eval() const override {
+        using std::pow;
+        auto l = base.try_eval();
+        if (!l) return l;
+        auto r = exponent.try_eval();
+        if (!r) return r;
+        return pow(*l, *r);
+    }
     Expression<Number> diff(const std::string& name) const override {
         // Using the formula: d/dx(f^g) = f^g * (g*f'/f + g'*ln(f))
-        return pow(base, exponent) * (exponent * base.diff(name) / base + exponent.diff(name) * ln(base));
+        return this->self() * (exponent * base.diff_by_rules(name) / base + exponent.diff_by_rules(name) * ln(base));
+    }
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        using std::pow, std::log;
+        auto b = base.inner->eval_diff(name, at);
+        if (!b) return b;
+        auto e = exponent.inner->eval_diff(name, at);
+        if (!e) return e;
+        Number value = pow(b->value, e->value);
+        Number rate = e->value * b->diff / b->value;
+        // diff() folds away `0 * ln(base)`, which keeps x ^ 2 finite for x < 0
+        if (e->diff != Number(0)) {
+            rate += e->diff * log(b->value);
+        }
+        return Dual<Number>{value, value * rate};
     }
     std::string to_string() const override {
         return std::format("{} ^ {}", 
@@ -308,6 +542,9 @@ struct PowExpr : Expr<Number> {
     int precedence() const override {
         return 3;
     }
+    ExprKind kind() const override {
+        return EXPR_POW;
+    }
     bool operator==(const Expression<Number>& other) const override {
         PowExpr<Number>* v;
         return (v = dynamic_cast<PowExpr<Number>*>(other.inner.get())) && v->base == base && v->exponent == exponent;
@@ -328,7 +565,7 @@ struct FunExprImpl : FunExpr<Number> {
     std::optional<Expression<Number>> subs(const std::string& name, const Expression<Number>& value) const override {
         auto expr_ = this->expr.subs_maybe(name, value);
         if (expr_) {
-            return Expression<Number>(std::make_shared<Self<Number>>(expr_.value_or(this->expr)));
+            return Expression<Number>(make_ref<Self<Number>>(std::move(*expr_)));
         } else {
             return {};
         }
@@ -349,16 +586,35 @@ struct SinExpr : FunExprImpl<Number, SinExpr> {
     using FunExprImpl<Number, SinExpr>::FunExprImpl;
 
     Number eval() const override {
+        using std::sin;
         return sin(this->expr.eval());
     }
 
+    std::expected<Number, EvalError> try_eval() const override {
+        auto x = this->expr.try_eval();
+        if (!x) return x;
+        using std::sin;
+        return sin(*x);
+    }
+
     Expression<Number> diff(const std::string& name) const override {
-        return cos(this->expr) * this->expr.diff(name);
+        return cos(this->expr) * this->expr.diff_by_rules(name);
+    }
+
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto x = this->expr.inner->eval_diff(name, at);
+        if (!x) return x;
+        using std::sin, std::cos;
+        return Dual<Number>{sin(x->value), cos(x->value) * x->diff};
     }
 
     std::string to_string() const override {
         return std::format("sin({})", this->expr.to_string());
     }
+
+    ExprKind kind() const override {
+        return EXPR_SIN;
+    }
 };
 
 template<typename Number = DefaultNumber>
@@ -366,16 +622,35 @@ struct CosExpr : FunExprImpl<Number, CosExpr> {
     using FunExprImpl<Number, CosExpr>::FunExprImpl;
 
     Number eval() const override {
+        using std::cos;
         return cos(this->expr.eval());
     }
 
+    std::expected<Number, EvalError> try_eval() const override {
+        auto x = this->expr.try_eval();
+        if (!x) return x;
+        using std::cos;
+        return cos(*x);
+    }
+
     Expression<Number> diff(const std::string& name) const override {
-        return -sin(this->expr) * this->expr.diff(name);
+        return -sin(this->expr) * this->expr.diff_by_rules(name);
+    }
+
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto x = this->expr.inner->eval_diff(name, at);
+        if (!x) return x;
+        using std::sin, std::cos;
+        return Dual<Number>{cos(x->value), -sin(x->value) * x->diff};
     }
 
     std::string to_string() const override {
         return std::format("cos({})", this->expr.to_string());
     }
+
+    ExprKind kind() const override {
+        return EXPR_COS;
+    }
 };
 
 template<typename Number = DefaultNumber>
@@ -383,16 +658,35 @@ struct LnExpr : FunExprImpl<Number, LnExpr> {
     using FunExprImpl<Number, LnExpr>::FunExprImpl;
 
     Number eval() const override {
+        using std::log;
         return log(this->expr.eval());
     }
 
+    std::expected<Number, EvalError> try_eval() const override {
+        auto x = this->expr.try_eval();
+        if (!x) return x;
+        using std::log;
+        return log(*x);
+    }
+
     Expression<Number> diff(const std::string& name) const override {
-        return this->expr.diff(name) / this->expr;
+        return this->expr.diff_by_rules(name) / this->expr;
+    }
+
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto x = this->expr.inner->eval_diff(name, at);
+        if (!x) return x;
+        using std::log;
+        return Dual<Number>{log(x->value), x->diff / x->value};
     }
 
     std::string to_string() const override {
         return std::format("ln({})", this->expr.to_string());
     }
+
+    ExprKind kind() const override {
+        return EXPR_LN;
+    }
 };
 
 template<typename Number = DefaultNumber>
@@ -400,55 +694,151 @@ struct ExpExpr : FunExprImpl<Number, ExpExpr> {
     using FunExprImpl<Number, ExpExpr>::FunExprImpl;
 
     Number eval() const override {
+        using std::exp;
         return exp(this->expr.eval());
     }
 
+    std::expected<Number, EvalError> try_eval() const override {
+        auto x = this->expr.try_eval();
+        if (!x) return x;
+        using std::exp;
+        return exp(*x);
+    }
+
     Expression<Number> diff(const std::string& name) const override {
-        return exp(this->expr) * this->expr.diff(name);
+        return this->self() * this->expr.diff_by_rules(name);
+    }
+
+    std::expected<Dual<Number>, EvalError> eval_diff(const std::string& name, const std::optional<Number>& at) const override {
+        auto x = this->expr.inner->eval_diff(name, at);
+        if (!x) return x;
+        using std::exp;
+        Number value = exp(x->value);
+        return Dual<Number>{value, value * x->diff};
     }
 
     std::string to_string() const override {
         return std::format("exp({})", this->expr.to_string());
     }
+
+    ExprKind kind() const override {
+        return EXPR_EXP;
+    }
 };
 
+// the operands of `node` in to_string() order: the first operand_count(node->kind())
+// entries, with the rest null
+template<typename Number>
+std::array<const Expression<Number>*, 2> operands(const Expr<Number>* node) {
+    switch (node->kind()) {
+        case EXPR_NUM:
+        case EXPR_VAR:
+            break;
+        case EXPR_SUM: return {&static_cast<const SumExpr<Number>*>(node)->lhs, &static_cast<const SumExpr<Number>*>(node)->rhs};
+        case EXPR_MUL: return {&static_cast<const MulExpr<Number>*>(node)->lhs, &static_cast<const MulExpr<Number>*>(node)->rhs};
+        case EXPR_DIV: return {&static_cast<const DivExpr<Number>*>(node)->lhs, &static_cast<const DivExpr<Number>*>(node)->rhs};
+        case EXPR_POW: return {&static_cast<const PowExpr<Number>*>(node)->base, &static_cast<const PowExpr<Number>*>(node)->exponent};
+        case EXPR_NEG: return {&static_cast<const NegExpr<Number>*>(node)->expr, nullptr};
+        case EXPR_SIN:
+        case EXPR_COS:
+        case EXPR_LN:
+        case EXPR_EXP:
+            return {&static_cast<const FunExpr<Number>*>(node)->expr, nullptr};
+    }
+    return {};
+}
+
 template<typename Number>
 class Parser;
 
+template<typename Number>
+struct LazyDiff;
+
+template<typename Number>
+struct Specialized;
+
 template<typename Number = DefaultNumber>
 struct Expression {
-    std::shared_ptr<Expr<Number>> inner;
+    Ref<Expr<Number>> inner;
 
-    explicit Expression(std::shared_ptr<Expr<Number>> value) : inner(value) {};
+    explicit Expression(Ref<Expr<Number>> value) : inner(std::move(value)) {};
 
     explicit Expression(const std::string& value) {
         inner = Parser<Number>(value).parse().inner;
     }
 
     static Expression<Number> var(const std::string& name) {
-        return Expression(std::make_shared<VarExpr<Number>>(name));
+        return Expression(make_ref<VarExpr<Number>>(name));
     }
 
-    Expression(std::type_identity_t<Number> value) : inner(std::make_shared<NumExpr<Number>>(value)) {}
+    Expression(std::type_identity_t<Number> value) : inner(make_ref<NumExpr<Number>>(value)) {}
 
+    // the nodes recurse through these wrappers, which count the depth towards the current Budget
     std::optional<Expression<Number>> subs_maybe(const std::string& name, const Expression<Number>& value) const {
+        BudgetDepth depth;
         return inner->subs(name, value);
     }
 
     Expression<Number> subs(const std::string& name, const Expression<Number>& value) const {
-        return inner->subs(name, value).value_or(*this);
+        return subs_maybe(name, value).value_or(*this);
+    }
+
+    Expression<Number> subs(const std::string& name, const Expression<Number>& value, Budget& budget) const {
+        BudgetScope scope(budget);
+        return subs(name, value);
     }
 
-    Expression<Number> diff(const std::string& name) const {
+    // the derivative by the rules of each node, which recurse through here
+    Expression<Number> diff_by_rules(const std::string& name) const {
+        BudgetDepth depth;
         return inner->diff(name);
     }
 
+    // diff_by_rules(), except that in expressions of at least PolynomialDifferentiator::AUTO_NODES
+    // nodes, polynomial subtrees that large are differentiated as Polynomials when those are
+    // no larger than the subtrees (see PolynomialDifferentiator::automatic in polynomial.h)
+    Expression<Number> diff(const std::string& name) const;
+
+    Expression<Number> diff(const std::string& name, Budget& budget) const {
+        BudgetScope scope(budget);
+        return diff(name);
+    }
+
+    // substitute the `bindings` and fold everything that becomes constant (see Specializer)
+    Specialized<Number> specialize(const std::vector<std::pair<std::string, Number>>& bindings) const;
+
+    Specialized<Number> specialize(const std::vector<std::pair<std::string, Number>>& bindings, Budget& budget) const {
+        BudgetScope scope(budget);
+        return specialize(bindings);
+    }
+
+    // makes the reference counts of every node atomic, so copies of the expression (or of
+    // its parts) can be made and dropped on several threads at once; see RefCounted
+    const Expression<Number>& share_across_threads() const;
+
+    // a derivative that is only built when it's needed as an expression (see LazyDiff)
+    LazyDiff<Number> lazy_diff(const std::string& name) const {
+        return LazyDiff<Number>{*this, name};
+    }
+
     Number eval() const {
         return inner->eval();
     }
 
+    std::expected<Number, EvalError> try_eval() const {
+        return inner->try_eval();
+    }
+
     std::string to_string() const {
-        return inner->to_string();
+        BudgetDepth depth;
+        std::string result = inner->to_string();
+        budget_detail::add_length(result.size());
+        return result;
+    }
+
+    std::string to_string(Budget& budget) const {
+        BudgetScope scope(budget);
+        return to_string();
     }
 
     int precedence() const {
@@ -466,17 +856,17 @@ struct Expression {
         if ((num = dynamic_cast<NumExpr<Number>*>(rhs.inner.get())) && num->value == Number(0)) {
             return lhs;
         }
-        return Expression(std::make_shared<SumExpr<Number>>(lhs, rhs));
+        return Expression(make_ref<SumExpr<Number>>(std::move(lhs), std::move(rhs)));
     }
     friend Expression<Number> operator-(Expression<Number> expr) {
         NumExpr<Number>* num;
         if ((num = dynamic_cast<NumExpr<Number>*>(expr.inner.get())) && num->value == Number(0)) {
             return expr;
         }
-        return Expression(std::make_shared<NegExpr<Number>>(expr));
+        return Expression(make_ref<NegExpr<Number>>(std::move(expr)));
     }
     friend Expression<Number> operator-(Expression<Number> lhs, Expression<Number> rhs) {
-        return lhs + (-rhs);
+        return std::move(lhs) + -std::move(rhs);
     }
     friend Expression<Number> operator*(Expression<Number> lhs, Expression<Number> rhs) {
         NumExpr<Number>* num;
@@ -488,35 +878,328 @@ struct Expression {
             if (num->value == Number(0)) return rhs;
             if (num->value == Number(1)) return lhs;
         }
-        return Expression(std::make_shared<MulExpr<Number>>(lhs, rhs));
+        return Expression(make_ref<MulExpr<Number>>(std::move(lhs), std::move(rhs)));
     }
     friend Expression<Number> operator/(Expression<Number> lhs, Expression<Number> rhs) {
-        return Expression(std::make_shared<DivExpr<Number>>(lhs, rhs));
+        return Expression(make_ref<DivExpr<Number>>(std::move(lhs), std::move(rhs)));
     }
     friend Expression<Number> pow(Expression<Number> base, Expression<Number> exponent) {
         NumExpr<Number>* num;
         if ((num = dynamic_cast<NumExpr<Number>*>(exponent.inner.get())) && num->value == Number(1)) {
             return base;
         }
-        return Expression(std::make_shared<PowExpr<Number>>(base, exponent));
+        return Expression(make_ref<PowExpr<Number>>(std::move(base), std::move(exponent)));
     }
     friend Expression<Number> operator^(Expression<Number> base, Expression<Number> exponent) {
-        return pow(base, exponent);
+        return pow(std::move(base), std::move(exponent));
     }
     friend Expression<Number> sin(Expression<Number> expr) {
-        return Expression(std::make_shared<SinExpr<Number>>(expr));
+        return Expression(make_ref<SinExpr<Number>>(std::move(expr)));
     }
     friend Expression<Number> cos(Expression<Number> expr) {
-        return Expression(std::make_shared<CosExpr<Number>>(expr));
+        return Expression(make_ref<CosExpr<Number>>(std::move(expr)));
     }
     friend Expression<Number> ln(Expression<Number> expr) {
-        return Expression(std::make_shared<LnExpr<Number>>(expr));
+        return Expression(make_ref<LnExpr<Number>>(std::move(expr)));
     }
     friend Expression<Number> exp(Expression<Number> expr) {
-        return Expression(std::make_shared<ExpExpr<Number>>(expr));
+        return Expression(make_ref<ExpExpr<Number>>(std::move(expr)));
     }    
 };
 
+// names of the variables in `expr`, in order of first appearance.
+// Shared subtrees are visited once, so this stays linear in the size of the DAG.
+template<typename Number = DefaultNumber>
+std::vector<std::string> variables(const Expression<Number>& expr) {
+    std::vector<std::string> result;
+    std::unordered_set<std::string_view> seen;
+    std::unordered_set<const Expr<Number>*> visited;
+    std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+    auto push = [&](const Expression<Number>& child) {
+        stack.push_back(child.inner.get());
+    };
+    while (!stack.empty()) {
+        const Expr<Number>* node = stack.back();
+        stack.pop_back();
+        if (!visited.insert(node).second) {
+            continue;
+        }
+        switch (node->kind()) {
+            case EXPR_NUM:
+                break;
+            case EXPR_VAR: {
+                auto& name = static_cast<const VarExpr<Number>*>(node)->name;
+                if (seen.insert(name).second) {
+                    result.push_back(name);
+                }
+                break;
+            }
+            // right operands first, so that left ones are popped (and named) first
+            case EXPR_SUM: push(static_cast<const SumExpr<Number>*>(node)->rhs); push(static_cast<const SumExpr<Number>*>(node)->lhs); break;
+            case EXPR_MUL: push(static_cast<const MulExpr<Number>*>(node)->rhs); push(static_cast<const MulExpr<Number>*>(node)->lhs); break;
+            case EXPR_DIV: push(static_cast<const DivExpr<Number>*>(node)->rhs); push(static_cast<const DivExpr<Number>*>(node)->lhs); break;
+            case EXPR_POW: push(static_cast<const PowExpr<Number>*>(node)->exponent); push(static_cast<const PowExpr<Number>*>(node)->base); break;
+            case EXPR_NEG: push(static_cast<const NegExpr<Number>*>(node)->expr); break;
+            case EXPR_SIN:
+            case EXPR_COS:
+            case EXPR_LN:
+            case EXPR_EXP:
+                push(static_cast<const FunExpr<Number>*>(node)->expr);
+                break;
+        }
+    }
+    return result;
+}
+
+// all variables of `expr` that aren't in `bound`, checked before evaluating
+// instead of finding the first one by a failed evaluation
+template<typename Number = DefaultNumber>
+std::vector<std::string> unbound_variables(const Expression<Number>& expr, const std::vector<std::string>& bound) {
+    std::vector<std::string> result = variables(expr);
+    std::erase_if(result, [&](const std::string& name) {
+        return std::find(bound.begin(), bound.end(), name) != bound.end();
+    });
+    return result;
+}
+
+// The derivative of `expr` by `name`, taken at `name` = `point` once a value is
+// substituted for it. eval() walks `expr` with eval_diff() instead of building
+// the derivative tree; anything else expands it into an Expression first.
+template<typename Number = DefaultNumber>
+struct LazyDiff {
+    Expression<Number> expr;
+    std::string name;
+    std::optional<Expression<Number>> point;
+
+    LazyDiff<Number> subs(const std::string& var, const Expression<Number>& value) const {
+        if (var == name) {
+            return {expr, name, point ? point->subs(var, value) : value};
+        }
+        auto free = variables(value);
+        if (std::find(free.begin(), free.end(), name) != free.end()) {
+            // `name` in `value` must not be differentiated, so rename the one in `expr`
+            std::string bound = name;
+            auto used = variables(expr);
+            do {
+                bound += "'";
+            } while (bound == var || std::find(used.begin(), used.end(), bound) != used.end() || std::find(free.begin(), free.end(), bound) != free.end());
+            LazyDiff<Number> renamed{expr.subs(name, Expression<Number>::var(bound)), bound, point.value_or(Expression<Number>::var(name))};
+            return renamed.subs(var, value);
+        }
+        return {expr.subs(var, value), name, point ? std::optional(point->subs(var, value)) : std::nullopt};
+    }
+
+    Number eval() const {
+        auto value = try_eval();
+        if (!value) {
+            throw std::invalid_argument(value.error().message());
+        }
+        return *value;
+    }
+
+    std::expected<Number, EvalError> try_eval() const {
+        std::optional<Number> at;
+        if (point) {
+            auto value = point->try_eval();
+            if (!value) return value;
+            at = *value;
+        }
+        auto result = expr.inner->eval_diff(name, at);
+        if (!result) return std::unexpected(result.error());
+        return result->diff;
+    }
+
+    Expression<Number> expand() const {
+        Expression<Number> derivative = expr.diff(name);
+        return point ? derivative.subs(name, *point) : derivative;
+    }
+
+    operator Expression<Number>() const {
+        return expand();
+    }
+
+    std::string to_string() const {
+        return expand().to_string();
+    }
+};
+
+// the number of distinct nodes in `expr`, counting shared subtrees once
+template<typename Number = DefaultNumber>
+std::size_t node_count(const Expression<Number>& expr) {
+    std::unordered_set<const Expr<Number>*> visited;
+    std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+    while (!stack.empty()) {
+        const Expr<Number>* node = stack.back();
+        stack.pop_back();
+        if (!visited.insert(node).second) {
+            continue;
+        }
+        auto children = operands(node);
+        for (std::size_t i = 0; i < operand_count(node->kind()); i++) {
+            stack.push_back(children[i]->inner.get());
+        }
+    }
+    return visited.size();
+}
+
+template<typename Number>
+const Expression<Number>& Expression<Number>::share_across_threads() const {
+    // nodes are immutable, so everything below a shared node is already shared
+    std::vector<const Expr<Number>*> stack = {inner.get()};
+    while (!stack.empty()) {
+        const Expr<Number>* node = stack.back();
+        stack.pop_back();
+        if (node->shared_across_threads()) {
+            continue;
+        }
+        node->share_across_threads();
+        auto children = operands(node);
+        for (std::size_t i = 0; i < operand_count(node->kind()); i++) {
+            stack.push_back(children[i]->inner.get());
+        }
+    }
+    return *this;
+}
+
+template<typename Number = DefaultNumber>
+struct Specialized {
+    Expression<Number> expr;
+    // node_count() of the original expression minus that of `expr`
+    std::size_t removed;
+};
+
+// Partial evaluation: substitutes values for some of the variables and replaces
+// every subtree that no longer depends on a variable by its value, so that
+// parameters fixed for many evaluations are only computed once.
+// Folded values are exactly what eval() would compute for them, except that a
+// complex value with a zero imaginary part is folded with +0 there: -(1) evaluates
+// to (-1, -0), which would put ln() and pow() on the other side of their branch
+// cuts than the real number -1. Other nodes are rebuilt with Expression's
+// operators like subs() does, or kept when nothing below them changed, and
+// shared subtrees stay shared.
+template<typename Number = DefaultNumber>
+class Specializer {
+    std::unordered_map<std::string, Number> values;
+    std::unordered_map<const Expr<Number>*, Expression<Number>> memo;
+
+public:
+    Specializer(const std::vector<std::pair<std::string, Number>>& bindings) : values(bindings.begin(), bindings.end()) {}
+
+    // with an explicit stack, so deep trees don't overflow the call stack: a node is
+    // specialized once all of its operands are
+    Expression<Number> operator()(const Expression<Number>& expr) {
+        std::vector<const Expression<Number>*> stack = {&expr};
+        while (!stack.empty()) {
+            const Expression<Number>* top = stack.back();
+            const Expr<Number>* node = top->inner.get();
+            if (memo.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!memo.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]);
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            memo.emplace(node, specialize(*top));
+        }
+        return memo.at(expr.inner.get());
+    }
+
+private:
+    static bool constant(const Expression<Number>& expr) {
+        return expr.inner->kind() == EXPR_NUM;
+    }
+
+    static Expression<Number> folded(Number value) {
+        if constexpr (std::is_same_v<Number, complex>) {
+            if (value.imag() == 0) {
+                value = value.real();
+            }
+        }
+        return Expression<Number>(value);
+    }
+
+    Expression<Number> specialize(const Expression<Number>& expr) {
+        const Expr<Number>* node = expr.inner.get();
+        switch (node->kind()) {
+            case EXPR_NUM:
+                return expr;
+            case EXPR_VAR: {
+                auto it = values.find(static_cast<const VarExpr<Number>*>(node)->name);
+                return it != values.end() ? Expression<Number>(it->second) : expr;
+            }
+            case EXPR_SUM: {
+                auto v = static_cast<const SumExpr<Number>*>(node);
+                return binary<SumExpr<Number>>(expr, v->lhs, v->rhs, [](auto l, auto r) { return std::move(l) + std::move(r); });
+            }
+            case EXPR_MUL: {
+                auto v = static_cast<const MulExpr<Number>*>(node);
+                return binary<MulExpr<Number>>(expr, v->lhs, v->rhs, [](auto l, auto r) { return std::move(l) * std::move(r); });
+            }
+            case EXPR_DIV: {
+                auto v = static_cast<const DivExpr<Number>*>(node);
+                return binary<DivExpr<Number>>(expr, v->lhs, v->rhs, [](auto l, auto r) { return std::move(l) / std::move(r); });
+            }
+            case EXPR_POW: {
+                auto v = static_cast<const PowExpr<Number>*>(node);
+                return binary<PowExpr<Number>>(expr, v->base, v->exponent, [](auto l, auto r) { return pow(std::move(l), std::move(r)); });
+            }
+            case EXPR_NEG:
+                return unary<NegExpr<Number>>(expr, static_cast<const NegExpr<Number>*>(node)->expr, [](auto x) { return -std::move(x); });
+            case EXPR_SIN:
+                return unary<SinExpr<Number>>(expr, static_cast<const FunExpr<Number>*>(node)->expr, [](auto x) { return sin(std::move(x)); });
+            case EXPR_COS:
+                return unary<CosExpr<Number>>(expr, static_cast<const FunExpr<Number>*>(node)->expr, [](auto x) { return cos(std::move(x)); });
+            case EXPR_LN:
+                return unary<LnExpr<Number>>(expr, static_cast<const FunExpr<Number>*>(node)->expr, [](auto x) { return ln(std::move(x)); });
+            case EXPR_EXP:
+                return unary<ExpExpr<Number>>(expr, static_cast<const FunExpr<Number>*>(node)->expr, [](auto x) { return exp(std::move(x)); });
+        }
+        throw std::logic_error("Unknown expression kind");
+    }
+
+    template<typename Node, typename Op>
+    Expression<Number> binary(const Expression<Number>& expr, const Expression<Number>& lhs, const Expression<Number>& rhs, Op op) {
+        Expression<Number> l = memo.at(lhs.inner.get());
+        Expression<Number> r = memo.at(rhs.inner.get());
+        if (constant(l) && constant(r)) {
+            // evaluated as the node itself, since the operators would fold e.g. 0 * inf to 0
+            return folded(Node(std::move(l), std::move(r)).eval());
+        }
+        if (l.inner == lhs.inner && r.inner == rhs.inner) {
+            return expr;
+        }
+        return op(std::move(l), std::move(r));
+    }
+
+    template<typename Node, typename Op>
+    Expression<Number> unary(const Expression<Number>& expr, const Expression<Number>& operand, Op op) {
+        Expression<Number> x = memo.at(operand.inner.get());
+        if (constant(x)) {
+            return folded(Node(std::move(x)).eval());
+        }
+        if (x.inner == operand.inner) {
+            return expr;
+        }
+        return op(std::move(x));
+    }
+};
+
+template<typename Number>
+Specialized<Number> Expression<Number>::specialize(const std::vector<std::pair<std::string, Number>>& bindings) const {
+    Expression<Number> result = Specializer<Number>(bindings)(*this);
+    std::size_t removed = node_count(*this) - node_count(result);
+    return {std::move(result), removed};
+}
+
 template<typename Number = DefaultNumber>
 std::ostream& operator<<(std::ostream& os, const Expression<Number>& expr)
 {
@@ -526,9 +1209,10 @@ std::ostream& operator<<(std::ostream& os, const Expression<Number>& expr)
 
 template<typename Number>
 struct std::formatter<Expression<Number>> : std::formatter<std::string> {
-    auto format(Expression<Number> expr, format_context& ctx) const {
+    auto format(const Expression<Number>& expr, format_context& ctx) const {
         return formatter<string>::format(expr.to_string(), ctx);
     }
 };
 
 #include "parser.h"
+#include "polynomial.h"
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "symexpr.h"
+#include "vecmath.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Flat form of one or more expressions: one instruction per distinct subexpression,
+// in evaluation order. Instruction `i` writes slot `i`. Structurally equal subtrees
+// are merged while building, so shared parts (also across outputs) are computed once.
+// Variables are read from a caller-provided array in `vars` order.
+template<typename Number = DefaultNumber>
+struct Tape {
+    struct Instr {
+        ExprKind kind;
+        // operand slots; for EXPR_NUM `lhs` indexes `constants`, for EXPR_VAR it indexes `vars`
+        std::uint32_t lhs;
+        std::uint32_t rhs;
+
+        // slot `i` of those it reads, for i < operand_count(kind)
+        std::uint32_t operand(std::size_t i) const {
+            return i == 0 ? lhs : rhs;
+        }
+    };
+
+    // number of points evaluated together by eval_batch
+    static constexpr std::size_t BATCH = 64;
+
+    std::vector<std::string> vars;
+    std::vector<Number> constants;
+    std::vector<Instr> code;
+    // slot holding each output
+    std::vector<std::uint32_t> outputs;
+    // let eval_batch use the vecmath.h kernels for sin, cos, exp, ln and pow (double only);
+    // they're within 2 ulp of the exact result, but not bit-identical to libm
+    bool vector_math = false;
+
+    Tape(const std::vector<Expression<Number>>& exprs, std::vector<std::string> _vars) : vars(std::move(_vars)) {
+        Builder builder(*this);
+        for (auto& expr: exprs) {
+            outputs.push_back(builder.emit(expr));
+        }
+    }
+
+    Tape(const Expression<Number>& expr, std::vector<std::string> _vars)
+        : Tape(std::vector<Expression<Number>>{expr}, std::move(_vars)) {}
+
+    // the same program over another number type, e.g. a float copy of a double tape
+    template<typename Other>
+    explicit Tape(const Tape<Other>& other) : vars(other.vars), outputs(other.outputs) {
+        for (auto& value: other.constants) {
+            constants.push_back(Number(value));
+        }
+        for (auto& ins: other.code) {
+            code.push_back({ins.kind, ins.lhs, ins.rhs});
+        }
+    }
+
+    std::size_t size() const {
+        return code.size();
+    }
+
+    // evaluate with `values[i]` bound to `vars[i]` and return the first output.
+    // `scratch` must hold size() numbers.
+    Number eval(const Number* values, Number* scratch) const {
+        run(values, scratch);
+        return scratch[outputs[0]];
+    }
+
+    Number eval(const Number* values) const {
+        std::vector<Number> scratch(size());
+        return eval(values, scratch.data());
+    }
+
+    // evaluate all outputs into `out`
+    void eval(const Number* values, Number* scratch, Number* out) const {
+        run(values, scratch);
+        for (std::size_t k = 0; k < outputs.size(); k++) {
+            out[k] = scratch[outputs[k]];
+        }
+    }
+
+    // evaluate `n` points stored row by row (`points[p * vars.size() + i]` is `vars[i]` of point `p`)
+    // and write the first output of each to `out`.
+    // Each instruction runs over a block of BATCH points at once, which amortizes
+    // the dispatch and lets the arithmetic loops vectorize.
+    void eval_batch(const Number* points, std::size_t n, Number* out) const {
+        std::vector<Number> scratch(size() * BATCH);
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            run_block(points + begin * vars.size(), count, scratch.data());
+            std::copy_n(&scratch[outputs[0] * BATCH], count, out + begin);
+        }
+    }
+
+    // like eval_batch, but writes every output: `out[p * outputs.size() + k]` is output `k` of point `p`
+    void eval_batch_all(const Number* points, std::size_t n, Number* out) const {
+        std::vector<Number> scratch(size() * BATCH);
+        std::size_t nout = outputs.size();
+        for (std::size_t begin = 0; begin < n; begin += BATCH) {
+            std::size_t count = std::min(BATCH, n - begin);
+            run_block(points + begin * vars.size(), count, scratch.data());
+            for (std::size_t k = 0; k < nout; k++) {
+                const Number* slot = &scratch[outputs[k] * BATCH];
+                for (std::size_t j = 0; j < count; j++) {
+                    out[(begin + j) * nout + k] = slot[j];
+                }
+            }
+        }
+    }
+
+    // instruction `ins` over `count` <= BATCH points into `dst`: operand slot `r` of point `j` is
+    // read from `scratch[r * BATCH + j]`, leaves from `constants` and the `nvars` variables of
+    // each point in `block`, row by row. The kernel of eval_batch, also run by Program and Profiler.
+    static void run_instr(const Instr& ins, const Number* constants, const Number* block, std::size_t nvars,
+                          const Number* scratch, Number* dst, std::size_t count, bool vector_math) {
+        using std::sin, std::cos, std::log, std::exp, std::pow;
+        // lhs and rhs of leaves aren't slots
+        std::size_t operands = operand_count(ins.kind);
+        const Number* a = operands > 0 ? &scratch[ins.lhs * BATCH] : nullptr;
+        const Number* b = operands > 1 ? &scratch[ins.rhs * BATCH] : nullptr;
+        if constexpr (std::is_same_v<Number, double>) {
+            if (vector_math && eval_vector_math(ins.kind, a, b, dst, count)) {
+                return;
+            }
+        }
+        switch (ins.kind) {
+            case EXPR_NUM:
+                std::fill(dst, dst + count, constants[ins.lhs]);
+                break;
+            case EXPR_VAR:
+                for (std::size_t j = 0; j < count; j++) dst[j] = block[j * nvars + ins.lhs];
+                break;
+            case EXPR_SUM: for (std::size_t j = 0; j < count; j++) dst[j] = a[j] + b[j]; break;
+            case EXPR_NEG: for (std::size_t j = 0; j < count; j++) dst[j] = -a[j]; break;
+            case EXPR_MUL: for (std::size_t j = 0; j < count; j++) dst[j] = a[j] * b[j]; break;
+            case EXPR_DIV: for (std::size_t j = 0; j < count; j++) dst[j] = a[j] / b[j]; break;
+            case EXPR_POW: for (std::size_t j = 0; j < count; j++) dst[j] = pow(a[j], b[j]); break;
+            case EXPR_SIN: for (std::size_t j = 0; j < count; j++) dst[j] = sin(a[j]); break;
+            case EXPR_COS: for (std::size_t j = 0; j < count; j++) dst[j] = cos(a[j]); break;
+            case EXPR_LN: for (std::size_t j = 0; j < count; j++) dst[j] = log(a[j]); break;
+            case EXPR_EXP: for (std::size_t j = 0; j < count; j++) dst[j] = exp(a[j]); break;
+        }
+    }
+
+private:
+    // evaluate `count` <= BATCH points into `scratch`, slot `i` of point `j` at `scratch[i * BATCH + j]`
+    void run_block(const Number* block, std::size_t count, Number* scratch) const {
+        for (std::size_t i = 0; i < code.size(); i++) {
+            run_instr(code[i], constants.data(), block, vars.size(), scratch, &scratch[i * BATCH], count, vector_math);
+        }
+    }
+
+    static bool eval_vector_math(ExprKind kind, const double* a, const double* b, double* dst, std::size_t count) {
+        switch (kind) {
+            case EXPR_POW: vecmath::pow(a, b, dst, count); return true;
+            case EXPR_SIN: vecmath::sin(a, dst, count); return true;
+            case EXPR_COS: vecmath::cos(a, dst, count); return true;
+            case EXPR_LN: vecmath::log(a, dst, count); return true;
+            case EXPR_EXP: vecmath::exp(a, dst, count); return true;
+            default: return false;
+        }
+    }
+
+    void run(const Number* values, Number* scratch) const {
+        using std::sin, std::cos, std::log, std::exp, std::pow;
+        for (std::size_t i = 0; i < code.size(); i++) {
+            const Instr& ins = code[i];
+            switch (ins.kind) {
+                case EXPR_NUM: scratch[i] = constants[ins.lhs]; break;
+                case EXPR_VAR: scratch[i] = values[ins.lhs]; break;
+                case EXPR_SUM: scratch[i] = scratch[ins.lhs] + scratch[ins.rhs]; break;
+                case EXPR_NEG: scratch[i] = -scratch[ins.lhs]; break;
+                case EXPR_MUL: scratch[i] = scratch[ins.lhs] * scratch[ins.rhs]; break;
+                case EXPR_DIV: scratch[i] = scratch[ins.lhs] / scratch[ins.rhs]; break;
+                case EXPR_POW: scratch[i] = pow(scratch[ins.lhs], scratch[ins.rhs]); break;
+                case EXPR_SIN: scratch[i] = sin(scratch[ins.lhs]); break;
+                case EXPR_COS: scratch[i] = cos(scratch[ins.lhs]); break;
+                case EXPR_LN: scratch[i] = log(scratch[ins.lhs]); break;
+                case EXPR_EXP: scratch[i] = exp(scratch[ins.lhs]); break;
+            }
+        }
+    }
+
+    struct Builder {
+        Tape& tape;
+        std::unordered_map<const Expr<Number>*, std::uint32_t> visited;
+        std::unordered_map<std::string, std::uint32_t> constant_index;
+        std::unordered_map<std::string, std::uint32_t> numbered;
+
+        Builder(Tape& _tape) : tape(_tape) {}
+
+        // with an explicit stack, so deep trees don't overflow the call stack; operands
+        // are emitted left to right so slot order is deterministic
+        std::uint32_t emit(const Expression<Number>& expr) {
+            std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+            while (!stack.empty()) {
+                const Expr<Number>* node = stack.back();
+                if (visited.contains(node)) {
+                    stack.pop_back();
+                    continue;
+                }
+                auto children = operands(node);
+                bool ready = true;
+                for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                    if (!visited.contains(children[i]->inner.get())) {
+                        stack.push_back(children[i]->inner.get());
+                        ready = false;
+                    }
+                }
+                if (!ready) {
+                    continue;
+                }
+                stack.pop_back();
+                visited.emplace(node, emit_node(node, children));
+            }
+            return visited.at(expr.inner.get());
+        }
+
+        // once the operands have their slots
+        std::uint32_t emit_node(const Expr<Number>* node, const std::array<const Expression<Number>*, 2>& children) {
+            switch (node->kind()) {
+                case EXPR_NUM:
+                    return push(EXPR_NUM, constant(static_cast<const NumExpr<Number>*>(node)->value), 0);
+                case EXPR_VAR:
+                    return push(EXPR_VAR, variable(static_cast<const VarExpr<Number>*>(node)->name), 0);
+                default:
+                    break;
+            }
+            std::uint32_t lhs = visited.at(children[0]->inner.get());
+            return push(node->kind(), lhs, children[1] ? visited.at(children[1]->inner.get()) : 0);
+        }
+
+        // constants are merged by bit pattern, so 0 and -0 stay distinct
+        std::uint32_t constant(const Number& value) {
+            std::string key(reinterpret_cast<const char*>(&value), sizeof(Number));
+            auto [it, inserted] = constant_index.emplace(std::move(key), tape.constants.size());
+            if (inserted) {
+                tape.constants.push_back(value);
+            }
+            return it->second;
+        }
+
+        std::uint32_t variable(const std::string& name) {
+            auto it = std::find(tape.vars.begin(), tape.vars.end(), name);
+            if (it == tape.vars.end()) {
+                throw std::invalid_argument(std::format("Can't evaluate an unknown `{}`", name));
+            }
+            return it - tape.vars.begin();
+        }
+
+        // value numbering: an instruction equal to an earlier one reuses its slot
+        std::uint32_t push(ExprKind kind, std::uint32_t lhs, std::uint32_t rhs) {
+            Instr ins{kind, lhs, rhs};
+            std::string key(reinterpret_cast<const char*>(&ins), sizeof(ins));
+            auto [it, inserted] = numbered.emplace(std::move(key), tape.code.size());
+            if (inserted) {
+                tape.code.push_back(ins);
+            }
+            return it->second;
+        }
+    };
+};
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "symexpr.h"
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <format>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Taylor-mode evaluation: every node is evaluated to the truncated series
+// c[0] + c[1] t + ... + c[order] t^order of its value at `var` = `at` + t, so
+// c[k] is the k-th derivative divided by k!. Products, quotients and the library
+// functions use the usual recurrences, which take O(order^2) per node, instead
+// of differentiating the tree `order` times.
+//
+// A power with a constant natural exponent is multiplied out by squaring (which
+// also works at a = 0), one with another constant exponent uses the recurrence
+// for a^p, and any other power is exp(exponent * ln(base)). The last two divide
+// by the base, so they throw where it's 0 instead of returning nans.
+template<typename Number = DefaultNumber>
+class TaylorSeries {
+    using Series = std::vector<Number>;
+
+    std::string var;
+    Number at;
+    std::size_t order;
+    std::unordered_map<std::string, Number> values;
+    std::unordered_map<const Expr<Number>*, Series> memo;
+
+public:
+    TaylorSeries(std::string _var, Number _at, std::size_t _order, const std::vector<std::pair<std::string, Number>>& bindings = {})
+        : var(std::move(_var)), at(_at), order(_order), values(bindings.begin(), bindings.end()) {}
+
+    // every node after its operands, from an explicit stack so deep trees don't
+    // overflow the call stack
+    const Series& operator()(const Expression<Number>& expr) {
+        std::vector<const Expr<Number>*> stack = {expr.inner.get()};
+        while (!stack.empty()) {
+            const Expr<Number>* node = stack.back();
+            if (memo.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto children = operands(node);
+            bool ready = true;
+            for (std::size_t i = operand_count(node->kind()); i-- > 0;) {
+                if (!memo.contains(children[i]->inner.get())) {
+                    stack.push_back(children[i]->inner.get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            stack.pop_back();
+            Series result = series(node, children);
+            memo.emplace(node, std::move(result));
+        }
+        return memo.at(expr.inner.get());
+    }
+
+private:
+    Series constant(Number value) const {
+        Series result(order + 1, Number(0));
+        result[0] = value;
+        return result;
+    }
+
+    // once the operands' series are known
+    Series series(const Expr<Number>* node, const std::array<const Expression<Number>*, 2>& children) {
+        auto operand = [&](std::size_t i) -> const Series& {
+            return memo.at(children[i]->inner.get());
+        };
+        switch (node->kind()) {
+            case EXPR_NUM:
+                return constant(static_cast<const NumExpr<Number>*>(node)->value);
+            case EXPR_VAR: {
+                auto& name = static_cast<const VarExpr<Number>*>(node)->name;
+                if (name == var) {
+                    Series result = constant(at);
+                    if (order > 0) {
+                        result[1] = Number(1);
+                    }
+                    return result;
+                }
+                auto it = values.find(name);
+                if (it == values.end()) {
+                    throw std::invalid_argument(std::format("Can't evaluate an unknown `{}`", name));
+                }
+                return constant(it->second);
+            }
+            case EXPR_SUM: {
+                Series result = operand(0);
+                const Series& b = operand(1);
+                for (std::size_t k = 0; k <= order; k++) {
+                    result[k] += b[k];
+                }
+                return result;
+            }
+            case EXPR_NEG: {
+                Series result = operand(0);
+                for (Number& c: result) {
+                    c = -c;
+                }
+                return result;
+            }
+            case EXPR_MUL: return mul(operand(0), operand(1));
+            case EXPR_DIV: return div(operand(0), operand(1));
+            case EXPR_POW: return pow(operand(0), operand(1));
+            case EXPR_SIN: return sincos(operand(0)).first;
+            case EXPR_COS: return sincos(operand(0)).second;
+            case EXPR_LN: return ln(operand(0));
+            case EXPR_EXP: return exp(operand(0));
+        }
+        throw std::logic_error("Unknown expression kind");
+    }
+
+    // c[k] = sum a[j] b[k - j]
+    Series mul(const Series& a, const Series& b) const {
+        Series c(order + 1, Number(0));
+        for (std::size_t k = 0; k <= order; k++) {
+            for (std::size_t j = 0; j <= k; j++) {
+                c[k] += a[j] * b[k - j];
+            }
+        }
+        return c;
+    }
+
+    // from a = b c: c[k] = (a[k] - sum_{j >= 1} b[j] c[k - j]) / b[0]
+    Series div(const Series& a, const Series& b) const {
+        Series c(order + 1);
+        for (std::size_t k = 0; k <= order; k++) {
+            Number sum = a[k];
+            for (std::size_t j = 1; j <= k; j++) {
+                sum -= b[j] * c[k - j];
+            }
+            c[k] = sum / b[0];
+        }
+        return c;
+    }
+
+    // from c' = a' c: k c[k] = sum j a[j] c[k - j]
+    Series exp(const Series& a) const {
+        using std::exp;
+        Series c(order + 1, Number(0));
+        c[0] = exp(a[0]);
+        for (std::size_t k = 1; k <= order; k++) {
+            for (std::size_t j = 1; j <= k; j++) {
+                c[k] += Number(double(j)) * a[j] * c[k - j];
+            }
+            c[k] /= Number(double(k));
+        }
+        return c;
+    }
+
+    // from a c' = a': c[k] = (a[k] - sum_{j < k} j c[j] a[k - j] / k) / a[0]
+    Series ln(const Series& a) const {
+        using std::log;
+        Series c(order + 1);
+        c[0] = log(a[0]);
+        for (std::size_t k = 1; k <= order; k++) {
+            Number sum(0);
+            for (std::size_t j = 1; j < k; j++) {
+                sum += Number(double(j)) * c[j] * a[k - j];
+            }
+            c[k] = (a[k] - sum / Number(double(k))) / a[0];
+        }
+        return c;
+    }
+
+    // from s' = a' c and c' = -a' s
+    std::pair<Series, Series> sincos(const Series& a) const {
+        using std::sin, std::cos;
+        Series s(order + 1, Number(0)), c(order + 1, Number(0));
+        s[0] = sin(a[0]);
+        c[0] = cos(a[0]);
+        for (std::size_t k = 1; k <= order; k++) {
+            for (std::size_t j = 1; j <= k; j++) {
+                s[k] += Number(double(j)) * a[j] * c[k - j];
+                c[k] -= Number(double(j)) * a[j] * s[k - j];
+            }
+            s[k] /= Number(double(k));
+            c[k] /= Number(double(k));
+        }
+        return {s, c};
+    }
+
+    Series pow(const Series& a, const Series& b) const {
+        using std::pow;
+        bool constant_exponent = true;
+        for (std::size_t k = 1; k <= order; k++) {
+            constant_exponent &= b[k] == Number(0);
+        }
+        Number p = b[0];
+        if (constant_exponent && natural(p)) {
+            return power(a, int(real_part(p)));
+        }
+        if (a[0] == Number(0) && order > 0) {
+            throw std::invalid_argument("Can't expand a power whose base is 0 into a Taylor series unless the exponent is a natural number");
+        }
+        if (!constant_exponent) {
+            return exp(mul(b, ln(a)));
+        }
+        // from a c' = p a' c: k a[0] c[k] = sum_{j >= 1} (p j - (k - j)) a[j] c[k - j]
+        Series c(order + 1, Number(0));
+        c[0] = pow(a[0], p);
+        for (std::size_t k = 1; k <= order; k++) {
+            for (std::size_t j = 1; j <= k; j++) {
+                c[k] += (p * Number(double(j)) - Number(double(k - j))) * a[j] * c[k - j];
+            }
+            c[k] /= Number(double(k)) * a[0];
+        }
+        return c;
+    }
+
+    // a^n by squaring
+    Series power(Series a, int n) const {
+        Series result = constant(Number(1));
+        for (; n > 0; n >>= 1) {
+            if (n & 1) {
+                result = mul(result, a);
+            }
+            if (n > 1) {
+                a = mul(a, a);
+            }
+        }
+        return result;
+    }
+
+    static double real_part(Number value) {
+        if constexpr (std::is_same_v<Number, complex>) {
+            return value.real();
+        } else {
+            return value;
+        }
+    }
+
+    static bool natural(Number value) {
+        double n = real_part(value);
+        return value == Number(n) && n >= 0 && n <= std::numeric_limits<int>::max() && n == std::trunc(n);
+    }
+};
+
+// the Taylor coefficients of `expr` in `var` around `at` up to t^order, i.e. d^k/dvar^k expr / k!
+template<typename Number = DefaultNumber>
+std::vector<Number> taylor_coefficients(const Expression<Number>& expr, const std::string& var, Number at, std::size_t order,
+                                        const std::vector<std::pair<std::string, Number>>& bindings = {}) {
+    return TaylorSeries<Number>(var, at, order, bindings)(expr);
+}
+
+// d^k/dvar^k expr at `var` = `at` for k = 0..order
+template<typename Number = DefaultNumber>
+std::vector<Number> taylor_derivatives(const Expression<Number>& expr, const std::string& var, Number at, std::size_t order,
+                                       const std::vector<std::pair<std::string, Number>>& bindings = {}) {
+    std::vector<Number> result = taylor_coefficients(expr, var, at, order, bindings);
+    double factorial = 1;
+    for (std::size_t k = 1; k <= order; k++) {
+        factorial *= k;
+        result[k] *= Number(factorial);
+    }
+    return result;
+}
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Vector math: sin, cos, exp, log and pow over arrays of doubles, plus sinh, cosh,
+// atan2 and ln(hypot(x, y)), which the complex kernels in complex_batch.h build on.
+//
+// Every function is a branch-free kernel that only uses double arithmetic and
+// 64-bit integer and/or/shift/add on the bit patterns, so the array loops below
+// vectorize for whatever the compiler targets: SSE2 by default, AVX2 or AVX-512
+// with -march=native (make NATIVE=1). Arguments the kernel doesn't cover (nan,
+// infinities, results that overflow, huge sin/cos arguments, ...) are flagged
+// and recomputed with libm afterwards, one lane at a time.
+// The scalar overloads run the same kernel and are the reference for the arrays.
+//
+// Error bounds against the exact result (the accuracy test in tests.cpp checks
+// them against glibc, which is within 0.52 ulp itself, over random samples):
+//     exp        1 ulp
+//     log        1 ulp
+//     sin/cos    1 ulp, |x| < 2^19 (larger arguments go to libm)
+//     pow        2 ulp
+//     sinh/cosh  2 ulp
+//     atan2      1 ulp
+//     log_hypot  1 ulp, also for x^2 + y^2 near 1 (checked against long double away from it)
+//
+// The Dekker products rely on the compiler not contracting a * b + c into fma,
+// which holds for -std=c++23 (ISO mode implies -ffp-contract=off with GCC).
+namespace vecmath {
+
+namespace detail {
+
+inline std::uint64_t bits(double x) {
+    return std::bit_cast<std::uint64_t>(x);
+}
+
+inline double from_bits(std::uint64_t x) {
+    return std::bit_cast<double>(x);
+}
+
+// adding it rounds a double below 2^51 in magnitude to an integer, which
+// then sits in the low bits of the sum's bit pattern
+constexpr double SHIFTER = 0x1.8p52;
+
+// ln(2) split so that k * LN2_HI is exact for |k| < 2^21
+constexpr double LN2_HI = 6.93147180369123816490e-01;
+constexpr double LN2_LO = 1.90821492927058770002e-10;
+constexpr double LOG2E = 1.44269504088896338700e+00;
+
+// error-free transformations: a + b = s + e and a * b = p + e exactly
+inline void two_sum(double a, double b, double& s, double& e) {
+    s = a + b;
+    double bb = s - a;
+    e = (a - (s - bb)) + (b - bb);
+}
+
+inline void split(double a, double& hi, double& lo) {
+    double c = 134217729.0 * a;
+    hi = c - (c - a);
+    lo = a - hi;
+}
+
+inline void two_prod(double a, double b, double& p, double& e) {
+    double ah, al, bh, bl;
+    split(a, ah, al);
+    split(b, bh, bl);
+    p = a * b;
+    e = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+}
+
+// all ones where `bit` (0 or 1) is set, for selecting between bit patterns
+inline std::uint64_t mask(std::uint64_t bit) {
+    return 0 - bit;
+}
+
+inline double select(std::uint64_t mask, double a, double b) {
+    return from_bits((bits(a) & mask) | (bits(b) & ~mask));
+}
+
+// exp(x + tail) for x in [-745.2, 709.7] and |tail| well below ulp(x)
+inline double exp_kernel(double x, double tail) {
+    double kd = x * LOG2E + SHIFTER;
+    std::uint64_t k = bits(kd) - bits(SHIFTER);
+    kd -= SHIFTER;
+    double r = (x - kd * LN2_HI) - kd * LN2_LO + tail;
+    // Taylor series to r^13 / 13!; the remainder is below 2^-60 for |r| <= ln(2) / 2
+    double p = 1.0 / 6227020800;
+    p = p * r + 1.0 / 479001600;
+    p = p * r + 1.0 / 39916800;
+    p = p * r + 1.0 / 3628800;
+    p = p * r + 1.0 / 362880;
+    p = p * r + 1.0 / 40320;
+    p = p * r + 1.0 / 5040;
+    p = p * r + 1.0 / 720;
+    p = p * r + 1.0 / 120;
+    p = p * r + 1.0 / 24;
+    p = p * r + 1.0 / 6;
+    p = p * r + 0.5;
+    p = p * r * r + r;
+    p += 1;
+    // 2^k in two halves, so that k down to -1075 gives subnormals with one rounding
+    std::uint64_t k1 = bits(kd * 0.5 + SHIFTER) - bits(SHIFTER);
+    std::uint64_t k2 = k - k1;
+    return p * from_bits((k1 + 1023) << 52) * from_bits((k2 + 1023) << 52);
+}
+
+constexpr double EXP_MIN = -745.1;
+constexpr double EXP_MAX = 709.7;
+
+inline bool exp_special(double x) {
+    return !(x >= EXP_MIN && x <= EXP_MAX);
+}
+
+// ln(x) = hi + lo with a relative error around 2^-68, for positive normal x
+inline void log_kernel(double x, double& hi, double& lo) {
+    // x = 2^k * m with m in [sqrt(1/2), sqrt(2))
+    std::uint64_t ix = bits(x);
+    std::uint64_t tmp = ix - 0x3fe6a09e667f3bcdull + (1ull << 62);
+    std::uint64_t biased = tmp >> 52;
+    double m = from_bits(ix - ((biased - 1024) << 52));
+    double kd = from_bits(0x4330000000000000ull | biased) - 0x1p52 - 1024;
+
+    // ln(m) = 2 atanh(s) with s = f / (2 + f), carried as s + s_lo
+    double f = m - 1;
+    double u = 2 + f;
+    double u_lo = (2 - u) + f;
+    double s = f / u;
+    double p, pe;
+    two_prod(s, u, p, pe);
+    double s_lo = (((f - p) - pe) - s * u_lo) / u;
+    double z = s * s;
+    double t = 1.0 / 23;
+    t = t * z + 1.0 / 21;
+    t = t * z + 1.0 / 19;
+    t = t * z + 1.0 / 17;
+    t = t * z + 1.0 / 15;
+    t = t * z + 1.0 / 13;
+    t = t * z + 1.0 / 11;
+    t = t * z + 1.0 / 9;
+    t = t * z + 1.0 / 7;
+    t = t * z + 1.0 / 5;
+    t = t * z + 1.0 / 3;
+
+    double e;
+    two_sum(kd * LN2_HI, 2 * s, hi, e);
+    lo = e + (kd * LN2_LO + 2 * s_lo + 2 * s * z * t);
+    double sum = hi + lo;
+    lo -= sum - hi;
+    hi = sum;
+}
+
+inline bool log_special(double x) {
+    return !(x >= DBL_MIN && x <= DBL_MAX);
+}
+
+inline double log_value(double x) {
+    double hi, lo;
+    log_kernel(x, hi, lo);
+    return hi;
+}
+
+// pow for |x| normal; a negative x is handled for integer y below 2^52
+inline double pow_kernel(double x, double y) {
+    double ax = std::abs(x);
+    double hi, lo;
+    log_kernel(ax, hi, lo);
+    double p, pe;
+    two_prod(y, hi, p, pe);
+    double result = exp_kernel(p, pe + y * lo);
+    // y + 2^52 is an integer whose lowest bit is y's parity
+    double ay = std::abs(y);
+    double rounded = ay + 0x1p52;
+    std::uint64_t odd = bits(rounded) & 1;
+    std::uint64_t negative = bits(x) >> 63;
+    return from_bits(bits(result) ^ ((odd & negative) << 63));
+}
+
+inline bool pow_special(double x, double y) {
+    double ax = std::abs(x);
+    double ay = std::abs(y);
+    if (!(ax >= DBL_MIN && ax <= DBL_MAX && ay <= DBL_MAX)) {
+        return true;
+    }
+    // a negative base needs an integer exponent the kernel can tell the parity of
+    if (x < 0 && !(ay < 0x1p52 && (ay + 0x1p52) - 0x1p52 == ay)) {
+        return true;
+    }
+    // |ln(x)| < (|exponent| + 1) * ln(2), so this bounds |y * ln(x)| from above
+    double exponent = from_bits(0x4330000000000000ull | (bits(ax) >> 52)) - 0x1p52 - 1023;
+    return ay * (std::abs(exponent) + 1) * LN2_HI > 700;
+}
+
+// sin(x) and cos(x) for |x| < 2^19: reduce by multiples of pi/2 (fdlibm's three-step
+// Cody-Waite reduction) and evaluate fdlibm's kernels on the remainder
+constexpr double SINCOS_MAX = 0x1p19;
+
+inline void sincos_kernel(double x, double& sin_x, double& cos_x) {
+    constexpr double TWO_OVER_PI = 6.36619772367581382433e-01;
+    constexpr double PIO2_1 = 1.57079632673412561417e+00;
+    constexpr double PIO2_2 = 6.07710050630396597660e-11;
+    constexpr double PIO2_2T = 2.02226624879595063154e-21;
+    constexpr double PIO2_3 = 2.02226624871116645580e-21;
+    constexpr double PIO2_3T = 8.47842766036889956997e-32;
+
+    double nd = x * TWO_OVER_PI + SHIFTER;
+    std::uint64_t quadrant = bits(nd) - bits(SHIFTER);
+    nd -= SHIFTER;
+
+    // the first step's tail PIO2_1T is superseded by the next two steps, which run unconditionally
+    double r = x - nd * PIO2_1;
+    double t = r;
+    double w = nd * PIO2_2;
+    r = t - w;
+    w = nd * PIO2_2T - ((t - r) - w);
+    t = r;
+    w = nd * PIO2_3;
+    r = t - w;
+    w = nd * PIO2_3T - ((t - r) - w);
+    double y0 = r - w;
+    double y1 = (r - y0) - w;
+
+    double z = y0 * y0;
+    double v = z * y0;
+    double sr = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06
+        + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+    double s = y0 - ((z * (0.5 * y1 - v * sr) - y1) - v * -1.66666666666666324348e-01);
+
+    double cr = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05
+        + z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+    double hz = 0.5 * z;
+    double cw = 1 - hz;
+    double c = cw + (((1 - cw) - hz) + (z * cr - y0 * y1));
+
+    // quadrant q: sin = s, c, -s, -c and cos = c, -s, -c, s
+    std::uint64_t swap = mask(quadrant & 1);
+    sin_x = from_bits(bits(select(swap, c, s)) ^ ((quadrant & 2) << 62));
+    cos_x = from_bits(bits(select(swap, s, c)) ^ (((quadrant + 1) & 2) << 62));
+}
+
+inline bool sincos_special(double x) {
+    return !(std::abs(x) < SINCOS_MAX);
+}
+
+inline double sin_value(double x) {
+    double s, c;
+    sincos_kernel(x, s, c);
+    return s;
+}
+
+inline double cos_value(double x) {
+    double s, c;
+    sincos_kernel(x, s, c);
+    return c;
+}
+
+inline double exp_value(double x) {
+    return exp_kernel(x, 0);
+}
+
+// sinh(x) and cosh(x) for |x| <= EXP_MAX from one exp: (e^x -+ e^-x) / 2, with the
+// Taylor series of sinh below 1, where the difference cancels
+inline void sinhcosh_kernel(double x, double& sinh_x, double& cosh_x) {
+    double ax = std::abs(x);
+    double e = exp_kernel(ax, 0);
+    double inv = 1 / e;
+    cosh_x = 0.5 * (e + inv);
+    // to x^19 / 19!; the remainder is below 2^-65 for |x| < 1
+    double z = ax * ax;
+    double p = 1.0 / 121645100408832000;
+    p = p * z + 1.0 / 355687428096000;
+    p = p * z + 1.0 / 1307674368000;
+    p = p * z + 1.0 / 6227020800;
+    p = p * z + 1.0 / 39916800;
+    p = p * z + 1.0 / 362880;
+    p = p * z + 1.0 / 5040;
+    p = p * z + 1.0 / 120;
+    p = p * z + 1.0 / 6;
+    double small = ax + ax * z * p;
+    double s = select(mask(ax < 1), small, 0.5 * (e - inv));
+    sinh_x = from_bits(bits(s) | (bits(x) & (1ull << 63)));
+}
+
+inline bool sinhcosh_special(double x) {
+    return !(std::abs(x) <= EXP_MAX);
+}
+
+inline double sinh_value(double x) {
+    double s, c;
+    sinhcosh_kernel(x, s, c);
+    return s;
+}
+
+inline double cosh_value(double x) {
+    double s, c;
+    sinhcosh_kernel(x, s, c);
+    return c;
+}
+
+// atan(x) for x >= 0: fdlibm's reduction to |t| < 7/16 around atan(0.5), atan(1),
+// atan(1.5) and pi/2, picking the one divisor and offset with selects
+inline double atan_kernel(double x) {
+    std::uint64_t m0 = mask(x >= 7.0 / 16);
+    std::uint64_t m1 = mask(x >= 11.0 / 16);
+    std::uint64_t m2 = mask(x >= 19.0 / 16);
+    std::uint64_t m3 = mask(x >= 39.0 / 16);
+    double num = select(m3, -1, select(m2, x - 1.5, select(m1, x - 1, select(m0, 2 * x - 1, x))));
+    double den = select(m3, x, select(m2, 1 + 1.5 * x, select(m1, x + 1, select(m0, 2 + x, 1))));
+    double hi = select(m3, 1.57079632679489655800e+00, select(m2, 9.82793723247329054082e-01,
+        select(m1, 7.85398163397448278999e-01, select(m0, 4.63647609000806093515e-01, 0))));
+    double lo = select(m3, 6.12323399573676603587e-17, select(m2, 1.39033110312309984516e-17,
+        select(m1, 3.06161699786838301793e-17, select(m0, 2.26987774529616870924e-17, 0))));
+    double t = num / den;
+    double z = t * t;
+    double w = z * z;
+    double s1 = z * (3.33333333333329318027e-01 + w * (1.42857142725034663711e-01 + w * (9.09088713343650656196e-02
+        + w * (6.66107313738753120669e-02 + w * (4.97687799461593236017e-02 + w * 1.62858201153657823623e-02)))));
+    double s2 = w * (-1.99999999998764832476e-01 + w * (-1.11111104054623557880e-01 + w * (-7.69187620504482999495e-02
+        + w * (-5.83357013379057348645e-02 + w * -3.65315727442169155270e-02))));
+    return hi - ((t * (s1 + s2) - lo) - t);
+}
+
+// atan2(y, x) as atan(|y / x|), moved to the quadrant; the ratio has to be normal
+inline double atan2_kernel(double y, double x) {
+    constexpr double PI = 3.1415926535897931160e+00;
+    constexpr double PI_LO = 1.2246467991473531772e-16;
+    double z = atan_kernel(std::abs(y) / std::abs(x));
+    double r = select(mask(bits(x) >> 63), PI - (z - PI_LO), z);
+    return from_bits(bits(r) | (bits(y) & (1ull << 63)));
+}
+
+inline bool atan2_special(double y, double x) {
+    double ratio = std::abs(y) / std::abs(x);
+    return !(ratio >= DBL_MIN && ratio <= DBL_MAX);
+}
+
+// ln(sqrt(x^2 + y^2)), the real part of the complex log: the sum of squares is
+// carried exactly as s + tail, so there's no cancellation for |x + yi| near 1
+inline double log_hypot_kernel(double x, double y) {
+    double p1, e1, p2, e2, s, e;
+    two_prod(x, x, p1, e1);
+    two_prod(y, y, p2, e2);
+    two_sum(p1, p2, s, e);
+    double tail = e + (e1 + e2);
+    double hi, lo;
+    log_kernel(s, hi, lo);
+    return 0.5 * (hi + (lo + tail / s));
+}
+
+inline bool log_hypot_special(double x, double y) {
+    double s = x * x + y * y;
+    return !(s >= DBL_MIN && s <= DBL_MAX);
+}
+
+// out[i] = kernel(x[i]), then the flagged lanes again with libm
+template<typename Kernel, typename Special, typename Fallback>
+void map(const double* x, double* out, std::size_t n, Kernel kernel, Special special, Fallback fallback) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = kernel(x[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (special(x[i])) {
+            out[i] = fallback(x[i]);
+        }
+    }
+}
+
+}
+
+inline double exp(double x) {
+    return detail::exp_special(x) ? std::exp(x) : detail::exp_value(x);
+}
+
+inline double log(double x) {
+    return detail::log_special(x) ? std::log(x) : detail::log_value(x);
+}
+
+inline double sin(double x) {
+    return detail::sincos_special(x) ? std::sin(x) : detail::sin_value(x);
+}
+
+inline double cos(double x) {
+    return detail::sincos_special(x) ? std::cos(x) : detail::cos_value(x);
+}
+
+inline double pow(double x, double y) {
+    return detail::pow_special(x, y) ? std::pow(x, y) : detail::pow_kernel(x, y);
+}
+
+inline double sinh(double x) {
+    return detail::sinhcosh_special(x) ? std::sinh(x) : detail::sinh_value(x);
+}
+
+inline double cosh(double x) {
+    return detail::sinhcosh_special(x) ? std::cosh(x) : detail::cosh_value(x);
+}
+
+inline double atan2(double y, double x) {
+    return detail::atan2_special(y, x) ? std::atan2(y, x) : detail::atan2_kernel(y, x);
+}
+
+inline double log_hypot(double x, double y) {
+    return detail::log_hypot_special(x, y) ? std::log(std::hypot(x, y)) : detail::log_hypot_kernel(x, y);
+}
+
+// `out` must not overlap the inputs
+inline void exp(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::exp_value(v); }, [](double v) { return detail::exp_special(v); },
+        [](double v) { return std::exp(v); });
+}
+
+inline void log(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::log_value(v); }, [](double v) { return detail::log_special(v); },
+        [](double v) { return std::log(v); });
+}
+
+inline void sin(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::sin_value(v); }, [](double v) { return detail::sincos_special(v); },
+        [](double v) { return std::sin(v); });
+}
+
+inline void cos(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::cos_value(v); }, [](double v) { return detail::sincos_special(v); },
+        [](double v) { return std::cos(v); });
+}
+
+inline void sincos(const double* x, double* sin_out, double* cos_out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        detail::sincos_kernel(x[i], sin_out[i], cos_out[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (detail::sincos_special(x[i])) {
+            sin_out[i] = std::sin(x[i]);
+            cos_out[i] = std::cos(x[i]);
+        }
+    }
+}
+
+inline void sinh(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::sinh_value(v); }, [](double v) { return detail::sinhcosh_special(v); },
+        [](double v) { return std::sinh(v); });
+}
+
+inline void cosh(const double* x, double* out, std::size_t n) {
+    detail::map(x, out, n, [](double v) { return detail::cosh_value(v); }, [](double v) { return detail::sinhcosh_special(v); },
+        [](double v) { return std::cosh(v); });
+}
+
+inline void sinhcosh(const double* x, double* sinh_out, double* cosh_out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        detail::sinhcosh_kernel(x[i], sinh_out[i], cosh_out[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (detail::sinhcosh_special(x[i])) {
+            sinh_out[i] = std::sinh(x[i]);
+            cosh_out[i] = std::cosh(x[i]);
+        }
+    }
+}
+
+inline void pow(const double* x, const double* y, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = detail::pow_kernel(x[i], y[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (detail::pow_special(x[i], y[i])) {
+            out[i] = std::pow(x[i], y[i]);
+        }
+    }
+}
+
+inline void atan2(const double* y, const double* x, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = detail::atan2_kernel(y[i], x[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (detail::atan2_special(y[i], x[i])) {
+            out[i] = std::atan2(y[i], x[i]);
+        }
+    }
+}
+
+inline void log_hypot(const double* x, const double* y, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = detail::log_hypot_kernel(x[i], y[i]);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (detail::log_hypot_special(x[i], y[i])) {
+            out[i] = std::log(std::hypot(x[i], y[i]));
+        }
+    }
+}
+
+}
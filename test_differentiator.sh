@@ -22,6 +22,18 @@ assert_equals "120" "$result" "Simple multiplication"
 result=$($DIFFERENTIATOR --eval "x * sin(x)" "x=2")
 assert_equals "1.81859" "$result" "Function with sin"
 
+result=$($DIFFERENTIATOR --eval "x * y" "x=10" 2>&1)
+assert_equals "Can't evaluate an unknown \`y\`" "$result" "Unbound variable"
+
+result=$($DIFFERENTIATOR --eval "ln(x) + 1" "x=-1")
+assert_equals "1 + 3.14159i" "$result" "Logarithm of a negative value"
+
+result=$($DIFFERENTIATOR --eval "x ^ n" "x=-2" "n=2")
+assert_equals "4" "$result" "Power with a bound integer exponent"
+
+result=$($DIFFERENTIATOR --eval "ln(-1)")
+assert_equals "3.14159i" "$result" "Logarithm of a negative literal"
+
 echo -e "\nTesting differentiation..."
 result=$($DIFFERENTIATOR --diff "x * sin(x)" --by x)
 assert_equals "x * cos(x) + sin(x)" "$result" "Derivative of x*sin(x)"
@@ -69,4 +81,100 @@ result=$($DIFFERENTIATOR --diff "(x + y*i) * (1 - i)" --by x)
 assert_equals "1 + -1i" "$result" "Complex derivative with respect to x"
 
 result=$($DIFFERENTIATOR --diff "sin(x + y*i)" --by y)
-assert_equals "cos(x + y * 1i) * 1i" "$result" "Complex derivative of sin"
\ No newline at end of file
+assert_equals "cos(x + y * 1i) * 1i" "$result" "Complex derivative of sin"
+
+echo -e "\nTesting Taylor expansion..."
+result=$($DIFFERENTIATOR --taylor "exp(2 * x)" "x=0" --order 3 | tr '\n' ' ')
+assert_equals "1 2 4 8 " "$result" "Derivatives of exp(2x)"
+
+result=$($DIFFERENTIATOR --taylor "x ^ 3 * y" "x=1" "y=2" --order 4 | tr '\n' ' ')
+assert_equals "2 6 12 12 0 " "$result" "Derivatives with a bound parameter"
+
+result=$($DIFFERENTIATOR --taylor "ln(x)" "x=-1" --order 1 | tr '\n' ' ')
+assert_equals "3.14159i -1 " "$result" "Complex derivatives of ln"
+
+result=$($DIFFERENTIATOR --taylor "x ^ 65" "x=0" --order 3 | tr '\n' ' ')
+assert_equals "0 0 0 0 " "$result" "Taylor of a high natural power at 0"
+
+result=$($DIFFERENTIATOR --taylor "x ^ 2.5" "x=0" --order 3 2>&1; echo "exit $?")
+assert_equals "Can't expand a power whose base is 0 into a Taylor series unless the exponent is a natural number exit 1" "$(echo $result)" "Taylor of a fractional power at 0"
+
+result=$($DIFFERENTIATOR --taylor "x * y" "x=1" 2>&1)
+assert_equals "Can't evaluate an unknown \`y\`" "$result" "Taylor with an unbound variable"
+
+result=$($DIFFERENTIATOR --taylor "exp(x)" "x=1" --order abc 2>&1; echo "exit $?")
+assert_equals "Invalid order \`abc\`, expected a whole number up to 10000 exit 1" "$(echo $result)" "Taylor with a non-numeric order"
+
+result=$($DIFFERENTIATOR --taylor "exp(x)" "x=1" --order -1 2>&1; echo "exit $?")
+assert_equals "Invalid order \`-1\`, expected a whole number up to 10000 exit 1" "$(echo $result)" "Taylor with a negative order"
+
+echo -e "\nTesting grid sampling..."
+result=$($DIFFERENTIATOR --grid "x * y + a" "x=0:1:3" "y=1:2:2" "a=1" | tr '\n' ';')
+assert_equals "0 1 1;0 2 1;0.5 1 1.5;0.5 2 2;1 1 2;1 2 3;" "$result" "Text grid"
+
+result=$($DIFFERENTIATOR --grid "x * x" "x=-1:1:3" --derivatives | tr '\n' ';')
+assert_equals "-1 1 -2;0 0 0;1 1 2;" "$result" "Text grid with derivatives"
+
+grid_file=$(mktemp)
+$DIFFERENTIATOR --grid "sin(x) * y" "x=0:1:100" "y=0:1:100" --threads 4 --output "$grid_file"
+assert_equals "80072" "$(stat -c %s "$grid_file")" "Binary grid size"
+assert_equals "SYMG" "$(head -c 4 "$grid_file")" "Binary grid magic"
+rm -f "$grid_file"
+
+result=$($DIFFERENTIATOR --grid "x * y" "x=0:1:3" 2>&1)
+assert_equals "Can't evaluate an unknown \`y\`" "$result" "Grid with an unbound variable"
+
+echo -e "\nTesting profiling..."
+result=$($DIFFERENTIATOR --profile "x * sin(y)" "x=1" "y=2" --points 1000 --top 2 | wc -l)
+assert_equals "3" "$result" "Profile lines"
+
+result=$($DIFFERENTIATOR --profile "x * sin(y)" "x=1" "y=2" --top 1 | tail -1 | sed 's/.*%  //')
+assert_equals "x * sin(y)" "$result" "Heaviest subtree is the whole"
+
+folded_file=$(mktemp)
+$DIFFERENTIATOR --profile "x * sin(y)" "x=1" "y=2" --folded "$folded_file" > /dev/null
+assert_equals "4" "$(wc -l < "$folded_file")" "Folded stack lines"
+assert_equals "x * sin(y);sin(y);y" "$(grep -o '^.*;y' "$folded_file")" "Folded stack of a leaf"
+rm -f "$folded_file"
+
+result=$($DIFFERENTIATOR --profile "x * y" "x=1" 2>&1)
+assert_equals "Can't evaluate an unknown \`y\`" "$result" "Profile with an unbound variable"
+
+echo -e "\nTesting expressions from files..."
+expr_file=$(mktemp)
+echo "x * sin(x)" > "$expr_file"
+result=$($DIFFERENTIATOR --diff "@$expr_file" --by x)
+assert_equals "x * cos(x) + sin(x)" "$result" "Derivative of an expression in a file"
+
+result=$($DIFFERENTIATOR --eval --file "$expr_file" "x=2")
+assert_equals "1.81859" "$result" "Evaluation with --file"
+rm -f "$expr_file"
+
+# deeper than a recursive walk over the tree could go
+deep_file=$(mktemp)
+{ printf 'x'; printf ' + x%.0s' $(seq 399999); } > "$deep_file"
+result=$($DIFFERENTIATOR --grid "@$deep_file" "x=0:1:3" 2>&1; echo "exit $?")
+assert_equals "0 0 0.5 2e+05 1 4e+05 exit 0" "$(echo $result)" "Grid of a deep expression"
+
+result=$($DIFFERENTIATOR --profile "@$deep_file" "x=1" --points 64 --top 1 2>&1 | tail -1 | cut -c1-24)
+assert_equals "100.0%   0.0%  x + x + x" "$result" "Profile of a deep expression"
+
+result=$($DIFFERENTIATOR --emit-c "@$deep_file" x > /dev/null 2>&1; echo "exit $?")
+assert_equals "exit 0" "$result" "Emitted C for a deep expression"
+rm -f "$deep_file"
+
+result=$(echo "x * y" | $DIFFERENTIATOR --eval @- "x=10" "y=12")
+assert_equals "120" "$result" "Expression from stdin"
+
+result=$($DIFFERENTIATOR --eval "@/nonexistent/expr.txt" 2>&1)
+assert_equals "Can't open \`/nonexistent/expr.txt\`" "$result" "Missing expression file"
+
+echo -e "\nTesting code generation..."
+result=$($DIFFERENTIATOR --emit-c "x * sin(y)" x y --name model | grep "out\[0\]")
+assert_equals "    out[0] = t3;" "$result" "Emitted C output assignment"
+
+result=$($DIFFERENTIATOR --emit-c "x * y" x y --gradient | grep -c "out\[")
+assert_equals "3" "$result" "Emitted C gradient outputs"
+
+result=$($DIFFERENTIATOR --emit-c "x + y" x 2>&1; echo "exit $?")
+assert_equals "Can't evaluate an unknown \`y\` exit 1" "$(echo $result)" "Emitted C with an unlisted variable"
@@ -1,8 +1,44 @@
 #include"../src/symexpr.h"
+#include"../src/jit.h"
+#include"../src/codegen.h"
+#include"../src/static_expr.h"
+#include"../src/serialize.h"
+#include"../src/diff_cache.h"
+#include"../src/domain.h"
+#include"../src/mixed_precision.h"
+#include"../src/complex_batch.h"
+#include"../src/vecmath.h"
+#include"../src/taylor.h"
+#include"../src/grid.h"
+#include"../src/integrate.h"
+#include"../src/newton.h"
+#include"../src/intern.h"
+#include"../src/interval.h"
+#include"../src/parallel_eval.h"
+#include"../src/polynomial.h"
+#include"../src/profile.h"
+#include"../src/program.h"
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include"utils.h"
 
+// `x + x + ... + x` as a tree deeper than a recursive walk over it could go
+template<typename Number = double>
+Expression<Number> deep_sum(std::size_t terms = 400000) {
+    std::string text = "x";
+    for (std::size_t i = 1; i < terms; i++) {
+        text += " + x";
+    }
+    return Parser<Number>(text).parse();
+}
+
 void test_basic_numbers() {
     assert_eq(Expression("1").eval(), 1);
     assert_eq(Expression("-1").eval(), -1);
@@ -353,6 +389,1543 @@ void test_symbolic_differentiation_with_parser() {
     assert_eq(Expression("(x + y)^2").diff("x").to_string(), "(x + y) ^ 2 * 2 / (x + y)");
 }
 
+void test_try_eval() {
+    auto expr = Expression("x * sin(y) + ln(x) / z ^ 2");
+    auto bound = expr.subs("x", 2).subs("y", 3).subs("z", 4);
+    assert_eq(bound.try_eval().value(), bound.eval());
+
+    auto missing = expr.subs("x", 2).try_eval();
+    assert(!missing.has_value());
+    assert_eq(missing.error().name, "y");
+    assert_eq(missing.error().message(), "Can't evaluate an unknown `y`");
+
+    assert_eq(Expression<complex>("exp(z * i)").subs("z", complex(1)).try_eval().value(), exp(complex(0, 1)));
+
+    std::vector<std::string> all = {"x", "y", "z"};
+    assert(variables(expr) == all);
+    std::vector<std::string> z = {"z"};
+    assert(unbound_variables(expr, {"y", "x"}) == z);
+    assert(unbound_variables(bound, {}).empty());
+
+    // shared subtrees are walked once
+    auto deep = Expression("x * y");
+    for (int i = 0; i < 64; i++) {
+        deep = deep * deep + Expression("w");
+    }
+    std::vector<std::string> xyw = {"x", "y", "w"};
+    assert(variables(deep) == xyw);
+    assert_eq((Expression("x * y") + Expression("w")).subs("x", 1).subs("y", 1).try_eval().error().name, "w");
+}
+
+void test_lazy_diff() {
+    auto expr = Expression("x * sin(y * x) + exp(-x * x) / (1 + y ^ 2) + x ^ 3");
+    auto lazy = expr.lazy_diff("x").subs("x", 0.7).subs("y", -1.3);
+    auto eager = expr.diff("x").subs("x", 0.7).subs("y", -1.3);
+    assert_close(lazy.eval(), eager.eval());
+    assert_eq(lazy.to_string(), eager.to_string());
+    assert_eq(Expression<double>(lazy).eval(), eager.eval());
+
+    // the exponent is constant, so no ln of the negative base
+    assert_eq(Expression("x ^ 2").lazy_diff("x").subs("x", -3).eval(), -6);
+    assert_eq(Expression("ln(x)").lazy_diff("x").subs("x", 1).eval(), 1);
+    assert_eq(Expression("y").lazy_diff("x").subs("y", 5).subs("x", 1).eval(), 0);
+    assert_close(Expression<complex>("exp(z * i)").lazy_diff("z").subs("z", complex(1)).eval(), complex(0, 1) * exp(complex(0, 1)));
+
+    // substituting an expression of `x` for `y` doesn't differentiate it: d/dx (x * y) at y = x is x
+    auto captured = Expression("x * y").lazy_diff("x").subs("y", Expression("x + 1")).subs("x", 2);
+    assert_eq(captured.eval(), 3);
+    assert_eq(captured.eval(), Expression<double>(captured).eval());
+    // the point can itself depend on other variables
+    assert_eq(Expression("x ^ 3").lazy_diff("x").subs("x", Expression("2 * t")).subs("t", 1).eval(), 12);
+
+    auto missing = expr.lazy_diff("x").subs("x", 1).try_eval();
+    assert(!missing.has_value());
+    assert_eq(missing.error().name, "y");
+    assert_eq(expr.lazy_diff("x").subs("y", 1).try_eval().error().name, "x");
+    assert_throws<std::invalid_argument>([&]() { expr.lazy_diff("x").eval(); });
+}
+
+void test_specialize() {
+    auto model = Expression("x * sin(a * b) + c ^ 2 * y + exp(a) * x");
+    auto specialized = model.specialize({{"a", 0.5}, {"b", 3}, {"c", 2}});
+    assert_eq(specialized.expr.to_string(), std::format("x * {} + 4 * y + {} * x", format_number(std::sin(1.5)), format_number(std::exp(0.5))));
+    // sin(a * b), a * b, a, b, c ^ 2, c, 2 and exp(a) become three constants
+    assert_eq(specialized.removed, 6u);
+    auto bound = model.subs("a", 0.5).subs("b", 3).subs("c", 2).subs("x", 1.5).subs("y", -2);
+    assert_eq(specialized.expr.subs("x", 1.5).subs("y", -2).eval(), bound.eval());
+
+    // constants from the source fold too, and untouched subtrees are kept as they are
+    auto partial = Expression("2 * 3 + x * sin(y)").specialize({});
+    assert_eq(partial.expr.to_string(), "6 + x * sin(y)");
+    assert_eq(partial.removed, 2u);
+    auto untouched = Expression("x * sin(y)");
+    assert(untouched.specialize({{"z", 1}}).expr.inner == untouched.inner);
+
+    // folding evaluates the node, not the simplifying operators: 0 * inf is nan
+    assert(std::isnan(Expression("a * b").specialize({{"a", 0}, {"b", INFINITY}}).expr.eval()));
+    // ...while partially bound nodes simplify like subs()
+    assert_eq(Expression("a * x + y").specialize({{"a", 0}}).expr.to_string(), "y");
+
+    // shared subtrees are specialized once and stay shared
+    auto deep = Expression("x * a");
+    for (int i = 0; i < 64; i++) {
+        deep = deep * deep + Expression("a");
+    }
+    // x * 1 is simplified to x
+    auto shared = deep.specialize({{"a", 1}});
+    assert_eq(shared.removed, 2u);
+    assert_eq(node_count(shared.expr), node_count(deep) - 2);
+    assert_eq(node_count(deep.specialize({{"x", 1}, {"a", 1}}).expr), 1u);
+    // deep trees are walked without recursion
+    auto sum = deep_sum();
+    assert(sum.specialize({}).expr.inner == sum.inner);
+    assert_eq(sum.specialize({{"x", 1}}).expr.eval(), 400000.0);
+
+    assert_close(Expression<complex>("z * exp(w * i)").specialize({{"w", complex(3.14159265358979)}}).expr.subs("z", complex(2)).eval(), complex(-2, 0));
+}
+
+void test_taylor() {
+    // against repeated diff()
+    for (auto source: {"x * sin(x) / (1 + exp(-x))", "ln(1 + x * x) ^ 2 - cos(x) / x", "x ^ x", "(x + 2) ^ 0.5 * exp(x / 3)"}) {
+        auto expr = Expression(source);
+        auto derivatives = taylor_derivatives(expr, "x", 0.7, 4);
+        auto d = expr;
+        for (int k = 0; k <= 4; k++) {
+            assert_close(derivatives[k], d.subs("x", 0.7).eval(), 1e-9 * std::max(1.0, std::abs(derivatives[k])));
+            d = d.diff("x");
+        }
+    }
+
+    // deep trees are expanded without recursion
+    assert(taylor_coefficients(deep_sum(), "x", 1.0, 2) == std::vector<double>({400000, 400000, 0}));
+
+    auto exp_series = taylor_coefficients(Expression("exp(x)"), "x", 0.0, 10);
+    double factorial = 1;
+    for (int k = 0; k <= 10; k++) {
+        assert_close(exp_series[k], 1 / factorial, 1e-15);
+        factorial *= k + 1;
+    }
+    // 1 / (1 - x) = 1 + x + x^2 + ...
+    for (double c: taylor_coefficients(Expression("1 / (1 - x)"), "x", 0.0, 20)) {
+        assert_eq(c, 1);
+    }
+    // natural powers are multiplied out, so they work at 0
+    std::vector<double> cube = {0, 0, 0, 1, 0};
+    assert(taylor_coefficients(Expression("x ^ 3"), "x", 0.0, 4) == cube);
+    std::vector<double> zeros(4, 0.0);
+    assert(taylor_coefficients(Expression("x ^ 65"), "x", 0.0, 3) == zeros);
+    assert_eq(taylor_coefficients(Expression("(1 + x) ^ 1000"), "x", 0.0, 2)[2], 499500.0);
+    // any other power of a base that is 0 has no series
+    assert_throws<std::invalid_argument>([]() { return taylor_coefficients(Expression("x ^ 2.5"), "x", 0.0, 3); });
+    assert_throws<std::invalid_argument>([]() { return taylor_coefficients(Expression("x ^ x"), "x", 0.0, 1); });
+    auto sqrt_series = taylor_coefficients(Expression("x ^ 0.5"), "x", 4.0, 2);
+    assert_close(sqrt_series[1], 0.25);
+    assert_close(sqrt_series[2], -1.0 / 64);
+
+    // high orders stay cheap and accurate: sin^(k)(0) cycles 0, 1, 0, -1
+    auto sin_derivatives = taylor_derivatives(Expression("sin(2 * x)"), "x", 0.0, 30);
+    assert_close(sin_derivatives[29], std::pow(2.0, 29), 1e-6 * std::pow(2.0, 29));
+    assert_close(sin_derivatives[30], 0.0, 1e-6);
+
+    auto bound = taylor_derivatives(Expression("a * x ^ 2 + b"), "x", 1.0, 2, {{"a", 3}, {"b", 1}});
+    std::vector<double> expected = {4, 6, 6};
+    assert(bound == expected);
+    assert_throws<std::invalid_argument>([]() { taylor_coefficients(Expression("x * y"), "x", 1.0, 3); });
+
+    auto complex_series = taylor_derivatives(Expression<complex>("exp(i * z)"), "z", complex(0), 3);
+    assert_close(complex_series[3], complex(0, -1));
+
+    // shared subtrees are expanded once
+    auto deep = Expression("sin(x)");
+    for (int i = 0; i < 64; i++) {
+        deep = deep * deep + Expression("x");
+    }
+    assert_eq(taylor_coefficients(deep, "x", 0.0, 5).size(), 6u);
+}
+
+void test_grid() {
+    auto axis = parse_grid_axis("x=-1:2:4");
+    assert(axis == (GridAxis{"x", -1, 2, 4}));
+    assert_eq(axis.at(0), -1);
+    assert_eq(axis.at(1), 0);
+    assert_eq(axis.at(3), 2);
+    assert_eq(parse_grid_axis("x=0:1:1").at(0), 0);
+    for (auto bad: {"x", "x=1:2", "=1:2:3", "x=1:2:0", "x=a:2:3", "x=1:2:3.5"}) {
+        assert_throws<std::invalid_argument>([&]() { parse_grid_axis(bad); });
+    }
+
+    auto expr = Expression("x * sin(y) + z ^ 2");
+    std::vector<GridAxis> axes = {{"x", 0, 1, 37}, {"y", -2, 2, 45}, {"z", 1, 3, 11}};
+    GridSampler sampler(expr, axes, true, 4);
+    assert_eq(sampler.points(), 37u * 45 * 11);
+    assert_eq(sampler.outputs(), 4u);
+    std::vector<double> values(sampler.points() * sampler.outputs());
+    sampler.sample(values.data());
+    // the last axis changes fastest, and each point holds the value and then d/dx, d/dy, d/dz
+    std::size_t p = (5 * 45 + 7) * 11 + 3;
+    double x = axes[0].at(5), y = axes[1].at(7), z = axes[2].at(3);
+    assert_eq(values[p * 4], expr.subs("x", x).subs("y", y).subs("z", z).eval());
+    assert_close(values[p * 4 + 1], std::sin(y));
+    assert_close(values[p * 4 + 2], x * std::cos(y));
+    assert_close(values[p * 4 + 3], 2 * z);
+
+    // tiles don't depend on the number of threads
+    GridSampler single(expr, axes, true, 1);
+    std::vector<double> single_values(values.size());
+    single.sample(single_values.data());
+    assert(single_values == values);
+
+    // the mapped file, the stream and sample() hold the same data
+    auto path = std::filesystem::temp_directory_path() / "symexpr_test_grid.bin";
+    sampler.write_file(path);
+    std::stringstream stream;
+    sampler.write_binary(stream);
+    {
+        MappedFile file(path);
+        assert_eq(std::string(file.data(), file.size()), stream.str());
+        GridHeader header = read_grid_header(file.bytes());
+        assert(header.axes == axes);
+        assert_eq(header.outputs, 4u);
+        assert_eq(header.data_offset % 8, 0u);
+        assert_eq(file.size(), header.data_offset + values.size() * sizeof(double));
+        assert(std::memcmp(file.data() + header.data_offset, values.data(), values.size() * sizeof(double)) == 0);
+    }
+    std::filesystem::remove(path);
+    assert_throws<std::invalid_argument>([]() { read_grid_header(std::as_bytes(std::span("SYMX", 4))); });
+
+    std::stringstream text;
+    GridSampler(Expression("x / y"), {{"x", 0, 1, 2}, {"y", 1, 4, 2}}).write_text(text);
+    assert_eq(text.str(), "0 1 0\n0 4 0\n1 1 1\n1 4 0.25\n");
+    assert_throws<std::invalid_argument>([]() { GridSampler(Expression("x * y"), {{"x", 0, 1, 2}}); });
+}
+
+void test_integrate() {
+    auto sin_integral = integrate(Expression("sin(x)"), "x", 0, M_PI);
+    assert(sin_integral.converged);
+    assert_close(sin_integral.value, 2.0, 1e-12);
+    assert(sin_integral.error <= 1e-10 * 2);
+
+    // a peak that needs subdivision: the integral of 1 / (1e-4 + x^2) over [-1, 1]
+    auto peak = integrate(Expression("1 / (a + x * x)"), "x", -1, 1, 1e-10, {{"a", 1e-4}});
+    assert(peak.converged);
+    assert_close(peak.value, 2 / std::sqrt(1e-4) * std::atan(1 / std::sqrt(1e-4)), 1e-8);
+    assert(peak.evaluations > 15);
+    // reversed limits flip the sign
+    assert_close(integrate(Expression("exp(x)"), "x", 1, 0).value, 1 - std::exp(1.0), 1e-12);
+
+    // boxes: the integral of x * y^2 * exp(z) over [0, 1] x [0, 2] x [0, 1]
+    auto box = integrate(Expression("x * y ^ 2 * exp(z)"), {{"x", 0, 1}, {"y", 0, 2}, {"z", 0, 1}}, 1e-9);
+    assert(box.converged);
+    assert_close(box.value, 0.5 * 8.0 / 3 * (std::exp(1.0) - 1), 1e-9);
+    // |x| * y has a kink, which is found by splitting along x
+    auto kink = integrate(Expression("(x * x) ^ 0.5 * y"), {{"x", -1, 2}, {"y", 0, 1}}, 1e-9);
+    assert(kink.converged);
+    assert_close(kink.value, 1.25, 1e-8);
+
+    // many parameter sets through one tape, in parallel
+    Integrator gaussian(Expression("exp(-s * x * x)"), {"x"}, {"s"});
+    gaussian.threads = 4;
+    std::vector<double> scales = {0.5, 1, 2, 4, 8, 16};
+    std::vector<Integral> results(scales.size());
+    gaussian.integrate_batch({{-10, 10}}, scales.data(), scales.size(), results.data());
+    for (std::size_t i = 0; i < scales.size(); i++) {
+        assert(results[i].converged);
+        assert_close(results[i].value, std::sqrt(M_PI / scales[i]), 1e-9);
+        // the same as integrating the set alone, on one thread
+        Integrator single = gaussian;
+        single.threads = 1;
+        assert_eq(single(-10, 10, {scales[i]}).value, results[i].value);
+    }
+
+    // the threads only change how the work is split, not the result
+    Integrator parallel(Expression("sin(x * y) / (1 + x * x)"), {"x", "y"});
+    Integrator serial = parallel;
+    parallel.threads = 4;
+    assert_eq(parallel({{0, 3}, {0, 3}}).value, serial({{0, 3}, {0, 3}}).value);
+
+    Integrator capped(Expression("sin(1 / x)"), {"x"});
+    capped.max_boxes = 16;
+    assert(!capped(1e-3, 1).converged);
+    assert(!integrate(Expression("ln(x)"), "x", -1, 1).converged);
+    assert_throws<std::invalid_argument>([]() { integrate(Expression("x * y"), "x", 0, 1); });
+    assert_throws<std::invalid_argument>([&]() { gaussian(0, 1); });
+}
+
+void test_newton() {
+    // cube roots of many values through one tape
+    NewtonSolver cube_root(Expression("x ^ 3 - a"), "x", {"a"});
+    std::vector<double> values, starts;
+    for (int i = 1; i <= 3000; i++) {
+        values.push_back(i * 0.01);
+        starts.push_back(1);
+    }
+    std::vector<Root> roots(values.size());
+    cube_root.solve(starts.data(), values.data(), values.size(), roots.data());
+    int most = 0;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        assert(roots[i].status == ROOT_CONVERGED);
+        assert_close(roots[i].x, std::cbrt(values[i]), 1e-12);
+        most = std::max(most, roots[i].iterations);
+    }
+    // lanes finish on their own: a = 1 is solved at once, a = 30 takes longer
+    assert(roots[99].iterations <= 2);
+    assert_eq(most, roots.back().iterations);
+    assert(most > 5);
+
+    // the threads only change how the lanes are split
+    NewtonSolver parallel = cube_root;
+    parallel.threads = 4;
+    std::vector<Root> parallel_roots(values.size());
+    parallel.solve(starts.data(), values.data(), values.size(), parallel_roots.data());
+    for (std::size_t i = 0; i < values.size(); i++) {
+        assert_eq(parallel_roots[i].x, roots[i].x);
+        assert_eq(parallel_roots[i].iterations, roots[i].iterations);
+    }
+
+    // failures are reported per lane
+    NewtonSolver flat(Expression("x * x + a"), "x", {"a"});
+    assert_eq(flat.solve(0, {-1}).status, ROOT_ZERO_DERIVATIVE);
+    NewtonSolver capped = cube_root;
+    capped.max_iterations = 3;
+    assert_eq(capped.solve(1, {30}).status, ROOT_MAX_ITERATIONS);
+    Root stopped = capped.solve(1, {30});
+    assert_eq(stopped.iterations, 3);
+    // x is the iterate f was evaluated at
+    assert_close(stopped.f, std::pow(stopped.x, 3) - 30, 1e-12);
+    assert_eq(NewtonSolver(Expression("ln(x)"), "x").solve(-1).status, ROOT_NOT_FINITE);
+
+    // Newton alone diverges on atan-like functions from far away, the bracket keeps it in place
+    NewtonSolver arctan(Expression("x / (1 + x * x) ^ 0.5 - a"), "x", {"a"});
+    assert(arctan.solve(5, {0}).status != ROOT_CONVERGED);
+    Root bracketed = arctan.solve_bracketed(-10, 5, {0});
+    assert_eq(bracketed.status, ROOT_CONVERGED);
+    assert_close(bracketed.x, 0, 1e-12);
+    std::vector<double> lo = {-10, -10, 0}, hi = {5, 5, 5}, targets = {0.5, 2, -0.5};
+    std::vector<Root> brackets(3);
+    arctan.solve_bracketed(lo.data(), hi.data(), targets.data(), 3, brackets.data());
+    assert_eq(brackets[0].status, ROOT_CONVERGED);
+    assert_close(brackets[0].x, 1 / std::sqrt(3.0), 1e-12);
+    assert_eq(brackets[1].status, ROOT_NO_SIGN_CHANGE);
+    assert_eq(brackets[2].status, ROOT_NO_SIGN_CHANGE);
+    // a root at an end of the bracket, found by the two evaluations at the ends
+    assert_eq(arctan.solve_bracketed(0, 1, {0}).x, 0.0);
+    assert_eq(arctan.solve_bracketed(0, 1, {0}).iterations, 2);
+    assert_eq(brackets[1].iterations, 2);
+    assert(brackets[0].iterations > 2);
+    // f is nan at the midpoint, so the bracket can't be narrowed and that isn't convergence
+    Root undefined = NewtonSolver(Expression("x + ln(x * x - 0.01) * 0.000001"), "x").solve_bracketed(-1, 1);
+    assert_eq(undefined.status, ROOT_NOT_FINITE);
+    assert(std::isnan(undefined.f));
+
+    assert_throws<std::invalid_argument>([&]() { arctan.solve(1); });
+}
+
+void test_streaming_parse() {
+    // numbers and whitespace runs longer than the eight-byte scans
+    Lexer lex("  \t\n\r   12345678901234567890.25e+10x 1e-");
+    assert(lex.peek().is(TOK_NUMBER));
+    assert_eq(lex.peek().str(), "12345678901234567890.25e+10");
+    assert_eq(lex.peek2().str(), "x");
+    lex.consume();
+    lex.consume();
+    assert_eq(lex.peek().str(), "1");
+    assert_eq(lex.peek2().str(), "e");
+    assert_throws<std::invalid_argument>([]() { Expression("0x10"); });
+
+    // nesting doesn't recurse
+    std::string nested = std::string(100000, '(') + "x" + std::string(100000, ')');
+    assert_eq(Expression(nested), Expression("x"));
+    assert_eq(Expression("-2 ^ -x ^ 2 * 3 - -y"), Expression("((-2) ^ ((-x) ^ 2)) * 3 - (-y)"));
+
+    // a stream is read in chunks, so tokens end up split between them
+    std::string source;
+    for (int i = 0; i < 5000; i++) {
+        source += std::format("{}1234.5e-{} * sin(x{}){}+", std::string(i % 13, ' '), i % 300, i % 7, i % 3 ? "\n" : "");
+    }
+    source += "y";
+    assert(source.size() > 2 * Lexer::CHUNK);
+    std::istringstream stream(source);
+    Expression<double> streamed = parse<double>(stream);
+    assert_eq(streamed, parse<double>(source));
+    assert(streamed.inner->kind() == EXPR_SUM);
+
+    // a number right at the end of the first chunk
+    std::istringstream boundary(std::string(Lexer::CHUNK - 2, ' ') + "12e+5 + 1");
+    assert_eq(parse<double>(boundary).eval(), 1200001.0);
+    std::istringstream empty("");
+    assert_throws<std::invalid_argument>([&]() { parse(empty); });
+
+    // a file is parsed straight from its mapping
+    std::string path = (std::filesystem::temp_directory_path() / "symexpr_parse_test.txt").string();
+    std::ofstream(path) << source;
+    assert_eq(parse_file<double>(path), streamed);
+    std::filesystem::remove(path);
+    assert_throws<std::runtime_error>([]() { parse_file("/nonexistent/expr.txt"); });
+}
+
+void test_refcount() {
+    Expression<double> x("x");
+    Expression<double> copy = x;
+    assert_eq(x.inner->ref_count(), 2u);
+    Expression<double> moved = std::move(copy);
+    assert_eq(x.inner->ref_count(), 2u);
+    {
+        // operands are moved into the new node
+        auto square = x * x;
+        assert_eq(x.inner->ref_count(), 4u);
+    }
+    assert_eq(x.inner->ref_count(), 2u);
+
+    // the derivative of a power reuses the power node
+    auto cube = pow(x, Expression<double>(3.0));
+    auto derivative = cube.diff("x");
+    assert(static_cast<MulExpr<double>*>(derivative.inner.get())->lhs.inner == cube.inner);
+
+    // a long chain is released without recursing
+    std::uint32_t refs = x.inner->ref_count();
+    Expression<double> chain = x;
+    for (int i = 0; i < 1000000; i++) {
+        chain = sin(chain);
+    }
+    chain = x;
+    assert_eq(x.inner->ref_count(), refs + 1);
+
+    // shared expressions can be copied on several threads at once
+    auto shared = x * sin(x) + cube;
+    assert(!shared.inner->shared_across_threads());
+    shared.share_across_threads();
+    assert(shared.inner->shared_across_threads());
+    assert(x.inner->shared_across_threads());
+    std::uint32_t before = x.inner->ref_count();
+    parallel_for(4, 4, [&](std::size_t) {
+        for (int i = 0; i < 100000; i++) {
+            Expression<double> local = shared;
+            auto built = local * x;
+        }
+    });
+    assert_eq(x.inner->ref_count(), before);
+    assert_eq(shared.inner->ref_count(), 1u);
+}
+
+void test_intern() {
+    InternTable<double> table;
+    auto x = table.var("x");
+    assert(table.var("x").inner == x.inner);
+    assert(table.num(1).inner == table.num(1).inner);
+    assert(table.num(0.0).inner != table.num(-0.0).inner);
+    // the builders fold like the operators
+    assert(table.add(table.num(0), x).inner == x.inner);
+    assert(table.mul(x, table.num(1)).inner == x.inner);
+
+    // equal subtrees of a foreign expression become one node
+    Expression<double> foreign("x * sin(x) + x * sin(x)");
+    auto interned = table.intern(foreign);
+    assert_eq(interned, foreign);
+    assert_eq(node_count(foreign), 9u);
+    assert_eq(node_count(interned), 4u);
+    auto sum = static_cast<SumExpr<double>*>(interned.inner.get());
+    assert(sum->lhs.inner == sum->rhs.inner);
+    assert(static_cast<MulExpr<double>*>(sum->lhs.inner.get())->lhs.inner == x.inner);
+    assert(table.intern(foreign).inner == interned.inner);
+    assert(interned.inner->shared_across_threads());
+
+    // threads building the same expressions get the same nodes
+    std::vector<Expression<double>> built(16, x);
+    parallel_for(built.size(), 4, [&](std::size_t i) {
+        Expression<double> e = table.var("y");
+        for (int k = 0; k < 200; k++) {
+            e = table.add(table.mul(e, table.sin(table.var("x"))), table.num(k));
+        }
+        built[i] = e;
+    });
+    for (auto& e: built) {
+        assert(e.inner == built[0].inner);
+    }
+    assert_eq(built[0], table.intern(built[0]));
+
+    // nodes only the table refers to are dropped
+    std::size_t before = table.size();
+    built.clear();
+    assert(table.collect() > 0);
+    assert(table.size() < before);
+    assert(table.intern(foreign).inner == interned.inner);
+    interned = x;
+    sum = nullptr;
+    table.collect();
+    assert_eq(table.size(), 1u);
+    // `x`, `interned` and the table
+    assert_eq(x.inner->ref_count(), 3u);
+}
+
+void test_program() {
+    Expression<double> f("x * sin(y) + exp(-x * x) / (1 + y ^ 2) + x * y * z");
+    std::vector<std::string> vars = {"x", "y", "z"};
+    std::vector<Expression<double>> outputs;
+    for (auto& v: vars) {
+        outputs.push_back(f.diff(v));
+        for (auto& w: vars) {
+            outputs.push_back(f.diff(v).diff(w));
+        }
+    }
+    // repeated outputs, a variable and a constant
+    outputs.push_back(outputs[0]);
+    outputs.push_back(Expression<double>::var("z"));
+    outputs.push_back(Expression<double>(2.5));
+
+    Program<double> program(outputs, vars);
+    Tape<double> tape(outputs, vars);
+    assert_eq(program.size(), tape.size());
+    assert_eq(program.outputs, outputs.size());
+    assert(program.registers < tape.size());
+
+    const std::size_t n = 100;
+    std::vector<double> points(n * 3), out(n * outputs.size()), expected(n * outputs.size()), single(outputs.size());
+    for (std::size_t p = 0; p < n; p++) {
+        points[3 * p] = 0.3 + p * 0.01;
+        points[3 * p + 1] = 0.2 + p * 0.02;
+        points[3 * p + 2] = 0.7 - p * 0.005;
+    }
+    program.eval_batch(points.data(), n, out.data());
+    tape.eval_batch_all(points.data(), n, expected.data());
+    assert(out == expected);
+    for (std::size_t p = 0; p < n; p += 7) {
+        program.eval(&points[3 * p], single.data());
+        for (std::size_t k = 0; k < outputs.size(); k++) {
+            assert_eq(single[k], expected[p * outputs.size() + k]);
+        }
+        double tree = outputs[0].subs("x", points[3 * p]).subs("y", points[3 * p + 1]).subs("z", points[3 * p + 2]).eval();
+        assert(std::abs(single[0] - tree) <= 1e-12 * std::abs(tree));
+    }
+    assert_eq(single[outputs.size() - 2], points[3 * 98 + 2]);
+    assert_eq(single[outputs.size() - 1], 2.5);
+
+    // a long chain only ever needs a couple of registers
+    Expression<double> chain = Expression<double>::var("x");
+    for (int i = 0; i < 100; i++) {
+        chain = sin(chain) * (chain + i);
+    }
+    Program<double> chained({chain}, {"x"});
+    assert(chained.registers <= 4u);
+    double x = 0.5, value;
+    chained.eval(&x, &value);
+    assert_eq(value, Tape<double>(chain, {"x"}).eval(&x));
+
+    assert_throws<std::invalid_argument>([]() { Program<double>({Expression<double>("x + w")}, {"x"}); });
+}
+
+void test_parallel_eval() {
+    auto x = Expression<double>::var("x"), y = Expression<double>::var("y");
+    // a balanced part, a long chain and subtrees used more than once
+    std::vector<Expression<double>> terms;
+    for (int i = 0; i < 256; i++) {
+        terms.push_back(sin(x * (i + 2.5)) / (y + i * 0.3 + 1.5) + exp(-y * x * 0.1));
+    }
+    while (terms.size() > 1) {
+        std::vector<Expression<double>> next;
+        for (std::size_t i = 0; i + 1 < terms.size(); i += 2) {
+            next.push_back(i % 4 ? terms[i] * terms[i + 1] : terms[i] + terms[i + 1]);
+        }
+        terms = next;
+    }
+    auto shared = cos(x * y + 3.5);
+    Expression<double> chain = terms[0];
+    for (int i = 0; i < 2000; i++) {
+        chain = chain + (i % 3 ? shared : pow(x + i * 0.5, y)) * (i + 2.5);
+    }
+    auto expr = ln(chain * chain + 2.5) - terms[0];
+
+    std::vector<double> values = {0.37, 1.21};
+    double expected = expr.subs("x", values[0]).subs("y", values[1]).eval();
+    auto same_bits = [](double a, double b) { return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b); };
+    for (unsigned threads: {1u, 2u, 4u}) {
+        for (double grain: {0.0, 50.0, 500.0, 1e9}) {
+            ParallelEval<double> parallel(expr, {"x", "y"}, threads, grain);
+            assert(same_bits(parallel.eval(values.data()), expected));
+            if (grain == 50) {
+                assert(parallel.task_count() > 8u);
+                assert(parallel.spine_size() > 0u);
+            }
+            if (grain == 1e9) {
+                assert_eq(parallel.task_count(), 1u);
+                assert_eq(parallel.spine_size(), 0u);
+            }
+        }
+    }
+
+    // without variables it's a drop-in for eval()
+    auto constant = expr.subs("x", 0.5).subs("y", 2.5);
+    assert(same_bits(ParallelEval<double>(constant, {}, 4, 100).eval(), constant.eval()));
+    assert_throws<std::invalid_argument>([&]() { ParallelEval<double>(expr, {"x"}); });
+}
+
+void test_interval() {
+    using I = Interval<double>;
+    auto encloses = [](const I& outer, double lo, double hi) { return outer.lo <= lo && hi <= outer.hi; };
+    assert(encloses(I(1, 2) + I(3, 4), 4, 6));
+    assert(encloses(I(-1, 2) * I(-3, 4), -6, 8));
+    assert(encloses(I(1, 2) / I(4, 8), 0.125, 0.5));
+    assert_eq(I(1, 2) / I(-1, 1), I::entire());
+    assert((I(1, 2) / I(0)).is_empty());
+    assert((I(0) * I::entire()).contains(0));
+    assert_eq(-I(1, 2), I(-2, -1));
+
+    // extrema inside the argument are found
+    assert_eq(sin(I(0, 3.2)).hi, 1.0);
+    assert(sin(I(0.1, 0.2)).hi < 0.2);
+    assert_eq(cos(I(-0.1, 0.1)).hi, 1.0);
+    assert_eq(cos(I(3, 3.3)).lo, -1.0);
+    assert_eq(sin(I(-100, 100)), I(-1, 1));
+    assert_eq(log(I(-1, 4)).lo, -std::numeric_limits<double>::infinity());
+    assert(log(I(-2, -1)).is_empty());
+    assert(encloses(exp(I(0, 1)), 1, std::exp(1.0)));
+    assert(encloses(pow(I(-2, 3), I(2)), 0, 9) && pow(I(-2, 3), I(2)).lo == 0);
+    assert(encloses(pow(I(-2, 3), I(3)), -8, 27));
+    assert(pow(I(-3, -2), I(0.5)).is_empty());
+    assert(encloses(pow(I(-1, 4), I(0.5)), 0, 2));
+    assert(encloses(pow(I(2, 4), I(-1)), 0.25, 0.5));
+
+    // decimal literals and constants are enclosed, integers stay exact
+    auto tenth = Expression<I>("0.1").eval();
+    assert(tenth.lo < 0.1 && 0.1 < tenth.hi);
+    assert_eq(Expression<I>("2").eval(), I(2));
+    assert(Expression<I>("pi").eval().contains(std::numbers::pi));
+    // so are decimals that a double holds exactly, whatever way they're written
+    for (auto source: {"2.0", "1e1", "0.5", "0.0250e2", "1.25E-1", "0.0", "9007199254740993"}) {
+        I literal = Expression<I>(source).eval();
+        bool point = literal.lo == literal.hi;
+        assert(point == (std::string(source) != "9007199254740993"));
+    }
+    assert(Expression<I>("1e-1").eval().lo < Expression<I>("1e-1").eval().hi);
+    // a point exponent keeps pow() defined for negative bases
+    auto square = Expression<I>("(x - 3) ^ 2.0").subs("x", I(0, 1)).eval();
+    assert(encloses(square, 4, 9) && square.hi < 9.001);
+    assert_eq(Expression<I>("x ^ 2").subs("x", I(-1, 1)).eval().lo, 0.0);
+
+    // every value at a point of the box is inside the bounds for the box
+    std::vector<std::string> sources = {
+        "x * sin(y) + exp(-x * x) / (1 + y ^ 2)",
+        "ln(x * x + 0.1) - cos(3 * y) * x ^ 3",
+        "(x + y) ^ 2.5 / (2 + sin(x))",
+        "x ^ -2 + y ^ 3 - x / y",
+        "cos(x) * cos(x) + sin(x) * sin(x)",
+        "exp(sin(x * y)) ^ y - ln(y)",
+    };
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> coordinate(-3, 3), unit(0, 1);
+    for (auto& source: sources) {
+        Expression<double> expr(source);
+        BoxEvaluator<double> boxes(expr, {"x", "y"});
+        Tape<double> points(expr, {"x", "y"});
+        for (int b = 0; b < 200; b++) {
+            std::vector<double> lo = {coordinate(rng), coordinate(rng)}, hi = lo;
+            hi[0] += unit(rng) * (b % 2 ? 0.01 : 2);
+            hi[1] += unit(rng) * (b % 2 ? 0.01 : 2);
+            I bound;
+            boxes.eval_batch(lo.data(), hi.data(), 1, &bound);
+            for (int k = 0; k < 20; k++) {
+                double point[2] = {lo[0] + (hi[0] - lo[0]) * unit(rng), lo[1] + (hi[1] - lo[1]) * unit(rng)};
+                double value = points.eval(point);
+                assert(std::isnan(value) || bound.contains(value));
+            }
+        }
+    }
+    auto identity = Expression<I>("cos(x) * cos(x) + sin(x) * sin(x)").subs("x", I(0, 10)).eval();
+    assert(identity.contains(1));
+
+    // a whole region is rejected at once
+    BoxEvaluator<double> circle(Expression<double>("x * x + y * y - 1"), {"x", "y"});
+    std::vector<I> regions = {I(2, 3), I(-1, 1), I(-0.5, 0.5), I(-0.5, 0.5)};
+    std::vector<I> bounds(2);
+    circle.threads = 2;
+    circle.eval_batch(regions.data(), 2, bounds.data());
+    assert(bounds[0].lo > 0);
+    assert(bounds[1].contains(-1) && bounds[1].hi < 0);
+    assert_eq(bounds[1], circle.eval(&regions[2]));
+    // deep trees are converted without recursion
+    BoxEvaluator<double> deep(deep_sum(), {"x"});
+    I box(1, 2);
+    I sum = deep.eval(&box);
+    assert(sum.contains(400000) && sum.contains(800000));
+    assert(sum.lo > 399999 && sum.hi < 800001);
+
+    auto derivative = Expression<I>("x * sin(x)").diff("x").subs("x", I(0.5, 0.6)).eval();
+    assert(derivative.contains(std::sin(0.55) + 0.55 * std::cos(0.55)));
+    assert_eq(Expression<I>("x + 2").subs("x", I(1, 2)).to_string(), "[1, 2] + 2");
+}
+
+void test_polynomial() {
+    std::vector<std::string> xy = {"x", "y"};
+    auto x = Polynomial<double>::variable(xy, 0), y = Polynomial<double>::variable(xy, 1);
+    auto one = Polynomial<double>::constant(xy, 1);
+    auto square = (x + y) * (x + y);
+    assert_eq(square.terms(), 3u);
+    assert_eq(square.degree(), 2u);
+    assert(square == x * x + x * y * Polynomial<double>::constant(xy, 2) + y * y);
+    assert(square - x * x - y * y - x * y - y * x == Polynomial<double>(xy));
+    assert((x + one).pow(5).terms() == 6u);
+    assert((x + y + one).pow(3) == (x + y + one) * (x + y + one) * (x + y + one));
+    assert(square.diff("x") == (x + y) * Polynomial<double>::constant(xy, 2));
+    assert_eq(square.diff("z").terms(), 0u);
+    assert_throws<std::invalid_argument>([&]() { return x + Polynomial<double>::variable({"x"}, 0); });
+
+    double point[2] = {1.5, -0.25};
+    assert_eq(square.eval(point), 1.5625);
+    assert_eq(Polynomial<double>(xy).eval(point), 0.0);
+    assert_eq(square.to_expression().to_string(), "(x + 2 * y) * x + y ^ 2");
+
+    // conversion from expressions, and back
+    Expression<double> expr("(x - 2 * y) ^ 3 + x * (y / 4 - 1) - 7");
+    auto p = to_polynomial(expr);
+    assert(p.has_value());
+    assert_eq(p->vars, xy);
+    assert_eq(p->terms(), 7u);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> coordinate(-2, 2);
+    Tape<double> tape(expr, xy), derivative(expr.diff("y"), xy);
+    for (int k = 0; k < 20; k++) {
+        double at[2] = {coordinate(rng), coordinate(rng)};
+        double exact = tape.eval(at);
+        assert(std::abs(p->eval(at) - exact) <= 1e-12 * (1 + std::abs(exact)));
+        assert(std::abs(Tape<double>(p->to_expression(), xy).eval(at) - exact) <= 1e-12 * (1 + std::abs(exact)));
+        double slope = derivative.eval(at);
+        assert(std::abs(p->diff("y").eval(at) - slope) <= 1e-12 * (1 + std::abs(slope)));
+    }
+    // more than one block of points
+    std::vector<double> points(200), out(100);
+    for (std::size_t i = 0; i < points.size(); i++) points[i] = 0.1 * i - 3;
+    p->eval_batch(points.data(), 100, out.data());
+    for (std::size_t i = 0; i < 100; i++) {
+        assert_eq(out[i], p->eval(&points[2 * i]));
+    }
+    assert(!to_polynomial(Expression<double>("x ^ y")).has_value());
+    assert(!to_polynomial(Expression<double>("x / y")).has_value());
+    assert(!to_polynomial(Expression<double>("x ^ 0.5")).has_value());
+    assert(!to_polynomial(Expression<double>("sin(x) * x")).has_value());
+    assert(!to_polynomial(Expression<double>("(x + y + 1) ^ 1000")).has_value());
+    assert(to_polynomial(Expression<complex>("(x + 2i) ^ 2")).has_value());
+
+    // degrees whose exponents would wrap around aren't expanded
+    Expression<double> huge("(((x ^ 1024) ^ 1024) ^ 1024) ^ 4");
+    assert(!to_polynomial(huge).has_value());
+    assert_eq(simplify_polynomials(huge).subs("x", 0.5).eval(), 0.0);
+    assert_eq(diff_polynomials(huge, "x").subs("x", 1).eval(), 4294967296.0);
+    assert_throws<std::invalid_argument>([&]() { return x.pow(1 << 16) * x; });
+    assert_throws<std::invalid_argument>([&]() { return x.pow(1 << 8).pow(1 << 9); });
+
+    // long gaps between exponents, squared the same way by eval() and eval_batch()
+    Expression<double> gaps("x ^ 1000 + 3 * x ^ 7 * y ^ 300 - y");
+    auto sparse = to_polynomial(gaps, xy);
+    Tape<double> gaps_tape(gaps, xy);
+    for (std::size_t i = 0; i < points.size(); i++) points[i] = 0.99 + 0.0002 * i;
+    sparse->eval_batch(points.data(), 100, out.data());
+    for (std::size_t i = 0; i < 100; i++) {
+        assert_eq(out[i], sparse->eval(&points[2 * i]));
+        double exact = gaps_tape.eval(&points[2 * i]);
+        assert(std::abs(out[i] - exact) <= 1e-12 * (1 + std::abs(exact)));
+    }
+
+    // the passes only touch the polynomial parts
+    assert_eq(simplify_polynomials(Expression<double>("sin(x * x + 2 * x * x) + x * y - y * x")).to_string(), "sin(3 * x ^ 2)");
+    Expression<double> mixed("(x + y) ^ 6 * sin(x) + exp(x * x)");
+    auto fast = diff_polynomials(mixed, "x");
+    auto slow = mixed.diff("x");
+    Tape<double> fast_tape(fast, xy), slow_tape(slow, xy);
+    for (int k = 0; k < 20; k++) {
+        double at[2] = {coordinate(rng), coordinate(rng)};
+        double exact = slow_tape.eval(at);
+        assert(std::abs(fast_tape.eval(at) - exact) <= 1e-10 * (1 + std::abs(exact)));
+    }
+    assert_eq(diff_polynomials(Expression<double>("x * x * x"), "x").to_string(), "3 * x ^ 2");
+
+    // diff() switches to polynomials only for subtrees of at least AUTO_NODES nodes,
+    // and only to polynomials no larger than those subtrees
+    assert_eq(Expression<double>("x * x * x").diff("x").to_string(), Expression<double>("x * x * x").diff_by_rules("x").to_string());
+    Expression<double> like("x * y * 2 + 3 * y * x - x * y + x * x * x * y - y * x * x * x + 4 * x * y");
+    assert(PolynomialDifferentiator<double>::has_nodes(like.inner.get(), PolynomialDifferentiator<double>::AUTO_NODES));
+    assert_eq(like.diff("x").to_string(), "8 * y");
+    // products of factors with more than one term aren't multiplied out
+    Expression<double> big("(1 + x + y) ^ 4 * (x - 2 * y + 3) ^ 3 * (x * y - 1) * (2 * x + y) * (x - y)");
+    assert(PolynomialDifferentiator<double>::has_nodes(big.inner.get(), PolynomialDifferentiator<double>::AUTO_NODES));
+    assert_eq(node_count(big.diff("x")), node_count(big.diff_by_rules("x")));
+    // so a factored form stays as accurate near its roots
+    std::string factors = "x - 1";
+    for (int i = 1; i < 8; i++) {
+        factors += ") * (x - 1";
+    }
+    double near = 1.001;
+    assert_close(Expression<double>("(" + factors + ")").diff("x").subs("x", near).eval(), 8 * std::pow(near - 1, 7), 1e-12 * 8e-21);
+    // rows only have the variables of their subtree, so a wide sum is cheap
+    std::string wide = "x0";
+    for (int i = 1; i < 1000; i++) {
+        wide += std::format(" + x{}", i);
+    }
+    assert_eq(Expression<double>(wide).diff("x500").to_string(), "1");
+    assert_eq(Expression<double>("x0 * x0 + " + wide).diff("x0").to_string(), "2 * x0 + 1");
+    Expression<double> wrapped = sin(Expression<double>::var("x")) * big + exp(Expression<double>::var("y"));
+    Tape<double> auto_tape(wrapped.diff("x"), xy), rules_tape(wrapped.diff_by_rules("x"), xy);
+    for (int k = 0; k < 20; k++) {
+        double at[2] = {coordinate(rng), coordinate(rng)};
+        double exact = rules_tape.eval(at);
+        assert(std::abs(auto_tape.eval(at) - exact) <= 1e-9 * (1 + std::abs(exact)));
+    }
+}
+
+void test_budget() {
+    // the exception a budgeted call throws, checked to be a BudgetExceeded
+    auto exceeded = [](auto call) {
+        try {
+            call();
+        } catch (const BudgetExceeded& e) {
+            return std::optional<BudgetExceeded>(e);
+        }
+        return std::optional<BudgetExceeded>();
+    };
+
+    Expression<double> expr("x ^ x ^ x ^ x");
+    Budget roomy;
+    Expression<double> derivative = expr.diff("x", roomy);
+    assert(derivative == expr.diff("x"));
+    assert(roomy.nodes > 0u);
+    assert_eq(roomy.depth, 0u);
+    assert(roomy.deepest >= 4u);
+
+    Budget small{.max_nodes = 10};
+    auto nodes = exceeded([&]() { return expr.diff("x").diff("x", small); });
+    assert(nodes.has_value());
+    assert(nodes->resource == BudgetExceeded::NODES);
+    assert_eq(nodes->used, 11u);
+    assert_eq(nodes->limit, 10u);
+    assert_eq(small.nodes, 11u);
+    // the scope is gone, so nothing else is limited
+    assert(expr.diff("x").diff("x").diff("x") == expr.diff("x").diff("x").diff("x"));
+
+    // to_string of a DAG is exponential in its depth; the check stops it early
+    Expression<double> doubled = Expression<double>::var("x");
+    for (int i = 0; i < 40; i++) {
+        doubled = doubled * doubled;
+    }
+    Budget text{.max_length = 1000};
+    auto length = exceeded([&]() { return doubled.to_string(text); });
+    assert(length.has_value() && length->resource == BudgetExceeded::LENGTH);
+    assert(length->used > 1000u && length->used <= 2003u);
+    Budget enough{.max_length = 1000};
+    assert_eq(expr.to_string(enough), expr.to_string());
+    assert_eq(enough.length, expr.to_string().size());
+
+    std::string chain = "x";
+    for (int i = 0; i < 200; i++) {
+        chain += " + x";
+    }
+    Budget shallow{.max_depth = 100};
+    auto depth = exceeded([&]() { return Parser<double>(chain).parse(shallow); });
+    assert(depth.has_value() && depth->resource == BudgetExceeded::DEPTH);
+    assert_eq(depth->used, 101u);
+    Budget deep{.max_depth = 300};
+    Expression<double> sum = Parser<double>(chain).parse(deep);
+    assert_eq(deep.deepest, 201u);
+    Budget recursion{.max_depth = 50};
+    auto subs = exceeded([&]() { return sum.subs("x", Expression<double>(2.0), recursion); });
+    assert(subs.has_value() && subs->resource == BudgetExceeded::DEPTH);
+    // the levels that threw are given back
+    assert_eq(recursion.depth, 0u);
+
+    Budget expired = Budget::within(std::chrono::seconds(0));
+    auto time = exceeded([&]() { return doubled.diff("x", expired).to_string(expired); });
+    assert(time.has_value() && time->resource == BudgetExceeded::TIME);
+    assert(time->used >= time->limit);
+
+    // a budget can be shared by several passes in a row
+    Budget shared{.max_nodes = 1000};
+    Expression<double> poly("(x + 1) * (x - 1) + sin(x * x)");
+    Expression<double> simplified = simplify_polynomials(poly, shared);
+    std::size_t after_simplify = shared.nodes;
+    assert(after_simplify > 0u);
+    diff_polynomials(simplified, "x", shared);
+    assert(shared.nodes > after_simplify);
+    Budget none{.max_nodes = 0};
+    assert_throws<BudgetExceeded>([&]() { return poly.specialize({{"x", 1.0}}, none); });
+}
+
+void test_profile() {
+    Expression<double> expr("x * sin(y) + exp(-x * x) / (1 + y ^ 2)");
+    std::vector<std::string> xy = {"x", "y"};
+    Profiler<double> profiler(expr, xy);
+    assert_eq(profiler.size(), node_count(expr));
+
+    const std::size_t n = 1000;
+    std::vector<double> points(2 * n), out(n), expected(n);
+    for (std::size_t i = 0; i < n; i++) {
+        points[2 * i] = 0.001 * i;
+        points[2 * i + 1] = 1 - 0.002 * i;
+    }
+    profiler.eval_batch(points.data(), n, out.data());
+    Tape<double>(expr, xy).eval_batch(points.data(), n, expected.data());
+    assert(out == expected);
+
+    auto nodes = profiler.profile();
+    assert_eq(nodes.size(), profiler.size());
+    assert(nodes.back().expr.inner == expr.inner);
+    assert_eq(nodes.back().parent, Profiler<double>::NONE);
+    double self = 0;
+    for (auto& node: nodes) {
+        assert_eq(node.calls, n);
+        assert(node.self >= 0 && node.total >= node.self);
+        self += node.self;
+    }
+    assert(nodes.back().total > 0);
+    assert(std::abs(nodes.back().total - self) <= 1e-9 * self);
+    // a shared node is computed once, but eval() on the tree computes it once for every path
+    Expression<double> x = Expression<double>::var("x");
+    Expression<double> square = x * x;
+    Profiler<double> shared(square * square + sin(x), {"x"});
+    assert_eq(shared.size(), 5u);
+    assert_eq(shared.profile().front().tree_calls, 5.0);
+    assert_eq(shared.profile().front().parent, 1u);
+    assert(profiler.heaviest(1).front().expr.inner == expr.inner);
+    assert_eq(profiler.heaviest(100).size(), nodes.size());
+
+    // without the annotations, it's to_string()
+    std::string annotated = profiler.annotate(0);
+    assert(annotated.find(" : ") != std::string::npos);
+    std::string plain;
+    for (std::size_t i = 0; i < annotated.size(); i++) {
+        if (annotated[i] == '{') continue;
+        if (annotated[i] == ' ' && annotated[i + 1] == ':') {
+            i = annotated.find('}', i);
+            continue;
+        }
+        plain += annotated[i];
+    }
+    assert_eq(plain, expr.to_string());
+    assert_eq(profiler.annotate(2), expr.to_string());
+    for (auto& node: nodes) {
+        assert_eq(profiler.to_string(node.slot), node.expr.to_string());
+    }
+    // deep trees are flattened and written out without recursion
+    Profiler<double> deep(deep_sum(), {"x"});
+    std::string text = deep.to_string(deep.size() - 1);
+    assert_eq(text.size(), 4 * 400000u - 3);
+    assert_eq(deep.annotate(), text);
+
+    std::string folded = profiler.folded();
+    assert_eq(std::size_t(std::count(folded.begin(), folded.end(), '\n')), nodes.size());
+    assert(folded.starts_with("x * sin(y) + exp(-x * x) / (1 + y ^ 2) "));
+    assert(folded.find("\nx * sin(y) + exp(-x * x) / (1 + y ^ 2);x * sin(y);sin(y);y ") != std::string::npos);
+
+    profiler.reset();
+    assert_eq(profiler.profile().back().total, 0.0);
+    assert_throws<std::invalid_argument>([&]() { return Profiler<double>(expr, {"x"}); });
+}
+
+void test_domain() {
+    auto parse = [](const std::string& source) { return Expression<complex>(source); };
+    assert_eq(infer_domain(parse("x * sin(y) + exp(x) / 2")), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("x * 2i")), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("x + y * i")), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("x * y"), {{"x", 1}, {"y", complex(0, 1)}}), DOMAIN_COMPLEX);
+
+    // ln and fractional powers only when the argument may be negative
+    assert_eq(infer_domain(parse("ln(x)")), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("ln(x)"), {{"x", 2}}), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("ln(x)"), {{"x", -2}}), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("ln(exp(x) + x ^ 2)")), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("ln(x * y)"), {{"x", -1}, {"y", -3}}), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("ln(x - y)"), {{"x", 3}, {"y", 2}}), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("x ^ 3 + x ^ -2")), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("x ^ 0.5")), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("x ^ 0.5"), {{"x", 4}}), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("ln(x ^ 3)"), {{"x", -1}}), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("ln(x ^ 4)"), {{"x", -1}}), DOMAIN_REAL);
+    // exponents that are integers once bound or folded
+    assert_eq(infer_domain(parse("x ^ n"), {{"x", -2}, {"n", 2}}), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("x ^ (n + 1)"), {{"x", -2}, {"n", 1}}), DOMAIN_REAL);
+    assert_eq(infer_domain(parse("x ^ (1 / 2)"), {{"x", -2}}), DOMAIN_COMPLEX);
+    assert_eq(infer_domain(parse("x ^ n"), {{"x", -2}}), DOMAIN_COMPLEX);
+
+    // folded real constants have a +0 imaginary part, so -1 is on the same side of the cut as a binding
+    auto log = parse("ln(-1)").specialize({}).expr.eval();
+    assert_eq(log, std::log(complex(-1, 0)));
+    assert(!std::signbit(parse("-1").specialize({}).expr.eval().imag()));
+
+    auto expr = parse("x * sin(x) / (1 + y ^ 2) - pi");
+    auto real = to_real(expr);
+    assert_eq(real, Expression<double>("x * sin(x) / (1 + y ^ 2) - pi"));
+    assert_close(real.subs("x", 2).subs("y", 3).eval(), expr.subs("x", complex(2)).subs("y", complex(3)).eval().real());
+    assert_throws<std::invalid_argument>([&]() {
+        to_real(parse("x + 2i"));
+    });
+    // deep trees are converted without recursion
+    double one = 1;
+    assert_eq(Tape(to_real(deep_sum<complex>()), {"x"}).eval(&one), 400000.0);
+}
+
+void test_float() {
+    auto expr = Expression<float>("x * 0.1 + sin(x) ^ 2");
+    assert_eq(expr.to_string(), "x * 0.1 + sin(x) ^ 2");
+    assert_eq(expr.diff("x").to_string(), Expression<double>("x * 0.1 + sin(x) ^ 2").diff("x").to_string());
+    // literals are rounded to float directly, not through double
+    assert_eq(Expression<float>("0.1").eval(), 0.1f);
+    assert_eq(Expression<float>("16777217").eval(), 16777216.0f);
+    assert_eq(parse_number<float>("2.5"), 2.5f);
+    assert_throws<std::invalid_argument>([]() {
+        parse_number<float>("2.5x");
+    });
+
+    float value = expr.subs("x", 2.0f).eval();
+    assert_eq(value, 2.0f * 0.1f + std::pow(std::sin(2.0f), 2.0f));
+    assert_eq(expr.subs("x", 2.0f).try_eval().value(), value);
+
+    Tape<float> tape(expr, {"x"});
+    float x = 2;
+    assert_eq(tape.eval(&x), value);
+    Tape<float> converted(Tape<double>(Expression("x * 0.1 + sin(x) ^ 2"), {"x"}));
+    assert_eq(converted.size(), tape.size());
+    assert_eq(converted.eval(&x), value);
+}
+
+void test_mixed_precision() {
+    MixedTape mixed(Expression("x * sin(y) + exp(-x * x) / (1 + y ^ 2)"), {"x", "y"});
+    std::vector<double> points, out(200);
+    for (int i = 0; i < 200; i++) {
+        points.push_back(-1 + i * 0.01);
+        points.push_back(0.5 + i * 0.02);
+    }
+    assert_eq(mixed.eval_batch(points.data(), 200, out.data()), 0u);
+    for (int i = 0; i < 200; i += 37) {
+        double exact = mixed.tape().eval(&points[2 * i]);
+        assert_close(out[i], exact, 1e-4 * std::abs(exact));
+    }
+
+    // cancellation: float gets 0 where the answer is 1, the bound catches it
+    MixedTape cancel(Expression("(x + 1) - x"), {"x"});
+    double big[] = {1e8, 2};
+    double result[2];
+    assert_eq(cancel.eval_batch(big, 2, result), 1u);
+    assert_eq(result[0], 1.0);
+    assert_eq(result[1], 1.0);
+
+    // out of float range
+    MixedTape huge(Expression("x * x"), {"x"});
+    assert_close(huge.eval(big), 1e16, 1e12);
+    double large = 1e30;
+    double scratch[2];
+    assert_eq(huge.eval(&large), huge.tape().eval(&large, scratch));
+
+    // a negative base only for an exact integer exponent
+    MixedTape power(Expression("x ^ 3 + x ^ 0.5"), {"x"});
+    double negative = -2;
+    assert(std::isnan(power.eval(&negative)));
+    double zero = 0;
+    assert_eq(power.eval(&zero), 0.0);
+}
+
+void test_complex_batch() {
+    auto expr = Expression<complex>("z * w / (z + 2i) + exp(z) * sin(w) - cos(z * w) + ln(w) ^ z");
+    std::vector<complex> points;
+    for (int p = 0; p < 150; p++) {
+        points.push_back(complex(std::sin(p * 0.37) * 2, std::cos(p * 0.11)));
+        points.push_back(complex(0.5 + p * 0.01, -1 + p * 0.013));
+    }
+    for (bool fast_math: {false, true}) {
+        for (bool vector_math: {false, true}) {
+            ComplexBatch batch(expr, {"z", "w"}, fast_math);
+            batch.vector_math = vector_math;
+            std::vector<complex> out(150);
+            batch.eval_batch(points.data(), 150, out.data());
+            bool close = true;
+            for (int p = 0; p < 150; p++) {
+                complex expected = expr.subs("z", points[2 * p]).subs("w", points[2 * p + 1]).eval();
+                close = close && abs(out[p] - expected) <= 1e-12 * std::max(1.0, abs(expected));
+            }
+            assert(close);
+        }
+    }
+
+    // the vecmath.h kernels against std::complex, including the libm fallbacks
+    auto functions = Expression<complex>("exp(z) + sin(z) * i + cos(z) * 2 + ln(z) * 3i + z ^ (1 + i)");
+    ComplexBatch libm(functions, {"z"}), vector(functions, {"z"});
+    vector.vector_math = true;
+    std::vector<double> fre, fim;
+    for (double x: {-800.0, -30.0, -1.0, -1e-300, 0.0, 1e-20, 0.7, 1.0, 5.0, 700.5, 1e6}) {
+        for (double y: {-710.0, -3.0, -0.25, 0.0, 1e-12, 0.999, 2.0, 40.0, 1e200}) {
+            fre.push_back(x);
+            fim.push_back(y);
+        }
+    }
+    std::size_t m = fre.size();
+    std::vector<double> libm_re(m), libm_im(m), vector_re(m), vector_im(m);
+    libm.eval_batch(fre.data(), fim.data(), m, libm_re.data(), libm_im.data());
+    vector.eval_batch(fre.data(), fim.data(), m, vector_re.data(), vector_im.data());
+    bool matches = true;
+    for (std::size_t p = 0; p < m; p++) {
+        complex expected(libm_re[p], libm_im[p]), actual(vector_re[p], vector_im[p]);
+        matches = matches && (std::isfinite(abs(expected))
+            ? abs(actual - expected) <= 1e-12 * std::max(1.0, abs(expected))
+            : std::isnan(abs(actual)) == std::isnan(abs(expected)));
+    }
+    assert(matches);
+
+    // special values go through std::complex in strict mode
+    ComplexBatch div(Expression<complex>("z / w * (z * w)"), {"z", "w"});
+    double inf = std::numeric_limits<double>::infinity();
+    std::vector<complex> special = {
+        complex(1, 1), complex(1e200, 1e200),
+        complex(1, 1), complex(1e-200, 1e-200),
+        complex(inf, 0), complex(1, 1),
+    };
+    std::vector<complex> out(3);
+    div.eval_batch(special.data(), 3, out.data());
+    for (int p = 0; p < 3; p++) {
+        complex z = special[2 * p], w = special[2 * p + 1];
+        complex expected = z / w * (z * w);
+        bool same = std::isinf(expected.real()) || std::isinf(expected.imag())
+            ? std::isinf(out[p].real()) || std::isinf(out[p].imag())
+            : abs(out[p] - expected) <= 1e-12 * abs(expected);
+        assert(same);
+    }
+
+    ComplexBatch zero(Expression<complex>("z ^ 2"), {"z"});
+    double re = 0, im = 0, out_re, out_im;
+    zero.eval_batch(&re, &im, 1, &out_re, &out_im);
+    assert_eq(complex(out_re, out_im), std::pow(complex(0), complex(2)));
+}
+
+// distance in representable doubles; 0 for equal values and for two nans
+std::uint64_t ulp_distance(double a, double b) {
+    if (a == b || (std::isnan(a) && std::isnan(b))) {
+        return 0;
+    }
+    auto ordered = [](double x) {
+        std::int64_t i = std::bit_cast<std::int64_t>(x);
+        return i < 0 ? std::numeric_limits<std::int64_t>::min() - i : i;
+    };
+    std::int64_t d = ordered(a) - ordered(b);
+    return d < 0 ? -d : d;
+}
+
+// largest distance between a vecmath array function and libm over the samples;
+// UINT64_MAX if an element differs from the scalar overload, which runs the same kernel
+template<typename Vector, typename Libm>
+std::uint64_t max_ulp(const std::vector<double>& x, Vector vector, Libm libm) {
+    std::vector<double> out(x.size());
+    vector(x.data(), out.data(), x.size());
+    std::uint64_t result = 0;
+    for (std::size_t i = 0; i < x.size(); i++) {
+        if (ulp_distance(out[i], vector(x[i])) != 0) {
+            return UINT64_MAX;
+        }
+        result = std::max(result, ulp_distance(out[i], libm(x[i])));
+    }
+    return result;
+}
+
+void test_vecmath() {
+    const std::size_t n = 200000;
+    std::mt19937_64 rng(2024);
+    auto sample = [&](auto distribution) {
+        std::vector<double> x(n);
+        for (auto& v: x) v = distribution(rng);
+        return x;
+    };
+    auto vec_exp = [](auto... args) { return vecmath::exp(args...); };
+    auto vec_log = [](auto... args) { return vecmath::log(args...); };
+    auto vec_sin = [](auto... args) { return vecmath::sin(args...); };
+    auto vec_cos = [](auto... args) { return vecmath::cos(args...); };
+
+    auto exp_x = sample(std::uniform_real_distribution<double>(-745, 710));
+    assert(max_ulp(exp_x, vec_exp, [](double x) { return std::exp(x); }) <= 1);
+
+    // every positive normal exponent, and the range around 1
+    auto log_x = sample([](std::mt19937_64& rng) {
+        return std::bit_cast<double>(std::uniform_int_distribution<std::uint64_t>(0x0010000000000000, 0x7fefffffffffffff)(rng));
+    });
+    assert(max_ulp(log_x, vec_log, [](double x) { return std::log(x); }) <= 1);
+    auto log_near = sample(std::uniform_real_distribution<double>(0.5, 2));
+    assert(max_ulp(log_near, vec_log, [](double x) { return std::log(x); }) <= 1);
+
+    for (auto range: {10.0, 1e5}) {
+        auto x = sample(std::uniform_real_distribution<double>(-range, range));
+        assert(max_ulp(x, vec_sin, [](double x) { return std::sin(x); }) <= 1);
+        assert(max_ulp(x, vec_cos, [](double x) { return std::cos(x); }) <= 1);
+    }
+
+    auto vec_sinh = [](auto... args) { return vecmath::sinh(args...); };
+    auto vec_cosh = [](auto... args) { return vecmath::cosh(args...); };
+    auto hyperbolic_x = sample(std::uniform_real_distribution<double>(-3, 3));
+    auto hyperbolic_wide = sample(std::uniform_real_distribution<double>(-709, 709));
+    for (auto* x: {&hyperbolic_x, &hyperbolic_wide}) {
+        assert(max_ulp(*x, vec_sinh, [](double x) { return std::sinh(x); }) <= 2);
+        assert(max_ulp(*x, vec_cosh, [](double x) { return std::cosh(x); }) <= 2);
+    }
+
+    // pairs over the whole plane, and near the unit circle for log_hypot
+    auto plane = [&](double spread) {
+        return sample([spread](std::mt19937_64& rng) {
+            double magnitude = std::exp(std::uniform_real_distribution<double>(-spread, spread)(rng));
+            return rng() & 1 ? magnitude : -magnitude;
+        });
+    };
+    auto plane_x = plane(300), plane_y = plane(300);
+    std::vector<double> atan2_out(n), hypot_out(n);
+    vecmath::atan2(plane_y.data(), plane_x.data(), atan2_out.data(), n);
+    vecmath::log_hypot(plane_x.data(), plane_y.data(), hypot_out.data(), n);
+    std::uint64_t atan2_ulp = 0, hypot_ulp = 0;
+    bool plane_scalar = true;
+    for (std::size_t i = 0; i < n; i++) {
+        double x = plane_x[i], y = plane_y[i];
+        atan2_ulp = std::max(atan2_ulp, ulp_distance(atan2_out[i], std::atan2(y, x)));
+        // the long double sum of squares is good to about 2^-64, which is plenty away from |x + yi| = 1
+        long double squares = (long double) x * x + (long double) y * y;
+        if (std::abs(std::log(squares)) > 0.5) {
+            hypot_ulp = std::max(hypot_ulp, ulp_distance(hypot_out[i], double(0.5L * std::log(squares))));
+        }
+        plane_scalar = plane_scalar && ulp_distance(atan2_out[i], vecmath::atan2(y, x)) == 0
+            && ulp_distance(hypot_out[i], vecmath::log_hypot(x, y)) == 0;
+    }
+    assert(atan2_ulp <= 1);
+    assert(hypot_ulp <= 1);
+    assert(plane_scalar);
+    // just off the unit circle: x^2 + y^2 = 1 + 2^-29 + 2^-40 + 2^-60 exactly
+    double circle = vecmath::log_hypot(1 + 0x1p-30, 0x1p-20);
+    assert(ulp_distance(circle, 0.5 * std::log1p(0x1p-29 + 0x1p-40 + 0x1p-60)) <= 1);
+
+    auto pow_x = sample([](std::mt19937_64& rng) { return std::exp(std::uniform_real_distribution<double>(-20, 20)(rng)); });
+    auto pow_y = sample(std::uniform_real_distribution<double>(-30, 30));
+    // negative bases with integer exponents
+    for (std::size_t i = 0; i < n; i += 4) {
+        pow_x[i] = -std::sqrt(pow_x[i]);
+        pow_y[i] = std::round(pow_y[i]);
+    }
+    std::vector<double> pow_out(n);
+    vecmath::pow(pow_x.data(), pow_y.data(), pow_out.data(), n);
+    std::uint64_t pow_ulp = 0;
+    bool pow_scalar = true;
+    for (std::size_t i = 0; i < n; i++) {
+        pow_ulp = std::max(pow_ulp, ulp_distance(pow_out[i], std::pow(pow_x[i], pow_y[i])));
+        pow_scalar = pow_scalar && ulp_distance(pow_out[i], vecmath::pow(pow_x[i], pow_y[i])) == 0;
+    }
+    assert(pow_ulp <= 2);
+    assert(pow_scalar);
+
+    // special values take the libm path
+    double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> special = {0.0, -0.0, inf, -inf, NAN, 1e-310, -1e-310};
+    bool same = true;
+    for (double x: special) {
+        same = same && ulp_distance(vecmath::exp(x), std::exp(x)) == 0 && ulp_distance(vecmath::log(x), std::log(x)) == 0;
+        same = same && ulp_distance(vecmath::sin(x), std::sin(x)) == 0 && ulp_distance(vecmath::cos(x), std::cos(x)) == 0;
+        same = same && ulp_distance(vecmath::sinh(x), std::sinh(x)) == 0 && ulp_distance(vecmath::cosh(x), std::cosh(x)) == 0;
+        for (double y: special) {
+            same = same && ulp_distance(vecmath::pow(x, y), std::pow(x, y)) == 0;
+            same = same && ulp_distance(vecmath::atan2(y, x), std::atan2(y, x)) == 0;
+            same = same && ulp_distance(vecmath::log_hypot(x, y), std::log(std::hypot(x, y))) == 0;
+        }
+    }
+    assert(same);
+
+    // and through the tape
+    auto expr = Expression("sin(x) * exp(-x) + ln(x) ^ 2 - cos(x) ^ 0.5");
+    Tape tape(expr, {"x"});
+    std::vector<double> points(300), libm(300), vector(300);
+    for (int i = 0; i < 300; i++) {
+        points[i] = 0.05 + i * 0.01;
+    }
+    tape.eval_batch(points.data(), 300, libm.data());
+    tape.vector_math = true;
+    tape.eval_batch(points.data(), 300, vector.data());
+    bool close = true;
+    for (int i = 0; i < 300; i++) {
+        close = close && (std::isnan(libm[i]) ? std::isnan(vector[i]) : std::abs(vector[i] - libm[i]) <= 1e-14 * std::abs(libm[i]));
+    }
+    assert(close);
+
+    // the other evaluators run the same kernels, so they give the tape's results exactly
+    auto same_as_tape = [&](const std::vector<double>& values) {
+        bool same = values.size() == vector.size();
+        for (std::size_t i = 0; same && i < values.size(); i++) {
+            same = ulp_distance(values[i], vector[i]) == 0;
+        }
+        return same;
+    };
+    std::vector<double> other(300);
+    Program<double> program({expr}, {"x"});
+    program.vector_math = true;
+    program.eval_batch(points.data(), 300, other.data());
+    assert(same_as_tape(other));
+    Profiler<double> profiler(expr, {"x"});
+    profiler.vector_math = true;
+    profiler.eval_batch(points.data(), 300, other.data());
+    assert(same_as_tape(other));
+    JitFunction jit(expr, {"x"}, true);
+    jit.eval_batch(points.data(), 300, other.data());
+    assert(same_as_tape(other));
+    for (int i = 0; i < 300; i += 7) {
+        other[i] = jit(&points[i]);
+    }
+    assert(same_as_tape(other));
+    GridAxis axis{"x", 0.05, 3.04, 300};
+    GridSampler sampler(expr, {axis}, false, 1, true);
+    sampler.sample(other.data());
+    for (int i = 0; i < 300; i++) {
+        points[i] = axis.at(i);
+    }
+    tape.eval_batch(points.data(), 300, vector.data());
+    assert(same_as_tape(other));
+
+    Integrator libm_integral(Expression("sin(x) * exp(-x * y)"), {"x", "y"});
+    Integrator vector_integral(Expression("sin(x) * exp(-x * y)"), {"x", "y"}, {}, true);
+    double integral = libm_integral({{0, 3}, {0.5, 1}}).value;
+    assert(std::abs(vector_integral({{0, 3}, {0.5, 1}}).value - integral) <= 1e-13 * std::abs(integral));
+}
+
+void test_tape() {
+    auto expr = Expression("x * sin(x) + x * sin(x) + y ^ 2");
+    Tape tape(expr, {"x", "y"});
+    assert_eq(tape.size(), 8u);
+
+    double values[] = {2, 3};
+    assert_close(tape.eval(values), expr.subs("x", 2).subs("y", 3).eval());
+
+    std::vector<double> points, out(100);
+    for (int i = 0; i < 100; i++) {
+        points.push_back(i * 0.1);
+        points.push_back(1 - i * 0.2);
+    }
+    tape.eval_batch(points.data(), 100, out.data());
+    for (int i = 0; i < 100; i += 33) {
+        assert_close(out[i], tape.eval(&points[2 * i]));
+    }
+
+    Tape<complex> ctape(Expression<complex>("exp(z * i)"), {"z"});
+    complex z = 1;
+    assert_close(ctape.eval(&z), complex(cos(1), sin(1)));
+
+    assert_throws<std::invalid_argument>([&]() {
+        Tape(expr, {"x"});
+    });
+
+    Tape deep(deep_sum(), {"x"});
+    double one = 1;
+    assert_eq(deep.eval(&one), 400000.0);
+}
+
+void test_jit() {
+    auto expr = Expression("-x * sin(x) / (1 + y ^ 2) - ln(x) + exp(cos(y)) + 0.5");
+    JitFunction jit(expr, {"x", "y"});
+    assert(jit.is_native() == bool(SYMEXPR_JIT_NATIVE));
+
+    double values[] = {2, 3};
+    assert_eq(jit(values), jit.tape().eval(values));
+    assert_close(jit(values), expr.subs("x", 2).subs("y", 3).eval());
+
+    std::vector<double> points, out(101);
+    for (int i = 0; i < 101; i++) {
+        points.push_back(0.1 + i * 0.1);
+        points.push_back(1 - i * 0.2);
+    }
+    jit.eval_batch(points.data(), 101, out.data());
+    bool all_equal = true;
+    for (int i = 0; i < 101; i++) {
+        all_equal = all_equal && out[i] == jit.tape().eval(&points[2 * i]);
+    }
+    assert(all_equal);
+
+    JitFunction constant(Expression("2 * pi"), {});
+    assert_close(constant(nullptr), 2 * M_PI);
+}
+
+void test_codegen() {
+    CodegenOptions options;
+    options.name = "f";
+    options.batch = false;
+    assert_eq(emit_c(Expression("x * sin(x) + sin(x) / 2"), {"x"}, options),
+        "/* generated by symexpr */\n"
+        "#include <math.h>\n"
+        "#include <stddef.h>\n"
+        "\n"
+        "/* in: in[0] = x; out: 1 value */\n"
+        "void f(const double* in, double* out) {\n"
+        "    const double t1 = sin(in[0]);\n"
+        "    const double t2 = in[0] * t1;\n"
+        "    const double t4 = t1 / 2.0;\n"
+        "    const double t5 = t2 + t4;\n"
+        "    out[0] = t5;\n"
+        "}\n");
+
+    auto gradient = emit_c_gradient(Expression("x * y"), {"x", "y"});
+    assert(gradient.find("void expr_batch(const double* in, double* out, size_t n) {") != std::string::npos);
+    assert(gradient.find("out[1] = in[1];") != std::string::npos);
+    assert(gradient.find("out[2] = in[0];") != std::string::npos);
+
+    auto complex_source = emit_c(Expression<complex>("-0.5 * z ^ i"), {"z"});
+    assert(complex_source.find("std::pow(in[0], std::complex<double>(0.0, 1.0))") != std::string::npos);
+    assert(complex_source.find("-std::complex<double>(0.5, 0.0)") != std::string::npos);
+}
+
+void test_static_expr() {
+    using static_expr::bind;
+
+    static_assert("1 + 2 * 3"_sym.eval() == 7);
+    static_assert("2 ^ 3 - x"_sym.eval(bind<"x">(1.0)) == 7);
+    assert_eq("0.1"_sym.eval(), 0.1);
+    assert_eq("123.456e-7"_sym.eval(), 123.456e-7);
+
+    assert_eq("1"_sym.to_expression(), Expression("1"));
+    assert_eq("x * sin(x) + 2.5e-3 - -y ^ 2"_sym.to_expression(), Expression("x * sin(x) + 2.5e-3 - -y ^ 2"));
+    assert_eq("(x + 0) * 1 - 0 + a ^ 1"_sym.to_expression(), Expression("(x + 0) * 1 - 0 + a ^ 1"));
+    assert_eq("exp(ln(pi * e)) / cos(2 ^ 2 ^ 2)"_sym.to_expression(), Expression("exp(ln(pi * e)) / cos(2 ^ 2 ^ 2)"));
+
+    auto f = "x * sin(y) + exp(-x * x) / (1 + y ^ 2)"_sym;
+    auto g = Expression("x * sin(y) + exp(-x * x) / (1 + y ^ 2)");
+    assert_eq(f.eval(bind<"x">(0.5), bind<"y">(2.0)), g.subs("x", 0.5).subs("y", 2).eval());
+    assert_eq(f.eval(bind<"y">(2.0), bind<"x">(0.5)), g.subs("x", 0.5).subs("y", 2).eval());
+    auto h = Expression<complex>("x * sin(y) + exp(-x * x) / (1 + y ^ 2)");
+    assert_eq(f.eval<complex>(bind<"x">(complex(0, 1)), bind<"y">(1.0)), h.subs("x", complex(0, 1)).subs("y", complex(1)).eval());
+
+    assert_eq(f.diff<"x">().to_expression(), g.diff("x"));
+    assert_eq(f.diff<"y">().to_expression(), g.diff("y"));
+    assert_eq(f.diff<"x">().diff<"y">().to_expression(), g.diff("x").diff("y"));
+    assert_eq(f.diff<"z">().to_string(), g.diff("z").to_string());
+    assert_eq("x + y"_sym.diff<"z">().to_string(), "0");
+    assert_eq("x * sin(x)"_sym.diff<"x">().to_string(), "x * cos(x) + sin(x)");
+    assert_eq("(x + y)^2"_sym.diff<"x">().to_string(), "(x + y) ^ 2 * 2 / (x + y)");
+}
+
+void test_serialize() {
+    auto bytes = [](const std::string& str) {
+        return std::as_bytes(std::span(str.data(), str.size()));
+    };
+
+    auto expr = Expression("x * sin(x) + -2.5 / y ^ 3 - exp(ln(cos(x)))");
+    std::stringstream stream;
+    write_binary(stream, expr);
+    std::string data = stream.str();
+    auto loaded = read_binary(bytes(data));
+    assert_eq(loaded, expr);
+    assert_eq(loaded.to_string(), expr.to_string());
+
+    // shared subtrees and names are stored once and stay shared
+    auto s = sin(Expression("x"));
+    auto shared = s * s + s;
+    std::stringstream shared_stream;
+    write_binary(shared_stream, shared);
+    auto shared_loaded = read_binary(bytes(shared_stream.str()));
+    auto sum = dynamic_cast<SumExpr<double>*>(shared_loaded.inner.get());
+    auto mul = dynamic_cast<MulExpr<double>*>(sum->lhs.inner.get());
+    assert(mul->lhs.inner == mul->rhs.inner);
+    assert(mul->lhs.inner == sum->rhs.inner);
+    assert_eq(shared_stream.str().size(), 8u + 6 + 5 + 5 + 9 + 9 + 5);
+
+    // several expressions in one stream share nodes too
+    std::stringstream multi;
+    BinaryWriter writer(multi);
+    writer.write(expr);
+    writer.write(expr.diff("x"));
+    writer.write(expr);
+    std::string multi_data = multi.str();
+    auto all = BinaryReader(bytes(multi_data)).read_all();
+    assert_eq(all.size(), 3u);
+    assert_eq(all[1], expr.diff("x"));
+    assert(all[0].inner == all[2].inner);
+
+    auto cexpr = Expression<complex>("(1 + 2i) * z ^ i");
+    std::stringstream cstream;
+    write_binary(cstream, cexpr);
+    assert_eq(read_binary<complex>(bytes(cstream.str())), cexpr);
+
+    // deep trees are written without recursion; the one name is read back as one node
+    std::stringstream deep;
+    write_binary(deep, deep_sum());
+    std::string deep_data = deep.str();
+    auto deep_loaded = read_binary(bytes(deep_data));
+    assert_eq(node_count(deep_loaded), 400000u);
+    double one = 1;
+    assert_eq(Tape(deep_loaded, {"x"}).eval(&one), 400000.0);
+
+    assert_throws<std::invalid_argument>([&]() {
+        read_binary<complex>(bytes(data));
+    });
+    assert_throws<std::invalid_argument>([&]() {
+        read_binary(bytes(data.substr(0, data.size() - 1)));
+    });
+    assert_throws<std::invalid_argument>([&]() {
+        read_binary(bytes("SYMY" + data.substr(4)));
+    });
+
+    auto path = (std::filesystem::temp_directory_path() / "symexpr_test_serialize.bin").string();
+    std::ofstream(path, std::ios::binary) << data;
+    assert_eq(load_binary(path), expr);
+    std::filesystem::remove(path);
+}
+
+void test_structural_hash() {
+    auto x = Expression("x");
+    auto shared = sin(x) * sin(x);
+    auto s = sin(x);
+    assert(structural_hash(shared) == structural_hash(s * s));
+    assert(structural_hash(Expression("x * y")) == structural_hash(Expression("x * y")));
+    assert(!(structural_hash(Expression("x * y")) == structural_hash(Expression("y * x"))));
+    assert(!(structural_hash(Expression("x")) == structural_hash(Expression("y"))));
+    assert(!(structural_hash(Expression("1")) == structural_hash(Expression("2"))));
+    assert(!(structural_hash(Expression("sin(x)")) == structural_hash(Expression("cos(x)"))));
+    assert_eq(structural_hash(Expression("x")).hex().size(), 32u);
+    // deep trees are hashed without recursion
+    assert(structural_hash(deep_sum()) == structural_hash(deep_sum()));
+    assert(!(structural_hash(deep_sum()) == structural_hash(deep_sum(399999))));
+}
+
+void test_diff_cache() {
+    auto dir = std::filesystem::temp_directory_path() / "symexpr_test_diff_cache";
+    std::filesystem::remove_all(dir);
+
+    auto expr = Expression("x * sin(x) / (1 + y ^ 2)");
+    {
+        DiffCache cache(dir);
+        assert_eq(cache.diff(expr, "x", 2), expr.diff("x").diff("x"));
+        assert_eq(cache.hits, 0u);
+    }
+    {
+        // a fresh instance, as after a restart
+        DiffCache cache(dir);
+        assert_eq(cache.diff(Expression("x * sin(x) / (1 + y ^ 2)"), "x", 2), expr.diff("x").diff("x"));
+        assert_eq(cache.hits, 1u);
+        assert_eq(cache.diff(expr, "x", 1), expr.diff("x"));
+        assert_eq(cache.hits, 2u);
+        assert_eq(cache.diff(expr, "x", 3), expr.diff("x").diff("x").diff("x"));
+        assert_eq(cache.hits, 3u);
+        assert_eq(cache.diff(expr, "y"), expr.diff("y"));
+        assert_eq(cache.hits, 3u);
+
+        Expression<complex> cexpr("x * i");
+        assert_eq(cache.diff(cexpr, "x"), cexpr.diff("x"));
+        assert_eq(cache.hits, 3u);
+    }
+    {
+        DiffCache cache(dir);
+        auto total = cache.size_bytes();
+        assert(total > 0);
+        cache.evict(total / 2);
+        assert(cache.size_bytes() <= total / 2);
+        assert_eq(cache.diff(expr, "x", 3), expr.diff("x").diff("x").diff("x"));
+    }
+    {
+        // entries beyond the limit get evicted on store
+        DiffCache cache(dir, 1);
+        cache.diff(Expression("exp(x) * y"), "y");
+        assert_eq(cache.size_bytes(), 0u);
+    }
+    {
+        // the size is kept up to date between scans
+        DiffCache cache(dir, 2000);
+        for (int k = 2; k < 40; k++) {
+            cache.diff(Expression(std::format("x ^ {} * sin(x)", k)), "x");
+        }
+        assert(cache.size_bytes() > 0u);
+        assert(cache.size_bytes() <= 2000u);
+    }
+    std::filesystem::remove_all(dir);
+}
+
 int main() {
     test_basic_numbers();
     test_basic_addition();
@@ -367,5 +1940,33 @@ int main() {
     test_lexer();
     test_parsing();
     test_symbolic_differentiation_with_parser();
+    test_try_eval();
+    test_lazy_diff();
+    test_specialize();
+    test_taylor();
+    test_grid();
+    test_integrate();
+    test_newton();
+    test_streaming_parse();
+    test_refcount();
+    test_intern();
+    test_program();
+    test_parallel_eval();
+    test_interval();
+    test_polynomial();
+    test_budget();
+    test_profile();
+    test_domain();
+    test_float();
+    test_mixed_precision();
+    test_complex_batch();
+    test_vecmath();
+    test_tape();
+    test_jit();
+    test_codegen();
+    test_static_expr();
+    test_serialize();
+    test_structural_hash();
+    test_diff_cache();
     summary();
 }